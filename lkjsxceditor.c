@@ -1,12 +1,28 @@
+// Build: cc -O2 -pthread -o lkjsxceditor lkjsxceditor.c
+#define _GNU_SOURCE  // for struct ucred (SO_PEERCRED)
 #include <ctype.h>
+#include <dirent.h>  // for DT_DIR etc. (directories are read with getdents64)
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>  // for PATH_MAX, INT_MAX
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>  // for NULL, size_t
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h> // For _exit, exit
 #include <string.h>
+#include <strings.h>  // for strncasecmp
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -15,12 +31,107 @@
 #define LKJSXCEDITOR_VERSION "0.0.1"
 #define BUFCHUNK_SIZE 512      // Size of each text chunk
 #define BUFCHUNK_COUNT 32768   // Number of chunks (32768 * 512 = 16MB for text)
-#define SCREEN_BUF_SIZE 65536  // Buffer for screen rendering (64KB)
+#define SCREEN_BUF_SIZE 262144 // Buffer for screen rendering (256KB, worst case full redraw of a max size screen)
+#define SCREEN_MAX_ROWS 256    // Max terminal rows tracked by the screen diff
+#define SCREEN_MAX_COLS 512    // Max terminal cols tracked by the screen diff
+#define SCREEN_REP_MIN 8       // Min run length before a run is sent as REP (CSI n b)
+#define SCREEN_ECH_MIN 8       // Min blank run length before it is sent as ECH (CSI n X)
+#define SCREEN_SKIP_MIN 5      // Min unchanged run length before cursor movement skips over it
+#define SCREEN_FRAME_FRESH 4   // Flag on the frame handoff index: published but not yet rendered
 #define FILE_BUF_SIZE 4096     // Buffer for file I/O (4KB)
+#define SAVE_BUF_SIZE (64 << 10)  // Output of the save transforms between writes
 #define STATUS_BUF_SIZE 128    // Buffer for status messages
 #define CMD_BUF_SIZE 128       // Max command length
-#define TAB_STOP 8
+#define TAB_STOP_DEFAULT 8    // Tab stop of a new buffer (:set ts=N changes it per buffer)
+#define TAB_STOP_MAX 32
 #define QUIT_TIMES 1  // Require 1 confirmation to quit if modified
+#define CTRL_KEY(k) ((k) & 0x1f)  // Key code of Ctrl + k
+#define BUFOBSERVER_MAX 8      // Observers registered on one buffer
+#define BUFDELTA_BATCH_MAX 64  // Coalesced deltas a batched observer holds before an early flush
+#define ESC_SEQ_TIMEOUT_MS 100     // Wait for the rest of an escape sequence (like VTIME = 1)
+#define INTERRUPT_POLL_MS 10       // How often a long scan looks for a Ctrl-C typed meanwhile
+#define TYPEAHEAD_SIZE 256         // Keys read by that look, handled after the scan
+#define SERVER_SOCKET_NAME "lkjsxceditor"  // Socket file name (in $XDG_RUNTIME_DIR or a private dir in /tmp)
+#define SERVER_MAX_BUFS 16         // Resident buffers kept by the server
+#define SERVER_MAX_SESSIONS 8      // Clients attached to the server at once
+#define SERVER_HELLO_SIZE (PATH_MAX + 64)  // Max size of the client hello line
+#define SERVER_HELLO_TIMEOUT_MS 2000  // A client that has not sent its hello by then is dropped
+#define SERVER_INPUT_SIZE 4096     // Bytes a client sent that are not handled yet
+#define PROXY_BUF_SIZE 4096        // Client proxy copy buffer
+#define LSP_MSG_MAX 262144         // Largest message exchanged with the language server
+#define LSP_CHANGES_MAX (LSP_MSG_MAX / 2)  // contentChanges gathered before a didChange must go out
+#define LSP_CHANGE_PIECE 4096      // Inserted text is sent in pieces of at most this size
+#define LSP_PENDING_MAX 16         // Requests awaiting a reply
+#define LSP_DIAG_MAX 64            // Diagnostics kept for the open document
+#define LSP_COMPLETION_MAX 256     // Longest completion text applied
+#define LSP_WRITE_TIMEOUT_MS 2000  // Give up on a server that stops reading
+#define WORDIDX_NODES 262144       // Trie nodes of the completion word index (16 bytes each)
+#define WORDIDX_WORD_MAX 48        // Longer words are not indexed
+#define WORDIDX_SLICE 65536        // Bytes indexed per scheduler step
+#define WORDIDX_MATCH_MAX 32       // Completion matches offered at once
+#define TAGS_FILE_NAME "tags"      // ctags index looked up next to the open file, then in the cwd
+#define TAG_NAME_MAX 256           // Longest tag name looked up
+#define TAG_PATTERN_MAX 1024       // Longest search pattern of a tag address
+#define TASKPOOL_THREADS_MAX 64    // Threads of the task pool (one per core, up to this)
+#define TASKPOOL_TASKS_MAX 4096    // Tasks queued, running or waiting for their callback
+#define SCHED_JOBS_MAX 8           // Long operations sliced on the main thread at once
+#define SCHED_SLICE_US 3000        // Time they get before keys are looked at again
+#define SCHED_REDRAW_MS 100        // Redraw this often while they run (progress)
+#define WALK_DIRQ_SIZE (1 << 20)   // Ring of directory paths waiting to be read
+#define WALK_DENTS_SIZE 32768      // getdents64 buffer per directory read
+#define WALK_TASKS_MAX (TASKPOOL_TASKS_MAX / 4)  // Directories a walk queues at once
+#define WALK_NEST_MAX 16           // Directories a task reads inside one another (deeper ones wait to be queued)
+#define WALK_WAIT_US 1000          // How often such a directory is tried again
+#define GREP_RESULTS_MAX 65536     // Matches kept in the results list
+#define GREP_ARENA_SIZE (4 << 20)  // Paths and line text of the matches
+#define GREP_TEXT_MAX 120          // Matched line text kept per result
+#define GREP_BATCH_MAX 64          // Matches a thread gathers before adding them to the list
+#define GREP_SCAN_STEP (1 << 20)   // Bytes of a file grep scans between looks at its cancel token
+#define GREP_BINARY_PEEK 8192      // A NUL byte this early marks a file as binary (skipped)
+#define FIND_FILES_MAX (1 << 21)   // Files indexed by :find
+#define FIND_ARENA_SIZE (128 << 20)  // Paths of the indexed files
+#define FIND_BATCH_MAX 256         // Paths a walk thread gathers before adding them to the index
+#define FIND_SHOWN 10              // Matches listed above the command line
+#define FIND_THREADS_MAX 16        // Slices a scoring job is split into (pool tasks + main thread)
+#define FIND_PARALLEL_MIN 16384    // Fewer paths are scored on the main thread alone
+#define DIFF_LINES_MAX (1 << 21)   // Lines per side of a diff
+#define DIFF_HUNKS_MAX 65536       // Hunks kept from one diff
+#define DIFF_COST_MAX 4096         // Edit distance searched in a range before it is taken as one replacement
+#define DIFF_GUTTER_WIDTH 2        // Columns of change marks left of the text in diff mode
+#define DIFF_HASH_SEED 14695981039346656037ULL  // FNV-1a offset basis (line hashes)
+#define DIFF_RUNS_MAX (3 * DIFF_HUNKS_MAX + 3)   // Aligned runs of :diffsplit (up to 3 per hunk and the end)
+#define DIFF_SPLIT_LINE_MAX 4096   // Bytes of a buffer line :diffsplit shows
+#define MULTICURSOR_MAX 16384      // Cursors besides the primary one
+#define MULTICURSOR_WINDOW 65536   // Bytes read at a time when searching for the next match
+#define BLOCK_LINES_MAX (1 << 18)  // Lines of a Ctrl-V block edit
+#define BLOCK_TEXT_MAX 4096        // Text a block insert repeats (and padding before it)
+#define INDENT_BATCH 65536         // Lines rewritten per bufclient_apply_edits batch
+#define INDENT_TABS_MAX 1024       // Widest indent written, in tab stops
+#define UNDO_RECORDS_MAX (1 << 20) // Edits kept in the undo history
+#define UNDO_TEXT_SIZE (64 << 20)  // Removed and inserted text of those edits
+#define UNDO_BATCH 65536           // Edits undone or redone per bufclient_apply_edits batch
+#define UNDO_UNITS_MAX (1 << 18)   // Units (nodes of the undo tree) kept
+#define UNDO_CHECKPOINT_EVERY 256  // Records recorded between two checkpoints of the text
+#define UNDO_CHECKPOINTS_MAX 64
+#define UNDO_PIECES_MAX (1 << 16)  // Chunk copies the checkpoints share (32MB)
+#define UNDO_PIECE_HASH (1 << 17)  // Buckets of their hash table (a power of 2)
+#define UNDO_RESTORE_WINDOW 64     // Chunks and pieces looked ahead to match them up again
+#define UNDO_UNIT_LOST (-2)        // Parent of a unit cut off from the history (see undo_drop)
+#define UNDO_FILE_MAGIC "LKJUNDO2"  // First bytes of an undo file
+#define UNDO_FILE_PAGE 4096         // Its header; the records start after it
+#define UNDO_FILE_RECORDS_MIN 512   // Smallest room for records in an undo file (a page of them)
+#define UNDO_FILE_TEXT_MIN (64 << 10)
+#define UNDO_FILE_UNITS_MIN 128     // (a page of units)
+#define UNDO_FILE_TIME_MAX (1LL << 40)  // Latest time a unit of an undo file may carry
+#define TEXT_WIDTH_DEFAULT 79      // Width gq fills lines to in a new buffer (:set tw=N changes it)
+#define REFLOW_BATCH 65536         // Edits of J and gq per bufclient_apply_edits batch
+#define REFLOW_INDENT_MAX 256      // Longest indent gq repeats on the lines it breaks
+#define SUBST_STEP 65536           // Bytes :s scans per scheduler step
+#define SUBST_EDITS_MAX (1 << 20)  // Matches :s keeps before applying them (one undo unit)
+#define SUBST_BATCH 8192           // Substitutions applied per step (one bufclient_apply_edits batch)
+#define SESSION_FILES_MAX 64       // Files a session remembers
+#define SESSION_FILE_DEFAULT ".lkjsxcsession"  // Session of the current directory
+#define SESSION_MAGIC "lkjsxcsession 1"         // First line of a session file
 
 // *** Enums ***
 enum RESULT {
@@ -31,7 +142,23 @@ enum RESULT {
 enum editorMode {
     MODE_NORMAL,
     MODE_INSERT,
-    MODE_COMMAND
+    MODE_COMMAND,
+    MODE_BLOCK     // Ctrl-V block selection
+};
+
+// Cell attributes used by the screen diff (mapped to SGR when flushed)
+enum screenAttr {
+    ATTR_NORMAL = 0,
+    ATTR_REVERSE = 1
+};
+
+// What a reply from the language server is for
+enum lspRequest {
+    LSP_REQ_NONE = 0,  // Free slot
+    LSP_REQ_INITIALIZE,
+    LSP_REQ_COMPLETION,
+    LSP_REQ_DEFINITION,
+    LSP_REQ_SHUTDOWN
 };
 
 // Custom key codes for non-ASCII keys
@@ -49,7 +176,83 @@ enum editorKey {
     PAGE_DOWN
 };
 
+// Line marks of diff mode (bits)
+enum diffMark {
+    DIFF_ADDED = 1,
+    DIFF_CHANGED = 2,
+    DIFF_DELETED_ABOVE = 4,  // Lines of the file were deleted just above this one
+    DIFF_DELETED_BELOW = 8   // ... just below this one (the last line)
+};
+
+// Kinds of aligned rows of :diffsplit
+enum diffRunKind {
+    DIFF_RUN_SAME,
+    DIFF_RUN_CHANGED,  // Pairs of differing lines
+    DIFF_RUN_ADDED,    // Buffer lines against filler rows
+    DIFF_RUN_DELETED   // Lines of the other file against filler rows
+};
+
+// Transforms editorSave applies to the text it writes (bits of bufclient.save_flags)
+enum saveFlag {
+    SAVE_STRIP_WS = 1,  // :set stripws - drop blanks at the ends of lines
+    SAVE_FIX_EOL = 2,   // :set fixeol - end the last line with a newline
+    SAVE_FF_UNIX = 4,   // :set ff=unix - end lines with LF
+    SAVE_FF_DOS = 8     // :set ff=dos - end lines with CR LF
+};
+
+// Case changes of bufclient_rewrite (0 there copies text instead)
+enum caseKind {
+    CASE_UPPER = 1,  // gU
+    CASE_LOWER,      // gu
+    CASE_TOGGLE      // ~ and g~
+};
+
+// Priorities of pool tasks: a thread takes the first one queued anywhere at the highest
+enum taskPriority {
+    TASK_INTERACTIVE,  // The user is waiting (scoring :find as it is typed)
+    TASK_VISIBLE,      // The result shows on screen (:diffsplit, the :find index)
+    TASK_BACKGROUND,   // Everything else (:grep, autosave)
+    TASK_PRIORITIES
+};
+
 // *** Structs ***
+struct bufclient;
+
+// One edit of a buffer, as reported to observers
+struct bufdelta {
+    int offset;      // Absolute index where the change starts
+    int removed;     // Bytes removed at offset (in the text before the change)
+    int inserted;    // Bytes inserted at offset (in the text after the change)
+    int line_delta;  // Newlines inserted minus newlines removed
+    int line;        // Line (0-based) containing offset
+    int col;         // Byte column of offset in that line
+    int end_line;    // Where the removed text ended, in the text before the change
+    int end_col;     // (equal to line/col when nothing was removed)
+};
+
+// One edit of a batch (bufclient_apply_edits): replace removed bytes at offset with text
+struct bufedit {
+    int offset;        // Absolute index in the text before the batch
+    int removed;
+    const char* text;  // inserted bytes (may be shared by all edits of a batch)
+    int inserted;
+    int line;          // Line of offset, filled in by bufclient_apply_edits
+    int col;           // and its byte column in that line
+};
+
+// A consumer of buffer edits. Immediate observers get every delta as it happens;
+// batched ones get coalesced deltas once per event loop tick (bufclient_flush_deltas).
+// Deltas of a batch apply in order, each relative to the text after the previous one.
+struct bufobserver {
+    void (*notify)(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx);
+    // Optional: called before text is removed, while it can still be read
+    void (*before_remove)(struct bufclient* buf, int offset, int removed, void* ctx);
+    void* ctx;        // Passed back to notify and before_remove
+    int batched;      // 1 to receive deltas per tick instead of per edit
+    int pending_len;  // Deltas waiting in pending (batched only)
+    struct bufdelta pending[BUFDELTA_BATCH_MAX];
+};
+
 struct bufchunk {
     char data[BUFCHUNK_SIZE];
     struct bufchunk* prev;
@@ -69,6 +272,9 @@ struct bufclient {
     int size;                       // Total size of the buffer in bytes
     char filename[256];             // Associated filename
     int dirty;                      // 1 if modified since last save, 0 otherwise
+    int tabstop;                    // Columns per tab stop (:set ts=N)
+    int textwidth;                  // Width gq fills lines to (:set tw=N)
+    int save_flags;                 // enum saveFlag (:set stripws, fixeol, ff=...)
     // Display offsets
     int rowoff;  // First visible row (line number)
     int coloff;  // First visible visual column
@@ -76,12 +282,79 @@ struct bufclient {
     struct bufchunk* rowoff_chunk;  // Chunk containing the start of the first visible row
     int rowoff_rel_i;               // Relative index within rowoff_chunk
     int rowoff_abs_i;               // Absolute index for start of rowoff
+    // Consumers of edits (owned by them, see bufclient_observe)
+    struct bufobserver* observers[BUFOBSERVER_MAX];
+    int observer_count;
+};
+
+// Cursor and viewport of one view onto a buffer (the per-client part of struct bufclient)
+struct bufview {
+    struct bufchunk* cursor_chunk;  // NULL if stale (recomputed from cursor_abs_i on load)
+    int cursor_rel_i;
+    int cursor_abs_i;
+    int cursor_abs_y;
+    int cursor_abs_x;
+    int cursor_goal_x;
+    int rowoff;
+    int coloff;
+    struct bufchunk* rowoff_chunk;  // NULL if stale
+    int rowoff_rel_i;
+    int rowoff_abs_i;
+};
+
+// One character cell of the composed screen
+struct screencell {
+    char ch;             // Byte shown in the cell
+    unsigned char attr;  // enum screenAttr
+};
+
+// A composed frame: an immutable snapshot of the viewport once published to the render thread
+struct screenframe {
+    struct screencell cells[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+    int rows;      // Rows used in cells (text area + status bar + command line)
+    int cols;      // Cols used in cells
+    int cursor_y;  // Final cursor position (0-based)
+    int cursor_x;
+};
+
+// Output pipeline of one terminal: the frame handoff plus the render thread's knowledge
+// of what the terminal currently shows.
+struct screenpipe {
+    // Frames are triple buffered: the edit thread composes into one, one waits in the
+    // handoff slot, and the render thread diffs the third against the terminal.
+    // Neither side ever waits.
+    struct screenframe frames[3];
+    int compose_i;       // Frame owned by the edit thread
+    int render_i;        // Frame owned by the render thread
+    atomic_int handoff;  // Frame in the handoff slot (| SCREEN_FRAME_FRESH if unseen)
+    // Render thread
+    pthread_t thread;
+    sem_t wakeup;     // Posted whenever a frame is published
+    atomic_int stop;  // Asks the render thread to exit
+    int running;
+    // Render thread state (only touched by the render thread once it runs)
+    int out_fd;         // Terminal output
+    atomic_int output_failed;  // The terminal (or a server client) stopped accepting output
+    struct screencell prev[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];  // What the terminal shows
+    int prev_valid;     // 0 forces a full clear and redraw on the next flush
+    int prev_rows;
+    int prev_cols;
+    int cur_y;                // Cursor row (0-based), -1 if unknown
+    int cur_x;                // Cursor col (0-based), -1 if unknown (e.g. pending wrap)
+    unsigned char cur_attr;   // Attribute the terminal is using
+    char buf[SCREEN_BUF_SIZE];  // Bytes of the frame being written
+    int buf_len;
 };
 
 // *** Global Variables ***
 static int screenrows;                     // Terminal height (text area)
 static int screencols;                     // Terminal width
 static struct termios orig_termios;        // Original terminal settings
+static int term_in_fd = STDIN_FILENO;      // Terminal input (the active client's socket in server mode)
+static int wake_fd[2] = {-1, -1};          // Background threads wake the main loop by writing here
+static atomic_int wake_pending;            // A wakeup byte is in flight
+static int server_mode = 0;                // 1 when running as the resident server
+static int server_discard_buffer = 0;      // Set by :q! to drop the session's resident buffer
 static volatile int terminate_editor = 0;  // Flag to signal exit from main loop
 static enum editorMode mode = MODE_NORMAL;
 static struct bufclient textbuf;   // Main text buffer
@@ -90,19 +363,624 @@ static int cmdbuf_len = 0;
 static char statusbuf[STATUS_BUF_SIZE];  // Status message buffer
 static time_t statusbuf_time = 0;        // Timestamp for status message display
 
+// Resident buffers kept by the server between client sessions
+struct residentbuf {
+    struct bufclient buf;  // Buffer contents and last cursor/viewport (moved into textbuf while attached)
+    int used;              // 1 if this slot holds a buffer
+    time_t mtime;          // File modification time when loaded/saved (to detect external changes)
+    off_t fsize;           // File size when loaded/saved
+    time_t last_used;      // For evicting the least recently used clean buffer
+    int sessions;          // Number of clients currently attached to this buffer
+};
+static struct residentbuf server_bufs[SERVER_MAX_BUFS];
+
+// A client attached to the server. While one of its keys is handled (or its screen
+// composed) its state lives in the editor globals; see session_activate().
+struct termsession {
+    int used;
+    int fd;                     // Client socket (terminal input and output)
+    int slot;                   // Resident buffer shown by this client
+    int rows;                   // screenrows
+    int cols;                   // screencols
+    enum editorMode mode;
+    char cmdbuf[CMD_BUF_SIZE];
+    int cmdbuf_len;
+    char statusbuf[STATUS_BUF_SIZE];
+    time_t statusbuf_time;
+    struct bufview view;        // Own cursor and viewport onto the shared buffer
+    int needs_refresh;          // Screen must be recomposed
+    struct screenpipe pipe;     // Own output pipeline and render thread
+    char in[SERVER_INPUT_SIZE]; // Input not handled yet: an unfinished command or escape sequence
+    int in_len;
+    long long in_ms;            // When the last input arrived
+    int in_retry;               // Look at the input again once the escape sequence timeout passed
+};
+static struct termsession server_sessions[SERVER_MAX_SESSIONS];
+// Client accepted but its hello line not complete yet
+struct pendingclient {
+    int used;
+    int fd;
+    long long since_ms;  // Accepted at
+    int len;
+    char hello[SERVER_HELLO_SIZE];
+};
+static struct pendingclient server_pending[SERVER_MAX_SESSIONS];
+static struct termsession* server_active = NULL;  // Session whose state is in the globals
+static int server_in_pos;    // Input of server_active read by the key being handled
+static int server_in_short;  // That key needed more input than has arrived
+static void server_notify(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx);
+static struct bufobserver server_observer = {server_notify, NULL, NULL, 0, 0, {{0}}};  // Immediate
+
+// Language server connection (standalone editor only)
+struct lsprequest {
+    int id;
+    enum lspRequest kind;  // LSP_REQ_NONE if the slot is free
+    int abs_i;             // Cursor when sent (replies for a moved cursor are dropped)
+    int version;           // Document version when sent
+};
+struct lspdiag {
+    int line;
+    int col;
+    int severity;  // 1 error, 2 warning, 3 info, 4 hint
+    char message[STATUS_BUF_SIZE];
+};
+struct lspclient {
+    pid_t pid;         // Server process, 0 if not running
+    int in_fd;         // Server's stdin
+    int out_fd;        // Server's stdout
+    int initialized;   // initialize reply received
+    int incremental;   // Server takes incremental didChange (otherwise edits are not sent)
+    int utf16;         // Columns count UTF-16 code units (the server did not take UTF-8)
+    int removed_at;    // Offset of the text about to be removed (utf16 only)
+    int removed_end;   // Column where that text ends, in UTF-16 code units
+    int doc_open;      // textbuf is open on the server as uri
+    int version;       // Document version of the last didChange
+    char uri[PATH_MAX * 3 + 16];
+    int next_id;
+    struct lsprequest pending[LSP_PENDING_MAX];
+    struct lspdiag diags[LSP_DIAG_MAX];
+    int diag_count;
+    int diag_errors;   // Counts last reported in the status line
+    int diag_warnings;
+    struct bufobserver observer;  // Immediate: inserted text is captured as it is typed
+    int out_len;
+    int in_len;
+    int in_skip;       // Input bytes still to discard (dispatched or oversized messages)
+    int changes_len;
+    // Buffers (everything above is reset when a server starts)
+    char out[LSP_MSG_MAX];            // Queued for the server
+    char in[LSP_MSG_MAX];             // Received, not yet dispatched
+    char changes[LSP_CHANGES_MAX];    // contentChanges of this tick, comma separated
+    char body[LSP_MSG_MAX];           // Scratch for composing a message
+};
+static struct lspclient lsp;
+
+// Word index for completion (one buffer at a time)
+struct wordnode {
+    int child;    // First child (0: none)
+    int sibling;  // Next sibling, in byte order (0: none)
+    int count;    // Occurrences of the word ending here
+    char c;
+};
+struct wordindex {
+    struct wordnode nodes[WORDIDX_NODES];  // nodes[0] is the root
+    int node_count;
+    int built;         // Text before this offset is indexed
+    int full;          // Ran out of nodes: some words are missing
+    int slot;          // Resident buffer indexed in server mode, -1 for the standalone textbuf
+    int region_start;  // Words being edited (between before_remove and the delta), -1 if none
+    int region_end;
+    struct bufobserver observer;  // Immediate
+};
+static struct wordindex wordidx;
+
+// Ctrl-N/Ctrl-P completion in progress
+struct wordcompletion {
+    int active;
+    const struct termsession* owner;  // Session completing (server mode)
+    int start;       // Where the completed word starts
+    int prefix_len;  // Typed part of it
+    int len;         // Current length of the word
+    int index;       // Match shown, -1 for the typed prefix
+    int count;
+    char prefix[WORDIDX_WORD_MAX];
+    char matches[WORDIDX_MATCH_MAX][WORDIDX_WORD_MAX + 1];
+};
+static struct wordcompletion completion;
+
+// Mapped tags file (kept mapped between lookups, remapped when the file changes)
+struct tagsfile {
+    const char* map;  // NULL if nothing is mapped
+    size_t size;
+    dev_t dev;        // Identity of the mapped file
+    ino_t ino;
+    time_t mtime;
+    int sorted;       // !_TAG_FILE_SORTED: 0 unsorted, 1 sorted, 2 sorted ignoring case
+    char dir[PATH_MAX];  // Directory of the tags file (tag paths are relative to it)
+};
+static struct tagsfile tags;
+
+// Set to ask work to stop; the work checks it now and then
+struct canceltoken {
+    atomic_int cancelled;
+};
+
+// Work for the task pool
+struct task {
+    void (*run)(void* arg, int worker);  // On a pool thread (worker: its index, for per-thread state)
+    void (*done)(void* arg);             // On the main thread once run returned (optional)
+    void* arg;
+    struct canceltoken* token;  // Optional: if cancelled before the task starts, run is skipped
+    atomic_int* group;          // Optional: counts the group's tasks yet to finish
+    int next;                   // Free or completed list
+};
+
+// Tasks queued on one pool thread, a ring per priority. The thread takes its newest
+// task (queued by itself, likely still in cache); idle threads steal the oldest.
+struct taskdeque {
+    pthread_mutex_t lock;
+    int head[TASK_PRIORITIES];
+    int count[TASK_PRIORITIES];
+    int ids[TASK_PRIORITIES][TASKPOOL_TASKS_MAX];
+};
+
+// Threads shared by all background work
+struct taskpool {
+    pthread_mutex_t lock;       // Guards the lists, idle and quit
+    pthread_cond_t work;        // A task was queued, or quit
+    pthread_cond_t finished;    // A group emptied, or a callback is waiting
+    pthread_t threads[TASKPOOL_THREADS_MAX];
+    int thread_count;           // 0 until the first task
+    int next_deque;             // Where the main thread queues next (round robin)
+    int idle;                   // Threads waiting for work
+    int quit;
+    atomic_int queued;          // Tasks in the deques
+    int free_head;              // Free tasks (-1: none)
+    int completed_head;         // Tasks waiting for their done callback, oldest first
+    int completed_tail;
+    struct task tasks[TASKPOOL_TASKS_MAX];
+    struct taskdeque deques[TASKPOOL_THREADS_MAX];
+};
+static struct taskpool taskpool;  // Lock and conditions set by taskpool_start
+static _Thread_local int taskpool_worker = -1;  // Index of the pool thread running (-1: not one)
+
+// Long operations run on the main thread a slice at a time, between keys
+struct schedjob {
+    int (*step)(void* ctx);  // Does a little of the work; returns 0 once all is done
+    void* ctx;
+};
+struct scheduler {
+    int count;
+    int next;                // Job the next slice starts with (round robin)
+    long long redraw_ms;     // Last redraw asked for while jobs run
+    struct schedjob jobs[SCHED_JOBS_MAX];
+};
+static struct scheduler sched;
+
+// Ctrl-C during a synchronous scan (the scan resets it when it starts)
+static struct canceltoken interrupt_token;
+static char typeahead[TYPEAHEAD_SIZE];  // Keys read while looking for it
+static int typeahead_len, typeahead_pos;
+
+// Directory tree walked by pool tasks (:grep, :find), a task per directory
+struct treewalk {
+    pthread_mutex_t lock;   // Guards the ring
+    struct canceltoken cancel;
+    atomic_int tasks;       // Directories queued or being read (the walk ends at 0)
+    atomic_int skipped;     // Directories left out: too deep, and no room to queue them
+    int started;            // Started and not yet stopped (main thread)
+    int priority;           // enum taskPriority of its tasks
+    int dirq_head;          // Ring of NUL-terminated directory paths, one per queued task
+    int dirq_used;
+    void (*on_file)(int dir_fd, const char* name, const char* path, void* local);  // Called unlocked
+    void (*on_dir_done)(void* local);  // After each directory (optional)
+    char* locals;           // Per pool thread state passed to them (local_size bytes each)
+    int local_size;
+    char dirq[WALK_DIRQ_SIZE];
+};
+
+// :grep results (the quickfix list) and the walk searching for them
+struct grepresult {
+    int path;  // Offsets into grep.arena
+    int text;
+    int line;  // 1-based
+    int col;   // 0-based byte column
+};
+struct grepsearch {
+    struct treewalk walk;
+    pthread_mutex_t lock;          // Guards the results (files to full)
+    int show_progress;             // Status line follows the search
+    int current;                   // Result shown by :cn/:cp, -1 before the first
+    char pattern[CMD_BUF_SIZE];
+    int pattern_len;
+    long long files;               // Files searched
+    int result_count;
+    int arena_len;
+    int full;                      // Results (or arena) ran out; search stopped
+    struct grepresult results[GREP_RESULTS_MAX];
+    char arena[GREP_ARENA_SIZE];
+};
+static struct grepsearch grep;  // Locks and callbacks set by the first grep_start
+
+// :find file index (built once, in the background) and the matches of the typed query
+struct findindex {
+    struct treewalk walk;
+    pthread_mutex_t lock;      // Guards count, arena_len and full while the walk appends
+    int count;                 // Paths indexed (entries below it never change)
+    int arena_len;
+    int full;                  // FIND_FILES_MAX or the arena ran out
+    int interrupted;           // Ctrl-C stopped the walk (the index stays partial)
+    int started;               // Index built or being built
+    int active;                // The command line holds a :find query
+    char query[CMD_BUF_SIZE];  // Lowercase, without spaces
+    int query_len;             // -1: nothing scored yet
+    uint64_t query_mask;
+    int scored;                // Paths below this were scored for the query
+    int match_count;           // Matching paths in matches
+    int shown[FIND_SHOWN];     // Best matches, best first
+    int shown_score[FIND_SHOWN];
+    int shown_count;
+    int selected;              // Index into shown
+    int paths[FIND_FILES_MAX];       // Offsets into arena
+    uint64_t masks[FIND_FILES_MAX];  // Characters in each path (see find_char_bit)
+    int matches[FIND_FILES_MAX];
+    char arena[FIND_ARENA_SIZE];
+};
+static struct findindex finder;  // Locks and callbacks set by find_index_start
+
+// Scoring of :find paths. A job is split into parts slices; the main thread scores
+// slice 0, then every slice no pool task has taken yet, and waits for the rest.
+struct findpool {
+    atomic_int tasks;      // Slice tasks yet to finish
+    atomic_int claimed[FIND_THREADS_MAX];  // Slice taken by a task or the main thread
+    int n;                 // The job, set by the main thread while no task runs
+    int from_list;
+    int base;
+    int* out;
+    int parts;
+    int slice_count[FIND_THREADS_MAX];
+    int top[FIND_THREADS_MAX][FIND_SHOWN];
+    int top_score[FIND_THREADS_MAX][FIND_SHOWN];
+    int top_count[FIND_THREADS_MAX];
+};
+static struct findpool findpool;
+
+// Diff against the saved file (:diffsaved) and the diff engine's work space
+struct diffhunk {
+    int a_start;  // Lines a_start..a_start+a_len of the old text
+    int a_len;    // became b_start..b_start+b_len of the new one
+    int b_start;
+    int b_len;
+};
+struct diffstate {
+    int active;          // Marks shown in the gutter
+    int stale;           // Buffer edited since the marks were computed
+    int file_stale;      // old_hash must be read from the file again
+    int old_count;       // Lines in old_hash (an empty one after a final newline too), -1 if none
+    int new_count;       // Lines in new_hash, likewise; kept in step with the buffer by edits
+    int new_lo;          // Buffer lines new_lo..new_hi-1 were edited since they were hashed
+    int new_hi;
+    int rehash;          // new_hash must be computed whole
+    time_t file_mtime;   // The file as last compared against
+    long long file_size; // -1 if there was no file
+    int line_count;      // Buffer lines with marks (0..line_count)
+    int added;           // Line counts of the last diff
+    int changed;
+    int deleted;
+    int hunk_count;
+    int overflow;        // More than DIFF_HUNKS_MAX hunks
+    struct bufobserver observer;  // Batched
+    struct diffhunk hunks[DIFF_HUNKS_MAX];
+    unsigned char marks[DIFF_LINES_MAX + 1];  // enum diffMark bits per buffer line
+    uint64_t old_hash[DIFF_LINES_MAX];
+    uint64_t new_hash[DIFF_LINES_MAX];
+    int v1[2 * DIFF_LINES_MAX + 2];  // Furthest x per diagonal, forward and reverse
+    int v2[2 * DIFF_LINES_MAX + 2];
+};
+static struct diffstate diff;
+
+// :diffsplit: the buffer and another file side by side, aligned
+struct diffrun {
+    int row;     // First aligned row
+    int len;     // Rows
+    int b_line;  // Buffer line of the first row (for DIFF_RUN_DELETED: of the next row with one)
+    int a_line;  // Line of the other file, likewise
+    int kind;    // enum diffRunKind
+};
+struct diffsplitstate {
+    int active;
+    int ready;               // The first diff is in
+    int stale;               // Buffer edited since the last diff started
+    int rowoff;              // First aligned row on screen
+    char filename[256];      // The other file
+    const char* map;         // ... mapped (read only)
+    int map_len;
+    int line_count;
+    int hashed;              // diff.old_hash holds its lines (set by the worker)
+    atomic_int tasks;        // Pool task of the running diff (group)
+    int running;
+    atomic_int done;
+    int job_base;            // Lines both share at the start
+    int job_tail;            // Lines both share at the end
+    int job_b_count;         // Buffer lines in all (set by the worker)
+    int job_failed;          // Too many lines
+    struct bufobserver observer;  // Batched
+    int run_count;
+    int row_count;
+    struct diffrun runs[DIFF_RUNS_MAX];
+    int line_starts[DIFF_LINES_MAX + 1];  // Of the other file, and one past its last line
+    int snapshot_len;
+    char snapshot[BUFCHUNK_COUNT * BUFCHUNK_SIZE];  // Buffer text between the shared start and end
+};
+static struct diffsplitstate diffsplit;
+
+// Multiple cursors: the primary one is textbuf's, the others are kept here
+struct multicursorstate {
+    int count;           // Cursors besides the primary one
+    int applying;        // One of our batches is being applied (positions are set after it)
+    int primary;         // Index of the primary cursor in all (multicursor_gather)
+    struct bufobserver observer;  // Immediate
+    int pos[MULTICURSOR_MAX];      // Offsets of the other cursors, ascending
+    int all[MULTICURSOR_MAX + 1];  // Offsets of all cursors during a batch
+    struct bufedit edits[MULTICURSOR_MAX + 1];
+};
+static struct multicursorstate multicursor;
+
+// Ctrl-V block selection and the block insert in progress
+struct blockstate {
+    int anchor_y;        // Line and visual column where Ctrl-V was pressed
+    int anchor_x;
+    int inserting;       // Typing the text of an I/A on the first line
+    int insert_abs_i;    // ... which starts here
+    int insert_line;
+    int insert_lines;    // Lines below the first that get it too
+    int insert_col;      // Visual column it goes to
+    int insert_after;    // 'A': short lines are padded up to insert_col
+    int starts[BLOCK_LINES_MAX];  // Per line of the block (block_scan)
+    int start_cols[BLOCK_LINES_MAX];
+    int ends[BLOCK_LINES_MAX];
+    struct bufedit edits[2 * BLOCK_LINES_MAX];
+};
+static struct blockstate block;
+
+// Indent rewrites (>>, <<, :retab)
+struct indentstate {
+    struct bufedit edits[INDENT_BATCH];
+    char spelling[INDENT_TABS_MAX + TAB_STOP_MAX];  // Tabs, then spaces; indents are slices of it
+};
+static struct indentstate indent;
+
+// Undo tree of textbuf
+struct undorecord {
+    int offset;    // Where removed bytes were replaced with inserted ones (text before the edit)
+    int removed;
+    int inserted;
+    int text_at;   // In undo.text: the removed bytes, then the inserted ones
+    int unit;      // Undo unit (one command, or one insert session); records of a unit are consecutive
+    int kind;      // enum caseKind of a case change made in place (0 otherwise): its inserted
+                   // bytes are not kept, and for CASE_TOGGLE neither are the removed ones
+};
+// A unit of edits: a node of the undo tree, whose state is the text after it
+struct undounit {
+    int parent;      // Unit it was made on (-1: the oldest state kept, UNDO_UNIT_LOST: cut off)
+    int depth;       // One more than its parent's
+    int first;       // Its records: first .. first + count - 1
+    int count;
+    int redo_child;  // Unit Ctrl-R redoes from here: the newest, or the one undone last (-1)
+    long long time;  // When it was made
+};
+// The text of one state, as pieces (shared by the checkpoints that have the same chunk)
+struct undocheckpoint {
+    int state;        // Unit the text is the state of (-1: the oldest state kept)
+    int pieces;
+    int* refs;        // Indexes into undo_pieces
+    long long at;     // undo.recorded when it was taken
+};
+struct undopiece {
+    uint64_t hash;
+    int size;
+    int refs;         // Checkpoints that have it
+    int next;         // 1 + next piece in its bucket (or in the free list), 0: none
+    char data[BUFCHUNK_SIZE];
+};
+struct undostate {
+    struct bufobserver observer;
+    int applying;    // Set while u/Ctrl-R edit the buffer (their edits are not recorded)
+    int sealed;      // The next edit starts a new unit
+    int held;        // undo_seal does nothing (a :s applied over several steps is one unit)
+    int skipping;    // The unit being recorded did not fit: the rest of it is not kept
+    int units;       // Units kept, oldest first (a child comes after its parent)
+    int cur;         // Unit whose state the buffer is in (-1: the oldest state)
+    int root_redo;   // redo_child of the oldest state
+    int root_depth;  // and its depth
+    long long root_time;  // When it was the newest state
+    int count;       // Records kept (of all units)
+    int text_len;    // Bytes of text used by the count records
+    int saved;       // State when the file was last written (UNDO_UNIT_LOST if that state is gone)
+    int case_kind;   // Set by the case operators while they edit (see undo_add)
+    long long recorded;         // Records added in this session
+    int checkpoint_count;
+    int pieces_used;            // Pieces ever taken from undo_pieces, and those in use
+    int pieces_live;
+    int piece_free;             // 1 + first free piece (0: none)
+    int no_file;     // :set noundofile - saving does not write the history out
+    int persisted;   // Leading records the undo file holds as they are (see undo_save_file)
+    int persisted_units;  // and units (the last of them may have grown since)
+    char file[PATH_MAX];  // That undo file ("" if none), and the room it has
+    int file_rec_cap;
+    int file_text_cap;
+    int file_unit_cap;
+    void* map_records;    // Space the undo file of a reopened file is mapped into
+    void* map_text;       // (NULL: records, text and tree are undo_records, undo_text and
+    void* map_units;      // undo_units)
+    struct undorecord* records;  // UNDO_RECORDS_MAX of them
+    char* text;                  // UNDO_TEXT_SIZE bytes
+    struct undounit* tree;       // UNDO_UNITS_MAX units
+    struct undocheckpoint checkpoints[UNDO_CHECKPOINTS_MAX];
+    int piece_hash[UNDO_PIECE_HASH];  // 1 + first piece of each bucket
+    struct bufedit edits[UNDO_BATCH];
+};
+static struct undostate undo;
+static struct undorecord undo_records[UNDO_RECORDS_MAX];
+static char undo_text[UNDO_TEXT_SIZE];
+static struct undounit undo_units[UNDO_UNITS_MAX];
+static int undo_path[UNDO_UNITS_MAX];  // Units undo_goto redoes
+static int undo_sizes[UNDO_UNITS_MAX];  // Size of each state of a loaded history, from the oldest
+static struct undopiece undo_pieces[UNDO_PIECES_MAX];
+static int undo_checkpoint_refs[UNDO_CHECKPOINTS_MAX][BUFCHUNK_COUNT];
+static char undo_restore_text[BUFCHUNK_COUNT * BUFCHUNK_SIZE];  // What a checkpoint puts back
+
+// Header of an undo file (".<name>.un~" next to the file). The records follow at
+// UNDO_FILE_PAGE, the text after rec_cap of them and the units after text_cap bytes. The
+// file is sized for all three caps (sparse past what was written), so a later save
+// appends in place.
+struct undofileheader {
+    char magic[8];   // UNDO_FILE_MAGIC
+    uint64_t hash;   // undo_hash_text of the file the history leads to
+    long long size;  // and its size
+    int record_size; // sizeof(struct undorecord)
+    int unit_size;   // sizeof(struct undounit)
+    int rec_cap;
+    int text_cap;
+    int unit_cap;
+    int count;       // As in struct undostate
+    int text_len;
+    int units;
+    int cur;
+    int root_depth;
+    long long root_time;
+};
+
+// editorSave with transforms on: the chunks stream through here into out
+struct savestream {
+    FILE* fp;
+    int flags;                   // enum saveFlag
+    int failed;                  // A write failed (errno tells why)
+    long long written;
+    int last;                    // Last byte written (-1 before the first)
+    struct bufchunk* run_chunk;  // Blanks since the last other byte of the line, written
+    int run_rel_i;               // only if the line goes on (run_last: the last of them)
+    int run_len;
+    int run_last;
+    int out_len;
+    int changed;                 // What was written differs from the buffer
+    char out[SAVE_BUF_SIZE];
+};
+static struct savestream savestream;
+
+// Autosave: after a pause in typing or a number of edits the buffer is copied into
+// chunks of its own, which a pool task hashes and writes out while editing goes on
+struct autosavestate {
+    int idle_seconds;        // :set autosave=N - save N seconds after the last key (0: off)
+    int edit_limit;          // :set autosaveedits=M - save once M edits were made (0: off)
+    int edits;               // Edits since the buffer was last saved or copied
+    int serial;              // Edits ever (tells whether the buffer changed during a write)
+    long long last_key_ms;   // When the last key was handled
+    struct bufobserver observer;  // Immediate
+    int running;             // The copy is being written
+    atomic_int tasks;        // Pool task writing it (group)
+    struct bufchunk* job_begin;  // The copy (NULL: empty)
+    int job_serial;          // serial and save_flags when it was taken
+    int job_flags;
+    int job_same;            // Result: the copy hashes like the last save (nothing written)
+    int job_failed;          // Result: writing failed (job_errno tells why)
+    int job_errno;
+    int job_changed;         // Result: the transforms changed the text (see savestream)
+    long long job_written;
+    uint64_t job_hash;
+    char job_filename[256];
+    uint64_t saved_hash;     // Hash of the text last saved (if have_hash)
+    int have_hash;
+};
+static struct autosavestate autosave;
+static struct bufchunk autosave_chunks[BUFCHUNK_COUNT];  // The copy
+
+// Session: the files visited, each with where the cursor and the view were when it was
+// left. Only the file on screen is loaded; the others are opened when gone to.
+struct sessionfile {
+    char filename[256];
+    int offset;       // Cursor (byte offset)
+    int line;         // Its line (used if the file changed on disk since)
+    int rowoff;
+    int coloff;
+    long long size;   // The file on disk when the position was taken (size -1: the buffer
+    long long mtime;  // had unsaved edits, so only line is trusted)
+};
+struct sessionstate {
+    int count;
+    int current;      // Entry of the file in textbuf (-1: none)
+    int restoring;    // editorOpen is opening a session file (its entry is not replaced)
+    char path[256];   // Session file written at exit ("": none made or restored)
+    struct sessionfile files[SESSION_FILES_MAX];
+};
+static struct sessionstate session = {0, -1, 0, "", {{"", 0, 0, 0, 0, 0, 0}}};
+
+// :s running as a scheduler job: the matches found so far become one batch of edits
+struct substitution {
+    int active;
+    int global;              // g flag: every match of a line, not just the first
+    int pos;                 // Next byte to look at
+    int end;                 // End of the range (both move with edits made meanwhile)
+    int start;               // Where the range starts (for progress)
+    int skip_line;           // Without g: the rest of the line after a match is skipped
+    int percent;             // Progress last shown
+    struct bufchunk* chunk;  // pos in the chunks, NULL until found again after an edit
+    int rel_i;
+    int count;               // Substitutions made (batches applied before included)
+    int edit_count;          // Matches waiting in edits
+    int unit_max;            // Matches applied as one undo unit (as many as the history holds)
+    int units;               // Undo units made
+    int flushing;            // The matches are being applied, a batch a step (the scan waits)
+    int applied;             // Of them, those applied (the others keep their offset in the
+                             // text before: applied * (rep_len - pat_len) is still to add)
+    int scanned;             // The range is scanned: done once the matches are applied
+    int failed;              // A batch did not fit in the buffer
+    int applying;            // Our batch is being applied (the observer leaves it alone)
+    struct canceltoken cancel;  // Ctrl-C: checked before each step and each batch
+    struct bufobserver observer;  // Immediate
+    int pat_len;
+    int rep_len;
+    char pat[CMD_BUF_SIZE];
+    char rep[CMD_BUF_SIZE];
+    char window[SUBST_STEP + CMD_BUF_SIZE];
+    struct bufedit edits[SUBST_EDITS_MAX];
+};
+static struct substitution subst;
+
+// J and gq: a forward scan of the lines, queuing the edits it finds
+struct reflowstate {
+    struct bufedit edits[REFLOW_BATCH];
+    int count;     // Edits queued
+    int delta;     // Bytes the queued edits add before the scan position
+    int last_at;   // Where the last queued edit ends up (in the text after them)
+    int edited;    // Edits applied so far
+    int failed;    // A batch could not be applied: the scan stops
+    struct bufchunk* chunk;  // Scan position
+    int rel_i;
+    int abs_i;
+    char indent[1 + REFLOW_INDENT_MAX];  // A newline, then the indent of the paragraph being filled
+    int indent_len;
+};
+static struct reflowstate reflow;
+
 // Buffer Chunk Pool
 static struct bufchunk bufchunk_pool_data[BUFCHUNK_COUNT];
 static struct bufchunk* bufchunk_pool_free = NULL;
 static int bufchunk_pool_used = 0;
 
-// Screen buffer (using a static buffer instead of dynamic abuf)
-static char screenbuf[SCREEN_BUF_SIZE];
-static int screenbuf_len = 0;
+// Terminal output pipelines (the server has one per attached client)
+static struct screenpipe main_pipe;                  // Standalone terminal
+static struct screenpipe* screen_pipe = &main_pipe;  // Pipe frames are composed for
+static struct screenframe* screen_next = NULL;       // Frame being composed (set by screen_begin_frame)
+static int screen_draw_y = 0;  // Compose position in screen_next
+static int screen_draw_x = 0;
+static unsigned char screen_draw_attr = ATTR_NORMAL;
 
 // *** Function Prototypes ***
 
 // Core Utils
 void die(const char* s);
+void editorExit(int status, const char* msg);
 void editorSetStatusMessage(const char* msg);
 
 // Buffer Chunk Pool
@@ -114,25 +992,56 @@ void bufchunk_free(struct bufchunk* chunk);
 enum RESULT bufclient_find_pos(struct bufclient* buf, int target_abs_i, struct bufchunk** chunk_out, int* rel_i_out);
 enum RESULT bufclient_find_line_start(struct bufclient* buf, int target_abs_y, struct bufchunk** chunk_out, int* rel_i_out, int* start_abs_i_out);
 enum RESULT bufclient_update_cursor_coords(struct bufclient* buf);  // Update abs_x, abs_y from abs_i
+int bufclient_line_col(struct bufclient* buf, int abs_i);  // Byte column of abs_i in its line
+int bufclient_read(struct bufclient* buf, int start_abs_i, char* out, int len);  // Copy text out, returns bytes copied
 
 // Buffer Client API
 enum RESULT bufclient_init(struct bufclient* buf);
 void bufclient_free(struct bufclient* buf);
 enum RESULT bufclient_insert_char(struct bufclient* buf, char c);
 enum RESULT bufclient_delete_char(struct bufclient* buf);  // Deletes char *before* cursor
+enum RESULT bufclient_insert_bytes(struct bufclient* buf, const char* s, int len);  // Inserts at cursor
+enum RESULT bufclient_delete_range(struct bufclient* buf, int start_abs_i, int len);  // Cursor ends at start
+enum RESULT bufclient_apply_edits(struct bufclient* buf, struct bufedit* edits, int count, int cursor_abs_i);
+int bufclient_rewrite(struct bufclient* buf, struct bufedit* edits, int count, int kind);  // In place, same length
 void bufclient_move_cursor_to(struct bufclient* buf, int target_abs_i);
 void bufclient_move_cursor_relative(struct bufclient* buf, int key);  // Uses enum editorKey
 void bufclient_clear(struct bufclient* buf);
+void bufview_save(struct bufview* view, const struct bufclient* buf);
+void bufview_load(struct bufclient* buf, const struct bufview* view);
+void bufview_apply_change(struct bufview* view, const struct bufdelta* delta);
+
+// Buffer Edit Observers
+enum RESULT bufclient_observe(struct bufclient* buf, struct bufobserver* obs);
+void bufclient_unobserve(struct bufclient* buf, struct bufobserver* obs);
+void bufclient_emit(struct bufclient* buf, int offset, int removed, int inserted, int line_delta, int line, int removed_tail);
+void bufclient_before_remove(struct bufclient* buf, int offset, int removed);
+void bufclient_flush_deltas(struct bufclient* buf);
 
 // Terminal Handling
 void disableRawMode();
 enum RESULT enableRawMode();
 enum RESULT getWindowSize(int* rows, int* cols);
+int editorReadByte(char* c, int timeout_ms);
+int typeahead_pending();
+void interrupt_poll();
+int interrupted();
 enum editorKey editorReadKey();
+int key_decode(const char* buf, int len, int* key);
 
 // Output / Rendering
-void screenbuf_append(const char* s, int len);
-void screenbuf_clear();
+void screenbuf_append(struct screenpipe* p, const char* s, int len);
+void screenbuf_clear(struct screenpipe* p);
+void screen_begin_frame();
+void screen_set_attr(unsigned char attr);
+void screen_put(const char* s, int len);
+void screen_clear_eol();
+void screen_next_row();
+void screen_move_cursor(struct screenpipe* p, int y, int x);
+void screen_flush(struct screenpipe* p, const struct screenframe* f);
+void screen_publish();
+enum RESULT render_thread_start(struct screenpipe* p, int out_fd);
+void render_thread_stop(struct screenpipe* p);
 void editorScroll();
 void editorDrawRows();
 void editorDrawStatusBar();
@@ -143,11 +1052,157 @@ int calculate_visual_x(struct bufclient* buf, int target_abs_y, int target_abs_i
 // File I/O
 enum RESULT editorOpen(const char* filename);
 enum RESULT editorSave();
+int save_set_option(const char* opt);
 
 // Editor Operations
 void initEditor();
 void editorProcessCommand();
 void editorProcessKeypress();
+int editorWaitInput();
+int editorInterrupt();
+void editorWake();
+enum RESULT editorWakeInit();
+
+// Client/Server
+const char* server_socket_path(char* out, size_t size);  // NULL or why it failed
+enum editorKey server_read_key();
+int serverMain();
+int clientMain(const char* filename);
+void server_views_invalidate();
+
+// Language Server Client
+void lsp_start(const char* command);
+void lsp_stop();
+void lsp_open_document();
+void lsp_close_document();
+void lsp_flush_changes();
+void lsp_request_completion();
+void lsp_request_definition();
+void lsp_next_diagnostic();
+int lsp_poll_fds(struct pollfd* pfd);
+void lsp_handle_poll(const struct pollfd* pfd, int count);
+
+// Task Pool
+void cancel_token_reset(struct canceltoken* token);
+void cancel_token_cancel(struct canceltoken* token);
+int cancel_token_cancelled(struct canceltoken* token);
+int taskpool_size();
+enum RESULT taskpool_submit(void (*run)(void* arg, int worker), void (*done)(void* arg), void* arg, int priority,
+                            struct canceltoken* token, atomic_int* group);
+void taskpool_wait_group(atomic_int* group);
+void taskpool_deliver();
+void taskpool_stop();
+
+// Scheduler
+enum RESULT sched_add(int (*step)(void* ctx), void* ctx);
+void sched_remove(int (*step)(void* ctx), void* ctx);
+int sched_pending();
+int sched_run_slice();
+
+// Word Completion
+void wordidx_bind();
+void word_complete(int dir);
+void word_complete_done();
+
+// Tags
+void tag_jump(const char* name, int len);
+void tag_jump_word();
+
+// Project Grep
+void grep_start(const char* pattern, int pattern_len, const char* dir);
+void grep_stop();
+int grep_interrupt();
+void grep_next(int dir);
+void grep_update();
+
+// Fuzzy File Finder
+void finder_on_cmdline();
+void finder_select(int dir);
+void finder_open();
+void finder_update();
+void finder_draw();
+void finder_stop();
+int finder_interrupt();
+
+// Diff
+void diff_saved();
+void diff_off();
+void diff_update();
+int diff_gutter_width();
+void diff_draw_gutter(int line);
+void diff_split(const char* filename);
+void diff_split_draw();
+void diff_split_scroll();
+int diff_split_row_of_line(int line);
+int diff_text_cols();
+
+// Multiple Cursors
+int multicursor_key(int c);
+void multicursor_clear();
+void multicursor_column(int n);
+int multicursor_first(int abs_i);
+int multicursor_at(int* next, int abs_i);
+void multicursor_draw_eol(int* next, int abs_i, int x, int text_cols);
+
+// Block Edit
+void block_start();
+int block_key(int c);
+int block_insert_done();
+int block_covers(int y, int x);
+
+// Indent
+void indent_shift(int first, int last, int dir);
+void indent_retab(int first, int last, int tabstop, int all);
+void indent_set_tabstop(int tabstop);
+int indent_command(const char* cmd);
+
+// Substitute
+static int subst_step(void* ctx);
+void subst_stop();
+int subst_interrupt();
+void subst_before_key(int c);
+int subst_command(const char* cmd);
+
+// Undo
+void undo_track();
+void undo_untrack();
+void undo_seal();
+void undo_mark_saved();
+void undo_undo();
+void undo_redo();
+void undo_note_case(int kind);
+void undo_save_file();
+int undo_load_file();
+void undo_checkpoint();
+void undo_travel(const char* arg, int forward);
+
+// Autosave
+void autosave_bind();
+int autosave_set_option(const char* opt);
+int autosave_timeout();
+void autosave_tick();
+void autosave_after_key();
+void autosave_wait();
+void autosave_note_saved();
+
+// Session
+void session_leave();
+void session_enter();
+enum RESULT session_write(const char* path);
+enum RESULT session_restore(const char* path);
+void session_next(int dir);
+
+// Join and Reflow
+void reflow_join(int first, int last);
+void reflow_fill(int first, int last);
+void reflow_motion();
+void reflow_set_textwidth(int width);
+int reflow_command(const char* cmd);
+
+// Case Conversion
+void case_rewrite(struct bufedit* edits, int count, int kind);
+void case_toggle_char();
+void case_motion(int kind);
 
 // *** Buffer Chunk Pool Implementation ***
 void bufchunk_pool_init() {
@@ -188,12 +1243,12 @@ void bufchunk_free(struct bufchunk* chunk) {
 
 // *** Buffer Client Helper Implementation ***
 
-// Find chunk and relative index for a given absolute index. (Inefficient linear scan)
+// Find chunk and relative index for a given absolute index. (Linear scan, starting from
+// the cursor's chunk when the target is nearer to it than to the start of the buffer)
 enum RESULT bufclient_find_pos(struct bufclient* buf, int target_abs_i, struct bufchunk** chunk_out, int* rel_i_out) {
     if (target_abs_i < 0 || target_abs_i > buf->size) {
         return RESULT_ERR;
     }
-    // Optimization: Check if target is near current cursor? Maybe later.
 
     // Handle edge case: position at the very end of the buffer
     if (target_abs_i == buf->size) {
@@ -202,6 +1257,30 @@ enum RESULT bufclient_find_pos(struct bufclient* buf, int target_abs_i, struct b
         return RESULT_OK;
     }
 
+    // Near the cursor (edits, completion, observers): walk from its chunk
+    if (buf->cursor_chunk != NULL) {
+        struct bufchunk* chunk = buf->cursor_chunk;
+        int base = buf->cursor_abs_i - buf->cursor_rel_i;  // Absolute index of chunk's first byte
+        int dist = target_abs_i > base ? target_abs_i - base : base - target_abs_i;
+        if (dist < target_abs_i) {
+            while (chunk != NULL && target_abs_i < base) {
+                chunk = chunk->prev;
+                if (chunk != NULL)
+                    base -= chunk->size;
+            }
+            while (chunk != NULL && target_abs_i >= base + chunk->size) {
+                base += chunk->size;
+                chunk = chunk->next;
+            }
+            if (chunk != NULL) {
+                *chunk_out = chunk;
+                *rel_i_out = target_abs_i - base;
+                return RESULT_OK;
+            }
+            // Fall back to the scan from the start
+        }
+    }
+
     struct bufchunk* current_chunk = buf->begin;
     int current_abs_base = 0;  // Absolute index at the start of current_chunk
     while (current_chunk != NULL) {
@@ -278,6 +1357,43 @@ enum RESULT bufclient_find_line_start(struct bufclient* buf, int target_abs_y, s
     return RESULT_ERR;
 }
 
+// Byte column of abs_i within its line (walks back to the previous newline)
+int bufclient_line_col(struct bufclient* buf, int abs_i) {
+    struct bufchunk* chunk;
+    int rel_i, col = 0;
+    if (bufclient_find_pos(buf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    while (chunk != NULL) {
+        while (rel_i > 0) {
+            if (chunk->data[--rel_i] == '\n')
+                return col;
+            col++;
+        }
+        chunk = chunk->prev;
+        if (chunk != NULL)
+            rel_i = chunk->size;
+    }
+    return col;
+}
+
+// Copy up to len bytes starting at start_abs_i into out; returns the number copied
+int bufclient_read(struct bufclient* buf, int start_abs_i, char* out, int len) {
+    struct bufchunk* chunk;
+    int rel_i, copied = 0;
+    if (bufclient_find_pos(buf, start_abs_i, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    while (chunk != NULL && copied < len) {
+        int n = chunk->size - rel_i;
+        if (n > len - copied)
+            n = len - copied;
+        memcpy(out + copied, chunk->data + rel_i, n);
+        copied += n;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return copied;
+}
+
 enum RESULT bufclient_update_cursor_coords(struct bufclient* buf) {
     // Target absolute index we need to find coordinates for
     int target_abs_i = buf->cursor_abs_i;
@@ -332,7 +1448,7 @@ enum RESULT bufclient_update_cursor_coords(struct bufclient* buf) {
                 current_x = 0; // Reset visual column for the new line
             } else if (c == '\t') {
                 // Add spaces up to the next tab stop
-                current_x += TAB_STOP - (current_x % TAB_STOP);
+                current_x += buf->tabstop - (current_x % buf->tabstop);
             } else if (c >= 0 && c < 32) {
                  // Handle other control characters (e.g., display as ^X or ignore)
                  // Simple approach: treat like a single character for position
@@ -437,7 +1553,7 @@ int calculate_visual_x(struct bufclient* buf, int target_abs_y, int target_abs_i
                 // Should not happen if target_abs_i is on target_abs_y and before the end
                 return visual_x; // Reached end of line before target_abs_i
             } else if (c == '\t') {
-                visual_x += (TAB_STOP - (visual_x % TAB_STOP));
+                visual_x += (buf->tabstop - (visual_x % buf->tabstop));
             } else if (iscntrl((unsigned char)c)) {
                 visual_x += 2;  // Assume ^X representation takes 2 columns
             } else {
@@ -468,6 +1584,8 @@ enum RESULT bufclient_init(struct bufclient* buf) {
     buf->rbegin = buf->begin;
     buf->cursor_chunk = buf->begin;
     buf->rowoff_chunk = buf->begin;  // Cache starts valid at beginning
+    buf->tabstop = TAB_STOP_DEFAULT;
+    buf->textwidth = TEXT_WIDTH_DEFAULT;
     // Other fields are initialized to 0 by memset
     return RESULT_OK;
 }
@@ -485,6 +1603,14 @@ void bufclient_free(struct bufclient* buf) {
 }
 
 void bufclient_clear(struct bufclient* buf) {
+    struct bufobserver* observers[BUFOBSERVER_MAX];
+    int observer_count = buf->observer_count;
+    int old_size = buf->size;
+    int old_lines = 0;
+    int old_tail = 0;  // Length of the last line
+    int tabstop = buf->tabstop;  // Settings stay with the buffer
+    int textwidth = buf->textwidth;
+    int save_flags = buf->save_flags;
     char old_filename[sizeof(buf->filename)];
     int filename_len = strlen(buf->filename); // Get len before memset in bufclient_free
     if (filename_len > 0 && filename_len < sizeof(old_filename)) {
@@ -493,6 +1619,23 @@ void bufclient_clear(struct bufclient* buf) {
         old_filename[0] = '\0';
     }
 
+    memcpy(observers, buf->observers, sizeof(observers));
+    if (observer_count > 0) {  // Observers need the line delta of dropping everything
+        struct bufchunk* ch;
+        int i;
+        for (ch = buf->begin; ch != NULL; ch = ch->next)
+            for (i = 0; i < ch->size; i++)
+                if (ch->data[i] == '\n') {
+                    old_lines++;
+                    old_tail = 0;
+                } else {
+                    old_tail++;
+                }
+    }
+
+    if (old_size > 0) {
+        bufclient_before_remove(buf, 0, old_size);
+    }
     bufclient_free(buf);
     if (bufclient_init(buf) != RESULT_OK) { // Re-initialize to a single empty chunk
          die("Failed to re-initialize buffer after clear"); // Should not happen if alloc worked once
@@ -502,6 +1645,75 @@ void bufclient_clear(struct bufclient* buf) {
        buf->filename[sizeof(buf->filename) - 1] = '\0';
     }
     buf->dirty = 1;                                               // Clearing makes it dirty unless it was already empty
+    buf->tabstop = tabstop;
+    buf->textwidth = textwidth;
+    buf->save_flags = save_flags;
+    memcpy(buf->observers, observers, sizeof(observers));
+    buf->observer_count = observer_count;
+    if (old_size > 0) {
+        bufclient_emit(buf, 0, old_size, 0, -old_lines, 0, old_tail);
+    }
+}
+
+// Copy the cursor/viewport part of buf into view
+void bufview_save(struct bufview* view, const struct bufclient* buf) {
+    view->cursor_chunk = buf->cursor_chunk;
+    view->cursor_rel_i = buf->cursor_rel_i;
+    view->cursor_abs_i = buf->cursor_abs_i;
+    view->cursor_abs_y = buf->cursor_abs_y;
+    view->cursor_abs_x = buf->cursor_abs_x;
+    view->cursor_goal_x = buf->cursor_goal_x;
+    view->rowoff = buf->rowoff;
+    view->coloff = buf->coloff;
+    view->rowoff_chunk = buf->rowoff_chunk;
+    view->rowoff_rel_i = buf->rowoff_rel_i;
+    view->rowoff_abs_i = buf->rowoff_abs_i;
+}
+
+// Make view the cursor/viewport of buf, recomputing positions that went stale
+void bufview_load(struct bufclient* buf, const struct bufview* view) {
+    buf->cursor_chunk = view->cursor_chunk;
+    buf->cursor_rel_i = view->cursor_rel_i;
+    buf->cursor_abs_i = view->cursor_abs_i;
+    buf->cursor_abs_y = view->cursor_abs_y;
+    buf->cursor_abs_x = view->cursor_abs_x;
+    buf->cursor_goal_x = view->cursor_goal_x;
+    buf->rowoff = view->rowoff;
+    buf->coloff = view->coloff;
+    buf->rowoff_chunk = view->rowoff_chunk;
+    buf->rowoff_rel_i = view->rowoff_rel_i;
+    buf->rowoff_abs_i = view->rowoff_abs_i;
+
+    if (buf->cursor_chunk == NULL) {
+        if (buf->cursor_abs_i > buf->size) buf->cursor_abs_i = buf->size;
+        if (buf->cursor_abs_i < 0) buf->cursor_abs_i = 0;
+        if (bufclient_find_pos(buf, buf->cursor_abs_i, &buf->cursor_chunk, &buf->cursor_rel_i) != RESULT_OK ||
+            bufclient_update_cursor_coords(buf) != RESULT_OK) {
+            buf->cursor_chunk = buf->begin;
+            buf->cursor_rel_i = 0;
+            buf->cursor_abs_i = 0;
+            buf->cursor_abs_y = 0;
+            buf->cursor_abs_x = 0;
+        }
+    }
+}
+
+// Shift a view that is not being edited through an edit of another view on the same
+// buffer: positions after the change move with the text, chunk pointers become stale.
+void bufview_apply_change(struct bufview* view, const struct bufdelta* delta) {
+    if (view->cursor_abs_i >= delta->offset + delta->removed) {
+        view->cursor_abs_i += delta->inserted - delta->removed;
+    } else if (view->cursor_abs_i > delta->offset) {
+        view->cursor_abs_i = delta->offset;  // Cursor was inside the removed text
+    }
+    view->cursor_chunk = NULL;  // Chunks may have been split, merged or freed
+
+    // Keep the same text at the top of the view when lines change above it
+    if (delta->offset < view->rowoff_abs_i) {
+        view->rowoff += delta->line_delta;
+        if (view->rowoff < 0) view->rowoff = 0;
+    }
+    view->rowoff_chunk = NULL;
 }
 
 enum RESULT bufclient_insert_char(struct bufclient* buf, char c) {
@@ -616,6 +1828,8 @@ enum RESULT bufclient_insert_char(struct bufclient* buf, char c) {
 
     buf->cursor_goal_x = buf->cursor_abs_x;  // Update goal x on horizontal move/insert
 
+    bufclient_emit(buf, buf->cursor_abs_i - 1, 0, 1, c == '\n' ? 1 : 0, buf->cursor_abs_y - (c == '\n' ? 1 : 0), 0);
+
     return RESULT_OK;
 }
 
@@ -639,7 +1853,8 @@ enum RESULT bufclient_delete_char(struct bufclient* buf) {  // Deletes char *bef
         buf->rowoff_chunk = NULL;
     }
 
-    //char deleted_char = del_chunk->data[del_rel_i]; // Keep track if needed for undo later
+    char deleted_char = del_chunk->data[del_rel_i]; // Needed for the line delta (and undo later)
+    bufclient_before_remove(buf, del_abs_i, 1);
 
     // Shift data within the chunk to overwrite the deleted character
     // Make sure not to read past the end if deleting the last char
@@ -737,101 +1952,826 @@ enum RESULT bufclient_delete_char(struct bufclient* buf) {  // Deletes char *bef
         }
     }
 
+    bufclient_emit(buf, del_abs_i, 1, 0, deleted_char == '\n' ? -1 : 0, buf->cursor_abs_y, 0);
+
     return RESULT_OK;
 }
 
-// Move cursor to a specific absolute index
-void bufclient_move_cursor_to(struct bufclient* buf, int target_abs_i) {
-    // Clamp target index within valid buffer range
-    if (target_abs_i < 0)
-        target_abs_i = 0;
-    if (target_abs_i > buf->size)
-        target_abs_i = buf->size;
+// *** Buffer Edit Observer Implementation ***
 
-    // Find the chunk and relative position for the target index
-    if (bufclient_find_pos(buf, target_abs_i, &buf->cursor_chunk, &buf->cursor_rel_i) == RESULT_OK) {
-        buf->cursor_abs_i = target_abs_i;
-        // Update visual coordinates (inefficiently but accurately)
-        if (bufclient_update_cursor_coords(buf) != RESULT_OK) {
-             editorSetStatusMessage("Warning: Cursor coordinate update failed after move.");
+// Register obs to receive the deltas of every edit of buf
+enum RESULT bufclient_observe(struct bufclient* buf, struct bufobserver* obs) {
+    if (buf->observer_count >= BUFOBSERVER_MAX) {
+        return RESULT_ERR;
+    }
+    obs->pending_len = 0;
+    buf->observers[buf->observer_count++] = obs;
+    return RESULT_OK;
+}
+
+// Unregister obs (pending deltas are dropped)
+void bufclient_unobserve(struct bufclient* buf, struct bufobserver* obs) {
+    int i;
+    for (i = 0; i < buf->observer_count; i++) {
+        if (buf->observers[i] == obs) {
+            memmove(&buf->observers[i], &buf->observers[i + 1], (buf->observer_count - i - 1) * sizeof(buf->observers[0]));
+            buf->observer_count--;
+            obs->pending_len = 0;
+            return;
         }
-        // Set goal x when explicitly moving cursor
-        buf->cursor_goal_x = buf->cursor_abs_x;
+    }
+}
+
+// Deliver and clear the pending deltas of a batched observer
+static void bufobserver_flush(struct bufclient* buf, struct bufobserver* obs) {
+    if (obs->pending_len == 0)
+        return;
+    int count = obs->pending_len;
+    obs->pending_len = 0;  // Cleared first so notify may edit the buffer again
+    obs->notify(buf, obs->pending, count, obs->ctx);
+}
+
+// Try to fold delta d into last (the previous pending delta); 1 on success
+static int bufdelta_coalesce(struct bufdelta* last, const struct bufdelta* d) {
+    if (last->removed == 0 && d->removed == 0 && d->offset == last->offset + last->inserted) {
+        // Typing: insertion continues right after the previous one
+        last->inserted += d->inserted;
+        last->line_delta += d->line_delta;
+        return 1;
+    }
+    if (last->inserted == 0 && d->inserted == 0 && d->offset + d->removed == last->offset) {
+        // Backspacing: removal right before the previous one (which keeps its end)
+        last->offset = d->offset;
+        last->removed += d->removed;
+        last->line_delta += d->line_delta;
+        last->line = d->line;
+        last->col = d->col;
+        return 1;
+    }
+    if (last->inserted == 0 && d->inserted == 0 && d->offset == last->offset) {
+        // Deleting forward at the same position: map d's end back to the text before last
+        if (d->end_line == d->line) {
+            last->end_col += d->end_col - d->col;
+        } else {
+            last->end_line += d->end_line - d->line;
+            last->end_col = d->end_col;
+        }
+        last->removed += d->removed;
+        last->line_delta += d->line_delta;
+        return 1;
+    }
+    return 0;
+}
+
+// bufclient_emit for a caller that knows the byte column of offset already. The removed
+// text spans removed_lines newlines (a replacement may remove as many as it inserts).
+static void bufclient_emit_at(struct bufclient* buf, int offset, int removed, int inserted, int line_delta, int line, int col, int removed_lines, int removed_tail) {
+    struct bufdelta d;
+    int i;
+    if (buf->observer_count == 0)
+        return;
+    d.offset = offset;
+    d.removed = removed;
+    d.inserted = inserted;
+    d.line_delta = line_delta;
+    d.line = line;
+    d.col = col;
+    if (removed_lines > 0) {
+        d.end_line = line + removed_lines;
+        d.end_col = removed_tail;
     } else {
-         editorSetStatusMessage("Error: Failed to find position for cursor move.");
-         // Optional: move to nearest valid position? (e.g., end of buffer)
-         // buf->cursor_abs_i = buf->size;
-         // bufclient_find_pos(buf, buf->cursor_abs_i, &buf->cursor_chunk, &buf->cursor_rel_i);
-         // bufclient_update_cursor_coords(buf);
+        d.end_line = line;
+        d.end_col = d.col + removed;
+    }
+    for (i = 0; i < buf->observer_count; i++) {
+        struct bufobserver* obs = buf->observers[i];
+        if (!obs->batched) {
+            obs->notify(buf, &d, 1, obs->ctx);
+            continue;
+        }
+        if (obs->pending_len > 0 && bufdelta_coalesce(&obs->pending[obs->pending_len - 1], &d))
+            continue;
+        if (obs->pending_len == BUFDELTA_BATCH_MAX)
+            bufobserver_flush(buf, obs);  // Batch full: deliver early
+        obs->pending[obs->pending_len++] = d;
     }
 }
 
-// Move cursor based on ARROW_UP, DOWN, LEFT, RIGHT keys
-void bufclient_move_cursor_relative(struct bufclient* buf, int key) {
-    int current_abs_i = buf->cursor_abs_i;
-    int target_abs_i = current_abs_i;
-    // Use current cursor chunk/rel_i as potential starting points for efficiency
-    struct bufchunk* target_chunk = buf->cursor_chunk;
-    int target_rel_i = buf->cursor_rel_i;
-    int need_full_update = 0; // Flag if efficient update fails
+// Report an edit of buf to all observers. An edit either removes or inserts text;
+// removed_tail is the number of removed bytes after the last removed newline.
+void bufclient_emit(struct bufclient* buf, int offset, int removed, int inserted, int line_delta, int line, int removed_tail) {
+    if (buf->observer_count == 0)
+        return;
+    bufclient_emit_at(buf, offset, removed, inserted, line_delta, line, bufclient_line_col(buf, offset), removed > 0 && line_delta < 0 ? -line_delta : 0, removed_tail);  // Text before offset is unchanged
+}
 
-    switch (key) {
-        case ARROW_LEFT:
-            if (target_abs_i > 0) {
-                target_abs_i--;
-                // Efficiently update chunk/rel_i if possible
-                if (target_rel_i > 0) {
-                    target_rel_i--;
-                } else if (target_chunk && target_chunk->prev != NULL) {
-                    target_chunk = target_chunk->prev;
-                    target_rel_i = target_chunk->size - 1; // Move to last char of prev chunk
-                } else {
-                    // At start of buffer or inconsistent state, need full find_pos
-                    need_full_update = 1;
-                }
+// Give observers a look at text about to be removed
+void bufclient_before_remove(struct bufclient* buf, int offset, int removed) {
+    int i;
+    for (i = 0; i < buf->observer_count; i++) {
+        struct bufobserver* obs = buf->observers[i];
+        if (obs->before_remove != NULL)
+            obs->before_remove(buf, offset, removed, obs->ctx);
+    }
+}
+
+// Deliver the deltas batched since the last call (once per event loop tick)
+void bufclient_flush_deltas(struct bufclient* buf) {
+    int i;
+    for (i = 0; i < buf->observer_count; i++) {
+        if (buf->observers[i]->batched)
+            bufobserver_flush(buf, buf->observers[i]);
+    }
+}
+
+// Advance visual column x over len bytes of s (same widths as bufclient_update_cursor_coords)
+static int bufclient_advance_x(struct bufclient* buf, int x, const char* s, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\n') {
+            x = 0;
+        } else if (s[i] == '\t') {
+            x += buf->tabstop - (x % buf->tabstop);
+        } else {
+            x++;
+        }
+    }
+    return x;
+}
+
+// Splice len bytes in at (*chunk_io, *rel_i_io) in one pass over the chunks, leaving the
+// position after them. The caller checks the pool (bufclient_splice_room) and emits.
+static void bufclient_splice_insert(struct bufclient* buf, struct bufchunk** chunk_io, int* rel_i_io, const char* s, int len) {
+    struct bufchunk* chunk = *chunk_io;
+    int rel_i = *rel_i_io;
+    char tail[BUFCHUNK_SIZE];
+    int tail_len = chunk->size - rel_i;
+
+    // Cut the part after the position off, append the new bytes, then put it back
+    memcpy(tail, chunk->data + rel_i, tail_len);
+    chunk->size = rel_i;
+
+    struct bufchunk* cur = chunk;
+    int done = 0;
+    while (done < len) {
+        if (cur->size == BUFCHUNK_SIZE) {
+            struct bufchunk* fresh = bufchunk_alloc();  // Cannot fail, checked by the caller
+            fresh->prev = cur;
+            fresh->next = cur->next;
+            if (cur->next != NULL) {
+                cur->next->prev = fresh;
             } else {
-                return; // Already at start
+                buf->rbegin = fresh;
             }
-            break; // ARROW_LEFT
+            cur->next = fresh;
+            cur = fresh;
+        }
+        int n = BUFCHUNK_SIZE - cur->size;
+        if (n > len - done)
+            n = len - done;
+        memcpy(cur->data + cur->size, s + done, n);
+        cur->size += n;
+        done += n;
+    }
+    *chunk_io = cur;
+    *rel_i_io = cur->size;
+
+    if (tail_len > 0) {
+        struct bufchunk* dest = cur;
+        if (cur->size + tail_len > BUFCHUNK_SIZE) {
+            dest = bufchunk_alloc();
+            dest->prev = cur;
+            dest->next = cur->next;
+            if (cur->next != NULL) {
+                cur->next->prev = dest;
+            } else {
+                buf->rbegin = dest;
+            }
+            cur->next = dest;
+        }
+        memcpy(dest->data + dest->size, tail, tail_len);
+        dest->size += tail_len;
+    }
 
-        case ARROW_RIGHT:
-            if (target_abs_i < buf->size) {
-                target_abs_i++;
-                // Efficiently update chunk/rel_i
-                if (target_chunk && target_rel_i < target_chunk->size) {
-                    target_rel_i++;
-                } else if (target_chunk && target_chunk->next != NULL) {
-                    target_chunk = target_chunk->next;
-                    target_rel_i = (target_chunk->size > 0) ? 0 : 0; // Move to first char of next chunk
-                     // Correction: If target_abs_i is the very end, rel_i should be size
-                     if (target_abs_i == buf->size) {
-                          target_rel_i = target_chunk ? target_chunk->size : 0;
-                     } else {
-                          target_rel_i = 0; // Moving into next chunk, not at end
-                     }
+    buf->size += len;
+    buf->dirty = 1;
+}
 
-                } else {
-                    // At end of buffer or inconsistent state, need full find_pos
-                     // If moving right to the absolute end, handle specially
-                     if (target_abs_i == buf->size) {
-                         target_chunk = buf->rbegin;
-                         target_rel_i = target_chunk ? target_chunk->size : 0;
-                     } else {
-                         need_full_update = 1;
-                     }
-                }
+// Chunks bufclient_splice_insert may take from the pool for len bytes spliced into chunk
+static int bufclient_splice_room(struct bufchunk* chunk, int len) {
+    return (chunk->size + len + BUFCHUNK_SIZE - 1) / BUFCHUNK_SIZE - 1;
+}
+
+// Remove len bytes starting at (*chunk_io, *rel_i_io) in one pass over the chunks (emptied
+// chunks are freed, neighbours merged once at the end), leaving the position of the cut.
+// Counts the removed newlines and the bytes after the last one. The caller emits.
+static void bufclient_splice_remove(struct bufclient* buf, struct bufchunk** chunk_io, int* rel_i_io, int len, int* newlines_out, int* tail_out) {
+    struct bufchunk* chunk = *chunk_io;
+    int rel_i = *rel_i_io, newlines = 0, tail = 0;
+    struct bufchunk* first = chunk;
+    int first_rel_i = rel_i;
+    int remaining = len;
+    while (remaining > 0 && chunk != NULL) {
+        int n = chunk->size - rel_i;
+        if (n > remaining)
+            n = remaining;
+        int i;
+        for (i = rel_i; i < rel_i + n; i++) {
+            if (chunk->data[i] == '\n') {
+                newlines++;
+                tail = 0;
             } else {
-                return; // Already at end
+                tail++;
             }
-            break; // ARROW_RIGHT
+        }
+        memmove(chunk->data + rel_i, chunk->data + rel_i + n, chunk->size - rel_i - n);
+        chunk->size -= n;
+        remaining -= n;
+
+        struct bufchunk* next = chunk->next;
+        if (chunk->size == 0 && chunk != buf->begin) {
+            // Unlink the emptied chunk
+            chunk->prev->next = next;
+            if (next != NULL) {
+                next->prev = chunk->prev;
+            } else {
+                buf->rbegin = chunk->prev;
+            }
+            if (buf->rowoff_chunk == chunk)
+                buf->rowoff_chunk = NULL;
+            if (chunk == first) {
+                first = chunk->prev;
+                first_rel_i = first->size;
+            }
+            bufchunk_free(chunk);
+        }
+        chunk = next;
+        rel_i = 0;
+    }
+    buf->size -= len;
+    buf->dirty = 1;
 
-        case ARROW_UP: {
-            if (buf->cursor_abs_y == 0)
-                return; // Already on first line
+    // Merge the chunk at the cut with its successor if they now fit into one
+    if (first != NULL && first->next != NULL && first->size + first->next->size <= BUFCHUNK_SIZE) {
+        struct bufchunk* next = first->next;
+        memcpy(first->data + first->size, next->data, next->size);
+        first->size += next->size;
+        first->next = next->next;
+        if (next->next != NULL) {
+            next->next->prev = first;
+        } else {
+            buf->rbegin = first;
+        }
+        if (buf->rowoff_chunk == next)
+            buf->rowoff_chunk = NULL;
+        bufchunk_free(next);
+    }
+    *chunk_io = first;
+    *rel_i_io = first_rel_i;
+    *newlines_out = newlines;
+    *tail_out = tail;
+}
 
-            // Find start of previous line
-            struct bufchunk* prev_line_start_chunk;
-            int prev_line_start_rel_i, prev_line_start_abs_i;
+// Insert len bytes at the cursor in one pass over the chunks, leaving the cursor after
+// them. Reported to observers as a single delta.
+enum RESULT bufclient_insert_bytes(struct bufclient* buf, const char* s, int len) {
+    struct bufchunk* chunk = buf->cursor_chunk;
+    int rel_i = buf->cursor_rel_i;
+    int i, newlines = 0;
+    int line = buf->cursor_abs_y;
+
+    if (len <= 0)
+        return RESULT_OK;
+    if (chunk == NULL) {
+        chunk = buf->begin;
+        rel_i = 0;
+        if (chunk == NULL) {
+            editorSetStatusMessage("Error: Buffer in inconsistent state during insert.");
+            return RESULT_ERR;
+        }
+    }
+
+    // Make sure the pool can hold everything before touching the buffer
+    if (bufclient_splice_room(chunk, len) > BUFCHUNK_COUNT - bufchunk_pool_used) {
+        editorSetStatusMessage("Out of memory!");
+        return RESULT_ERR;
+    }
+
+    if (buf->rowoff_chunk && buf->cursor_abs_i < buf->rowoff_abs_i) {
+        buf->rowoff_chunk = NULL;  // Rows after the cursor move
+    }
+
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\n')
+            newlines++;
+    }
+    bufclient_splice_insert(buf, &chunk, &rel_i, s, len);
+    buf->cursor_chunk = chunk;
+    buf->cursor_rel_i = rel_i;
+
+    buf->cursor_abs_i += len;
+    buf->cursor_abs_y += newlines;
+    buf->cursor_abs_x = bufclient_advance_x(buf, buf->cursor_abs_x, s, len);
+    buf->cursor_goal_x = buf->cursor_abs_x;
+
+    bufclient_emit(buf, buf->cursor_abs_i - len, 0, len, newlines, line, 0);
+    return RESULT_OK;
+}
+
+// Delete len bytes starting at start_abs_i in one pass over the chunks. The cursor ends
+// at start_abs_i. Reported to observers as a single delta.
+enum RESULT bufclient_delete_range(struct bufclient* buf, int start_abs_i, int len) {
+    struct bufchunk* chunk;
+    int rel_i, newlines, tail;
+
+    if (start_abs_i < 0 || len < 0 || start_abs_i + len > buf->size) {
+        return RESULT_ERR;
+    }
+    if (len == 0) {
+        bufclient_move_cursor_to(buf, start_abs_i);
+        return RESULT_OK;
+    }
+    if (bufclient_find_pos(buf, start_abs_i, &chunk, &rel_i) != RESULT_OK) {
+        editorSetStatusMessage("Error finding delete position!");
+        return RESULT_ERR;
+    }
+    if (buf->rowoff_chunk && start_abs_i < buf->rowoff_abs_i) {
+        buf->rowoff_chunk = NULL;
+    }
+
+    bufclient_before_remove(buf, start_abs_i, len);
+    buf->cursor_chunk = NULL;  // May be freed below; found again by bufclient_move_cursor_to
+    bufclient_splice_remove(buf, &chunk, &rel_i, len, &newlines, &tail);
+
+    bufclient_move_cursor_to(buf, start_abs_i);
+    bufclient_emit(buf, start_abs_i, len, 0, -newlines, buf->cursor_abs_y, tail);
+    return RESULT_OK;
+}
+
+// Fill in the line and column of every edit (ascending offsets) in one forward pass over the chunks.
+static void bufclient_edit_lines(struct bufclient* buf, struct bufedit* edits, int count) {
+    struct bufchunk* chunk = buf->begin;
+    int rel_i = 0, abs_i = 0, line = 0, line_start = 0, k;
+    for (k = 0; k < count; k++) {
+        while (abs_i < edits[k].offset && chunk != NULL) {
+            int n = chunk->size - rel_i;
+            if (n > edits[k].offset - abs_i)
+                n = edits[k].offset - abs_i;
+            const char* p = chunk->data + rel_i;
+            const char* end = p + n;
+            while ((p = memchr(p, '\n', end - p)) != NULL) {
+                line++;
+                p++;
+                line_start = abs_i + (int)(p - (chunk->data + rel_i));
+            }
+            rel_i += n;
+            abs_i += n;
+            if (rel_i == chunk->size) {
+                chunk = chunk->next;
+                rel_i = 0;
+            }
+        }
+        edits[k].line = line;
+        edits[k].col = edits[k].offset - line_start;
+    }
+}
+
+// Pack the bytes of buf into as few chunks as they fill, the emptied ones going back to the
+// pool. Splices leave chunks part full; a batch packs them when the pool runs short. Chunk
+// pointers into buf are stale afterwards.
+static void bufclient_pack(struct bufclient* buf) {
+    struct bufchunk* chunk;
+    for (chunk = buf->begin; chunk != NULL; chunk = chunk->next) {
+        while (chunk->size < BUFCHUNK_SIZE && chunk->next != NULL) {
+            struct bufchunk* next = chunk->next;
+            int n = BUFCHUNK_SIZE - chunk->size;
+            if (n > next->size)
+                n = next->size;
+            memcpy(chunk->data + chunk->size, next->data, n);
+            chunk->size += n;
+            memmove(next->data, next->data + n, next->size - n);
+            next->size -= n;
+            if (next->size == 0) {
+                chunk->next = next->next;
+                if (next->next != NULL) {
+                    next->next->prev = chunk;
+                } else {
+                    buf->rbegin = chunk;
+                }
+                bufchunk_free(next);
+            }
+        }
+    }
+    buf->cursor_chunk = NULL;
+    buf->rowoff_chunk = NULL;
+}
+
+// Apply count edits (ascending, non-overlapping offsets into the text before the batch)
+// as one mutation: their lines come from one forward pass, then they are spliced in back
+// to front so the offsets still to come stay valid, each found by a short walk back from
+// the previous one. Observers get each edit as its own deltas, in the order applied.
+// The cursor ends at cursor_abs_i (in the text after the batch), the top row keeps its text.
+// The pool is checked up front, so a batch is applied whole or not at all.
+enum RESULT bufclient_apply_edits(struct bufclient* buf, struct bufedit* edits, int count, int cursor_abs_i) {
+    struct bufchunk* chunk;
+    int rel_i, k, i, own = 0;
+    long long total, room = 0;
+    int top_valid = buf->rowoff_chunk != NULL;
+    int top_shift = 0, top_lines = 0;  // How the first visible row moves
+    enum RESULT result = RESULT_OK;
+
+    if (count <= 0)
+        return RESULT_OK;
+    if (buf->begin == NULL) {
+        editorSetStatusMessage("Error: Buffer in inconsistent state during insert.");
+        return RESULT_ERR;
+    }
+    total = buf->size;
+    for (k = 0; k < count; k++) {
+        struct bufedit* e = &edits[k];
+        if (e->offset < 0 || e->removed < 0 || e->inserted < 0 || e->offset + e->removed > buf->size ||
+            (k > 0 && e->offset < edits[k - 1].offset + edits[k - 1].removed)) {
+            return RESULT_ERR;
+        }
+        total += e->inserted;
+        room += (e->inserted + BUFCHUNK_SIZE - 1) / BUFCHUNK_SIZE;  // What one splice can take
+    }
+    // Make sure the pool can hold everything before touching the buffer: either every splice
+    // gets its worst case, or packed, the text never takes more than its bytes fill plus one
+    // (an insert may split the chunk it goes into), whatever the splices before it left.
+    if (room > BUFCHUNK_COUNT - bufchunk_pool_used) {
+        for (chunk = buf->begin; chunk != NULL; chunk = chunk->next)
+            own++;
+        if ((total + BUFCHUNK_SIZE - 1) / BUFCHUNK_SIZE + 1 > BUFCHUNK_COUNT - (bufchunk_pool_used - own)) {
+            editorSetStatusMessage("Out of memory!");
+            return RESULT_ERR;
+        }
+    }
+    bufclient_edit_lines(buf, edits, count);
+
+    buf->rowoff_chunk = NULL;  // Split or freed along the way; found again at the end
+    for (k = count - 1; k >= 0; k--) {
+        struct bufedit* e = &edits[k];
+        int removed_lines = 0, tail = 0, inserted_lines = 0;
+        if (bufclient_find_pos(buf, e->offset, &chunk, &rel_i) != RESULT_OK) {
+            editorSetStatusMessage("Error finding edit position!");
+            result = RESULT_ERR;
+            break;
+        }
+        if (e->removed > 0) {
+            bufclient_before_remove(buf, e->offset, e->removed);
+            buf->cursor_chunk = NULL;  // May be freed
+            bufclient_splice_remove(buf, &chunk, &rel_i, e->removed, &removed_lines, &tail);
+            buf->cursor_chunk = chunk;
+            buf->cursor_rel_i = rel_i;
+            buf->cursor_abs_i = e->offset;
+            bufclient_emit_at(buf, e->offset, e->removed, 0, -removed_lines, e->line, e->col, removed_lines, tail);
+        }
+        if (e->inserted > 0) {
+            if (bufclient_splice_room(chunk, e->inserted) > BUFCHUNK_COUNT - bufchunk_pool_used) {
+                bufclient_pack(buf);  // Leaves room, see the check above
+                bufclient_find_pos(buf, e->offset, &chunk, &rel_i);
+            }
+            for (i = 0; i < e->inserted; i++) {
+                if (e->text[i] == '\n')
+                    inserted_lines++;
+            }
+            bufclient_splice_insert(buf, &chunk, &rel_i, e->text, e->inserted);
+            buf->cursor_chunk = chunk;
+            buf->cursor_rel_i = rel_i;
+            buf->cursor_abs_i = e->offset + e->inserted;
+            bufclient_emit_at(buf, e->offset, 0, e->inserted, inserted_lines, e->line, e->col, 0, 0);
+        }
+
+        // Keep the same text at the top of the view when lines change above it
+        if (top_valid && e->offset < buf->rowoff_abs_i) {
+            if (e->removed > 0 && e->offset + e->removed >= buf->rowoff_abs_i) {
+                top_valid = 0;  // The row start itself (or the newline before it) went away
+            } else {
+                top_shift += e->inserted - e->removed;
+                top_lines += inserted_lines - removed_lines;
+            }
+        }
+    }
+    if (top_valid && result == RESULT_OK) {
+        buf->rowoff_abs_i += top_shift;
+        buf->rowoff += top_lines;
+        if (bufclient_find_pos(buf, buf->rowoff_abs_i, &buf->rowoff_chunk, &buf->rowoff_rel_i) != RESULT_OK)
+            buf->rowoff_chunk = NULL;
+    }
+
+    bufclient_move_cursor_to(buf, cursor_abs_i);  // The only coordinate update
+    return result;
+}
+
+// Bytes among the 8 ASCII bytes of w whose letter kind (enum caseKind) changes, as a
+// mask with 0x20 (the case bit) in each of them. All 8 at once in one word (SWAR): a
+// byte plus 0x80 - 'A' has its top bit set from 'A' on, plus 0x7F - 'Z' from past 'Z'.
+static uint64_t case_ascii_mask(uint64_t w, int kind) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t tops = 0x8080808080808080ULL;
+    uint64_t upper = (w + (0x80 - 'A') * ones) & ~(w + (0x7F - 'Z') * ones);
+    uint64_t lower = (w + (0x80 - 'a') * ones) & ~(w + (0x7F - 'z') * ones);
+    uint64_t m = kind == CASE_UPPER ? lower : kind == CASE_LOWER ? upper : upper | lower;
+    return (m & tops) >> 2;
+}
+
+static int case_ascii(int c, int kind) {
+    if (c >= 'a' && c <= 'z' && kind != CASE_LOWER)
+        return c - 32;
+    if (c >= 'A' && c <= 'Z' && kind != CASE_UPPER)
+        return c + 32;
+    return c;
+}
+
+// Upper case partner of a code point with a two-byte UTF-8 encoding (Latin-1, Latin
+// Extended-A, Greek, Cyrillic), or cp itself
+static int case_wide_upper(int cp) {
+    if ((cp >= 0xE0 && cp <= 0xFE && cp != 0xF7) || (cp >= 0x3B1 && cp <= 0x3CB && cp != 0x3C2) || (cp >= 0x430 && cp <= 0x44F))
+        return cp - 0x20;
+    if (cp >= 0x450 && cp <= 0x45F)
+        return cp - 0x50;
+    if (cp == 0x3C2)
+        return 0x3A3;  // Final sigma
+    if (cp == 0x3AC)
+        return 0x386;
+    if (cp >= 0x3AD && cp <= 0x3AF)
+        return cp - 0x25;
+    if (cp == 0x3CC)
+        return 0x38C;
+    if (cp == 0x3CD || cp == 0x3CE)
+        return cp - 0x3F;
+    // Latin Extended-A: pairs of capital and small letter, the capital even in some runs, odd in others
+    if ((cp >= 0x100 && cp <= 0x12F) || (cp >= 0x132 && cp <= 0x137) || (cp >= 0x14A && cp <= 0x177))
+        return cp & ~1;
+    if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E))
+        return (cp & 1) ? cp : cp - 1;
+    return cp;
+}
+
+// Lower case partner of cp, as case_wide_upper
+static int case_wide_lower(int cp) {
+    if ((cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) || (cp >= 0x391 && cp <= 0x3AB && cp != 0x3A2) || (cp >= 0x410 && cp <= 0x42F))
+        return cp + 0x20;
+    if (cp >= 0x400 && cp <= 0x40F)
+        return cp + 0x50;
+    if (cp == 0x386)
+        return 0x3AC;
+    if (cp >= 0x388 && cp <= 0x38A)
+        return cp + 0x25;
+    if (cp == 0x38C)
+        return 0x3CC;
+    if (cp == 0x38E || cp == 0x38F)
+        return cp + 0x3F;
+    if ((cp >= 0x100 && cp <= 0x12F) || (cp >= 0x132 && cp <= 0x137) || (cp >= 0x14A && cp <= 0x177))
+        return cp | 1;
+    if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E))
+        return (cp & 1) ? cp + 1 : cp;
+    return cp;
+}
+
+// cp changed to kind. Toggling only swaps true pairs, so toggling twice gives cp back.
+static int case_wide(int cp, int kind) {
+    int upper = case_wide_upper(cp), lower = case_wide_lower(cp);
+    if (kind == CASE_UPPER)
+        return upper;
+    if (kind == CASE_LOWER)
+        return lower;
+    if (upper != cp && case_wide_lower(upper) == cp)
+        return upper;
+    if (lower != cp && case_wide_upper(lower) == cp)
+        return lower;
+    return cp;
+}
+
+// Change the case (enum caseKind) of the letters among len bytes from (chunk, rel_i):
+// eight ASCII bytes at a time, and byte by byte around other UTF-8 text, where only
+// letters whose partner has the same length change. With write unset, just looks.
+// Returns whether any letter changes.
+static int bufclient_case_pass(struct bufchunk* chunk, int rel_i, int len, int kind, int write) {
+    unsigned char* lead = NULL;  // Lead byte of a two-byte sequence (perhaps in the previous chunk)
+    int found = 0;
+    while (chunk != NULL && len > 0) {
+        unsigned char* p = (unsigned char*)chunk->data + rel_i;
+        int n = chunk->size - rel_i, i = 0;
+        if (n > len)
+            n = len;
+        while (i < n) {
+            if (lead == NULL && i + 8 <= n) {
+                uint64_t w, m;
+                memcpy(&w, p + i, 8);
+                if ((w & 0x8080808080808080ULL) == 0) {
+                    m = case_ascii_mask(w, kind);
+                    if (m != 0) {
+                        if (!write)
+                            return 1;
+                        w ^= m;
+                        memcpy(p + i, &w, 8);
+                        found = 1;
+                    }
+                    i += 8;
+                    continue;
+                }
+            }
+            int c = p[i];
+            if (c < 0x80) {
+                int to = case_ascii(c, kind);
+                if (to != c) {
+                    if (!write)
+                        return 1;
+                    p[i] = (unsigned char)to;
+                    found = 1;
+                }
+                lead = NULL;
+            } else if (c >= 0xC2 && c < 0xE0) {
+                lead = p + i;
+            } else if (c < 0xC0 && lead != NULL) {
+                int cp = ((*lead & 0x1F) << 6) | (c & 0x3F);
+                int to = case_wide(cp, kind);
+                if (to != cp) {
+                    if (!write)
+                        return 1;
+                    *lead = (unsigned char)(0xC0 | (to >> 6));
+                    p[i] = (unsigned char)(0x80 | (to & 0x3F));
+                    found = 1;
+                }
+                lead = NULL;
+            } else {
+                lead = NULL;  // Longer sequences keep their case
+            }
+            i++;
+        }
+        len -= n;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return found;
+}
+
+// Rewrite the bytes of each edit (offset and removed; ascending, not overlapping) in place:
+// with a kind (enum caseKind), change the case of their letters; with 0, copy e->text over
+// them. Both keep the length and the newlines of the text, so no chunk is split or freed
+// and the cursor and the top row stay valid. The edits are reached in one forward pass;
+// each one that changes anything is reported as one delta replacing its bytes.
+// Returns the number of edits that changed the text.
+int bufclient_rewrite(struct bufclient* buf, struct bufedit* edits, int count, int kind) {
+    struct bufchunk* chunk;
+    int rel_i, abs_i, k, changed = 0;
+
+    if (count <= 0)
+        return 0;
+    for (k = 0; k < count; k++) {
+        if (edits[k].offset < 0 || edits[k].removed < 0 || edits[k].offset + edits[k].removed > buf->size ||
+            (k > 0 && edits[k].offset < edits[k - 1].offset + edits[k - 1].removed)) {
+            return 0;
+        }
+    }
+    if (bufclient_find_pos(buf, edits[0].offset, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    if (buf->observer_count > 0)
+        bufclient_edit_lines(buf, edits, count);
+    abs_i = edits[0].offset;
+    for (k = 0; k < count; k++) {
+        struct bufedit* e = &edits[k];
+        while (abs_i < e->offset) {
+            int n = chunk->size - rel_i;
+            if (n > e->offset - abs_i) {
+                rel_i += e->offset - abs_i;
+                abs_i = e->offset;
+            } else {
+                abs_i += n;
+                chunk = chunk->next;
+                rel_i = 0;
+            }
+        }
+        if (e->removed == 0 || (kind != 0 && !bufclient_case_pass(chunk, rel_i, e->removed, kind, 0)))
+            continue;
+
+        bufclient_before_remove(buf, e->offset, e->removed);
+        struct bufchunk* c = chunk;
+        int c_rel_i = rel_i, done = 0, lines = 0, tail = 0;
+        if (kind != 0)
+            bufclient_case_pass(chunk, rel_i, e->removed, kind, 1);
+        while (c != NULL && done < e->removed) {
+            int n = c->size - c_rel_i;
+            if (n > e->removed - done)
+                n = e->removed - done;
+            char* p = c->data + c_rel_i;
+            if (kind == 0)
+                memcpy(p, e->text + done, n);
+            if (buf->observer_count > 0) {
+                const char* q = p;
+                const char* end = p + n;
+                tail += n;
+                while ((q = memchr(q, '\n', end - q)) != NULL) {
+                    lines++;
+                    q++;
+                    tail = (int)(end - q);
+                }
+            }
+            done += n;
+            c = c->next;
+            c_rel_i = 0;
+        }
+        buf->dirty = 1;
+        bufclient_emit_at(buf, e->offset, e->removed, e->removed, 0, e->line, e->col, lines, tail);
+        changed++;
+    }
+    return changed;
+}
+
+// Move cursor to a specific absolute index
+void bufclient_move_cursor_to(struct bufclient* buf, int target_abs_i) {
+    // Clamp target index within valid buffer range
+    if (target_abs_i < 0)
+        target_abs_i = 0;
+    if (target_abs_i > buf->size)
+        target_abs_i = buf->size;
+
+    // Find the chunk and relative position for the target index
+    if (bufclient_find_pos(buf, target_abs_i, &buf->cursor_chunk, &buf->cursor_rel_i) == RESULT_OK) {
+        buf->cursor_abs_i = target_abs_i;
+        // Update visual coordinates (inefficiently but accurately)
+        if (bufclient_update_cursor_coords(buf) != RESULT_OK) {
+             editorSetStatusMessage("Warning: Cursor coordinate update failed after move.");
+        }
+        // Set goal x when explicitly moving cursor
+        buf->cursor_goal_x = buf->cursor_abs_x;
+    } else {
+         editorSetStatusMessage("Error: Failed to find position for cursor move.");
+         // Optional: move to nearest valid position? (e.g., end of buffer)
+         // buf->cursor_abs_i = buf->size;
+         // bufclient_find_pos(buf, buf->cursor_abs_i, &buf->cursor_chunk, &buf->cursor_rel_i);
+         // bufclient_update_cursor_coords(buf);
+    }
+}
+
+// Move cursor based on ARROW_UP, DOWN, LEFT, RIGHT keys
+void bufclient_move_cursor_relative(struct bufclient* buf, int key) {
+    int current_abs_i = buf->cursor_abs_i;
+    int target_abs_i = current_abs_i;
+    // Use current cursor chunk/rel_i as potential starting points for efficiency
+    struct bufchunk* target_chunk = buf->cursor_chunk;
+    int target_rel_i = buf->cursor_rel_i;
+    int need_full_update = 0; // Flag if efficient update fails
+
+    switch (key) {
+        case ARROW_LEFT:
+            if (target_abs_i > 0) {
+                target_abs_i--;
+                // Efficiently update chunk/rel_i if possible
+                if (target_rel_i > 0) {
+                    target_rel_i--;
+                } else if (target_chunk && target_chunk->prev != NULL) {
+                    target_chunk = target_chunk->prev;
+                    target_rel_i = target_chunk->size - 1; // Move to last char of prev chunk
+                } else {
+                    // At start of buffer or inconsistent state, need full find_pos
+                    need_full_update = 1;
+                }
+            } else {
+                return; // Already at start
+            }
+            break; // ARROW_LEFT
+
+        case ARROW_RIGHT:
+            if (target_abs_i < buf->size) {
+                target_abs_i++;
+                // Efficiently update chunk/rel_i
+                if (target_chunk && target_rel_i < target_chunk->size) {
+                    target_rel_i++;
+                } else if (target_chunk && target_chunk->next != NULL) {
+                    target_chunk = target_chunk->next;
+                    target_rel_i = (target_chunk->size > 0) ? 0 : 0; // Move to first char of next chunk
+                     // Correction: If target_abs_i is the very end, rel_i should be size
+                     if (target_abs_i == buf->size) {
+                          target_rel_i = target_chunk ? target_chunk->size : 0;
+                     } else {
+                          target_rel_i = 0; // Moving into next chunk, not at end
+                     }
+
+                } else {
+                    // At end of buffer or inconsistent state, need full find_pos
+                     // If moving right to the absolute end, handle specially
+                     if (target_abs_i == buf->size) {
+                         target_chunk = buf->rbegin;
+                         target_rel_i = target_chunk ? target_chunk->size : 0;
+                     } else {
+                         need_full_update = 1;
+                     }
+                }
+            } else {
+                return; // Already at end
+            }
+            break; // ARROW_RIGHT
+
+        case ARROW_UP: {
+            if (buf->cursor_abs_y == 0)
+                return; // Already on first line
+
+            // Find start of previous line
+            struct bufchunk* prev_line_start_chunk;
+            int prev_line_start_rel_i, prev_line_start_abs_i;
             if (bufclient_find_line_start(buf, buf->cursor_abs_y - 1, &prev_line_start_chunk, &prev_line_start_rel_i, &prev_line_start_abs_i) != RESULT_OK)
                 return; // Error finding previous line
 
@@ -852,7 +2792,7 @@ void bufclient_move_cursor_relative(struct bufclient* buf, int key) {
 
                     int char_width = 0;
                     if (c == '\t') {
-                        char_width = (TAB_STOP - (visual_x % TAB_STOP));
+                        char_width = (buf->tabstop - (visual_x % buf->tabstop));
                     } else if (iscntrl((unsigned char)c)) {
                         char_width = 2;
                     } else {
@@ -917,7 +2857,7 @@ void bufclient_move_cursor_relative(struct bufclient* buf, int key) {
 
                         int char_width = 0;
                         if (c == '\t') {
-                            char_width = (TAB_STOP - (visual_x % TAB_STOP));
+                            char_width = (buf->tabstop - (visual_x % buf->tabstop));
                         } else if (iscntrl((unsigned char)c)) {
                             char_width = 2;
                         } else {
@@ -1005,13 +2945,32 @@ void bufclient_move_cursor_relative(struct bufclient* buf, int key) {
 
 
 // *** Terminal Handling Implementation ***
+// Fatal error. The resident server only ends the active client's session (die returns
+// there): the other sessions and the buffers kept in memory must survive it.
 void die(const char* s) {
-    // Try to clear screen and restore terminal before exiting
-    write(STDOUT_FILENO, "\x1b[2J", 4);  // Clear screen
-    write(STDOUT_FILENO, "\x1b[H", 3);   // Move cursor to top-left
+    char msg[256];
+    snprintf(msg, sizeof(msg), "%s: %s", s, strerror(errno));  // Before anything changes errno
+    if (server_mode) {
+        fprintf(stderr, "%s\n", msg);
+        terminate_editor = 1;
+        return;
+    }
+    editorExit(1, msg);
+}
+
+// End the editor process; the only place that restores the terminal and exits. The
+// render thread is stopped first so nothing else writes to the terminal meanwhile. On
+// failure the screen is cleared and msg printed below it.
+void editorExit(int status, const char* msg) {
+    render_thread_stop(&main_pipe);
+    if (status != 0) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);  // Clear screen
+        write(STDOUT_FILENO, "\x1b[H", 3);   // Move cursor to top-left
+    }
     disableRawMode();
-    perror(s);  // Print error message related to errno
-    exit(1);   // Use exit() for normal cleanup (if possible) vs _exit()
+    if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    exit(status);
 }
 
 void disableRawMode() {
@@ -1033,10 +2992,6 @@ enum RESULT enableRawMode() {
         return RESULT_ERR;
     }
 
-    // Ensure disableRawMode is called on exit
-    atexit(disableRawMode);
-
-
     struct termios raw = orig_termios;
     // Input flags: disable Break signal, CR-to-NL translation, Parity check, Input stripping, SW flow control
     raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -1133,136 +3088,600 @@ enum RESULT getWindowSize(int* rows, int* cols) {
     return RESULT_OK;
 }
 
-// Read a key, handling escape sequences for arrows, home, end etc.
-enum editorKey editorReadKey() {
-    int nread;
-    char c;
-    // Loop until a key is read or an error occurs (excluding timeout/EAGAIN)
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN)
-            die("read keypress");
-        // Handle signals or other non-EAGAIN errors if necessary?
-        // For now, just retry on EAGAIN (timeout).
-    }
-
-    if (c == '\x1b') {  // Potential escape sequence start
-        char seq[3];
-        // Try reading the next character with immediate timeout (non-blocking check)
-        // Set VTIME = 0 briefly? No, rely on the 100ms default timeout.
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b'; // Just ESC pressed
-
-        // Check for common sequence start '[' or 'O'
-        if (seq[0] == '[') {
-            if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b'; // Incomplete sequence ESC [
-
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                // Extended sequence like Home, End, Del, PageUp/Down (e.g., Esc[3~)
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b'; // Incomplete ESC [ digit
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;  // Often ^[[1~
-                        case '3': return DEL_KEY;   // Often ^[[3~
-                        case '4': return END_KEY;   // Often ^[[4~
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;  // Sometimes ^[[7~
-                        case '8': return END_KEY;   // Sometimes ^[[8~
-                        default: return '\x1b';    // Unrecognized number
-                    }
-                } else {
-                     // Possibly other sequences like ESC [ 1 ; 5 C for Ctrl+Right? Ignore for now.
-                    return '\x1b'; // Malformed or unrecognized sequence
-                }
-            } else {
-                // Standard CSI sequences (e.g., arrow keys)
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;    // Esc[A
-                    case 'B': return ARROW_DOWN;  // Esc[B
-                    case 'C': return ARROW_RIGHT; // Esc[C
-                    case 'D': return ARROW_LEFT;  // Esc[D
-                    case 'H': return HOME_KEY;    // Sometimes Esc[H (xterm)
-                    case 'F': return END_KEY;     // Sometimes Esc[F (linux console)
-                    default: return '\x1b';      // Unrecognized letter
+// Read one byte from the terminal input, waiting at most timeout_ms (-1 waits forever).
+// Returns 1 if a byte was read, 0 on timeout, -1 if the input was closed or failed.
+int editorReadByte(char* c, int timeout_ms) {
+    struct pollfd pfd;
+    if (typeahead_pos < typeahead_len) {
+        *c = typeahead[typeahead_pos++];  // Typed during a long scan
+        return 1;
+    }
+    pfd.fd = term_in_fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ready == 0)
+            return 0;  // Timeout
+        ssize_t nread = read(term_in_fd, c, 1);
+        if (nread == 1)
+            return 1;
+        if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+            continue;  // Raw mode read() timeout (VTIME), poll again
+        return -1;     // EOF (client hung up) or read error
+    }
+}
+
+// 1 if keys read by interrupt_poll are waiting
+int typeahead_pending() {
+    return typeahead_pos < typeahead_len;
+}
+
+// Look for a Ctrl-C typed while a long operation keeps the main loop from reading keys.
+// Raw mode clears ISIG, so Ctrl-C arrives as a byte among the others: what was typed is
+// read, the other keys are kept for editorReadByte, and a Ctrl-C calls editorInterrupt.
+// Reads at most every INTERRUPT_POLL_MS, so scan loops may call this for every chunk.
+void interrupt_poll() {
+    static long long last_ms;
+    struct timespec ts;
+    struct pollfd pfd;
+    int ctrl_c = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (server_mode || now_ms - last_ms < INTERRUPT_POLL_MS)
+        return;
+    last_ms = now_ms;
+    if (typeahead_pos == typeahead_len)
+        typeahead_pos = typeahead_len = 0;
+    pfd.fd = term_in_fd;
+    pfd.events = POLLIN;
+    while (typeahead_len < TYPEAHEAD_SIZE && poll(&pfd, 1, 0) > 0) {
+        ssize_t n = read(term_in_fd, typeahead + typeahead_len, TYPEAHEAD_SIZE - typeahead_len);
+        int i, kept = typeahead_len;
+        if (n <= 0)
+            break;
+        for (i = typeahead_len; i < typeahead_len + n; i++) {
+            if (typeahead[i] == CTRL_KEY('c'))
+                ctrl_c = 1;
+            else
+                typeahead[kept++] = typeahead[i];
+        }
+        typeahead_len = kept;
+    }
+    if (ctrl_c)
+        editorInterrupt();
+}
+
+// 1 once Ctrl-C interrupted the synchronous scan in progress (which reset interrupt_token
+// when it started); call at chunk granularity
+int interrupted() {
+    interrupt_poll();
+    return cancel_token_cancelled(&interrupt_token);
+}
+
+// Decode the key at the start of the len bytes in buf (arrows, Home, End etc. arrive as
+// escape sequences). Returns the bytes it spans, 0 if buf ends inside a sequence.
+int key_decode(const char* buf, int len, int* key) {
+    if (len < 1)
+        return 0;
+    *key = buf[0];
+    if (buf[0] != '\x1b')
+        return 1;  // Regular character (including Backspace, Enter, Tab etc.)
+    if (len < 2)
+        return 0;
+    *key = '\x1b';  // Unrecognized sequences are taken as a plain ESC
+    if (buf[1] == '[') {
+        if (len < 3)
+            return 0;
+        if (buf[2] >= '0' && buf[2] <= '9') {
+            // Extended sequence like Home, End, Del, PageUp/Down (e.g., Esc[3~)
+            if (len < 4)
+                return 0;
+            if (buf[3] == '~') {
+                switch (buf[2]) {
+                    case '1': *key = HOME_KEY; break;  // Often ^[[1~
+                    case '3': *key = DEL_KEY; break;   // Often ^[[3~
+                    case '4': *key = END_KEY; break;   // Often ^[[4~
+                    case '5': *key = PAGE_UP; break;
+                    case '6': *key = PAGE_DOWN; break;
+                    case '7': *key = HOME_KEY; break;  // Sometimes ^[[7~
+                    case '8': *key = END_KEY; break;   // Sometimes ^[[8~
                 }
             }
-        } else if (seq[0] == 'O') {
-            // Alternate sequences (e.g., from VT100 keypad/linux console)
-            if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b'; // Incomplete ESC O
-            switch (seq[1]) {
-                case 'H': return HOME_KEY; // EscOH
-                case 'F': return END_KEY;  // EscOF
-                // Arrows might be EscOA, EscOB, etc. Add if needed for specific terminals.
-                // case 'A': return ARROW_UP;
-                // case 'B': return ARROW_DOWN;
-                // case 'C': return ARROW_RIGHT;
-                // case 'D': return ARROW_LEFT;
-                default: return '\x1b';
-            }
-        } else {
-            // Escape followed by something other than [ or O (e.g., Alt+key might send ESC char)
-             // We could potentially handle Alt sequences here if needed.
-            return '\x1b'; // Treat as plain ESC for now
+            return 4;  // Possibly ESC [ 1 ; 5 C for Ctrl+Right etc.: not handled
         }
-    } else {
-        // Regular character (including Backspace, Enter, Tab etc.)
-        return c;
+        // Standard CSI sequences (e.g., arrow keys)
+        switch (buf[2]) {
+            case 'A': *key = ARROW_UP; break;     // Esc[A
+            case 'B': *key = ARROW_DOWN; break;   // Esc[B
+            case 'C': *key = ARROW_RIGHT; break;  // Esc[C
+            case 'D': *key = ARROW_LEFT; break;   // Esc[D
+            case 'H': *key = HOME_KEY; break;     // Sometimes Esc[H (xterm)
+            case 'F': *key = END_KEY; break;      // Sometimes Esc[F (linux console)
+        }
+        return 3;
+    }
+    if (buf[1] == 'O') {
+        // Alternate sequences (e.g., from VT100 keypad/linux console)
+        if (len < 3)
+            return 0;
+        if (buf[2] == 'H')
+            *key = HOME_KEY;  // EscOH
+        else if (buf[2] == 'F')
+            *key = END_KEY;   // EscOF
+        return 3;
+    }
+    return 2;  // Escape followed by something else (e.g. Alt+key): taken as ESC
+}
+
+// Read a key, handling escape sequences for arrows, home, end etc.
+enum editorKey editorReadKey() {
+    char seq[4];
+    int len = 0, key;
+    if (server_mode)
+        return server_read_key();  // From the bytes the active client has sent
+    // Wait until a key is read or the input fails
+    if (editorReadByte(&seq[len++], -1) != 1) {
+        die("read keypress");
     }
+    // The rest of a sequence arrives immediately; a lone ESC times out
+    while (key_decode(seq, len, &key) == 0) {
+        if (editorReadByte(&seq[len], ESC_SEQ_TIMEOUT_MS) != 1)
+            return '\x1b';
+        len++;
+    }
+    return key;
 }
 
 // *** Output / Rendering Implementation ***
 
-// Append string to static screen buffer, handling overflow
-void screenbuf_append(const char* s, int len) {
+// Append string to the pipe's output buffer, handling overflow
+void screenbuf_append(struct screenpipe* p, const char* s, int len) {
     if (len <= 0)
         return;
-    if (screenbuf_len + len > SCREEN_BUF_SIZE) {
+    if (p->buf_len + len > SCREEN_BUF_SIZE) {
         // Buffer overflow! Truncate the appended string.
-        len = SCREEN_BUF_SIZE - screenbuf_len;
+        len = SCREEN_BUF_SIZE - p->buf_len;
         if (len <= 0) {
              // Optionally log an error here, screen updates will be incomplete.
              // fprintf(stderr, "Screen buffer overflow!\n");
              return; // No space left at all
         }
     }
-    memcpy(screenbuf + screenbuf_len, s, len);
-    screenbuf_len += len;
+    memcpy(p->buf + p->buf_len, s, len);
+    p->buf_len += len;
 }
 
-// Clear static screen buffer and add initial control sequences
-void screenbuf_clear() {
-    screenbuf_len = 0;
-    // Start with hiding cursor (prevents flicker during redraw)
-    screenbuf_append("\x1b[?25l", 6);
-    // Go to home position (top-left) instead of clearing whole screen
-    // Clearing line-by-line (using \x1b[K) during draw prevents full screen clear flicker.
-    screenbuf_append("\x1b[H", 3);
+// Clear the pipe's output buffer (control sequences are added by screen_flush)
+void screenbuf_clear(struct screenpipe* p) {
+    p->buf_len = 0;
 }
 
-// Adjust rowoff/coloff to ensure cursor is visible on screen
-void editorScroll() {
-    // Ensure cursor coordinates are up-to-date before scrolling
-    // This might have already been done by the operation causing the scroll,
-    // but doing it again ensures correctness if multiple operations happened.
-    // bufclient_update_cursor_coords(&textbuf); // Can be slow, assume coords are current
+// *** Screen Diff Implementation ***
+// Drawing code composes the frame into screen_next via screen_put() and friends, and
+// screen_publish() hands it to the render thread. There screen_flush() compares it with
+// p->prev (what the terminal shows) and emits only the changed cells, choosing the
+// cheapest cursor movement and using REP/ECH/EL for runs, so an unchanged frame costs
+// (almost) nothing on the wire. Key handling never waits for terminal output.
 
-    // Check if cursor Y is valid relative to rowoff
-    if (textbuf.cursor_abs_y < textbuf.rowoff) {
-        textbuf.rowoff = textbuf.cursor_abs_y;
-        textbuf.rowoff_chunk = NULL; // Invalidate cache when scrolling up
-    }
-    if (textbuf.cursor_abs_y >= textbuf.rowoff + screenrows) {
-        textbuf.rowoff = textbuf.cursor_abs_y - screenrows + 1;
-        textbuf.rowoff_chunk = NULL; // Invalidate cache when scrolling down
-    }
+// Total number of screen rows drawn per frame (text area + status bar + command line)
+static int screen_total_rows() {
+    return screenrows + 2;
+}
+
+// Reset the compose position and attribute for a new frame
+void screen_begin_frame() {
+    screen_next = &screen_pipe->frames[screen_pipe->compose_i];
+    screen_next->rows = screen_total_rows();
+    screen_next->cols = screencols;
+    screen_draw_y = 0;
+    screen_draw_x = 0;
+    screen_draw_attr = ATTR_NORMAL;
+}
+
+// Set the attribute used by subsequent screen_put() calls
+void screen_set_attr(unsigned char attr) {
+    screen_draw_attr = attr;
+}
+
+// Write bytes at the compose position, clipped to the screen width
+void screen_put(const char* s, int len) {
+    if (screen_draw_y >= screen_total_rows())
+        return;
+    struct screencell* row = screen_next->cells[screen_draw_y];
+    while (len > 0 && screen_draw_x < screencols) {
+        row[screen_draw_x].ch = *s;
+        row[screen_draw_x].attr = screen_draw_attr;
+        screen_draw_x++;
+        s++;
+        len--;
+    }
+}
+
+// Blank the rest of the current row (like \x1b[K, always with normal attributes)
+void screen_clear_eol() {
+    if (screen_draw_y >= screen_total_rows())
+        return;
+    struct screencell* row = screen_next->cells[screen_draw_y];
+    int x;
+    for (x = screen_draw_x; x < screencols; x++) {
+        row[x].ch = ' ';
+        row[x].attr = ATTR_NORMAL;
+    }
+    screen_draw_x = screencols;
+}
+
+// Finish the current row (blanking what is left of it) and move to the next one
+void screen_next_row() {
+    screen_clear_eol();
+    screen_draw_y++;
+    screen_draw_x = 0;
+}
+
+// Append "\x1b[<n><final>" (or "\x1b[<final>" when n == 1 and it may be omitted)
+static int screen_fmt_csi(char* out, int n, char final) {
+    if (n == 1)
+        return snprintf(out, 16, "\x1b[%c", final);
+    return snprintf(out, 16, "\x1b[%d%c", n, final);
+}
+
+// Emit the SGR sequence for attr if the terminal is not already using it
+static void screen_emit_attr(struct screenpipe* p, unsigned char attr) {
+    if (attr == p->cur_attr)
+        return;
+    if (attr == ATTR_REVERSE) {
+        screenbuf_append(p, "\x1b[7m", 4);
+    } else {
+        screenbuf_append(p, "\x1b[m", 3);
+    }
+    p->cur_attr = attr;
+}
+
+// Move the terminal cursor to (y, x) (0-based) using the shortest sequence available:
+// absolute CUP, or relative CR/LF/CUU/CUD/CUF/CUB from the known current position.
+void screen_move_cursor(struct screenpipe* p, int y, int x) {
+    char best[40], cand[40], h[16];
+    int best_len, cand_len, h_len, dy, dx;
+
+    if (y == p->cur_y && x == p->cur_x)
+        return;
+
+    // Absolute positioning always works
+    if (y == 0 && x == 0) {
+        best_len = snprintf(best, sizeof(best), "\x1b[H");
+    } else if (x == 0) {
+        best_len = snprintf(best, sizeof(best), "\x1b[%dH", y + 1);
+    } else {
+        best_len = snprintf(best, sizeof(best), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+
+    if (p->cur_y >= 0 && p->cur_x >= 0) {
+        // Vertical part: LF moves straight down (OPOST is off, so no implicit CR)
+        dy = y - p->cur_y;
+        cand_len = 0;
+        if (dy > 0 && dy <= 4) {
+            memset(cand, '\n', dy);
+            cand_len = dy;
+        } else if (dy > 0) {
+            cand_len = screen_fmt_csi(cand, dy, 'B');
+        } else if (dy < 0) {
+            cand_len = screen_fmt_csi(cand, -dy, 'A');
+        }
+
+        // Horizontal part: either relative to the current column or from column 0 after CR
+        dx = x - p->cur_x;
+        if (dx > 0) {
+            h_len = screen_fmt_csi(h, dx, 'C');
+        } else if (dx < 0) {
+            h_len = screen_fmt_csi(h, -dx, 'D');
+        } else {
+            h_len = 0;
+        }
+        if (x == 0 && dx != 0) {
+            h[0] = '\r';
+            h_len = 1;
+        } else if (dx < 0 && x > 0) {
+            char cr[16];
+            int cr_len = 1 + screen_fmt_csi(cr + 1, x, 'C');
+            cr[0] = '\r';
+            if (cr_len < h_len) {
+                memcpy(h, cr, cr_len);
+                h_len = cr_len;
+            }
+        }
+        memcpy(cand + cand_len, h, h_len);
+        cand_len += h_len;
+
+        if (cand_len < best_len) {
+            memcpy(best, cand, cand_len);
+            best_len = cand_len;
+        }
+    }
+
+    screenbuf_append(p, best, best_len);
+    p->cur_y = y;
+    p->cur_x = x;
+}
+
+// Output cells [x, end) of row y (cursor must already be at (y, x)), using REP and ECH
+// for long runs. Rows containing bytes >= 0x80 are written verbatim (plain) so multi-byte
+// sequences reach the terminal unsplit.
+static void screen_emit_cells(struct screenpipe* p, const struct screenframe* f, int y, int x, int end, int plain) {
+    const struct screencell* row = f->cells[y];
+    while (x < end) {
+        int run = 1;
+        while (x + run < end && row[x + run].ch == row[x].ch && row[x + run].attr == row[x].attr)
+            run++;
+
+        if (!plain && row[x].ch == ' ' && row[x].attr == ATTR_NORMAL && run >= SCREEN_ECH_MIN) {
+            // Erase the blanks without moving, then step over them
+            char seq[16];
+            screen_emit_attr(p, ATTR_NORMAL);
+            screenbuf_append(p, seq, screen_fmt_csi(seq, run, 'X'));
+            x += run;
+            if (x < f->cols)
+                screen_move_cursor(p, y, x);
+            continue;
+        }
+
+        screen_emit_attr(p, row[x].attr);
+        if (!plain && run >= SCREEN_REP_MIN) {
+            // One literal copy, then repeat it run - 1 times
+            char seq[16];
+            screenbuf_append(p, &row[x].ch, 1);
+            screenbuf_append(p, seq, screen_fmt_csi(seq, run - 1, 'b'));
+        } else {
+            int i;
+            for (i = 0; i < run; i++)
+                screenbuf_append(p, &row[x].ch, 1);
+        }
+        x += run;
+        p->cur_x = x;
+    }
+    // After writing the last column the terminal has a pending wrap; position is unreliable
+    if (p->cur_x >= f->cols)
+        p->cur_x = -1;
+}
+
+// Append the difference between frame f and p->prev to screenbuf (render thread)
+void screen_flush(struct screenpipe* p, const struct screenframe* f) {
+    int rows = f->rows;
+    int cols = f->cols;
+    int y;
+
+    if (!p->prev_valid || rows != p->prev_rows || cols != p->prev_cols) {
+        // Unknown terminal contents: start from a cleared screen
+        screenbuf_append(p, "\x1b[m\x1b[H\x1b[2J", 10);
+        p->cur_attr = ATTR_NORMAL;
+        p->cur_y = 0;
+        p->cur_x = 0;
+        for (y = 0; y < rows; y++) {
+            int x;
+            for (x = 0; x < cols; x++) {
+                p->prev[y][x].ch = ' ';
+                p->prev[y][x].attr = ATTR_NORMAL;
+            }
+        }
+        p->prev_valid = 1;
+        p->prev_rows = rows;
+        p->prev_cols = cols;
+    }
+
+    for (y = 0; y < rows; y++) {
+        const struct screencell* next = f->cells[y];
+        struct screencell* prev = p->prev[y];
+        int first, last, tail, x, plain = 0;
+
+        // Changed span of this row
+        first = 0;
+        while (first < cols && next[first].ch == prev[first].ch && next[first].attr == prev[first].attr)
+            first++;
+        if (first == cols)
+            continue;  // Row unchanged
+        last = cols - 1;
+        while (last > first && next[last].ch == prev[last].ch && next[last].attr == prev[last].attr)
+            last--;
+
+        // Start of the trailing blank region, which EL can clear in one go
+        tail = cols;
+        while (tail > 0 && next[tail - 1].ch == ' ' && next[tail - 1].attr == ATTR_NORMAL)
+            tail--;
+        if (tail < first)
+            tail = first;
+
+        // With multi-byte UTF-8 on the row (now or on the terminal) a cell is no longer a
+        // terminal column, so no cursor move into the row can be trusted: clear it and
+        // write it whole from column 0
+        for (x = 0; x < cols && !plain; x++) {
+            if ((unsigned char)next[x].ch >= 0x80 || (unsigned char)prev[x].ch >= 0x80)
+                plain = 1;
+        }
+        if (plain) {
+            screen_move_cursor(p, y, 0);
+            screen_emit_attr(p, ATTR_NORMAL);
+            screenbuf_append(p, "\x1b[2K", 4);
+            screen_emit_cells(p, f, y, 0, tail, 1);
+            p->cur_x = -1;  // Bytes written, not columns moved
+            memcpy(prev, next, sizeof(struct screencell) * cols);
+            continue;
+        }
+
+        x = first;
+        while (x <= last && x < tail) {
+            // Skip over unchanged cells if moving is cheaper than rewriting them
+            if (next[x].ch == prev[x].ch && next[x].attr == prev[x].attr) {
+                int same = 1;
+                while (x + same <= last && next[x + same].ch == prev[x + same].ch && next[x + same].attr == prev[x + same].attr)
+                    same++;
+                if (same >= SCREEN_SKIP_MIN || x + same > last) {
+                    x += same;
+                    continue;
+                }
+            }
+            // Find the end of the span to rewrite (up to the next long unchanged run)
+            int end = x + 1;
+            while (end <= last && end < tail) {
+                if (next[end].ch == prev[end].ch && next[end].attr == prev[end].attr) {
+                    int same = 1;
+                    while (end + same <= last && next[end + same].ch == prev[end + same].ch && next[end + same].attr == prev[end + same].attr)
+                        same++;
+                    if (same >= SCREEN_SKIP_MIN || end + same > last)
+                        break;
+                    end += same;
+                } else {
+                    end++;
+                }
+            }
+            screen_move_cursor(p, y, x);
+            screen_emit_cells(p, f, y, x, end, 0);
+            x = end;
+        }
+
+        // Clear the blank tail if anything in it changed
+        if (last >= tail) {
+            screen_move_cursor(p, y, tail);
+            screen_emit_attr(p, ATTR_NORMAL);
+            screenbuf_append(p, "\x1b[K", 3);
+        }
+
+        memcpy(prev, next, sizeof(struct screencell) * cols);
+    }
+}
+
+// Hand the composed frame to the render thread and take a free one to compose the next
+// frame into. Lock-free: a single atomic exchange swaps it with the handoff slot, so a
+// frame the render thread has not picked up yet is simply replaced by the newer one.
+void screen_publish() {
+    struct screenpipe* p = screen_pipe;
+    int old = atomic_exchange(&p->handoff, p->compose_i | SCREEN_FRAME_FRESH);
+    p->compose_i = old & (SCREEN_FRAME_FRESH - 1);
+    if (p->running) {
+        sem_post(&p->wakeup);
+    }
+}
+
+// Diff frame f against the terminal contents and write the result out (render thread)
+static void screen_render(struct screenpipe* p, const struct screenframe* f) {
+    // The cursor is hidden while cells are being rewritten to prevent flicker;
+    // if nothing changed, it is only moved.
+    screenbuf_clear(p);
+    screenbuf_append(p, "\x1b[?25l", 6);
+    int hide_len = p->buf_len;
+    screen_flush(p, f);
+    if (p->buf_len == hide_len) {
+        p->buf_len = 0;  // No cell changed, the cursor does not need hiding
+    }
+    int redraw = p->buf_len > 0;
+
+    screen_move_cursor(p, f->cursor_y, f->cursor_x);
+
+    // Show cursor again after positioning it
+    if (redraw) {
+        screenbuf_append(p, "\x1b[?25h", 6);
+    }
+
+    // Write the entire accumulated screen buffer to the terminal in one go
+    int written = 0;
+    while (written < p->buf_len && !atomic_load(&p->output_failed)) {
+        ssize_t n = write(p->out_fd, p->buf + written, p->buf_len - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            // Terminal or client gone: the main loop ends the editor (or a server client's
+            // session ends when its input reports EOF)
+            atomic_store(&p->output_failed, 1);
+            editorWake();
+            break;
+        }
+        written += n;
+    }
+}
+
+// Render thread of one pipe: wait for published frames and write the newest one out
+static void* render_thread_main(void* arg) {
+    struct screenpipe* p = arg;
+    while (!atomic_load(&p->stop)) {
+        while (sem_wait(&p->wakeup) == -1 && errno == EINTR) {
+        }
+        if (!(atomic_load(&p->handoff) & SCREEN_FRAME_FRESH)) {
+            continue;  // Already rendered by an earlier wakeup
+        }
+        int old = atomic_exchange(&p->handoff, p->render_i);
+        p->render_i = old & (SCREEN_FRAME_FRESH - 1);
+        screen_render(p, &p->frames[p->render_i]);
+    }
+    return NULL;
+}
+
+// Set up pipe p for a terminal written through out_fd and start its render thread.
+// The terminal contents are unknown, so the first frame redraws everything.
+enum RESULT render_thread_start(struct screenpipe* p, int out_fd) {
+    p->compose_i = 0;
+    p->render_i = 1;
+    atomic_store(&p->handoff, 2);
+    p->out_fd = out_fd;
+    atomic_store(&p->output_failed, 0);
+    p->prev_valid = 0;
+    p->cur_y = -1;
+    p->cur_x = -1;
+    p->cur_attr = ATTR_NORMAL;
+    p->buf_len = 0;
+    if (sem_init(&p->wakeup, 0, 0) == -1) {
+        return RESULT_ERR;
+    }
+    atomic_store(&p->stop, 0);
+    int err = pthread_create(&p->thread, NULL, render_thread_main, p);
+    if (err != 0) {
+        sem_destroy(&p->wakeup);
+        errno = err;  // For die()
+        return RESULT_ERR;
+    }
+    p->running = 1;
+    return RESULT_OK;
+}
+
+// Stop the render thread of p (a frame still being written is finished first)
+void render_thread_stop(struct screenpipe* p) {
+    if (!p->running)
+        return;
+    atomic_store(&p->stop, 1);
+    sem_post(&p->wakeup);
+    pthread_join(p->thread, NULL);
+    sem_destroy(&p->wakeup);
+    p->running = 0;
+}
 
+// Adjust rowoff/coloff to ensure cursor is visible on screen
+void editorScroll() {
+    // Ensure cursor coordinates are up-to-date before scrolling
+    // This might have already been done by the operation causing the scroll,
+    // but doing it again ensures correctness if multiple operations happened.
+    // bufclient_update_cursor_coords(&textbuf); // Can be slow, assume coords are current
+
+    // Check if cursor Y is valid relative to rowoff
+    if (textbuf.cursor_abs_y < textbuf.rowoff) {
+        textbuf.rowoff = textbuf.cursor_abs_y;
+        textbuf.rowoff_chunk = NULL; // Invalidate cache when scrolling up
+    }
+    if (textbuf.cursor_abs_y >= textbuf.rowoff + screenrows) {
+        textbuf.rowoff = textbuf.cursor_abs_y - screenrows + 1;
+        textbuf.rowoff_chunk = NULL; // Invalidate cache when scrolling down
+    }
 
-    // Check if cursor X is valid relative to coloff
+
+    // Check if cursor X is valid relative to coloff (the text area is right of the gutter)
+    int text_cols = diff_text_cols();
     if (textbuf.cursor_abs_x < textbuf.coloff) {
         textbuf.coloff = textbuf.cursor_abs_x;
     }
-    if (textbuf.cursor_abs_x >= textbuf.coloff + screencols) {
-        textbuf.coloff = textbuf.cursor_abs_x - screencols + 1;
+    if (textbuf.cursor_abs_x >= textbuf.coloff + text_cols) {
+        textbuf.coloff = textbuf.cursor_abs_x - text_cols + 1;
     }
+    diff_split_scroll();  // :diffsplit scrolls by aligned rows
 }
 
 // Draw the text buffer content onto the screen buffer
@@ -1297,14 +3716,13 @@ void editorDrawRows() {
                 int welcome_len = snprintf(welcome, sizeof(welcome), "lkjsxceditor v%s -- %d chunks free", LKJSXCEDITOR_VERSION, BUFCHUNK_COUNT - bufchunk_pool_used);
                 if (welcome_len > screencols) welcome_len = screencols;
                 int padding = (screencols - welcome_len) / 2;
-                if (padding > 0) { screenbuf_append("~", 1); padding--; }
-                while (padding-- > 0) screenbuf_append(" ", 1);
-                if (welcome_len > 0) screenbuf_append(welcome, welcome_len);
+                if (padding > 0) { screen_put("~", 1); padding--; }
+                while (padding-- > 0) screen_put(" ", 1);
+                if (welcome_len > 0) screen_put(welcome, welcome_len);
              } else {
-                screenbuf_append("~", 1);
+                screen_put("~", 1);
              }
-             screenbuf_append("\x1b[K", 3); // Clear rest of line
-             screenbuf_append("\r\n", 2);
+             screen_next_row(); // Clear rest of line and move to the next one
          }
          return; // Nothing more to draw
     } else if (textbuf.rowoff_chunk == NULL) {
@@ -1320,6 +3738,10 @@ void editorDrawRows() {
     current_abs_i = textbuf.rowoff_abs_i;
 
 
+    int gutter = diff_gutter_width();
+    int text_cols = screencols - gutter;  // Columns for text right of the gutter
+    int next_cursor = multicursor_first(current_abs_i);  // Extra cursors are drawn reversed
+
     // --- Iterate through each row of the terminal screen ---
     for (y = 0; y < screenrows; y++) {
         int file_line_abs_y = textbuf.rowoff + y; // The absolute line number we are trying to render
@@ -1334,15 +3756,18 @@ void editorDrawRows() {
                  int welcome_len = snprintf(welcome, sizeof(welcome), "lkjsxceditor v%s -- %d chunks free", LKJSXCEDITOR_VERSION, BUFCHUNK_COUNT - bufchunk_pool_used);
                  if (welcome_len > screencols) welcome_len = screencols;
                  int padding = (screencols - welcome_len) / 2;
-                 if (padding > 0) { screenbuf_append("~", 1); padding--; }
-                 while (padding-- > 0) screenbuf_append(" ", 1);
-                 if (welcome_len > 0) screenbuf_append(welcome, welcome_len);
+                 if (padding > 0) { screen_put("~", 1); padding--; }
+                 while (padding-- > 0) screen_put(" ", 1);
+                 if (welcome_len > 0) screen_put(welcome, welcome_len);
              } else {
-                 screenbuf_append("~", 1);
+                 screen_put("~", 1);
              }
              line_render_finished = 1; // No more content to draw for this or subsequent rows
         } else {
             // --- Render the current file line char by char ---
+            if (gutter > 0) {
+                diff_draw_gutter(file_line_abs_y);
+            }
             int line_visual_col = 0; // Visual column within the *file* line
             // Temporary pointers for line traversal, starting from current position
             struct bufchunk* line_chunk = current_chunk;
@@ -1355,6 +3780,7 @@ void editorDrawRows() {
 
                     if (c == '\n') {
                         // End of the current file line found
+                        multicursor_draw_eol(&next_cursor, line_abs_i, line_visual_col - textbuf.coloff, text_cols);
                         // Advance main pointers past the newline for the *next* screen row iteration
                         current_abs_i = line_abs_i + 1;
                         if (line_rel_i + 1 < line_chunk->size) {
@@ -1374,11 +3800,11 @@ void editorDrawRows() {
 
                     // Calculate width of current character and its representation
                     int char_width = 0;
-                    char display_buf[TAB_STOP + 3]; // Max width for tab or ^X
+                    char display_buf[TAB_STOP_MAX + 3]; // Max width for tab or ^X
                     int display_len = 0;
 
                     if (c == '\t') {
-                        char_width = (TAB_STOP - (line_visual_col % TAB_STOP));
+                        char_width = (textbuf.tabstop - (line_visual_col % textbuf.tabstop));
                         memset(display_buf, ' ', char_width); // Fill with spaces
                         display_len = char_width;
                     } else if (iscntrl((unsigned char)c)) {
@@ -1391,14 +3817,14 @@ void editorDrawRows() {
                         display_buf[0] = c;
                         display_len = 1;
                     }
-                    //display_buf[display_len] = '\0'; // Not needed for screenbuf_append
+                    //display_buf[display_len] = '\0'; // Not needed for screen_put
 
                     // --- Horizontal Scrolling Logic ---
                     int char_end_visual_col = line_visual_col + char_width;
                     int screen_x = line_visual_col - textbuf.coloff; // Screen col where char *starts*
 
                     // Check if this character is *at least partially* visible on screen
-                    if (char_end_visual_col > textbuf.coloff && screen_x < screencols) {
+                    if (char_end_visual_col > textbuf.coloff && screen_x < text_cols) {
                         int append_len = display_len;
                         const char* append_ptr = display_buf;
 
@@ -1422,16 +3848,19 @@ void editorDrawRows() {
                             }
                         }
 
-                        // Adjust if character ends after screencols
-                        if (screen_x + append_len > screencols) {
-                             append_len = screencols - screen_x;
+                        // Adjust if character ends after the text area
+                        if (screen_x + append_len > text_cols) {
+                             append_len = text_cols - screen_x;
                         }
 
                         // Append the visible part if any length remains
                         if (append_len > 0) {
-                             screenbuf_append(append_ptr, append_len);
+                             int marked = multicursor_at(&next_cursor, line_abs_i) || block_covers(file_line_abs_y, line_visual_col);
+                             if (marked) screen_set_attr(ATTR_REVERSE);
+                             screen_put(append_ptr, append_len);
+                             if (marked) screen_set_attr(ATTR_NORMAL);
                         }
-                    } else if (screen_x >= screencols) {
+                    } else if (screen_x >= text_cols) {
                          // Character starts beyond the right edge. Stop rendering this line.
                          // We need to advance the main pointers to the start of the next line.
                           struct bufchunk* scan_chunk = line_chunk;
@@ -1487,6 +3916,7 @@ void editorDrawRows() {
             // If we exit the loop because we ran out of buffer content before finding '\n'
             // (i.e., last line doesn't end with newline)
             if (!line_render_finished) {
+                 multicursor_draw_eol(&next_cursor, textbuf.size, line_visual_col - textbuf.coloff, text_cols);
                  current_chunk = NULL; // Signal end for next screen row iteration
                  current_rel_i = 0;
                  current_abs_i = textbuf.size;
@@ -1495,15 +3925,14 @@ void editorDrawRows() {
         } // end else (not past end of content)
 
         // --- Finish the screen row ---
-        screenbuf_append("\x1b[K", 3); // Clear rest of the screen line from cursor onwards
-        screenbuf_append("\r\n", 2);   // Move to the beginning of the next screen line
+        screen_next_row(); // Clear rest of the screen line and move to the next one
     } // end for each screen row y
 }
 
 
 // Draw the status bar at the bottom
 void editorDrawStatusBar() {
-    screenbuf_append("\x1b[7m", 4);  // Invert colors (enter reverse video mode)
+    screen_set_attr(ATTR_REVERSE);  // Invert colors (enter reverse video mode)
 
     char status[128], rstatus[64];
     int len = 0, rlen = 0;
@@ -1517,6 +3946,7 @@ void editorDrawStatusBar() {
         case MODE_NORMAL:   mode_str = "-- NORMAL --"; break;
         case MODE_INSERT:   mode_str = "-- INSERT --"; break;
         case MODE_COMMAND:  mode_str = "-- COMMAND --"; break;
+        case MODE_BLOCK:    mode_str = "-- BLOCK --"; break;
         default:            mode_str = "?? UNKNOWN ??"; break;
     }
     // Use snprintf carefully to avoid overflow
@@ -1586,34 +4016,33 @@ void editorDrawStatusBar() {
 
     // Render left status, truncated if necessary by screen width
     if (len > screencols) len = screencols;
-    if (len > 0) screenbuf_append(status, len);
+    if (len > 0) screen_put(status, len);
 
     // Render right status with padding in between
     int current_col = len;
     while (current_col < screencols) {
         if (screencols - current_col == rlen) {  // If right status fits exactly
-            if (rlen > 0) screenbuf_append(rstatus, rlen);
+            if (rlen > 0) screen_put(rstatus, rlen);
             current_col += rlen;
             break; // Done filling
         } else {
-            screenbuf_append(" ", 1);  // Add padding space
+            screen_put(" ", 1);  // Add padding space
             current_col++;
         }
     }
     // Ensure the line is filled if rstatus didn't fit
     while(current_col < screencols) {
-         screenbuf_append(" ", 1);
+         screen_put(" ", 1);
          current_col++;
     }
 
 
-    screenbuf_append("\x1b[m", 3);  // Reset colors (exit reverse video mode)
-    // No \r\n needed here, editorDrawCommandLine will follow on the next line
+    screen_set_attr(ATTR_NORMAL);  // Reset colors (exit reverse video mode)
+    screen_next_row();             // editorDrawCommandLine follows on the next line
 }
 
 // Draw the command/status message line below the status bar
 void editorDrawCommandLine() {
-    screenbuf_append("\x1b[K", 3);  // Clear the line first
 
     time_t current_time = time(NULL);
     if (mode == MODE_COMMAND) {
@@ -1621,7 +4050,7 @@ void editorDrawCommandLine() {
         statusbuf[0] = '\0';      // Clear any timed status message when entering command mode
         statusbuf_time = 0;
         int prompt_len = 1;       // Length of ":"
-        screenbuf_append(":", prompt_len);
+        screen_put(":", prompt_len);
         int cmd_display_len = cmdbuf_len;
 
         // Handle command longer than screen width (basic truncation from left?)
@@ -1632,14 +4061,14 @@ void editorDrawCommandLine() {
             cmd_display_len = max_cmd_display;
         }
         if (cmd_display_len > 0) {
-             screenbuf_append(cmdbuf, cmd_display_len);
+             screen_put(cmdbuf, cmd_display_len);
         }
         // Cursor will be positioned after the command text later in editorRefreshScreen
     } else if (statusbuf[0] != '\0' && statusbuf_time > 0 && current_time - statusbuf_time < 5) {
         // Display timed status message if active and not expired (5 seconds)
         int msg_len = strlen(statusbuf);
         if (msg_len > screencols) msg_len = screencols; // Truncate if needed
-        if (msg_len > 0) screenbuf_append(statusbuf, msg_len);
+        if (msg_len > 0) screen_put(statusbuf, msg_len);
     } else {
         // Clear status message if expired or not in command mode and no message set
         if (statusbuf_time > 0) { // Only clear if it was a timed message
@@ -1648,20 +4077,28 @@ void editorDrawCommandLine() {
         }
          // Leave persistent messages (statusbuf_time == 0) alone unless command mode overwrites.
     }
+    screen_clear_eol();  // Blank the rest of the line
 }
 
 // Refresh the entire screen content based on current editor state
 void editorRefreshScreen() {
-    editorScroll();     // Ensure cursor position is valid for scrolling offsets
-    screenbuf_clear();  // Reset buffer and add initial control sequences (\x1b[?25l \x1b[H)
-
-    editorDrawRows();         // Draw text content
-    editorDrawStatusBar();    // Draw status bar (includes \x1b[7m ... \x1b[m)
-    editorDrawCommandLine();  // Draw command/message line (includes \x1b[K)
+    diff_update();         // Diff mode marks follow the edits
+    editorScroll();        // Ensure cursor position is valid for scrolling offsets
+    screen_begin_frame();  // Compose the new frame from the top-left cell
+
+    if (diffsplit.active)
+        diff_split_draw();    // Buffer and the other file side by side
+    else
+        editorDrawRows();     // Draw text content
+    finder_draw();            // :find matches over the bottom text rows
+    editorDrawStatusBar();    // Draw status bar (reverse video)
+    editorDrawCommandLine();  // Draw command/message line
 
     // Calculate final cursor position on screen (1-based)
     int screen_cursor_y = textbuf.cursor_abs_y - textbuf.rowoff + 1;
-    int screen_cursor_x = textbuf.cursor_abs_x - textbuf.coloff + 1;
+    if (diffsplit.active)
+        screen_cursor_y = diff_split_row_of_line(textbuf.cursor_abs_y) - diffsplit.rowoff + 1;
+    int screen_cursor_x = textbuf.cursor_abs_x - textbuf.coloff + 1 + diff_gutter_width();
 
     // Clamp cursor position to screen boundaries if something went wrong
     if (screen_cursor_y < 1) screen_cursor_y = 1;
@@ -1679,25 +4116,10 @@ void editorRefreshScreen() {
         screen_cursor_x = cmd_cursor_x;
     }
 
-    // Generate cursor positioning command (Move cursor)
-    char buf[32];
-    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", screen_cursor_y, screen_cursor_x);
-    if (len > 0 && len < sizeof(buf)) {
-         screenbuf_append(buf, len);
-    }
-
-    // Show cursor again after positioning it
-    screenbuf_append("\x1b[?25h", 6);
-
-    // Write the entire accumulated screen buffer to standard output in one go
-    if (write(STDOUT_FILENO, screenbuf, screenbuf_len) == -1) {
-        // Avoid die() here as it might try writing again. Exit directly.
-        perror("Fatal: write to screen failed");
-        disableRawMode(); // Try to restore terminal
-        exit(1);
-    }
-    // Reset buffer length for next refresh cycle
-    // screenbuf_len = 0; // Done by screenbuf_clear() at the start
+    // Hand the finished frame to the render thread (0-based cursor position)
+    screen_next->cursor_y = screen_cursor_y - 1;
+    screen_next->cursor_x = screen_cursor_x - 1;
+    screen_publish();
 }
 
 // *** File I/O Implementation ***
@@ -1708,11 +4130,17 @@ enum RESULT editorOpen(const char* filename) {
          editorSetStatusMessage("Error: No filename specified for open.");
          return RESULT_ERR;
     }
+    autosave_wait();  // Not into the file about to be loaded
+    session_leave();  // Where the cursor was in the file being left
+    subst_stop();     // A :s still running does not go on in the next file
 
     FILE* fp = fopen(filename, "r");
     if (!fp) {
         // File doesn't exist, treat as a new file
         if (errno == ENOENT) {
+            lsp_close_document();
+            multicursor_clear();
+            undo_untrack();
             strncpy(textbuf.filename, filename, sizeof(textbuf.filename) - 1);
             textbuf.filename[sizeof(textbuf.filename) - 1] = '\0';
             bufclient_clear(&textbuf);  // Ensure buffer is empty for new file
@@ -1722,6 +4150,10 @@ enum RESULT editorOpen(const char* filename) {
             editorSetStatusMessage("New file"); // Overwrite status from clear
             // Reset cursor etc. just in case clear didn't fully reset
             bufclient_move_cursor_to(&textbuf, 0);
+            lsp_open_document();
+            undo_track();
+            autosave_note_saved();
+            session_enter();
             return RESULT_OK;
         } else {
             // Other error opening file
@@ -1734,6 +4166,9 @@ enum RESULT editorOpen(const char* filename) {
     }
 
     // File exists, store filename and clear current buffer content *before* loading
+    lsp_close_document();  // The server gets the loaded text in one didOpen, not as edits
+    multicursor_clear();
+    undo_untrack();        // Loading is not an edit to undo
     strncpy(textbuf.filename, filename, sizeof(textbuf.filename) - 1);
     textbuf.filename[sizeof(textbuf.filename) - 1] = '\0';
     bufclient_clear(&textbuf);  // Clear existing buffer before loading
@@ -1744,20 +4179,16 @@ enum RESULT editorOpen(const char* filename) {
     long long total_read = 0;
     int io_error = 0;
 
-    // Read file in chunks and insert characters into buffer client
+    // Read file in chunks and insert each block into buffer client at once
     while ((nread = fread(readbuf, 1, sizeof(readbuf), fp)) > 0) {
-        size_t i;
         total_read += nread;
-        for (i = 0; i < nread; i++) {
-            // TODO: Handle potential CR/LF conversion? For simplicity, store as is.
-            if (bufclient_insert_char(&textbuf, readbuf[i]) != RESULT_OK) {
-                editorSetStatusMessage("Error loading file: Out of memory?");
-                res = RESULT_ERR;
-                io_error = 1; // Mark error to stop loop
-                break; // Exit inner loop
-            }
+        // TODO: Handle potential CR/LF conversion? For simplicity, store as is.
+        if (bufclient_insert_bytes(&textbuf, readbuf, (int)nread) != RESULT_OK) {
+            editorSetStatusMessage("Error loading file: Out of memory?");
+            res = RESULT_ERR;
+            io_error = 1; // Mark error to stop loop
+            break;
         }
-        if (io_error) break; // Exit outer loop if memory error occurred
     }
 
     // Check for read errors after loop (if not already memory error)
@@ -1776,15 +4207,187 @@ enum RESULT editorOpen(const char* filename) {
         char status[sizeof(textbuf.filename) + 32];
         snprintf(status, sizeof(status), "Opened \"%s\" (%lld bytes)", textbuf.filename, total_read);
         editorSetStatusMessage(status);
+        lsp_open_document();
     } else {
          // If loading failed (memory or read error), buffer might be partially loaded.
          // It's already marked dirty by clear/insert. Keep it that way.
          // Cursor position might be arbitrary. Resetting to 0 is safest.
          bufclient_move_cursor_to(&textbuf, 0);
     }
+    undo_track();
+    int undoable = res == RESULT_OK ? undo_load_file() : 0;
+    if (res == RESULT_OK) {
+        autosave_note_saved();
+        session_enter();
+    }
+    if (undoable > 0) {
+        char status[sizeof(textbuf.filename) + 64];
+        snprintf(status, sizeof(status), "Opened \"%s\" (%lld bytes, %d change%s to undo)", textbuf.filename, total_read, undoable, undoable == 1 ? "" : "s");
+        editorSetStatusMessage(status);
+    }
     return res;
 }
 
+// Write out the bytes collected by the save transforms
+static void save_flush() {
+    if (savestream.out_len > 0 && !savestream.failed &&
+        fwrite(savestream.out, 1, savestream.out_len, savestream.fp) != (size_t)savestream.out_len) {
+        savestream.failed = 1;
+    }
+    savestream.out_len = 0;
+}
+
+static void save_put(const char* s, int len) {
+    if (len <= 0)
+        return;
+    savestream.written += len;
+    savestream.last = (unsigned char)s[len - 1];
+    while (len > 0) {
+        int n = SAVE_BUF_SIZE - savestream.out_len;
+        if (n > len)
+            n = len;
+        memcpy(savestream.out + savestream.out_len, s, n);
+        savestream.out_len += n;
+        s += n;
+        len -= n;
+        if (savestream.out_len == SAVE_BUF_SIZE)
+            save_flush();
+    }
+}
+
+// Write the first len bytes of the pending blanks (they were not trailing after all)
+static void save_put_run(int len) {
+    struct bufchunk* chunk = savestream.run_chunk;
+    int rel_i = savestream.run_rel_i;
+    while (chunk != NULL && len > 0) {
+        int n = chunk->size - rel_i;
+        if (n > len)
+            n = len;
+        save_put(chunk->data + rel_i, n);
+        len -= n;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    savestream.run_len = 0;
+}
+
+static int save_is_blank(int c) {
+    return c == ' ' || c == '\t' || c == '\r';  // A CR before a newline belongs to the line end
+}
+
+// Stream the bytes of one chunk through the transforms: each piece of a line is written
+// up to its trailing blanks, which wait in the run until the line goes on or ends there
+static void save_chunk(struct bufchunk* chunk) {
+    const char* data = chunk->data;
+    int i = 0;
+    while (i < chunk->size) {
+        const char* nl = memchr(data + i, '\n', chunk->size - i);
+        int end = nl != NULL ? (int)(nl - data) : chunk->size;
+        int t = end;
+        while (t > i && save_is_blank((unsigned char)data[t - 1]))
+            t--;
+        if (t > i) {
+            save_put_run(savestream.run_len);
+            save_put(data + i, t - i);
+            savestream.run_chunk = chunk;
+            savestream.run_rel_i = t;
+            savestream.run_len = end - t;
+        } else if (savestream.run_len == 0) {
+            savestream.run_chunk = chunk;
+            savestream.run_rel_i = i;
+            savestream.run_len = end - i;
+        } else {
+            savestream.run_len += end - i;
+        }
+        if (end > i)
+            savestream.run_last = (unsigned char)data[end - 1];
+        if (nl == NULL)
+            break;
+
+        // The line ends: its blanks go (or stay, but for a CR ending), then the newline
+        int cr = savestream.run_len > 0 && savestream.run_last == '\r';
+        if (savestream.flags & SAVE_STRIP_WS) {
+            savestream.changed |= savestream.run_len > cr;
+            savestream.run_len = 0;
+        } else {
+            save_put_run(savestream.run_len - cr);
+        }
+        savestream.changed |= (savestream.flags & SAVE_FF_DOS) ? !cr : (savestream.flags & SAVE_FF_UNIX) ? cr : 0;
+        if (savestream.flags & SAVE_FF_DOS)
+            save_put("\r\n", 2);
+        else if (savestream.flags & SAVE_FF_UNIX)
+            save_put("\n", 1);
+        else
+            save_put(cr ? "\r\n" : "\n", cr + 1);
+        savestream.run_len = 0;
+        i = end + 1;
+    }
+}
+
+// Write the chunks from begin on (the buffer's, or a copy of them) to fp through the
+// transforms of flags (enum saveFlag), in one pass; the chunks themselves are left as
+// they are. Sets *written to the bytes written; on RESULT_ERR errno tells why.
+static enum RESULT save_stream(FILE* fp, struct bufchunk* begin, int flags, long long* written) {
+    struct bufchunk* chunk;
+    savestream.fp = fp;
+    savestream.flags = flags;
+    savestream.failed = 0;
+    savestream.written = 0;
+    savestream.last = -1;
+    savestream.run_len = 0;
+    savestream.out_len = 0;
+    savestream.changed = 0;
+    for (chunk = begin; chunk != NULL && !savestream.failed; chunk = chunk->next)
+        save_chunk(chunk);
+
+    // The last line, without a newline
+    if (!(flags & SAVE_STRIP_WS))
+        save_put_run(savestream.run_len);
+    savestream.changed |= savestream.run_len > 0;
+    savestream.run_len = 0;
+    if ((flags & SAVE_FIX_EOL) && savestream.last >= 0 && savestream.last != '\n') {
+        savestream.changed = 1;
+        if (flags & SAVE_FF_DOS)
+            save_put("\r\n", 2);
+        else
+            save_put("\n", 1);
+    }
+    save_flush();
+    *written = savestream.written;
+    return savestream.failed ? RESULT_ERR : RESULT_OK;
+}
+
+// :set stripws / nostripws, fixeol / nofixeol, ff=unix / ff=dos (ff= writes line ends as
+// they are), undofile / noundofile. Returns 0 if opt is none of them.
+int save_set_option(const char* opt) {
+    const char* value = strchr(opt, '=');
+    if (strcmp(opt, "undofile") == 0 || strcmp(opt, "noundofile") == 0) {
+        undo.no_file = opt[0] == 'n';
+    } else if (strcmp(opt, "stripws") == 0) {
+        textbuf.save_flags |= SAVE_STRIP_WS;
+    } else if (strcmp(opt, "nostripws") == 0) {
+        textbuf.save_flags &= ~SAVE_STRIP_WS;
+    } else if (strcmp(opt, "fixeol") == 0 || strcmp(opt, "fixendofline") == 0) {
+        textbuf.save_flags |= SAVE_FIX_EOL;
+    } else if (strcmp(opt, "nofixeol") == 0 || strcmp(opt, "nofixendofline") == 0) {
+        textbuf.save_flags &= ~SAVE_FIX_EOL;
+    } else if (strncmp(opt, "ff=", 3) == 0 || strncmp(opt, "fileformat=", 11) == 0) {
+        value++;
+        if (strcmp(value, "unix") != 0 && strcmp(value, "dos") != 0 && value[0] != '\0') {
+            editorSetStatusMessage("ff: use unix or dos");
+            return 1;
+        }
+        textbuf.save_flags &= ~(SAVE_FF_UNIX | SAVE_FF_DOS);
+        if (strcmp(value, "unix") == 0)
+            textbuf.save_flags |= SAVE_FF_UNIX;
+        else if (strcmp(value, "dos") == 0)
+            textbuf.save_flags |= SAVE_FF_DOS;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 // Save the current text buffer content to the associated filename
 enum RESULT editorSave() {
     if (textbuf.filename[0] == '\0') {
@@ -1792,6 +4395,7 @@ enum RESULT editorSave() {
         editorSetStatusMessage("No filename. Use :w <filename>");
         return RESULT_ERR;
     }
+    autosave_wait();  // One writer at a time
 
     // Open file for writing (truncates existing file or creates new)
     // Use "wb" for binary mode to avoid CR/LF translation issues on Windows if ported
@@ -1809,6 +4413,17 @@ enum RESULT editorSave() {
     enum RESULT res = RESULT_OK;
     int write_error = 0;
 
+    if (textbuf.save_flags != 0) {
+        // Transforms on (:set stripws ...): the text streams through them
+        if (save_stream(fp, textbuf.begin, textbuf.save_flags, &total_written) != RESULT_OK) {
+            char err_msg[64];
+            snprintf(err_msg, sizeof(err_msg), "Write error: %s", strerror(errno));
+            editorSetStatusMessage(err_msg);
+            res = RESULT_ERR;
+            write_error = 1;
+        }
+        current = NULL;
+    }
     while (current != NULL) {
         if (current->size > 0) {  // Only write if chunk has data
             size_t written = fwrite(current->data, 1, current->size, fp);
@@ -1840,6 +4455,10 @@ enum RESULT editorSave() {
 
     if (res == RESULT_OK) {
         textbuf.dirty = 0;  // Mark buffer as clean after successful save and close
+        undo_mark_saved();
+        if (textbuf.save_flags == 0 || !savestream.changed)
+            undo_save_file();  // The history leads to what is in the file
+        autosave_note_saved();
         char status[sizeof(textbuf.filename) + 32];
         snprintf(status, sizeof(status), "\"%s\" %lld bytes written", textbuf.filename, total_written);
         editorSetStatusMessage(status);
@@ -1854,9 +4473,6 @@ enum RESULT editorSave() {
 
 // Initialize editor state: terminal, screen size, buffers
 void initEditor() {
-    // Setup exit handler for terminal restoration *before* enabling raw mode
-    // atexit(disableRawMode); // Moved inside enableRawMode to ensure orig_termios is set first
-
     bufchunk_pool_init();  // Initialize memory pool first
     if (bufclient_init(&textbuf) != RESULT_OK) {
         // Use fprintf directly as die() might rely on editor state not yet set
@@ -1871,7 +4487,7 @@ void initEditor() {
     statusbuf_time = 0;
     mode = MODE_NORMAL;
 
-    // Enable raw mode (includes getting original termios and setting atexit handler)
+    // Enable raw mode (includes getting original termios)
     if (enableRawMode() == RESULT_ERR) {
          // Error message printed by enableRawMode or tcgetattr/tcsetattr
          exit(1);
@@ -1882,25 +4498,24 @@ void initEditor() {
     int total_rows = 0, total_cols = 0;
     if (getWindowSize(&total_rows, &total_cols) == RESULT_ERR) {
          // Error messages printed by getWindowSize or its helpers
-         // Still try to disable raw mode before dying
-         disableRawMode();
-         fprintf(stderr, "Fatal: Could not determine terminal size.\n");
-         exit(1);
+         editorExit(1, "Fatal: Could not determine terminal size.");
     }
 
     screencols = total_cols;
     // Reserve bottom 2 rows for status bar and command line
     screenrows = total_rows - 2;
     if (screenrows < 1) {
-         disableRawMode();
-         fprintf(stderr, "Fatal: Terminal too small (need at least 3 rows total).\n");
-         exit(1);
+         editorExit(1, "Fatal: Terminal too small (need at least 3 rows total).");
     }
 
-     // Ensure screen buffer is large enough (optional check)
-     if (SCREEN_BUF_SIZE < (size_t)(screencols * total_rows * 4)) { // Estimate worst case VT100 sequences
-          // This isn't fatal, but drawing might truncate.
-          // fprintf(stderr, "Warning: Screen buffer might be small for terminal size.\n");
+     // The screen diff only tracks up to SCREEN_MAX_ROWS x SCREEN_MAX_COLS cells
+     if (screencols > SCREEN_MAX_COLS) screencols = SCREEN_MAX_COLS;
+     if (screenrows > SCREEN_MAX_ROWS - 2) screenrows = SCREEN_MAX_ROWS - 2;
+     // Terminal output happens on the render thread from here on; it wakes the main loop
+     // if the terminal goes away
+     editorWakeInit();
+     if (render_thread_start(&main_pipe, STDOUT_FILENO) != RESULT_OK) {
+         die("render thread");
      }
 }
 
@@ -1916,6 +4531,89 @@ void editorSetStatusMessage(const char* msg) {
     statusbuf_time = time(NULL);            // Record time for timeout display (5 seconds)
 }
 
+// Wake the main loop from a background thread (one byte in flight at a time)
+void editorWake() {
+    if (wake_fd[1] != -1 && !atomic_exchange(&wake_pending, 1)) {
+        ssize_t ignored = write(wake_fd[1], "", 1);
+        (void)ignored;
+    }
+}
+
+// Create the wakeup pipe (before the first background thread starts)
+enum RESULT editorWakeInit() {
+    int i;
+    if (wake_fd[0] != -1)
+        return RESULT_OK;
+    if (pipe(wake_fd) == -1) {
+        wake_fd[0] = wake_fd[1] = -1;
+        return RESULT_ERR;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(wake_fd[i], F_SETFD, FD_CLOEXEC);
+        fcntl(wake_fd[i], F_SETFL, O_NONBLOCK);
+    }
+    return RESULT_OK;
+}
+
+// Wait until a key can be read. Meanwhile the language server is served, background
+// work (:grep, :find, :diffsplit, autosave) is followed, an idle autosave is started
+// when due and, while nothing else happens, long operations (the word index, :s) run a
+// slice at a time. Returns 1 when a key is ready, 0 when something else happened and
+// the screen may need redrawing.
+int editorWaitInput() {
+    struct pollfd pfd[4];
+    for (;;) {
+        int nfds = 1, lsp_at, busy = sched_pending();
+        int timeout = busy ? 0 : autosave_timeout();
+        if (typeahead_pending())
+            return 1;  // Keys typed during a long scan
+        pfd[0].fd = term_in_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        if (wake_fd[0] != -1) {
+            pfd[1].fd = wake_fd[0];
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            nfds++;
+        }
+        lsp_at = nfds;
+        nfds += lsp_poll_fds(&pfd[nfds]);
+        if (nfds == 1 && timeout < 0)
+            return 1;  // Nothing to do but wait in editorReadKey
+        int ready = poll(pfd, nfds, timeout);
+        if (ready == -1)
+            return 0;  // EINTR (e.g. SIGWINCH): just redraw
+        if (ready == 0) {
+            autosave_tick();
+            if (busy && sched_run_slice())
+                return 0;  // A long operation ended or has progress to show: redraw
+            continue;
+        }
+        lsp_handle_poll(&pfd[lsp_at], nfds - lsp_at);
+        if (lsp_at > 1 && pfd[1].revents != 0) {
+            char drain[64];
+            while (read(wake_fd[0], drain, sizeof(drain)) > 0) {}
+            atomic_store(&wake_pending, 0);  // After draining, so a later wakeup is not lost
+            grep_update();
+            finder_update();
+            taskpool_deliver();  // Done callbacks of finished tasks
+            return 0;  // Background work progressed: redraw
+        }
+        return pfd[0].revents != 0;
+    }
+}
+
+// Ctrl-C: interrupt the long operations running (:s, :grep, the :find index and the
+// synchronous scan in progress), each reporting how far it got. Returns 0 if none ran.
+int editorInterrupt() {
+    int stopped = 0;
+    cancel_token_cancel(&interrupt_token);
+    stopped |= subst_interrupt();
+    stopped |= grep_interrupt();
+    stopped |= finder_interrupt();
+    return stopped;
+}
+
 // Process the command entered in command mode (: line)
 void editorProcessCommand() {
     cmdbuf[cmdbuf_len] = '\0';  // Null-terminate the received command
@@ -1948,7 +4646,9 @@ void editorProcessCommand() {
 
     // --- Command Matching ---
     if (strcmp(cmdbuf, "q") == 0) {
-        if (textbuf.dirty && QUIT_TIMES > 0) {
+        if (server_mode) {
+            terminate_editor = 1;  // Detach; the buffer (and unsaved changes) stays resident
+        } else if (textbuf.dirty && QUIT_TIMES > 0) {
             // Static quit_confirm counter is problematic if user tries :q, then :w, then :q again.
             // Better: Just check dirty flag each time.
             editorSetStatusMessage("Unsaved changes! Use :wq to save and quit, or :q! to discard.");
@@ -1958,6 +4658,7 @@ void editorProcessCommand() {
         }
     } else if (strcmp(cmdbuf, "q!") == 0) {
         terminate_editor = 1;  // Force quit, discard changes
+        server_discard_buffer = 1;  // In server mode, drop the resident copy too
     } else if (strcmp(cmdbuf, "w") == 0) {
         if (editorSave() == RESULT_OK) {
             // Status set by editorSave
@@ -1978,9 +4679,11 @@ void editorProcessCommand() {
 
         if (filename[0] != '\0') {
             // Update buffer's filename before saving
+            lsp_close_document();  // The document's URI changes with it
             strncpy(textbuf.filename, filename, sizeof(textbuf.filename) - 1);
             textbuf.filename[sizeof(textbuf.filename) - 1] = '\0';
             editorSave();  // Save to the new filename (status set by save)
+            lsp_open_document();
         } else {
             editorSetStatusMessage("Filename missing for :w command");
         }
@@ -2011,6 +4714,113 @@ void editorProcessCommand() {
             editorSetStatusMessage("Filename missing for :e! command");
         }
         mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "lsp") == 0) {
+        if (lsp.pid == 0)
+            editorSetStatusMessage("LSP: not running (use :lsp <command>)");
+        else
+            editorSetStatusMessage(lsp.doc_open ? "LSP: running, document open" : lsp.initialized ? "LSP: running" : "LSP: starting...");
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "lsp ", 4) == 0) {
+        // Start a language server: :lsp <command>
+        lsp_start(cmdbuf + 4);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "lspstop") == 0) {
+        lsp_stop();
+        editorSetStatusMessage("LSP: stopped");
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "diag") == 0) {
+        lsp_next_diagnostic();
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "tag ", 4) == 0) {
+        // Jump to a tag: :tag <name>
+        tag_jump(cmdbuf + 4, (int)strlen(cmdbuf + 4));
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "grep ", 5) == 0) {
+        // Search files: :grep <pattern> [dir], or :grep "<pattern with spaces>" [dir]
+        char* pattern = cmdbuf + 5;
+        char* dir;
+        while (*pattern && isspace((unsigned char)*pattern)) pattern++;
+        if (*pattern == '"') {
+            pattern++;
+            dir = strchr(pattern, '"');
+        } else {
+            dir = pattern;
+            while (*dir && !isspace((unsigned char)*dir)) dir++;
+        }
+        if (dir == NULL) {
+            editorSetStatusMessage("grep: missing closing quote");
+        } else {
+            int pattern_len = (int)(dir - pattern);
+            if (*dir) dir++;
+            while (*dir && isspace((unsigned char)*dir)) dir++;
+            grep_start(pattern, pattern_len, dir[0] ? dir : ".");
+        }
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "find ", 5) == 0) {
+        // Open a file by fuzzy path: :find <query> (matches are listed while typing)
+        finder_open();
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "diffsaved") == 0) {
+        diff_saved();
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "diffsplit ", 10) == 0) {
+        diff_split(cmdbuf + 10);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "diffoff") == 0) {
+        diff_off();
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "cursors ", 8) == 0) {
+        // Add a column of cursors: :cursors <count> (lines below the last cursor)
+        multicursor_column(atoi(cmdbuf + 8));
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "set ts=", 7) == 0 || strncmp(cmdbuf, "set tabstop=", 12) == 0) {
+        // Tab stop of this buffer: :set ts=<n>
+        indent_set_tabstop(atoi(strchr(cmdbuf, '=') + 1));
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "set ", 4) == 0 && autosave_set_option(cmdbuf + 4)) {
+        // autosave=N, autosaveedits=M, noautosave
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "set ", 4) == 0 && save_set_option(cmdbuf + 4)) {
+        // How :w writes the text: :set [no]stripws, :set [no]fixeol, :set ff=unix|dos, :set [no]undofile
+        mode = MODE_NORMAL;
+    } else if (indent_command(cmdbuf)) {
+        // Shift or respell indents: :[range]> :[range]< :[range]retab[!] [n]
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "set tw=", 7) == 0 || strncmp(cmdbuf, "set textwidth=", 14) == 0) {
+        // Width gq fills lines to: :set tw=<n>
+        reflow_set_textwidth(atoi(strchr(cmdbuf, '=') + 1));
+        mode = MODE_NORMAL;
+    } else if (reflow_command(cmdbuf)) {
+        // Join or fill lines: :[range]j[oin] :[range]gq
+        mode = MODE_NORMAL;
+    } else if (subst_command(cmdbuf)) {
+        // Replace text: :[range]s/old/new/[g]
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "earlier", 7) == 0 && (cmdbuf[7] == '\0' || cmdbuf[7] == ' ')) {
+        // Go back through the undo tree: :earlier [count | 10s | 5m | 2h | 1d]
+        undo_travel(cmdbuf + 7, 0);
+        mode = MODE_NORMAL;
+    } else if (strncmp(cmdbuf, "later", 5) == 0 && (cmdbuf[5] == '\0' || cmdbuf[5] == ' ')) {
+        undo_travel(cmdbuf + 5, 1);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "mksession") == 0 || strncmp(cmdbuf, "mksession ", 10) == 0) {
+        // Write the session: :mksession [file] (SESSION_FILE_DEFAULT if none)
+        const char* path = cmdbuf + 9;
+        while (*path && isspace((unsigned char)*path)) path++;
+        session_write(path[0] != '\0' ? path : SESSION_FILE_DEFAULT);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "bn") == 0 || strcmp(cmdbuf, "bnext") == 0) {
+        session_next(1);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "bp") == 0 || strcmp(cmdbuf, "bprevious") == 0) {
+        session_next(-1);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "cn") == 0) {
+        grep_next(1);
+        mode = MODE_NORMAL;
+    } else if (strcmp(cmdbuf, "cp") == 0) {
+        grep_next(-1);
+        mode = MODE_NORMAL;
     }
     // --- Add other commands here ---
     // Example: Go to line number
@@ -2053,12 +4863,29 @@ void editorProcessCommand() {
 void editorProcessKeypress() {
     enum editorKey c = editorReadKey();
 
+    if (c != CTRL_KEY('n') && c != CTRL_KEY('p')) {
+        word_complete_done();
+    }
+    if (mode != MODE_INSERT) {
+        undo_seal();  // Each command is an undo unit; an insert session is one too
+    }
+
     // --- Global Keybinds (if any, e.g., resize handling) ---
-    // None implemented here yet.
+    if (c == CTRL_KEY('c') && editorInterrupt()) {
+        return;  // Stopped a long operation (otherwise the mode handles it)
+    }
+    subst_before_key(c);
 
     // --- Mode-Specific Key Presses ---
     switch (mode) {
+        case MODE_BLOCK:
+            if (block_key(c))
+                break;
+            // Movement keys move the corner of the block as in normal mode
+            // fall through
         case MODE_NORMAL:
+            if (multicursor_key(c))  // Ctrl-N/Ctrl-J, or a key for all cursors
+                break;
             switch (c) {
                 // --- Mode Changes ---
                 case 'i':  // Enter Insert mode (at cursor)
@@ -2204,6 +5031,49 @@ void editorProcessKeypress() {
                         bufclient_delete_char(&textbuf); // Delete char before new cursor pos
                     }
                     break;
+                case '>':  // '>>': indent the line by a tab stop
+                    if (editorReadKey() == '>') {
+                        indent_shift(textbuf.cursor_abs_y, textbuf.cursor_abs_y, 1);
+                    }
+                    break;
+                case '<':  // '<<': outdent it
+                    if (editorReadKey() == '<') {
+                        indent_shift(textbuf.cursor_abs_y, textbuf.cursor_abs_y, -1);
+                    }
+                    break;
+                case CTRL_KEY('v'):  // Start a block selection
+                    block_start();
+                    break;
+                case CTRL_KEY(']'):  // Jump to the tag under the cursor
+                    tag_jump_word();
+                    break;
+                case 'g': {  // 'gd': go to definition (language server); 'gq': format; 'g~', 'gU', 'gu': case
+                    int next = editorReadKey();
+                    if (next == 'd') {
+                        lsp_request_definition();
+                    } else if (next == 'q') {
+                        reflow_motion();
+                    } else if (next == '~') {
+                        case_motion(CASE_TOGGLE);
+                    } else if (next == 'U') {
+                        case_motion(CASE_UPPER);
+                    } else if (next == 'u') {
+                        case_motion(CASE_LOWER);
+                    }
+                    break;
+                }
+                case '~':  // Toggle the case of the character under the cursor
+                    case_toggle_char();
+                    break;
+                case 'J':  // Join the line below onto this one
+                    reflow_join(textbuf.cursor_abs_y, textbuf.cursor_abs_y + 1);
+                    break;
+                case 'u':  // Undo the last change
+                    undo_undo();
+                    break;
+                case CTRL_KEY('r'):  // Redo it
+                    undo_redo();
+                    break;
                 case 'd':  // Potential start of 'dd' (delete line)
                      // Requires peeking at next key, complex state.
                      // For now, just implement single 'd' as no-op or beep?
@@ -2225,17 +5095,10 @@ void editorProcessKeypress() {
                             end_of_line_pos = textbuf.size;
                         }
 
-                        // Delete characters one by one from end back to original position
-                        while (textbuf.cursor_abs_i < end_of_line_pos) {
-                            // Move cursor to the end of the part to delete
-                            bufclient_move_cursor_to(&textbuf, end_of_line_pos);
-                            if (textbuf.cursor_abs_i == 0) break; // Safety check
-                            if (bufclient_delete_char(&textbuf) != RESULT_OK) break; // Stop on error
-                            // Deleting moves cursor back one, end_of_line_pos is now one smaller too
-                            end_of_line_pos--;
+                        // Delete the rest of the line as one range (cursor stays where 'D' was pressed)
+                        if (end_of_line_pos > original_cursor_pos) {
+                            bufclient_delete_range(&textbuf, original_cursor_pos, end_of_line_pos - original_cursor_pos);
                         }
-                        // Ensure cursor is back where 'D' was pressed if possible
-                         bufclient_move_cursor_to(&textbuf, original_cursor_pos > textbuf.size ? textbuf.size : original_cursor_pos);
                     }
                     break;
                 case 'o':  // Open line below and enter insert mode
@@ -2274,9 +5137,15 @@ void editorProcessKeypress() {
             break;  // End MODE_NORMAL
 
         case MODE_INSERT:
+            if (multicursor_key(c))  // Typed at all cursors
+                break;
             switch (c) {
                 case '\x1b':  // Escape: Return to Normal mode
                     mode = MODE_NORMAL;
+                    if (block_insert_done()) {  // Ctrl-V I/A: the text goes onto the other lines too
+                        editorSetStatusMessage("");
+                        break;
+                    }
                     // Vim behavior: move cursor left if possible after exiting insert,
                     // unless it was already at the beginning of the line.
                     if (textbuf.cursor_abs_i > 0) {
@@ -2333,6 +5202,18 @@ void editorProcessKeypress() {
                       break;
 
 
+                case CTRL_KEY('n'):  // Complete the word before the cursor from the buffer's words
+                    word_complete(1);
+                    break;
+                case CTRL_KEY('p'):  // Same, cycling backwards
+                    word_complete(-1);
+                    break;
+                case CTRL_KEY('x'):  // Ctrl-X Ctrl-O: complete from the language server
+                    if (editorReadKey() == CTRL_KEY('o')) {
+                        lsp_request_completion();
+                    }
+                    break;
+
                 default:  // Insert regular character if printable
                     // Check for standard printable ASCII range and Tab
                     if ((c >= 32 && c <= 126) || c == '\t') {
@@ -2366,10 +5247,15 @@ void editorProcessKeypress() {
                     }
                     break;
 
-                // Basic command line editing? (Arrows, Del, Home, End) - Ignored for now
+                case ARROW_UP: case CTRL_KEY('p'):  // Move the :find selection up the list
+                    finder_select(1);
+                    break;
+                case ARROW_DOWN: case CTRL_KEY('n'):
+                    finder_select(-1);
+                    break;
+
+                // Basic command line editing? (Del, Home, End) - Ignored for now
                 case DEL_KEY:     // Could implement delete char under cursor
-                case ARROW_UP:    // Could implement command history
-                case ARROW_DOWN:  // Could implement command history
                 case ARROW_LEFT:  // Could implement cursor movement
                 case ARROW_RIGHT: // Could implement cursor movement
                 case PAGE_UP:
@@ -2391,38 +5277,7582 @@ void editorProcessKeypress() {
                     }
                     break;
             }
+            finder_on_cmdline();  // Re-score :find matches for the edited query
             break;  // End MODE_COMMAND
     } // end switch(mode)
 }
 
 
-// *** Main Function ***
-int main(int argc, char* argv[]) {
-    // Initialization (terminal, screen size, buffers, raw mode, exit handler)
-    initEditor();
+// *** Word Completion Implementation ***
+// Insert-mode Ctrl-N/Ctrl-P complete the word before the cursor from an index of the
+// buffer's words: a trie (siblings kept sorted, so matches come out alphabetically) of
+// word -> occurrence count. The index is built from the chunks a slice at a time while
+// the editor is idle, and kept current from edit deltas, so a completion only walks the
+// trie below the prefix. Text before `built` is indexed; it always sits at a word
+// boundary, and a word is counted iff it starts before it.
 
-    // Open file specified on command line, if any
-    if (argc >= 2) {
-        editorOpen(argv[1]);
-        // editorOpen sets status messages for success/failure/new file
-    } else {
-        // No file specified, show welcome message
-        editorSetStatusMessage("lkjsxceditor | Version " LKJSXCEDITOR_VERSION " | Press : for command");
-    }
+static int is_word_char(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
 
-    // Main event loop
-    while (!terminate_editor) {
-        editorRefreshScreen();    // Update display based on current state
-        editorProcessKeypress();  // Wait for and process one keypress
+// Start of the run of word chars that ends at abs_i
+static int word_run_start(struct bufclient* buf, int abs_i) {
+    struct bufchunk* chunk;
+    int rel_i;
+    if (bufclient_find_pos(buf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return abs_i;
+    while (chunk != NULL) {
+        while (rel_i > 0) {
+            if (!is_word_char(chunk->data[rel_i - 1]))
+                return abs_i;
+            rel_i--;
+            abs_i--;
+        }
+        chunk = chunk->prev;
+        if (chunk != NULL)
+            rel_i = chunk->size;
     }
+    return abs_i;
+}
+
+// End of the run of word chars that starts at abs_i
+static int word_run_end(struct bufclient* buf, int abs_i) {
+    struct bufchunk* chunk;
+    int rel_i;
+    if (bufclient_find_pos(buf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return abs_i;
+    while (chunk != NULL) {
+        while (rel_i < chunk->size) {
+            if (!is_word_char(chunk->data[rel_i]))
+                return abs_i;
+            rel_i++;
+            abs_i++;
+        }
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return abs_i;
+}
+
+static void wordidx_reset() {
+    wordidx.nodes[0].child = 0;  // Node 0 is the root; 0 also means "no node" in links
+    wordidx.nodes[0].sibling = 0;
+    wordidx.nodes[0].count = 0;
+    wordidx.node_count = 1;
+    wordidx.built = 0;
+    wordidx.full = 0;
+    wordidx.region_start = -1;
+}
+
+// Adjust the count of word w (len bytes) by delta
+static void wordidx_add(const char* w, int len, int delta) {
+    int node = 0, i;
+    for (i = 0; i < len; i++) {
+        int* link = &wordidx.nodes[node].child;
+        while (*link != 0 && wordidx.nodes[*link].c < w[i])
+            link = &wordidx.nodes[*link].sibling;
+        if (*link == 0 || wordidx.nodes[*link].c != w[i]) {
+            if (delta < 0)
+                return;  // Not indexed (e.g. the index was full when it appeared)
+            if (wordidx.node_count == WORDIDX_NODES) {
+                wordidx.full = 1;
+                return;
+            }
+            int fresh = wordidx.node_count++;
+            wordidx.nodes[fresh].c = w[i];
+            wordidx.nodes[fresh].child = 0;
+            wordidx.nodes[fresh].count = 0;
+            wordidx.nodes[fresh].sibling = *link;
+            *link = fresh;
+        }
+        node = *link;
+    }
+    wordidx.nodes[node].count += delta;
+    if (wordidx.nodes[node].count < 0)
+        wordidx.nodes[node].count = 0;
+}
+
+// Add delta to the count of every word in [start, end) that starts before limit
+// (start and end must be word boundaries)
+static void wordidx_count_range(struct bufclient* buf, int start, int end, int limit, int delta) {
+    struct bufchunk* chunk;
+    int rel_i, abs_i = start;
+    char word[WORDIDX_WORD_MAX];
+    int len = 0, word_start = start;
+    if (start >= end || start >= limit || bufclient_find_pos(buf, start, &chunk, &rel_i) != RESULT_OK)
+        return;
+    while (chunk != NULL && abs_i < end) {
+        if (rel_i == chunk->size) {
+            chunk = chunk->next;
+            rel_i = 0;
+            continue;
+        }
+        char c = chunk->data[rel_i++];
+        if (is_word_char(c)) {
+            if (len == 0)
+                word_start = abs_i;
+            if (len < WORDIDX_WORD_MAX)
+                word[len] = c;
+            len++;
+        } else if (len > 0) {
+            if (len >= 2 && len <= WORDIDX_WORD_MAX && word_start < limit)
+                wordidx_add(word, len, delta);
+            len = 0;
+            if (abs_i >= limit)
+                return;
+        }
+        abs_i++;
+    }
+    if (len >= 2 && len <= WORDIDX_WORD_MAX && word_start < limit)
+        wordidx_add(word, len, delta);
+}
+
+// Index the next slice of the buffer
+static void wordidx_build_step(struct bufclient* buf) {
+    int end = wordidx.built + WORDIDX_SLICE;
+    if (end >= buf->size)
+        end = buf->size;
+    else
+        end = word_run_end(buf, end);  // Stop at a word boundary
+    wordidx_count_range(buf, wordidx.built, end, INT_MAX, 1);
+    wordidx.built = end;
+}
+
+// 1 while the bound textbuf is not fully indexed yet
+static int wordidx_pending() {
+    return wordidx.observer.notify != NULL && wordidx.slot < 0 && wordidx.built < textbuf.size;
+}
+
+// Index one more slice of textbuf (scheduler job while it is behind)
+static int wordidx_step(void* ctx) {
+    (void)ctx;
+    if (wordidx_pending())
+        wordidx_build_step(&textbuf);
+    return wordidx_pending();
+}
+
+// Removal ahead: uncount the words it touches (text around it included)
+static void wordidx_before_remove(struct bufclient* buf, int offset, int removed, void* ctx) {
+    (void)ctx;
+    if (offset == 0 && removed == buf->size) {
+        wordidx_reset();  // Whole buffer dropped (file reload)
+        return;
+    }
+    wordidx.region_start = word_run_start(buf, offset);
+    wordidx.region_end = word_run_end(buf, offset + removed);
+    wordidx_count_range(buf, wordidx.region_start, wordidx.region_end, wordidx.built, -1);
+}
+
+// Count the words around an edit again, and move the build position with the text
+static void wordidx_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int d;
+    (void)ctx;
+    for (d = 0; d < count; d++) {
+        const struct bufdelta* delta = &deltas[d];
+        int start, old_end, new_end;
+        if (delta->removed > 0) {
+            if (wordidx.region_start < 0)
+                continue;  // Whole buffer dropped
+            start = wordidx.region_start;
+            old_end = wordidx.region_end;
+            new_end = old_end - delta->removed + delta->inserted;
+            wordidx.region_start = -1;
+        } else {
+            start = word_run_start(buf, delta->offset);
+            new_end = word_run_end(buf, delta->offset + delta->inserted);
+            old_end = new_end - delta->inserted;
+            // Before the insertion, the word chars on both sides of it were one word
+            int left = delta->offset - start;
+            int right = new_end - (delta->offset + delta->inserted);
+            if (start < wordidx.built && left + right >= 2 && left + right <= WORDIDX_WORD_MAX) {
+                char word[WORDIDX_WORD_MAX];
+                bufclient_read(buf, start, word, left);
+                bufclient_read(buf, delta->offset + delta->inserted, word + left, right);
+                wordidx_add(word, left + right, -1);
+            }
+        }
+        if (wordidx.built > old_end)
+            wordidx.built += delta->inserted - delta->removed;
+        else if (wordidx.built >= start)
+            wordidx.built = start;  // Edited next to the build position: rescan from here
+        wordidx_count_range(buf, start, new_end, wordidx.built, 1);
+    }
+    if (wordidx_pending())
+        sched_add(wordidx_step, NULL);  // (once)
+}
+
+// Make the index follow textbuf (it indexes one buffer at a time)
+void wordidx_bind() {
+    int i;
+    for (i = 0; i < textbuf.observer_count; i++) {
+        if (textbuf.observers[i] == &wordidx.observer)
+            return;  // Already indexing this buffer
+    }
+    if (wordidx.observer.notify != NULL && wordidx.slot >= 0 && server_bufs[wordidx.slot].used)
+        bufclient_unobserve(&server_bufs[wordidx.slot].buf, &wordidx.observer);
+    wordidx_reset();
+    wordidx.slot = server_active != NULL ? server_active->slot : -1;
+    wordidx.observer.notify = wordidx_on_edit;
+    wordidx.observer.before_remove = wordidx_before_remove;
+    bufclient_observe(&textbuf, &wordidx.observer);
+    if (wordidx_pending())
+        sched_add(wordidx_step, NULL);
+}
+
+// Collect up to WORDIDX_MATCH_MAX words that extend prefix (alphabetically), returns the
+// count. A word equal to skip (skip_len bytes) is left out if it occurs only once.
+static int wordidx_matches(const char* prefix, int prefix_len, const char* skip, int skip_len) {
+    int stack[WORDIDX_WORD_MAX + 1];  // Node per depth below the prefix node
+    char word[WORDIDX_WORD_MAX];
+    int node = 0, i, depth, found = 0;
+
+    for (i = 0; i < prefix_len; i++) {
+        node = wordidx.nodes[node].child;
+        while (node != 0 && wordidx.nodes[node].c != prefix[i])
+            node = wordidx.nodes[node].sibling;
+        if (node == 0)
+            return 0;
+    }
+    memcpy(word, prefix, prefix_len);
+    // Depth-first walk; stack[depth] is the node at word[prefix_len + depth - 1]
+    depth = 0;
+    stack[0] = node;
+    int next = wordidx.nodes[node].child;
+    while (found < WORDIDX_MATCH_MAX) {
+        if (next != 0 && prefix_len + depth < WORDIDX_WORD_MAX) {
+            depth++;
+            stack[depth] = next;
+            word[prefix_len + depth - 1] = wordidx.nodes[next].c;
+            int only_skip = wordidx.nodes[next].count == 1 && prefix_len + depth == skip_len &&
+                            memcmp(word, skip, skip_len) == 0;
+            if (wordidx.nodes[next].count > 0 && !only_skip) {
+                memcpy(completion.matches[found], word, prefix_len + depth);
+                completion.matches[found][prefix_len + depth] = '\0';
+                found++;
+            }
+            next = wordidx.nodes[next].child;
+            continue;
+        }
+        // Go to the next sibling, climbing as needed
+        while (depth > 0 && wordidx.nodes[stack[depth]].sibling == 0)
+            depth--;
+        if (depth == 0)
+            break;
+        next = wordidx.nodes[stack[depth]].sibling;
+        depth--;
+    }
+    return found;
+}
+
+// Ctrl-N (dir 1) / Ctrl-P (dir -1): start completing the word before the cursor, or
+// cycle through the matches (and back to what was typed)
+void word_complete(int dir) {
+    char status[STATUS_BUF_SIZE];
+    if (!completion.active || completion.owner != server_active ||
+        textbuf.cursor_abs_i != completion.start + completion.len) {
+        wordidx_bind();
+        while (wordidx.built < textbuf.size)
+            wordidx_build_step(&textbuf);  // Not indexed yet: finish now
+        completion.start = word_run_start(&textbuf, textbuf.cursor_abs_i);
+        completion.prefix_len = textbuf.cursor_abs_i - completion.start;
+        if (completion.prefix_len == 0 || completion.prefix_len >= WORDIDX_WORD_MAX) {
+            editorSetStatusMessage("No word before the cursor");
+            return;
+        }
+        bufclient_read(&textbuf, completion.start, completion.prefix, completion.prefix_len);
+        // The word the cursor is in is no match for itself
+        char current[WORDIDX_WORD_MAX];
+        int current_len = word_run_end(&textbuf, textbuf.cursor_abs_i) - completion.start;
+        if (current_len > WORDIDX_WORD_MAX)
+            current_len = 0;
+        bufclient_read(&textbuf, completion.start, current, current_len);
+        completion.count = wordidx_matches(completion.prefix, completion.prefix_len, current, current_len);
+        if (completion.count == 0) {
+            editorSetStatusMessage(wordidx.full ? "No matches (word index full)" : "No matches");
+            return;
+        }
+        completion.active = 1;
+        completion.owner = server_active;
+        completion.len = completion.prefix_len;
+        completion.index = -1;  // The typed prefix
+    }
+
+    completion.index += dir;
+    if (completion.index >= completion.count)
+        completion.index = -1;
+    else if (completion.index < -1)
+        completion.index = completion.count - 1;
+
+    // Only the part after the prefix changes
+    const char* text = completion.index >= 0 ? completion.matches[completion.index] + completion.prefix_len : "";
+    int text_len = strlen(text);
+    if (completion.len > completion.prefix_len)
+        bufclient_delete_range(&textbuf, completion.start + completion.prefix_len, completion.len - completion.prefix_len);
+    bufclient_insert_bytes(&textbuf, text, text_len);
+    completion.len = completion.prefix_len + text_len;
+
+    if (completion.index < 0) {
+        editorSetStatusMessage("Back at original");
+    } else {
+        snprintf(status, sizeof(status), "Match %d of %d%s", completion.index + 1, completion.count,
+                 completion.count == WORDIDX_MATCH_MAX ? "+" : "");
+        editorSetStatusMessage(status);
+    }
+}
+
+// Any other key ends the completion
+void word_complete_done() {
+    completion.active = 0;
+}
+
+// *** Tags Implementation ***
+// :tag and Ctrl-] look names up in a ctags file. The file is mapped and binary-searched
+// in place (its lines are sorted by name), so a lookup reads a few dozen lines however
+// big the file is; nothing is parsed or loaded up front.
+
+// (Re)map the tags file at path if it is not the one mapped already
+static enum RESULT tags_map(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return RESULT_ERR;
+    if (tags.map != NULL && tags.dev == st.st_dev && tags.ino == st.st_ino &&
+        tags.mtime == st.st_mtime && tags.size == (size_t)st.st_size)
+        return RESULT_OK;  // Unchanged since the last lookup
+    if (tags.map != NULL) {
+        munmap((void*)tags.map, tags.size);
+        tags.map = NULL;
+    }
+    if (st.st_size == 0)
+        return RESULT_ERR;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return RESULT_ERR;
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping stays valid
+    if (map == MAP_FAILED)
+        return RESULT_ERR;
+    madvise(map, (size_t)st.st_size, MADV_RANDOM);  // Binary search: no read-ahead
+    tags.map = map;
+    tags.size = (size_t)st.st_size;
+    tags.dev = st.st_dev;
+    tags.ino = st.st_ino;
+    tags.mtime = st.st_mtime;
+
+    // Pseudo-tags ("!_TAG_...") sort first; only the sort order matters here
+    tags.sorted = 1;
+    const char* p = tags.map;
+    const char* end = tags.map + tags.size;
+    while (p < end && *p == '!') {
+        const char* eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        if (eol - p > 19 && strncmp(p, "!_TAG_FILE_SORTED\t", 18) == 0)
+            tags.sorted = p[18] - '0';
+        p = eol + 1;
+    }
+
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL)
+        snprintf(tags.dir, sizeof(tags.dir), ".");
+    else
+        snprintf(tags.dir, sizeof(tags.dir), "%.*s", (int)(slash - path), path);
+    return RESULT_OK;
+}
+
+// Map the tags file next to the open file, or else the one in the current directory
+static enum RESULT tags_open() {
+    char path[PATH_MAX];
+    const char* slash = strrchr(textbuf.filename, '/');
+    if (slash != NULL) {
+        snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - textbuf.filename), textbuf.filename, TAGS_FILE_NAME);
+        if (tags_map(path) == RESULT_OK)
+            return RESULT_OK;
+    }
+    return tags_map(TAGS_FILE_NAME);
+}
+
+// Start of the line containing p
+static const char* tags_line_start(const char* p) {
+    while (p > tags.map && p[-1] != '\n')
+        p--;
+    return p;
+}
+
+// Start of the line after the one at p
+static const char* tags_line_next(const char* p) {
+    const char* eol = memchr(p, '\n', tags.map + tags.size - p);
+    return eol != NULL ? eol + 1 : tags.map + tags.size;
+}
+
+// Compare the name field of the tag line at p with name (<0, 0, >0 like strcmp)
+static int tags_compare(const char* p, const char* name, int len, int fold) {
+    const char* end = tags.map + tags.size;
+    int i;
+    for (i = 0; i < len; i++) {
+        if (p + i >= end || p[i] == '\t' || p[i] == '\n')
+            return -1;  // The line's name is a prefix of name
+        int a = (unsigned char)p[i];
+        int b = (unsigned char)name[i];
+        if (fold) {
+            a = toupper(a);
+            b = toupper(b);
+        }
+        if (a != b)
+            return a - b;
+    }
+    return (p + i < end && p[i] != '\t' && p[i] != '\n') ? 1 : 0;
+}
+
+// First line of the mapped file whose tag is name, NULL if there is none
+static const char* tags_find(const char* name, int len) {
+    const char* end = tags.map + tags.size;
+    if (tags.sorted != 1 && tags.sorted != 2) {
+        // Unsorted file: nothing to do but read it all
+        const char* p;
+        for (p = tags.map; p < end; p = tags_line_next(p)) {
+            if (tags_compare(p, name, len, 0) == 0)
+                return p;
+        }
+        return NULL;
+    }
+    // Lower bound over line starts: lines before lo sort below name, lines from hi on do not
+    const char* lo = tags.map;
+    const char* hi = end;
+    while (lo < hi) {
+        const char* line = tags_line_start(lo + (hi - lo) / 2);
+        if (tags_compare(line, name, len, tags.sorted == 2) < 0)
+            lo = tags_line_next(line);
+        else
+            hi = line;
+    }
+    if (lo < end && tags_compare(lo, name, len, tags.sorted == 2) == 0)
+        return lo;
+    return NULL;
+}
+
+// 1 if textbuf holds pat (len bytes) at chunk/rel_i, followed by a line end if eol is set
+static int tag_match_at(struct bufchunk* chunk, int rel_i, const char* pat, int len, int eol) {
+    int k;
+    for (k = 0; k < len; k++) {
+        while (chunk != NULL && rel_i >= chunk->size) {
+            chunk = chunk->next;
+            rel_i = 0;
+        }
+        if (chunk == NULL || chunk->data[rel_i] != pat[k])
+            return 0;
+        rel_i++;
+    }
+    if (!eol)
+        return 1;
+    while (chunk != NULL && rel_i >= chunk->size) {
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return chunk == NULL || chunk->data[rel_i] == '\n';
+}
+
+// Offset of the first match of a tag search pattern in textbuf, -1 if none.
+// Tag patterns are literal text, optionally anchored with ^ and $.
+static int tag_search(const char* pat, int len, int bol, int eol) {
+    struct bufchunk* chunk;
+    int abs_i = 0;
+    int at_bol = 1;
+    for (chunk = textbuf.begin; chunk != NULL; chunk = chunk->next) {
+        int rel_i;
+        for (rel_i = 0; rel_i < chunk->size; rel_i++, abs_i++) {
+            char c = chunk->data[rel_i];
+            if ((at_bol || !bol) && (len == 0 || c == pat[0]) && tag_match_at(chunk, rel_i, pat, len, eol))
+                return abs_i;
+            at_bol = (c == '\n');
+        }
+    }
+    if (at_bol && len == 0)
+        return abs_i;  // Empty last line
+    return -1;
+}
+
+// Move the cursor to a tag address: a line number or a /pattern/ (?pattern?)
+static enum RESULT tag_goto_address(const char* p, const char* end) {
+    if (p < end && isdigit((unsigned char)*p)) {
+        int line = 0;
+        while (p < end && isdigit((unsigned char)*p))
+            line = line * 10 + (*p++ - '0');
+        struct bufchunk* chunk;
+        int rel_i, abs_i;
+        if (line < 1 || bufclient_find_line_start(&textbuf, line - 1, &chunk, &rel_i, &abs_i) != RESULT_OK)
+            return RESULT_ERR;
+        bufclient_move_cursor_to(&textbuf, abs_i);
+        return RESULT_OK;
+    }
+    if (p >= end || (*p != '/' && *p != '?'))
+        return RESULT_ERR;
+
+    // Unescape the pattern up to its closing delimiter
+    char delim = *p++;
+    char pat[TAG_PATTERN_MAX];
+    int len = 0;
+    int bol = 0, eol = 0;
+    if (p < end && *p == '^') {
+        bol = 1;
+        p++;
+    }
+    while (p < end && *p != delim) {
+        if (*p == '\\' && p + 1 < end)
+            p++;  // \/, \? and \\ stand for the character itself
+        else if (*p == '$' && p + 1 < end && p[1] == delim) {
+            eol = 1;
+            break;
+        }
+        if (len == (int)sizeof(pat))
+            return RESULT_ERR;
+        pat[len++] = *p++;
+    }
+    int abs_i = tag_search(pat, len, bol, eol);
+    if (abs_i < 0)
+        return RESULT_ERR;
+    bufclient_move_cursor_to(&textbuf, abs_i);
+    return RESULT_OK;
+}
+
+// 1 if path names the file open in textbuf
+static int is_open_file(const char* path) {
+    struct stat a, b;
+    if (strcmp(path, textbuf.filename) == 0)
+        return 1;
+    return stat(path, &a) == 0 && stat(textbuf.filename, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Jump to the definition of a tag: open its file if needed and go to its address
+void tag_jump(const char* name, int len) {
+    char msg[STATUS_BUF_SIZE];
+    while (len > 0 && isspace((unsigned char)*name)) {
+        name++;
+        len--;
+    }
+    if (len == 0) {
+        editorSetStatusMessage("Tag name missing");
+        return;
+    }
+    if (len > TAG_NAME_MAX) {
+        editorSetStatusMessage("Tag name too long");
+        return;
+    }
+    if (tags_open() != RESULT_OK) {
+        editorSetStatusMessage("No tags file");
+        return;
+    }
+    const char* line = tags_find(name, len);
+    if (line == NULL) {
+        snprintf(msg, sizeof(msg), "Tag not found: %.*s", len, name);
+        editorSetStatusMessage(msg);
+        return;
+    }
+    int count = 1;
+    const char* next;
+    for (next = tags_line_next(line); next < tags.map + tags.size && tags_compare(next, name, len, tags.sorted == 2) == 0; next = tags_line_next(next))
+        count++;
+
+    // name<TAB>file<TAB>address[;"<TAB>extension fields]
+    const char* end = tags_line_next(line);
+    const char* file = memchr(line, '\t', end - line);
+    const char* address = file != NULL ? memchr(file + 1, '\t', end - file - 1) : NULL;
+    if (address == NULL) {
+        editorSetStatusMessage("Malformed tags file entry");
+        return;
+    }
+    file++;
+    address++;
+    const char* address_end = end;
+    const char* p;
+    for (p = address; p + 1 < end; p++) {
+        if (p[0] == ';' && p[1] == '"') {
+            address_end = p;
+            break;
+        }
+    }
+    while (address_end > address && (address_end[-1] == '\n' || address_end[-1] == '\r'))
+        address_end--;
+
+    char path[PATH_MAX];
+    int file_len = (int)(address - 1 - file);
+    int path_len;
+    if (file[0] == '/' || strcmp(tags.dir, ".") == 0)
+        path_len = snprintf(path, sizeof(path), "%.*s", file_len, file);
+    else
+        path_len = snprintf(path, sizeof(path), "%s/%.*s", tags.dir, file_len, file);
+    if (path_len >= (int)sizeof(path)) {
+        editorSetStatusMessage("Tag file path too long");
+        return;
+    }
+
+    if (!is_open_file(path)) {
+        if (textbuf.dirty) {
+            editorSetStatusMessage("Tag is in another file; save first");
+            return;
+        }
+        if (editorOpen(path) != RESULT_OK)
+            return;
+    }
+    if (tag_goto_address(address, address_end) != RESULT_OK) {
+        snprintf(msg, sizeof(msg), "Tag %.*s: address not found in %.*s", len, name, file_len, file);
+        editorSetStatusMessage(msg);
+        return;
+    }
+    if (count > 1)
+        snprintf(msg, sizeof(msg), "Tag %.*s (1 of %d)", len, name, count);
+    else
+        snprintf(msg, sizeof(msg), "Tag %.*s", len, name);
+    editorSetStatusMessage(msg);
+}
+
+// Ctrl-]: jump to the tag named by the word under the cursor
+void tag_jump_word() {
+    int start = word_run_start(&textbuf, textbuf.cursor_abs_i);
+    int end = word_run_end(&textbuf, textbuf.cursor_abs_i);
+    char name[TAG_NAME_MAX];
+    if (end == start) {
+        editorSetStatusMessage("No word under cursor");
+        return;
+    }
+    if (end - start > (int)sizeof(name)) {
+        editorSetStatusMessage("Tag name too long");
+        return;
+    }
+    bufclient_read(&textbuf, start, name, end - start);
+    tag_jump(name, end - start);
+}
+
+// *** Task Pool Implementation ***
+// Background work (:grep and :find walks, :find scoring, :diffsplit, autosave) runs as
+// tasks on one pool of threads, one per core, started with the first task. Each thread
+// has a deque per priority: tasks queued by a pool thread go on its own deque, those of
+// the main thread round robin. A thread looks for the highest priority first: its own
+// newest task, else the oldest one of another thread (stealing). A task may carry a
+// cancel token (cancelled before it started, it is skipped), a group counter (the
+// submitter waits for it or polls it) and a done callback, which the main loop calls
+// after editorWake.
+
+void cancel_token_reset(struct canceltoken* token) {
+    atomic_store(&token->cancelled, 0);
+}
+
+void cancel_token_cancel(struct canceltoken* token) {
+    atomic_store(&token->cancelled, 1);
+}
+
+// 1 if the work should stop (never for no token)
+int cancel_token_cancelled(struct canceltoken* token) {
+    return token != NULL && atomic_load(&token->cancelled);
+}
+
+// Take the next task for thread w (-1: none found)
+static int taskpool_take(int w) {
+    int n = taskpool.thread_count;
+    int priority, k;
+    for (priority = 0; priority < TASK_PRIORITIES; priority++) {
+        for (k = 0; k < n; k++) {
+            struct taskdeque* d = &taskpool.deques[(w + k) % n];
+            int id = -1;
+            pthread_mutex_lock(&d->lock);
+            if (d->count[priority] > 0) {
+                d->count[priority]--;
+                if (k == 0) {  // Own deque: newest
+                    id = d->ids[priority][(d->head[priority] + d->count[priority]) % TASKPOOL_TASKS_MAX];
+                } else {       // Another's: oldest
+                    id = d->ids[priority][d->head[priority]];
+                    d->head[priority] = (d->head[priority] + 1) % TASKPOOL_TASKS_MAX;
+                }
+            }
+            pthread_mutex_unlock(&d->lock);
+            if (id >= 0) {
+                atomic_fetch_sub(&taskpool.queued, 1);
+                return id;
+            }
+        }
+    }
+    return -1;
+}
+
+// Run task id on thread w, then hand it to the main loop (done) or free it
+static void taskpool_run(int id, int w) {
+    struct task* task = &taskpool.tasks[id];
+    if (!cancel_token_cancelled(task->token))
+        task->run(task->arg, w);
+    int has_done = task->done != NULL;
+    atomic_int* group = task->group;
+    pthread_mutex_lock(&taskpool.lock);
+    if (has_done) {
+        task->next = -1;
+        if (taskpool.completed_head == -1)
+            taskpool.completed_head = id;
+        else
+            taskpool.tasks[taskpool.completed_tail].next = id;
+        taskpool.completed_tail = id;
+    } else {
+        task->next = taskpool.free_head;
+        taskpool.free_head = id;
+    }
+    int emptied = group != NULL && atomic_fetch_sub(group, 1) == 1;
+    if (has_done || emptied)
+        pthread_cond_broadcast(&taskpool.finished);
+    pthread_mutex_unlock(&taskpool.lock);
+    if (has_done || emptied)
+        editorWake();
+}
+
+static void* taskpool_main(void* arg) {
+    int w = (int)(intptr_t)arg;
+    taskpool_worker = w;
+    for (;;) {
+        int id = atomic_load(&taskpool.queued) > 0 ? taskpool_take(w) : -1;
+        if (id >= 0) {
+            taskpool_run(id, w);
+            continue;
+        }
+        pthread_mutex_lock(&taskpool.lock);
+        while (atomic_load(&taskpool.queued) == 0 && !taskpool.quit) {
+            taskpool.idle++;
+            pthread_cond_wait(&taskpool.work, &taskpool.lock);
+            taskpool.idle--;
+        }
+        int quit = taskpool.quit;
+        pthread_mutex_unlock(&taskpool.lock);
+        if (quit)
+            break;
+    }
+    return NULL;
+}
+
+// Start the threads (once)
+static enum RESULT taskpool_start() {
+    int i;
+    if (taskpool.thread_count > 0)
+        return RESULT_OK;
+    if (editorWakeInit() != RESULT_OK)
+        return RESULT_ERR;
+    pthread_mutex_init(&taskpool.lock, NULL);
+    pthread_cond_init(&taskpool.work, NULL);
+    pthread_cond_init(&taskpool.finished, NULL);
+    taskpool.free_head = -1;
+    for (i = TASKPOOL_TASKS_MAX - 1; i >= 0; i--) {
+        taskpool.tasks[i].next = taskpool.free_head;
+        taskpool.free_head = i;
+    }
+    taskpool.completed_head = -1;
+    taskpool.quit = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1 ? 1 : cpus > TASKPOOL_THREADS_MAX ? TASKPOOL_THREADS_MAX : (int)cpus;
+    for (i = 0; i < count; i++)
+        pthread_mutex_init(&taskpool.deques[i].lock, NULL);
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&taskpool.threads[i], NULL, taskpool_main, (void*)(intptr_t)i) != 0)
+            break;
+        taskpool.thread_count++;
+    }
+    return taskpool.thread_count > 0 ? RESULT_OK : RESULT_ERR;
+}
+
+// Threads in the pool (started if need be; 0 if it could not start)
+int taskpool_size() {
+    return taskpool_start() == RESULT_OK ? taskpool.thread_count : 0;
+}
+
+// Queue run(arg) at priority (enum taskPriority). token, group and done are optional.
+// Fails if the pool cannot start or all TASKPOOL_TASKS_MAX tasks are in use.
+enum RESULT taskpool_submit(void (*run)(void* arg, int worker), void (*done)(void* arg), void* arg, int priority,
+                            struct canceltoken* token, atomic_int* group) {
+    if (taskpool_start() != RESULT_OK)
+        return RESULT_ERR;
+    pthread_mutex_lock(&taskpool.lock);
+    int id = taskpool.free_head;
+    if (id >= 0)
+        taskpool.free_head = taskpool.tasks[id].next;
+    int d = taskpool_worker >= 0 ? taskpool_worker : taskpool.next_deque++ % taskpool.thread_count;
+    pthread_mutex_unlock(&taskpool.lock);
+    if (id < 0)
+        return RESULT_ERR;
+    struct task* task = &taskpool.tasks[id];
+    task->run = run;
+    task->done = done;
+    task->arg = arg;
+    task->token = token;
+    task->group = group;
+    if (group != NULL)
+        atomic_fetch_add(group, 1);
+
+    struct taskdeque* deque = &taskpool.deques[d];
+    atomic_fetch_add(&taskpool.queued, 1);  // Before it can be taken (queued never goes below 0)
+    pthread_mutex_lock(&deque->lock);
+    deque->ids[priority][(deque->head[priority] + deque->count[priority]) % TASKPOOL_TASKS_MAX] = id;
+    deque->count[priority]++;
+    pthread_mutex_unlock(&deque->lock);
+    pthread_mutex_lock(&taskpool.lock);
+    if (taskpool.idle > 0)
+        pthread_cond_signal(&taskpool.work);
+    pthread_mutex_unlock(&taskpool.lock);
+    return RESULT_OK;
+}
+
+// Wait until every task of group finished (main thread; done callbacks are not called)
+void taskpool_wait_group(atomic_int* group) {
+    if (taskpool.thread_count == 0)
+        return;  // Not started: no task was queued
+    pthread_mutex_lock(&taskpool.lock);
+    while (atomic_load(group) > 0)
+        pthread_cond_wait(&taskpool.finished, &taskpool.lock);
+    pthread_mutex_unlock(&taskpool.lock);
+}
+
+// Call the done callbacks of finished tasks (main loop)
+void taskpool_deliver() {
+    if (taskpool.thread_count == 0)
+        return;  // Not started (nor its lock)
+    for (;;) {
+        pthread_mutex_lock(&taskpool.lock);
+        int id = taskpool.completed_head;
+        if (id < 0) {
+            pthread_mutex_unlock(&taskpool.lock);
+            return;
+        }
+        struct task* task = &taskpool.tasks[id];
+        void (*done)(void*) = task->done;
+        void* arg = task->arg;
+        taskpool.completed_head = task->next;
+        task->next = taskpool.free_head;
+        taskpool.free_head = id;
+        pthread_mutex_unlock(&taskpool.lock);
+        done(arg);
+    }
+}
+
+// Stop the threads (at exit, once the work using them was stopped)
+void taskpool_stop() {
+    int i;
+    if (taskpool.thread_count == 0)
+        return;
+    pthread_mutex_lock(&taskpool.lock);
+    taskpool.quit = 1;
+    pthread_cond_broadcast(&taskpool.work);
+    pthread_mutex_unlock(&taskpool.lock);
+    for (i = 0; i < taskpool.thread_count; i++)
+        pthread_join(taskpool.threads[i], NULL);
+    taskpool.thread_count = 0;
+}
+
+// *** Scheduler Implementation ***
+// Long operations on the buffer (building the word index, :s) run on the main thread,
+// where they may touch textbuf, as jobs split into small steps. While keys are not
+// waiting, editorWaitInput hands the jobs a slice of SCHED_SLICE_US: steps run round
+// robin until it is used up or a key arrives, so keys always come first and the screen
+// is redrawn between slices. No worker thread is needed for any of it.
+
+static long long sched_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Add a job (a job already added with the same step and ctx is not added again)
+enum RESULT sched_add(int (*step)(void* ctx), void* ctx) {
+    int i;
+    for (i = 0; i < sched.count; i++) {
+        if (sched.jobs[i].step == step && sched.jobs[i].ctx == ctx)
+            return RESULT_OK;
+    }
+    if (sched.count == SCHED_JOBS_MAX)
+        return RESULT_ERR;
+    sched.jobs[sched.count].step = step;
+    sched.jobs[sched.count].ctx = ctx;
+    sched.count++;
+    return RESULT_OK;
+}
+
+// Drop a job (done, or given up)
+void sched_remove(int (*step)(void* ctx), void* ctx) {
+    int i;
+    for (i = 0; i < sched.count; i++) {
+        if (sched.jobs[i].step == step && sched.jobs[i].ctx == ctx) {
+            memmove(&sched.jobs[i], &sched.jobs[i + 1], (sched.count - i - 1) * sizeof(sched.jobs[0]));
+            sched.count--;
+            if (sched.next > i)
+                sched.next--;
+            return;
+        }
+    }
+}
+
+// 1 while there are jobs
+int sched_pending() {
+    return sched.count > 0;
+}
+
+// A key can be read
+static int sched_key_waiting() {
+    struct pollfd pfd;
+    if (typeahead_pending())
+        return 1;
+    pfd.fd = term_in_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// Run job steps for one slice. Returns 1 if the screen should be redrawn (a job ended,
+// or SCHED_REDRAW_MS passed since the last redraw for progress).
+int sched_run_slice() {
+    long long start = sched_now_us();
+    int ended = 0;
+    while (sched.count > 0) {
+        if (sched.next >= sched.count)
+            sched.next = 0;
+        struct schedjob job = sched.jobs[sched.next];
+        if (job.step(job.ctx)) {
+            sched.next++;
+        } else {
+            sched_remove(job.step, job.ctx);
+            ended = 1;
+        }
+        if (sched_now_us() - start >= SCHED_SLICE_US || sched_key_waiting())
+            break;
+    }
+    long long now_ms = sched_now_us() / 1000;
+    if (ended || now_ms - sched.redraw_ms >= SCHED_REDRAW_MS) {
+        sched.redraw_ms = now_ms;
+        return 1;
+    }
+    return 0;
+}
+
+// *** Directory Walk Implementation ***
+// :grep and :find walk a directory tree on the task pool. Each directory to read is a
+// task; its path waits in a ring shared by the walk's tasks. A directory is read with
+// getdents64 (the entry type comes with the name, so files need no stat) and its regular
+// files are handed to the walk's on_file. Hidden entries (.git etc.) are skipped and
+// symlinks not followed.
+
+// Directory entry as returned by getdents64
+struct walkdirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static void treewalk_task(void* arg, int worker);
+
+// Queue a directory as a task of the walk, 0 if the ring or the pool is full or (unless
+// capped is 0) the walk has WALK_TASKS_MAX directories queued already: the pool stays
+// free for other work
+static int treewalk_queue(struct treewalk* w, const char* path, int capped) {
+    int len = (int)strlen(path) + 1;
+    int i;
+    if (capped && atomic_load(&w->tasks) >= WALK_TASKS_MAX)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->dirq_used + len > WALK_DIRQ_SIZE) {
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+    }
+    int tail = (w->dirq_head + w->dirq_used) % WALK_DIRQ_SIZE;
+    for (i = 0; i < len; i++)
+        w->dirq[(tail + i) % WALK_DIRQ_SIZE] = path[i];
+    // The task cannot take a path before the lock is released
+    int queued = taskpool_submit(treewalk_task, NULL, w, w->priority, &w->cancel, &w->tasks) == RESULT_OK;
+    if (queued)
+        w->dirq_used += len;
+    pthread_mutex_unlock(&w->lock);
+    return queued;
+}
+
+// Take the oldest queued directory (locked, dirq not empty)
+static void treewalk_pop(struct treewalk* w, char* out) {
+    int len = 0;
+    while ((out[len] = w->dirq[(w->dirq_head + len) % WALK_DIRQ_SIZE]) != '\0')
+        len++;
+    len++;
+    w->dirq_head = (w->dirq_head + len) % WALK_DIRQ_SIZE;
+    w->dirq_used -= len;
+}
+
+static atomic_int treewalk_waiting;  // Pool threads waiting in treewalk_wait_queue
+
+// Queue a directory WALK_NEST_MAX levels below a task's own: wait until the ring and the
+// pool have room. A pool thread waits only while another one is free to run the queued
+// directories (and so make room); 0 if this one is the last (or cancelled meanwhile).
+static int treewalk_wait_queue(struct treewalk* w, const char* path) {
+    while (!cancel_token_cancelled(&w->cancel)) {
+        if (atomic_fetch_add(&treewalk_waiting, 1) + 1 >= taskpool.thread_count) {
+            atomic_fetch_sub(&treewalk_waiting, 1);
+            return 0;
+        }
+        usleep(WALK_WAIT_US);
+        atomic_fetch_sub(&treewalk_waiting, 1);
+        if (treewalk_queue(w, path, 0))
+            return 1;
+    }
+    return 0;
+}
+
+// Read a directory: hand over its files and queue its subdirectories. When they cannot
+// be queued they are read here, but at most 2 * WALK_NEST_MAX levels deep (each level
+// takes WALK_DENTS_SIZE + PATH_MAX of stack): past that the directory is left out.
+static void treewalk_dir(struct treewalk* w, const char* path, void* local, int nest) {
+    char buf[WALK_DENTS_SIZE];
+    char child[PATH_MAX];
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        long pos;
+        for (pos = 0; pos < n && !cancel_token_cancelled(&w->cancel); ) {
+            struct walkdirent* d = (struct walkdirent*)(buf + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.')
+                continue;  // ., .. and hidden entries
+            int type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG)
+                continue;  // Symlinks (no loops), devices, sockets...
+            int len = strcmp(path, ".") == 0 ? snprintf(child, sizeof(child), "%s", d->d_name)
+                                             : snprintf(child, sizeof(child), "%s/%s", path, d->d_name);
+            if (len >= (int)sizeof(child))
+                continue;
+            if (type == DT_REG) {
+                w->on_file(fd, d->d_name, child, local);
+                continue;
+            }
+            if (treewalk_queue(w, child, nest < WALK_NEST_MAX) || (nest >= WALK_NEST_MAX && treewalk_wait_queue(w, child)))
+                continue;
+            if (nest < 2 * WALK_NEST_MAX)
+                treewalk_dir(w, child, local, nest + 1);  // Ring, pool or the walk's share full: read it here
+            else if (!cancel_token_cancelled(&w->cancel))
+                atomic_fetch_add(&w->skipped, 1);
+        }
+        if (cancel_token_cancelled(&w->cancel))
+            break;
+    }
+    close(fd);
+}
+
+// Task of a queued directory: read one of them (each task has a path in the ring)
+static void treewalk_task(void* arg, int worker) {
+    struct treewalk* w = arg;
+    char path[PATH_MAX];
+    pthread_mutex_lock(&w->lock);
+    int have = w->dirq_used > 0;
+    if (have)
+        treewalk_pop(w, path);
+    pthread_mutex_unlock(&w->lock);
+    if (!have)
+        return;
+    void* local = w->locals + (size_t)worker * w->local_size;
+    treewalk_dir(w, path, local, 0);
+    if (w->on_dir_done != NULL)
+        w->on_dir_done(local);
+}
+
+// Set up a walk before its first start: its lock and what is called for its entries
+static void treewalk_init(struct treewalk* w, void (*on_file)(int dir_fd, const char* name, const char* path, void* local),
+                          void (*on_dir_done)(void* local)) {
+    pthread_mutex_init(&w->lock, NULL);
+    w->on_file = on_file;
+    w->on_dir_done = on_dir_done;
+}
+
+// Start walking root with tasks of priority. locals holds local_size bytes of state per
+// pool thread (TASKPOOL_THREADS_MAX of them), passed to on_file.
+static enum RESULT treewalk_start(struct treewalk* w, const char* root, int priority, void* locals, int local_size) {
+    cancel_token_reset(&w->cancel);
+    atomic_store(&w->skipped, 0);
+    w->dirq_head = 0;
+    w->dirq_used = 0;
+    w->priority = priority;
+    w->locals = locals;
+    w->local_size = local_size;
+    if (!treewalk_queue(w, root, 0))
+        return RESULT_ERR;
+    w->started = 1;
+    return RESULT_OK;
+}
+
+// Ask the walk's tasks to stop soon (those not started are skipped)
+static void treewalk_cancel(struct treewalk* w) {
+    cancel_token_cancel(&w->cancel);
+}
+
+// 1 once no directory task of the walk is left
+static int treewalk_finished(struct treewalk* w) {
+    return atomic_load(&w->tasks) == 0;
+}
+
+// Cancel the walk (if it is still going) and wait for its tasks
+static void treewalk_stop(struct treewalk* w) {
+    if (!w->started)
+        return;
+    treewalk_cancel(w);
+    taskpool_wait_group(&w->tasks);
+    w->started = 0;
+}
+
+// *** Project Grep Implementation ***
+// :grep searches every file below a directory for a fixed string. Files are mapped and
+// scanned with memchr (vectorized in libc). Matches stream into grep.results while the
+// user keeps editing, the status line follows the search, and :cn/:cp step through
+// the list.
+
+// Matches of one file, gathered by a thread before they go into the list
+struct grepbatch {
+    int count;
+    int text_len;
+    int line[GREP_BATCH_MAX];
+    int col[GREP_BATCH_MAX];
+    int text[GREP_BATCH_MAX];  // Offsets into text
+    char text_buf[GREP_BATCH_MAX * (GREP_TEXT_MAX + 1)];
+};
+
+// Copy s into the arena, returns its offset or -1 when the arena is full (locked)
+static int grep_arena_add(const char* s, int len) {
+    if (grep.arena_len + len + 1 > GREP_ARENA_SIZE)
+        return -1;
+    int offset = grep.arena_len;
+    memcpy(grep.arena + offset, s, len);
+    grep.arena[offset + len] = '\0';
+    grep.arena_len += len + 1;
+    return offset;
+}
+
+// Move a thread's matches into the results list
+static void grep_flush_batch(const char* path, struct grepbatch* b) {
+    int i;
+    if (b->count == 0)
+        return;
+    pthread_mutex_lock(&grep.lock);
+    int path_offset = grep_arena_add(path, (int)strlen(path));
+    for (i = 0; i < b->count && !grep.full; i++) {
+        int text_offset = path_offset < 0 ? -1 : grep_arena_add(b->text_buf + b->text[i], (int)strlen(b->text_buf + b->text[i]));
+        if (text_offset < 0 || grep.result_count == GREP_RESULTS_MAX) {
+            grep.full = 1;
+            treewalk_cancel(&grep.walk);
+            break;
+        }
+        struct grepresult* r = &grep.results[grep.result_count++];
+        r->path = path_offset;
+        r->text = text_offset;
+        r->line = b->line[i];
+        r->col = b->col[i];
+    }
+    pthread_mutex_unlock(&grep.lock);
+    b->count = 0;
+    b->text_len = 0;
+    editorWake();
+}
+
+// Search one file, one result per matching line (on_file of the walk)
+static void grep_file(int dir_fd, const char* name, const char* path, void* local) {
+    struct grepbatch* b = local;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < grep.pattern_len || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    madvise((void*)map, size, MADV_SEQUENTIAL);
+
+    const char* end = map + size;
+    if (memchr(map, '\0', size < GREP_BINARY_PEEK ? size : GREP_BINARY_PEEK) == NULL) {
+        const char* p = map;
+        const char* line_start = map;  // Start of the line containing p
+        int line = 1;
+        const char* last = end - grep.pattern_len + 1;  // Matches start before this
+        char first = grep.pattern[0];
+        while (p < last && !cancel_token_cancelled(&grep.walk.cancel)) {
+            const char* stop = last - p > GREP_SCAN_STEP ? p + GREP_SCAN_STEP : last;
+            const char* hit = memchr(p, first, stop - p);
+            if (hit == NULL) {
+                p = stop;  // Look at the token again before the next step
+                continue;
+            }
+            if (memcmp(hit, grep.pattern, grep.pattern_len) != 0) {
+                p = hit + 1;
+                continue;
+            }
+            // Count the lines up to the match
+            const char* nl;
+            while ((nl = memchr(line_start, '\n', hit - line_start)) != NULL) {
+                line_start = nl + 1;
+                line++;
+            }
+            const char* line_end = memchr(hit, '\n', end - hit);
+            if (line_end == NULL)
+                line_end = end;
+            int text_len = (int)(line_end - line_start);
+            if (text_len > GREP_TEXT_MAX)
+                text_len = GREP_TEXT_MAX;
+            if (b->count == GREP_BATCH_MAX)
+                grep_flush_batch(path, b);
+            b->line[b->count] = line;
+            b->col[b->count] = (int)(hit - line_start);
+            b->text[b->count] = b->text_len;
+            memcpy(b->text_buf + b->text_len, line_start, text_len);
+            b->text_buf[b->text_len + text_len] = '\0';
+            b->text_len += text_len + 1;
+            b->count++;
+            if (line_end == end)
+                break;
+            p = line_start = line_end + 1;  // Next line
+            line++;
+        }
+    }
+    munmap((void*)map, size);
+    grep_flush_batch(path, b);
+    pthread_mutex_lock(&grep.lock);
+    grep.files++;
+    pthread_mutex_unlock(&grep.lock);
+}
+
+static struct grepbatch grep_batches[TASKPOOL_THREADS_MAX];  // Per pool thread
+
+// Cancel a running search and wait for its tasks
+void grep_stop() {
+    treewalk_stop(&grep.walk);
+}
+
+// Ctrl-C: stop a running search, keeping the results found so far; 0 if none ran
+int grep_interrupt() {
+    char msg[STATUS_BUF_SIZE];
+    if (!grep.walk.started)
+        return 0;
+    grep_stop();
+    snprintf(msg, sizeof(msg), "grep: interrupted: %d match%s in %lld files (:cn/:cp to visit)", grep.result_count,
+             grep.result_count == 1 ? "" : "es", grep.files);
+    editorSetStatusMessage(msg);
+    return 1;
+}
+
+// Start searching the files below dir for pattern (replacing the previous results)
+void grep_start(const char* pattern, int pattern_len, const char* dir) {
+    if (server_mode) {
+        editorSetStatusMessage("grep: not available in server mode");
+        return;
+    }
+    if (pattern_len == 0 || pattern_len >= (int)sizeof(grep.pattern)) {
+        editorSetStatusMessage("grep: pattern missing or too long");
+        return;
+    }
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        editorSetStatusMessage("grep: not a directory");
+        return;
+    }
+    if (grep.walk.on_file == NULL) {
+        pthread_mutex_init(&grep.lock, NULL);
+        treewalk_init(&grep.walk, grep_file, NULL);
+    }
+    grep_stop();
+    if (editorWakeInit() != RESULT_OK) {
+        editorSetStatusMessage("grep: pipe failed");
+        return;
+    }
+
+    // No tasks are running: reset without the lock
+    memcpy(grep.pattern, pattern, pattern_len);
+    grep.pattern_len = pattern_len;
+    grep.show_progress = 1;
+    grep.current = -1;
+    grep.files = 0;
+    grep.result_count = 0;
+    grep.arena_len = 0;
+    grep.full = 0;
+    if (treewalk_start(&grep.walk, dir, TASK_BACKGROUND, grep_batches, sizeof(grep_batches[0])) != RESULT_OK) {
+        editorSetStatusMessage("grep: could not start search tasks");
+        return;
+    }
+    editorSetStatusMessage("grep: searching...");
+}
+
+// Background progress: update the status line, and end the walk once the search ended
+void grep_update() {
+    char msg[STATUS_BUF_SIZE];
+    if (!grep.walk.started)
+        return;
+    pthread_mutex_lock(&grep.lock);
+    int count = grep.result_count;
+    long long files = grep.files;
+    pthread_mutex_unlock(&grep.lock);
+    int finished = treewalk_finished(&grep.walk);
+    if (finished)
+        grep_stop();
+    if (!grep.show_progress && !finished)
+        return;  // Leave the user's :cn/:cp position on the status line
+    if (finished)
+        snprintf(msg, sizeof(msg), "grep: %d match%s in %lld files%s (:cn/:cp to visit)", count, count == 1 ? "" : "es", files,
+                 grep.full ? ", list full" : atomic_load(&grep.walk.skipped) > 0 ? ", too deep in places" : "");
+    else
+        snprintf(msg, sizeof(msg), "grep: %d match%s in %lld files, searching...", count, count == 1 ? "" : "es", files);
+    editorSetStatusMessage(msg);
+}
+
+// :cn / :cp: open the next or previous result
+void grep_next(int dir) {
+    char msg[STATUS_BUF_SIZE];
+    if (grep.walk.on_file == NULL) {
+        editorSetStatusMessage("grep: no results");  // No search yet (nor its lock)
+        return;
+    }
+    pthread_mutex_lock(&grep.lock);
+    int count = grep.result_count;
+    int index = grep.current + dir;
+    struct grepresult r = {0, 0, 0, 0};
+    if (index >= 0 && index < count)
+        r = grep.results[index];  // Arena text behind it is never rewritten while searching
+    pthread_mutex_unlock(&grep.lock);
+    if (count == 0) {
+        editorSetStatusMessage("grep: no results");
+        return;
+    }
+    if (index < 0 || index >= count) {
+        editorSetStatusMessage(dir > 0 ? "grep: no more results" : "grep: at the first result");
+        return;
+    }
+    const char* path = grep.arena + r.path;
+    if (!is_open_file(path)) {
+        if (textbuf.dirty) {
+            editorSetStatusMessage("grep: result is in another file; save first");
+            return;
+        }
+        if (editorOpen(path) != RESULT_OK)
+            return;
+    }
+    grep.current = index;
+    grep.show_progress = 0;
+    struct bufchunk* chunk;
+    int rel_i, abs_i;
+    if (bufclient_find_line_start(&textbuf, r.line - 1, &chunk, &rel_i, &abs_i) == RESULT_OK)
+        bufclient_move_cursor_to(&textbuf, abs_i + r.col <= textbuf.size ? abs_i + r.col : textbuf.size);
+    snprintf(msg, sizeof(msg), "(%d of %d) %s:%d: %s", index + 1, count, path, r.line, grep.arena + r.text);
+    editorSetStatusMessage(msg);
+}
+
+// *** Fuzzy File Finder Implementation ***
+// Typing ":find <query>" lists the files below the current directory whose path holds
+// the query's characters in order, best first, above the command line; Enter opens the
+// selected one. The file list is built once by a background walk. Each path carries a
+// 64-bit mask of the characters in it, so most paths are rejected with one AND before
+// the scorer looks at their text. Scoring is split into tasks of the task pool, and a
+// query that only grew re-scores the previous matches instead of every path.
+
+static unsigned char find_fold[256];  // tolower() of each byte (set up by find_index_start)
+
+// Bit of c in the character masks (letters case-folded, other bytes share the top bits)
+static int find_char_bit(unsigned char c) {
+    c = (unsigned char)tolower(c);
+    if (c >= 'a' && c <= 'z')
+        return c - 'a';
+    if (c >= '0' && c <= '9')
+        return 26 + c - '0';
+    return 36 + c % 28;
+}
+
+static uint64_t find_mask(const char* s, int len) {
+    uint64_t mask = 0;
+    int i;
+    for (i = 0; i < len; i++)
+        mask |= (uint64_t)1 << find_char_bit((unsigned char)s[i]);
+    return mask;
+}
+
+// Score path for the lowercase query q, -1 if q is not a subsequence of it. The query
+// is matched from the end of the path backwards, so it lands in the file name when it
+// can; matches at word starts, in runs and in the file name score higher, and shorter
+// paths win ties.
+static int find_score(const char* path, int len, const char* q, int qlen) {
+    int i = len - 1;
+    int k = qlen - 1;
+    int score = 0;
+    int last = -1;
+    int in_name = 2;  // Bonus while still in the file name
+    for (; k >= 0 && i >= 0; i--) {
+        unsigned char c = (unsigned char)path[i];
+        if (c == '/')
+            in_name = 0;
+        if (find_fold[c] != (unsigned char)q[k])
+            continue;
+        unsigned char prev = i > 0 ? (unsigned char)path[i - 1] : '/';
+        score += 1 + in_name;
+        if (prev == '/' || prev == '_' || prev == '-' || prev == '.' || prev == ' ' || (islower(prev) && isupper(c)))
+            score += 8;  // Word start
+        if (last == i + 1)
+            score += 8;  // Run
+        last = i;
+        k--;
+    }
+    if (k >= 0)
+        return -1;
+    return score * 256 + 255 - (len < 255 ? len : 255);
+}
+
+// Insert path index idx with score into a best-first list of at most FIND_SHOWN
+static void find_top_add(int* top, int* top_score, int* count, int idx, int score) {
+    int j = *count < FIND_SHOWN ? (*count)++ : FIND_SHOWN;
+    if (j == FIND_SHOWN && (score < top_score[j - 1] || (score == top_score[j - 1] && idx > top[j - 1])))
+        return;
+    if (j == FIND_SHOWN)
+        j--;
+    while (j > 0 && (score > top_score[j - 1] || (score == top_score[j - 1] && idx < top[j - 1]))) {
+        top[j] = top[j - 1];
+        top_score[j] = top_score[j - 1];
+        j--;
+    }
+    top[j] = idx;
+    top_score[j] = score;
+}
+
+// Score slice t of the current job: keep the matching paths (compacted to the start of
+// the slice's part of out) and note the slice's best ones
+static void find_score_slice(int t) {
+    int a = (int)((long long)findpool.n * t / findpool.parts);
+    int b = (int)((long long)findpool.n * (t + 1) / findpool.parts);
+    uint64_t qmask = finder.query_mask;
+    int kept = 0;
+    int i;
+    findpool.top_count[t] = 0;
+    for (i = a; i < b; i++) {
+        int idx = findpool.from_list ? finder.matches[i] : findpool.base + i;
+        if ((finder.masks[idx] & qmask) != qmask)
+            continue;  // Some query character is nowhere in the path
+        const char* path = finder.arena + finder.paths[idx];
+        int score = find_score(path, (int)strlen(path), finder.query, finder.query_len);
+        if (score < 0)
+            continue;
+        findpool.out[a + kept++] = idx;
+        find_top_add(findpool.top[t], findpool.top_score[t], &findpool.top_count[t], idx, score);
+    }
+    findpool.slice_count[t] = kept;
+}
+
+// Score slice t unless someone took it already
+static void find_claim_slice(int t) {
+    if (atomic_exchange(&findpool.claimed[t], 1) == 0)
+        find_score_slice(t);
+}
+
+// Task of slice arg
+static void find_score_task(void* arg, int worker) {
+    (void)worker;
+    find_claim_slice((int)(intptr_t)arg);
+}
+
+// Score n paths (finder.matches[0..n) if from_list, else paths base..base+n) and put
+// the matching ones in finder.matches from out on; merges the best into finder.shown
+static void find_score_paths(int n, int from_list, int base, int out) {
+    int t;
+    if (n == 0)
+        return;
+    findpool.n = n;
+    findpool.from_list = from_list;
+    findpool.base = base;
+    findpool.out = finder.matches + out;
+    findpool.parts = n < FIND_PARALLEL_MIN ? 1 : taskpool_size() + 1;
+    if (findpool.parts > FIND_THREADS_MAX)
+        findpool.parts = FIND_THREADS_MAX;
+    for (t = 0; t < findpool.parts; t++)
+        atomic_store(&findpool.claimed[t], t == 0);
+    for (t = 1; t < findpool.parts; t++) {
+        if (taskpool_submit(find_score_task, NULL, (void*)(intptr_t)t, TASK_INTERACTIVE, NULL, &findpool.tasks) != RESULT_OK)
+            find_claim_slice(t);
+    }
+    find_score_slice(0);  // The main thread takes a slice too
+    for (t = 1; t < findpool.parts; t++)
+        find_claim_slice(t);  // and those the pool has not started (busy with other work)
+    taskpool_wait_group(&findpool.tasks);
+
+    // Close the gaps between the slices' matches, then merge their best
+    int kept = 0;
+    for (t = 0; t < findpool.parts; t++) {
+        int a = (int)((long long)n * t / findpool.parts);
+        memmove(findpool.out + kept, findpool.out + a, findpool.slice_count[t] * sizeof(int));
+        kept += findpool.slice_count[t];
+    }
+    finder.match_count = out + kept;
+    for (t = 0; t < findpool.parts; t++) {
+        int j;
+        for (j = 0; j < findpool.top_count[t]; j++)
+            find_top_add(finder.shown, finder.shown_score, &finder.shown_count, findpool.top[t][j], findpool.top_score[t][j]);
+    }
+}
+
+// Score the paths indexed since the last scoring
+static void find_catch_up() {
+    pthread_mutex_lock(&finder.lock);
+    int count = finder.count;
+    pthread_mutex_unlock(&finder.lock);
+    find_score_paths(count - finder.scored, 0, finder.scored, finder.match_count);
+    finder.scored = count;
+}
+
+// Paths a walk thread found, before they go into the index
+struct findbatch {
+    int count;
+    int len;
+    int offsets[FIND_BATCH_MAX];
+    uint64_t masks[FIND_BATCH_MAX];
+    char buf[FIND_BATCH_MAX * 256];
+};
+
+// Move a thread's paths into the index (also on_dir_done of the walk)
+static void find_flush_batch(void* local) {
+    struct findbatch* b = local;
+    int i;
+    if (b->count == 0)
+        return;
+    pthread_mutex_lock(&finder.lock);
+    for (i = 0; i < b->count; i++) {
+        const char* path = b->buf + b->offsets[i];
+        int len = (int)strlen(path) + 1;
+        if (finder.count == FIND_FILES_MAX || finder.arena_len + len > FIND_ARENA_SIZE) {
+            finder.full = 1;
+            treewalk_cancel(&finder.walk);
+            break;
+        }
+        memcpy(finder.arena + finder.arena_len, path, len);
+        finder.paths[finder.count] = finder.arena_len;
+        finder.masks[finder.count] = b->masks[i];
+        finder.arena_len += len;
+        finder.count++;
+    }
+    pthread_mutex_unlock(&finder.lock);
+    b->count = 0;
+    b->len = 0;
+    editorWake();
+}
+
+// Add a file to the index (on_file of the walk)
+static void find_add_file(int dir_fd, const char* name, const char* path, void* local) {
+    struct findbatch* b = local;
+    int len = (int)strlen(path);
+    (void)dir_fd;
+    (void)name;
+    if (b->count == FIND_BATCH_MAX || b->len + len + 1 > (int)sizeof(b->buf))
+        find_flush_batch(b);
+    memcpy(b->buf + b->len, path, len + 1);
+    b->offsets[b->count] = b->len;
+    b->masks[b->count] = find_mask(path, len);
+    b->len += len + 1;
+    b->count++;
+}
+
+static struct findbatch find_batches[TASKPOOL_THREADS_MAX];  // Per pool thread
+
+// Start the walk that builds the index (once)
+static void find_index_start() {
+    int i;
+    if (finder.started)
+        return;
+    if (finder.walk.on_file == NULL) {  // Before anything takes the lock
+        pthread_mutex_init(&finder.lock, NULL);
+        treewalk_init(&finder.walk, find_add_file, find_flush_batch);
+    }
+    if (editorWakeInit() != RESULT_OK)
+        return;
+    finder.started = 1;
+    for (i = 0; i < 256; i++)
+        find_fold[i] = (unsigned char)tolower(i);
+    treewalk_start(&finder.walk, ".", TASK_VISIBLE, find_batches, sizeof(find_batches[0]));
+}
+
+// The command line changed: (re)score the paths if it holds a :find query
+void finder_on_cmdline() {
+    char query[CMD_BUF_SIZE];
+    int query_len = 0;
+    const char* p;
+    if (mode != MODE_COMMAND || strncmp(cmdbuf, "find ", 5) != 0 || server_mode) {
+        finder.active = 0;
+        return;
+    }
+    if (!finder.active) {
+        finder.active = 1;
+        finder.query_len = -1;
+        find_index_start();
+    }
+    for (p = cmdbuf + 5; *p; p++) {
+        if (!isspace((unsigned char)*p))
+            query[query_len++] = (char)tolower((unsigned char)*p);
+    }
+    int grew = finder.query_len >= 0 && query_len >= finder.query_len && memcmp(query, finder.query, finder.query_len) == 0;
+    if (grew && query_len == finder.query_len)
+        return;  // Same query
+    memcpy(finder.query, query, query_len);
+    finder.query_len = query_len;
+    finder.query_mask = find_mask(query, query_len);
+    finder.shown_count = 0;
+    finder.selected = 0;
+    if (grew) {
+        find_score_paths(finder.match_count, 1, 0, 0);  // Only paths that matched before can match now
+    } else {
+        finder.match_count = 0;
+        finder.scored = 0;
+    }
+    find_catch_up();
+}
+
+// Background progress: take in newly indexed paths
+void finder_update() {
+    if (finder.walk.started && treewalk_finished(&finder.walk))
+        treewalk_stop(&finder.walk);
+    if (finder.active)
+        find_catch_up();
+}
+
+// Move the selection: +1 goes up the list (to worse matches)
+void finder_select(int dir) {
+    if (!finder.active || finder.shown_count == 0)
+        return;
+    finder.selected += dir;
+    if (finder.selected < 0)
+        finder.selected = 0;
+    if (finder.selected >= finder.shown_count)
+        finder.selected = finder.shown_count - 1;
+}
+
+// Enter on a :find query: open the selected file
+void finder_open() {
+    if (server_mode) {
+        editorSetStatusMessage("find: not available in server mode");
+        return;
+    }
+    if (!finder.active || finder.shown_count == 0) {
+        finder.active = 0;
+        editorSetStatusMessage("find: no matching file");
+        return;
+    }
+    const char* path = finder.arena + finder.paths[finder.shown[finder.selected]];
+    finder.active = 0;
+    if (is_open_file(path))
+        return;
+    if (textbuf.dirty) {
+        editorSetStatusMessage("Unsaved changes! Save before opening another file.");
+        return;
+    }
+    editorOpen(path);  // Status set by open
+}
+
+// Draw the matches over the bottom rows of the text area, best one lowest
+void finder_draw() {
+    char header[64];
+    int rows = FIND_SHOWN + 1 <= screenrows ? FIND_SHOWN + 1 : screenrows;
+    int j;
+    if (!finder.active || rows < 1)
+        return;
+    screen_draw_y = screenrows - rows;
+    screen_draw_x = 0;
+    int len = snprintf(header, sizeof(header), "  %d of %d files%s", finder.match_count, finder.scored,
+                       finder.walk.started ? " (indexing...)" : finder.full ? " (index full)"
+                                           : finder.interrupted ? " (index interrupted)"
+                                           : atomic_load(&finder.walk.skipped) > 0 ? " (tree too deep in places)" : "");
+    screen_put(header, len < screencols ? len : screencols);
+    screen_next_row();
+    for (j = rows - 2; j >= 0; j--) {
+        if (j < finder.shown_count && screencols > 2) {
+            const char* path = finder.arena + finder.paths[finder.shown[j]];
+            int path_len = (int)strlen(path);
+            if (path_len > screencols - 2)
+                path_len = screencols - 2;
+            if (j == finder.selected)
+                screen_set_attr(ATTR_REVERSE);
+            screen_put(j == finder.selected ? "> " : "  ", 2);
+            screen_put(path, path_len);
+            screen_set_attr(ATTR_NORMAL);
+        }
+        screen_next_row();
+    }
+}
+
+// Stop the index walk
+void finder_stop() {
+    treewalk_stop(&finder.walk);
+}
+
+// Ctrl-C: stop indexing, keeping the paths found so far; 0 if the index was not being built
+int finder_interrupt() {
+    char msg[STATUS_BUF_SIZE];
+    if (!finder.walk.started)
+        return 0;
+    finder_stop();
+    finder.interrupted = 1;
+    if (finder.active)
+        find_catch_up();
+    snprintf(msg, sizeof(msg), "find: indexing interrupted after %d files", finder.count);
+    editorSetStatusMessage(msg);
+    return 1;
+}
+
+// *** Diff Implementation ***
+// :diffsaved marks the lines of the buffer that differ from the saved file in a gutter
+// left of the text ('+' added, '~' changed, '-' lines deleted above, '_' deleted below
+// the last line). The marks follow edits: they are recomputed before a frame when the
+// buffer or the file changed. The line hashes of both sides are kept between diffs;
+// edits only re-hash the buffer lines they touched, the file is hashed again when it
+// changes. The lines both share at the start and at the end are skipped, the hashes of
+// the others compared with Myers' O(ND) algorithm in linear space: the middle snake of
+// each range splits it in two (bisection, as in diff-match-patch), until the pieces
+// are pure inserts or deletes. :diffsplit (below) uses the same engine; it skips the
+// bytes both texts share at the start and end (buffer chunks against the mapped file,
+// with memcmp) and hashes the lines in between.
+
+// Start a diff (results go to diff.hunks)
+static void diff_hunks_reset() {
+    diff.hunk_count = 0;
+    diff.overflow = 0;
+}
+
+// Append a hunk, merging it with the previous one if they touch
+static void diff_add_hunk(int a_start, int a_len, int b_start, int b_len) {
+    if (diff.hunk_count > 0) {
+        struct diffhunk* last = &diff.hunks[diff.hunk_count - 1];
+        if (last->a_start + last->a_len == a_start && last->b_start + last->b_len == b_start) {
+            last->a_len += a_len;
+            last->b_len += b_len;
+            return;
+        }
+    }
+    if (diff.hunk_count == DIFF_HUNKS_MAX) {
+        diff.overflow = 1;
+        return;
+    }
+    diff.hunks[diff.hunk_count].a_start = a_start;
+    diff.hunks[diff.hunk_count].a_len = a_len;
+    diff.hunks[diff.hunk_count].b_start = b_start;
+    diff.hunks[diff.hunk_count].b_len = b_len;
+    diff.hunk_count++;
+}
+
+static void diff_compare(const uint64_t* a, int a0, int a1, const uint64_t* b, int b0, int b1);
+
+// Find the middle snake of a[a0..a1) against b[b0..b1) and diff the halves on either
+// side of it (both ranges non-empty, no common prefix or suffix)
+static void diff_bisect(const uint64_t* a, int a0, int a1, const uint64_t* b, int b0, int b1) {
+    int n = a1 - a0;
+    int m = b1 - b0;
+    int max_d = (n + m + 1) / 2;
+    int v_offset = max_d;
+    int v_length = 2 * max_d;
+    int delta = n - m;
+    int front = delta & 1;  // Odd delta: the forward paths meet the reverse ones
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+    int* v1 = diff.v1;
+    int* v2 = diff.v2;
+    int d, i;
+    for (i = 0; i < v_length + 2; i++) {  // k runs over -d-1..d+1 around v_offset
+        v1[i] = -1;
+        v2[i] = -1;
+    }
+    v1[v_offset + 1] = 0;
+    v2[v_offset + 1] = 0;
+    for (d = 0; d < max_d && d < DIFF_COST_MAX; d++) {
+        int k;
+        // Forward paths
+        for (k = -d + k1start; k <= d - k1end; k += 2) {
+            int k1_offset = v_offset + k;
+            int x1;
+            if (k == -d || (k != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+                x1 = v1[k1_offset + 1];
+            else
+                x1 = v1[k1_offset - 1] + 1;
+            int y1 = x1 - k;
+            while (x1 < n && y1 < m && a[a0 + x1] == b[b0 + y1]) {
+                x1++;
+                y1++;
+            }
+            v1[k1_offset] = x1;
+            if (x1 > n) {
+                k1end += 2;  // Ran off the right of the graph
+            } else if (y1 > m) {
+                k1start += 2;  // Ran off the bottom
+            } else if (front) {
+                int k2_offset = v_offset + delta - k;
+                if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1 && x1 >= n - v2[k2_offset]) {
+                    diff_compare(a, a0, a0 + x1, b, b0, b0 + y1);
+                    diff_compare(a, a0 + x1, a1, b, b0 + y1, b1);
+                    return;
+                }
+            }
+        }
+        // Reverse paths (x2, y2 count from the ends)
+        for (k = -d + k2start; k <= d - k2end; k += 2) {
+            int k2_offset = v_offset + k;
+            int x2;
+            if (k == -d || (k != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+                x2 = v2[k2_offset + 1];
+            else
+                x2 = v2[k2_offset - 1] + 1;
+            int y2 = x2 - k;
+            while (x2 < n && y2 < m && a[a1 - x2 - 1] == b[b1 - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            v2[k2_offset] = x2;
+            if (x2 > n) {
+                k2end += 2;
+            } else if (y2 > m) {
+                k2start += 2;
+            } else if (!front) {
+                int k1_offset = v_offset + delta - k;
+                if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+                    int x1 = v1[k1_offset];
+                    int y1 = v_offset + x1 - k1_offset;
+                    if (x1 >= n - x2) {
+                        diff_compare(a, a0, a0 + x1, b, b0, b0 + y1);
+                        diff_compare(a, a0 + x1, a1, b, b0 + y1, b1);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+    // Nothing in common (or too different to be worth the search): one replacement
+    diff_add_hunk(a0, n, b0, m);
+}
+
+// Diff a[a0..a1) against b[b0..b1), appending hunks in order
+static void diff_compare(const uint64_t* a, int a0, int a1, const uint64_t* b, int b0, int b1) {
+    while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) {
+        a0++;
+        b0++;
+    }
+    while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) {
+        a1--;
+        b1--;
+    }
+    if (a0 == a1 && b0 == b1)
+        return;
+    if (a0 == a1 || b0 == b1) {
+        diff_add_hunk(a0, a1 - a0, b0, b1 - b0);
+        return;
+    }
+    diff_bisect(a, a0, a1, b, b0, b1);
+}
+
+// Hash of one line (FNV-1a); continued across chunk boundaries through h
+static uint64_t diff_hash_step(uint64_t h, const char* s, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hash the lines of s[0..len) into out, returns the line count or -1 if there are too many
+static int diff_hash_text(const char* s, size_t len, uint64_t* out, int max) {
+    int count = 0;
+    const char* end = s + len;
+    while (s < end) {
+        const char* nl = memchr(s, '\n', end - s);
+        const char* line_end = nl != NULL ? nl : end;
+        if (count == max)
+            return -1;
+        out[count++] = diff_hash_step(DIFF_HASH_SEED, s, (int)(line_end - s));
+        s = line_end + 1;
+    }
+    return count;
+}
+
+// Hash the lines of buf[start..end) into out (start at a line start), like diff_hash_text
+static int diff_hash_buffer(struct bufclient* buf, int start, int end, uint64_t* out, int max) {
+    struct bufchunk* chunk;
+    int rel_i;
+    int count = 0;
+    int in_line = 0;
+    uint64_t h = DIFF_HASH_SEED;
+    if (start >= end || bufclient_find_pos(buf, start, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    int left = end - start;
+    while (chunk != NULL && left > 0) {
+        int n = chunk->size - rel_i < left ? chunk->size - rel_i : left;
+        const char* s = chunk->data + rel_i;
+        const char* stop = s + n;
+        while (s < stop) {
+            const char* nl = memchr(s, '\n', stop - s);
+            const char* piece_end = nl != NULL ? nl : stop;
+            h = diff_hash_step(h, s, (int)(piece_end - s));
+            in_line = 1;
+            if (nl == NULL)
+                break;
+            if (count == max)
+                return -1;
+            out[count++] = h;
+            h = DIFF_HASH_SEED;
+            in_line = 0;
+            s = nl + 1;
+        }
+        left -= n;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    if (in_line) {
+        if (count == max)
+            return -1;
+        out[count++] = h;  // Last line without a newline
+    }
+    return count;
+}
+
+// Bytes at the start of buf equal to the start of s
+static int diff_common_prefix(struct bufclient* buf, const char* s, int len) {
+    struct bufchunk* chunk;
+    int done = 0;
+    for (chunk = buf->begin; chunk != NULL && done < len; chunk = chunk->next) {
+        int n = chunk->size < len - done ? chunk->size : len - done;
+        if (memcmp(chunk->data, s + done, n) == 0) {
+            done += n;  // Whole chunk equal
+            continue;
+        }
+        int i = 0;
+        while (chunk->data[i] == s[done + i])
+            i++;
+        return done + i;
+    }
+    return done;
+}
+
+// Bytes at the end of buf equal to the end of s (at most limit)
+static int diff_common_suffix(struct bufclient* buf, const char* s, int len, int limit) {
+    struct bufchunk* chunk;
+    int done = 0;
+    for (chunk = buf->rbegin; chunk != NULL && done < limit; chunk = chunk->prev) {
+        int n = chunk->size < limit - done ? chunk->size : limit - done;
+        if (memcmp(chunk->data + chunk->size - n, s + len - done - n, n) == 0) {
+            done += n;
+            continue;
+        }
+        int i = 0;
+        while (chunk->data[chunk->size - 1 - i] == s[len - done - 1 - i])
+            i++;
+        return done + i;
+    }
+    return done;
+}
+
+// Equal bytes at the start and end of buf and s[0..len), cut back to whole lines
+static void diff_trim(struct bufclient* buf, const char* s, int len, int* prefix_out, int* suffix_out) {
+    int min_len = len < buf->size ? len : buf->size;
+    int prefix = diff_common_prefix(buf, s, min_len);
+    int suffix = diff_common_suffix(buf, s, len, min_len - prefix);
+    while (prefix > 0 && s[prefix - 1] != '\n')
+        prefix--;
+    if (suffix > 0) {
+        // Start the suffix after its first newline: only then is it a line start in both
+        const char* nl = memchr(s + len - suffix, '\n', suffix);
+        suffix = nl != NULL ? (int)(s + len - (nl + 1)) : 0;
+    }
+    *prefix_out = prefix;
+    *suffix_out = suffix;
+}
+
+// Newlines in s[0..len)
+static int diff_count_lines(const char* s, int len) {
+    int count = 0;
+    const char* end = s + len;
+    const char* nl;
+    while ((nl = memchr(s, '\n', end - s)) != NULL) {
+        count++;
+        s = nl + 1;
+    }
+    return count;
+}
+
+// Hash the lines of the saved file into old_hash
+static void diff_hash_file() {
+    struct stat st;
+    diff.file_stale = 0;
+    diff.old_count = -1;
+    int fd = open(textbuf.filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1)
+            close(fd);
+        diff.file_size = -1;
+        return;  // No saved file (yet): nothing to compare against
+    }
+    diff.file_mtime = st.st_mtime;
+    diff.file_size = st.st_size;
+    if ((long long)st.st_size > (long long)INT_MAX) {
+        close(fd);
+        editorSetStatusMessage("diff: file too large");
+        return;
+    }
+    int file_len = (int)st.st_size;  // Of the file as opened (sized by fstat, not by name)
+    const char* map = "";
+    if (file_len > 0)
+        map = mmap(NULL, (size_t)file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    int n = diff_hash_text(map, (size_t)file_len, diff.old_hash, DIFF_LINES_MAX);
+    if (n >= 0 && (file_len == 0 || map[file_len - 1] == '\n')) {
+        if (n < DIFF_LINES_MAX)
+            diff.old_hash[n++] = DIFF_HASH_SEED;  // The empty line after it
+        else
+            n = -1;
+    }
+    if (file_len > 0)
+        munmap((void*)map, (size_t)file_len);
+    if (n < 0) {
+        editorSetStatusMessage("diff: too many lines");
+        return;
+    }
+    diff.old_count = n;
+}
+
+// Bring new_hash up to date with the buffer: hash the lines edited since, or all of them
+static enum RESULT diff_hash_edits() {
+    struct bufchunk* chunk;
+    int rel_i, start, end, n;
+    if (!diff.rehash && diff.new_lo < diff.new_hi) {
+        if (diff.new_hi > diff.new_count ||
+            bufclient_find_line_start(&textbuf, diff.new_lo, &chunk, &rel_i, &start) != RESULT_OK) {
+            diff.rehash = 1;  // Out of step with the buffer (cannot happen)
+        } else {
+            if (diff.new_hi == diff.new_count || bufclient_find_line_start(&textbuf, diff.new_hi, &chunk, &rel_i, &end) != RESULT_OK)
+                end = textbuf.size;
+            n = diff_hash_buffer(&textbuf, start, end, diff.new_hash + diff.new_lo, diff.new_hi - diff.new_lo);
+            if (n < 0)
+                diff.rehash = 1;
+            while (n >= 0 && diff.new_lo + n < diff.new_hi)
+                diff.new_hash[diff.new_lo + n++] = DIFF_HASH_SEED;  // Empty last line
+        }
+    }
+    diff.new_lo = INT_MAX;
+    diff.new_hi = 0;
+    if (!diff.rehash)
+        return RESULT_OK;
+    char last = '\n';
+    if (textbuf.size > 0)
+        bufclient_read(&textbuf, textbuf.size - 1, &last, 1);
+    n = diff_hash_buffer(&textbuf, 0, textbuf.size, diff.new_hash, DIFF_LINES_MAX);
+    if (n >= 0 && last == '\n') {
+        if (n == DIFF_LINES_MAX)
+            return RESULT_ERR;
+        diff.new_hash[n++] = DIFF_HASH_SEED;  // The empty line after it
+    }
+    if (n < 0)
+        return RESULT_ERR;
+    diff.new_count = n;
+    diff.rehash = 0;
+    return RESULT_OK;
+}
+
+// Recompute the marks of textbuf against its file
+static void diff_refresh() {
+    int i;
+    diff.stale = 0;
+    memset(diff.marks, 0, sizeof(diff.marks[0]) * (size_t)diff.line_count);
+    diff.line_count = 0;
+    diff.added = diff.changed = diff.deleted = 0;
+    diff_hunks_reset();
+    if (diff.file_stale)
+        diff_hash_file();
+    if (diff.old_count < 0)
+        return;
+    if (diff_hash_edits() != RESULT_OK) {
+        editorSetStatusMessage("diff: too many lines");
+        return;
+    }
+
+    // An empty line after the last newline is not compared (as if the file ended there)
+    const uint64_t* a = diff.old_hash;
+    const uint64_t* b = diff.new_hash;
+    int n = diff.old_count, m = diff.new_count, prefix = 0, suffix = 0;
+    if (n > 0 && a[n - 1] == DIFF_HASH_SEED)
+        n--;
+    if (m > 0 && b[m - 1] == DIFF_HASH_SEED)
+        m--;
+    // Skip the lines both share at the start and end, compare the rest
+    while (prefix < n && prefix < m && a[prefix] == b[prefix])
+        prefix++;
+    while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix])
+        suffix++;
+    diff_compare(a, prefix, n - suffix, b, prefix, m - suffix);
+
+    // Marks for the buffer lines
+    diff.line_count = m + 1;
+    for (i = 0; i < diff.hunk_count; i++) {
+        const struct diffhunk* h = &diff.hunks[i];
+        int line = h->b_start;
+        int j;
+        if (h->b_len == 0) {
+            if (h->b_start < m || line == 0)
+                diff.marks[line] |= DIFF_DELETED_ABOVE;
+            else
+                diff.marks[line - 1] |= DIFF_DELETED_BELOW;  // At the end of the buffer
+            diff.deleted += h->a_len;
+            continue;
+        }
+        // Pair up old and new lines as changed; the rest were added or deleted
+        int paired = h->a_len < h->b_len ? h->a_len : h->b_len;
+        for (j = 0; j < h->b_len; j++)
+            diff.marks[line + j] |= j < paired ? DIFF_CHANGED : DIFF_ADDED;
+        diff.changed += paired;
+        diff.added += h->b_len - paired;
+        if (h->a_len > h->b_len) {
+            diff.marks[line + h->b_len - 1] |= DIFF_DELETED_BELOW;
+            diff.deleted += h->a_len - h->b_len;
+        }
+    }
+}
+
+// Buffer edits (batched observer): move the hashes of the lines after each edit along
+// and note the lines it touched, for diff_hash_edits
+static void diff_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int d;
+    (void)buf;
+    (void)ctx;
+    diff.stale = 1;
+    for (d = 0; d < count && !diff.rehash; d++) {
+        const struct bufdelta* delta = &deltas[d];
+        int last = delta->end_line, new_last = delta->end_line + delta->line_delta;
+        if (last >= diff.new_count || diff.new_count + delta->line_delta > DIFF_LINES_MAX) {
+            diff.rehash = 1;
+            break;
+        }
+        if (new_last != last)
+            memmove(&diff.new_hash[new_last + 1], &diff.new_hash[last + 1], sizeof(diff.new_hash[0]) * (size_t)(diff.new_count - last - 1));
+        diff.new_count += delta->line_delta;
+        if (delta->line < diff.new_lo)
+            diff.new_lo = delta->line;
+        diff.new_hi = diff.new_hi > last + 1 ? diff.new_hi + delta->line_delta : new_last + 1;
+    }
+}
+
+static void diff_split_close();
+static void diff_split_update();
+
+// :diffsaved: show the differences to the saved file
+void diff_saved() {
+    char msg[STATUS_BUF_SIZE];
+    if (server_mode) {
+        editorSetStatusMessage("diff: not available in server mode");
+        return;
+    }
+    if (textbuf.filename[0] == '\0') {
+        editorSetStatusMessage("diff: buffer has no file");
+        return;
+    }
+    if (diffsplit.active)
+        diff_split_close();  // Shares the work space
+    if (!diff.active) {
+        diff.observer.notify = diff_on_edit;
+        diff.observer.batched = 1;
+        if (bufclient_observe(&textbuf, &diff.observer) != RESULT_OK) {
+            editorSetStatusMessage("diff: too many buffer observers");
+            return;
+        }
+        diff.active = 1;
+        diff.rehash = 1;
+        diff.new_lo = INT_MAX;
+        diff.new_hi = 0;
+    }
+    diff.file_stale = 1;
+    diff_refresh();
+    if (diff.file_size < 0)
+        snprintf(msg, sizeof(msg), "diff: \"%.60s\" is not saved yet", textbuf.filename);
+    else if (diff.hunk_count == 0)
+        snprintf(msg, sizeof(msg), "diff: no changes since the file was saved (:diffoff to hide)");
+    else
+        snprintf(msg, sizeof(msg), "diff: %d hunk%s, %d added, %d changed, %d deleted lines%s", diff.hunk_count,
+                 diff.hunk_count == 1 ? "" : "s", diff.added, diff.changed, diff.deleted, diff.overflow ? " (truncated)" : "");
+    editorSetStatusMessage(msg);
+}
+
+// :diffoff: hide the marks, close the split
+void diff_off() {
+    if (diffsplit.active)
+        diff_split_close();
+    if (diff.active) {
+        bufclient_unobserve(&textbuf, &diff.observer);
+        diff.active = 0;
+    }
+}
+
+// Before a frame: bring the marks (or the split) up to date with the buffer and the file
+void diff_update() {
+    struct stat st;
+    if (diffsplit.active)
+        diff_split_update();
+    if (!diff.active)
+        return;
+    if (!diff.file_stale) {
+        // Saved (or changed on disk) since?
+        if (stat(textbuf.filename, &st) == 0)
+            diff.file_stale = st.st_mtime != diff.file_mtime || st.st_size != diff.file_size;
+        else
+            diff.file_stale = diff.file_size >= 0;
+    }
+    if (diff.stale || diff.file_stale)
+        diff_refresh();
+}
+
+// Columns taken by the gutter left of the text
+int diff_gutter_width() {
+    return diff.active || diffsplit.active ? DIFF_GUTTER_WIDTH : 0;
+}
+
+// Draw the gutter of one buffer line
+void diff_draw_gutter(int line) {
+    unsigned char mark = line >= 0 && line < diff.line_count ? diff.marks[line] : 0;
+    char cell[DIFF_GUTTER_WIDTH];
+    memset(cell, ' ', sizeof(cell));
+    if (mark & DIFF_CHANGED)
+        cell[0] = '~';
+    else if (mark & DIFF_ADDED)
+        cell[0] = '+';
+    else if (mark & DIFF_DELETED_ABOVE)
+        cell[0] = '-';
+    else if (mark & DIFF_DELETED_BELOW)
+        cell[0] = '_';
+    screen_put(cell, sizeof(cell));
+}
+
+// :diffsplit shows the buffer (left) and another file (right, read only from its mapping)
+// side by side. Both panes scroll together through aligned rows: runs of equal or changed
+// line pairs, and of lines only one side has (drawn against '-' filler rows on the other
+// side). The line diff runs on a worker thread: the main thread copies the buffer text
+// between the start and end both share, the worker hashes its lines (and the other file's,
+// once) and runs the Myers diff; the runs are then built from its hunks on the main
+// thread. Edits start the next diff as soon as the last one is done. Only the rows on screen are drawn, and their
+// changed bytes (between the common start and end of a pair) are found while drawing.
+
+// Append a run of aligned rows
+static void diff_split_add_run(int kind, int b_line, int a_line, int len) {
+    if (len <= 0 || diffsplit.run_count == DIFF_RUNS_MAX)
+        return;
+    struct diffrun* run = &diffsplit.runs[diffsplit.run_count++];
+    run->row = diffsplit.row_count;
+    run->len = len;
+    run->b_line = b_line;
+    run->a_line = a_line;
+    run->kind = kind;
+    diffsplit.row_count += len;
+}
+
+// Build the aligned rows from the hunks of the last diff
+static void diff_split_align() {
+    int a = 0, b = 0, i;
+    diffsplit.run_count = 0;
+    diffsplit.row_count = 0;
+    for (i = 0; i < diff.hunk_count; i++) {
+        const struct diffhunk* h = &diff.hunks[i];
+        int paired = h->a_len < h->b_len ? h->a_len : h->b_len;
+        diff_split_add_run(DIFF_RUN_SAME, b, a, h->b_start - b);
+        diff_split_add_run(DIFF_RUN_CHANGED, h->b_start, h->a_start, paired);
+        diff_split_add_run(DIFF_RUN_ADDED, h->b_start + paired, h->a_start + h->a_len, h->b_len - paired);
+        diff_split_add_run(DIFF_RUN_DELETED, h->b_start + h->b_len, h->a_start + paired, h->a_len - paired);
+        a = h->a_start + h->a_len;
+        b = h->b_start + h->b_len;
+    }
+    // The shared end (shorter than one side only if the hunks overflowed)
+    int same = diffsplit.line_count - a < diffsplit.job_b_count - b ? diffsplit.line_count - a : diffsplit.job_b_count - b;
+    diff_split_add_run(DIFF_RUN_SAME, b, a, same);
+    diff_split_add_run(DIFF_RUN_ADDED, b + same, a + same, diffsplit.job_b_count - b - same);
+    diff_split_add_run(DIFF_RUN_DELETED, diffsplit.job_b_count, a + same, diffsplit.line_count - a - same);
+}
+
+// Pool task: hash the copied buffer lines and the other file's (first run only), diff them
+static void diff_split_task(void* arg, int worker) {
+    (void)arg;
+    (void)worker;
+    int i;
+    int mid = diff_hash_text(diffsplit.snapshot, (size_t)diffsplit.snapshot_len, diff.new_hash + diffsplit.job_base,
+                             DIFF_LINES_MAX - diffsplit.job_base);
+    if (mid < 0 || diffsplit.job_base + mid + diffsplit.job_tail > DIFF_LINES_MAX) {
+        diffsplit.job_failed = 1;
+        atomic_store(&diffsplit.done, 1);
+        return;
+    }
+    diffsplit.job_b_count = diffsplit.job_base + mid + diffsplit.job_tail;
+    if (!diffsplit.hashed) {
+        for (i = 0; i < diffsplit.line_count; i++) {
+            int start = diffsplit.line_starts[i];
+            diff.old_hash[i] = diff_hash_step(DIFF_HASH_SEED, diffsplit.map + start, diffsplit.line_starts[i + 1] - 1 - start);
+        }
+        diffsplit.hashed = 1;
+    }
+    diff_hunks_reset();
+    diff_compare(diff.old_hash, diffsplit.job_base, diffsplit.line_count - diffsplit.job_tail,
+                 diff.new_hash, diffsplit.job_base, diffsplit.job_base + mid);
+    atomic_store(&diffsplit.done, 1);  // (the pool wakes the main loop as the task ends)
+}
+
+// Copy the buffer text that differs from the other file and start a diff of it
+static void diff_split_start() {
+    int prefix, suffix;
+    diffsplit.stale = 0;
+    diff_trim(&textbuf, diffsplit.map, diffsplit.map_len, &prefix, &suffix);
+    int base = diff_count_lines(diffsplit.map, prefix);
+    int tail = diff_count_lines(diffsplit.map + diffsplit.map_len - suffix, suffix);
+    if (suffix > 0 && diffsplit.map[diffsplit.map_len - 1] != '\n')
+        tail++;  // Last line without a newline
+    diffsplit.snapshot_len = bufclient_read(&textbuf, prefix, diffsplit.snapshot, textbuf.size - suffix - prefix);
+    diffsplit.job_base = base;
+    diffsplit.job_tail = tail;
+    diffsplit.job_failed = 0;
+    atomic_store(&diffsplit.done, 0);
+    if (taskpool_submit(diff_split_task, NULL, NULL, TASK_VISIBLE, NULL, &diffsplit.tasks) != RESULT_OK) {
+        editorSetStatusMessage("diffsplit: failed to start diff task");
+        return;
+    }
+    diffsplit.running = 1;
+}
+
+// Buffer edits call for a new diff (batched observer)
+static void diff_split_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    (void)buf;
+    (void)deltas;
+    (void)count;
+    (void)ctx;
+    diffsplit.stale = 1;
+}
+
+// Close the split (waits for a running diff)
+static void diff_split_close() {
+    if (diffsplit.running) {
+        taskpool_wait_group(&diffsplit.tasks);
+        diffsplit.running = 0;
+    }
+    bufclient_unobserve(&textbuf, &diffsplit.observer);
+    if (diffsplit.map_len > 0)
+        munmap((void*)diffsplit.map, (size_t)diffsplit.map_len);
+    diffsplit.map = NULL;
+    diffsplit.map_len = 0;
+    diffsplit.run_count = 0;
+    diffsplit.row_count = 0;
+    diffsplit.active = 0;
+}
+
+// :diffsplit filename: compare the buffer with another file side by side
+void diff_split(const char* filename) {
+    char msg[STATUS_BUF_SIZE];
+    struct stat st;
+    int i;
+    if (server_mode) {
+        editorSetStatusMessage("diffsplit: not available in server mode");
+        return;
+    }
+    while (*filename == ' ')
+        filename++;
+    if (*filename == '\0') {
+        editorSetStatusMessage("diffsplit: file name needed");
+        return;
+    }
+    diff_off();  // One diff at a time: they share the diff work space
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd != -1)
+            close(fd);
+        snprintf(msg, sizeof(msg), "diffsplit: cannot open \"%.60s\"", filename);
+        editorSetStatusMessage(msg);
+        return;
+    }
+    if ((long long)st.st_size >= (long long)INT_MAX) {
+        close(fd);
+        editorSetStatusMessage("diffsplit: file too large");
+        return;
+    }
+    int len = (int)st.st_size;
+    const char* map = "";
+    if (len > 0) {
+        map = mmap(NULL, (size_t)len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            editorSetStatusMessage("diffsplit: cannot map the file");
+            return;
+        }
+    }
+    close(fd);
+
+    // Line starts (one past the end: the next line's start, as if the last line had a newline)
+    int count = 0;
+    const char* p = map;
+    const char* end = map + len;
+    while (p < end && count < DIFF_LINES_MAX) {
+        const char* nl = memchr(p, '\n', end - p);
+        diffsplit.line_starts[count++] = (int)(p - map);
+        p = nl != NULL ? nl + 1 : end + 1;
+    }
+    if (p < end) {
+        if (len > 0)
+            munmap((void*)map, (size_t)len);
+        editorSetStatusMessage("diffsplit: too many lines");
+        return;
+    }
+    diffsplit.line_starts[count] = (int)(p - map);
+
+    diffsplit.observer.notify = diff_split_on_edit;
+    diffsplit.observer.batched = 1;
+    if (bufclient_observe(&textbuf, &diffsplit.observer) != RESULT_OK) {
+        if (len > 0)
+            munmap((void*)map, (size_t)len);
+        editorSetStatusMessage("diffsplit: too many buffer observers");
+        return;
+    }
+    for (i = 0; filename[i] != '\0' && i < (int)sizeof(diffsplit.filename) - 1; i++)
+        diffsplit.filename[i] = filename[i];
+    diffsplit.filename[i] = '\0';
+    diffsplit.map = map;
+    diffsplit.map_len = len;
+    diffsplit.line_count = count;
+    diffsplit.hashed = 0;
+    diffsplit.ready = 0;
+    diffsplit.run_count = 0;
+    diffsplit.row_count = 0;
+    diffsplit.rowoff = textbuf.rowoff;  // Rows are lines until the first diff is in
+    diffsplit.active = 1;
+    diff_split_start();
+    snprintf(msg, sizeof(msg), "diffsplit: comparing with \"%.60s\"...", diffsplit.filename);
+    editorSetStatusMessage(msg);
+}
+
+// Take in a finished diff and start the next one if the buffer changed meanwhile
+static void diff_split_update() {
+    char msg[STATUS_BUF_SIZE];
+    if (diffsplit.running && atomic_load(&diffsplit.done)) {
+        taskpool_wait_group(&diffsplit.tasks);  // Returning from the task
+        diffsplit.running = 0;
+        if (diffsplit.job_failed) {
+            editorSetStatusMessage("diffsplit: too many lines");
+            return;
+        }
+        diff_split_align();
+        if (!diffsplit.ready) {
+            diffsplit.ready = 1;
+            snprintf(msg, sizeof(msg), "diffsplit: %d hunk%s against \"%.60s\"%s (:diffoff to close)", diff.hunk_count,
+                     diff.hunk_count == 1 ? "" : "s", diffsplit.filename, diff.overflow ? " (truncated)" : "");
+            editorSetStatusMessage(msg);
+        }
+    }
+    if (!diffsplit.running && diffsplit.stale)
+        diff_split_start();
+}
+
+// Buffer and other file line of an aligned row (-1 where that side has none), returns enum diffRunKind
+static int diff_split_locate(int row, int* b_line, int* a_line) {
+    int lo = 0, hi = diffsplit.run_count - 1, r = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (diffsplit.runs[mid].row <= row) {
+            r = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (r < 0) {
+        *b_line = row;  // No diff yet
+        *a_line = row;
+        return DIFF_RUN_SAME;
+    }
+    const struct diffrun* run = &diffsplit.runs[r];
+    int offset = row - run->row;
+    if (offset < run->len) {
+        *b_line = run->kind == DIFF_RUN_DELETED ? -1 : run->b_line + offset;
+        *a_line = run->kind == DIFF_RUN_ADDED ? -1 : run->a_line + offset;
+        return run->kind;
+    }
+    // Past the aligned rows: buffer lines added since the diff
+    *b_line = run->b_line + (run->kind == DIFF_RUN_DELETED ? 0 : run->len) + offset - run->len;
+    *a_line = -1;
+    return DIFF_RUN_SAME;
+}
+
+// Aligned row of a buffer line
+int diff_split_row_of_line(int line) {
+    int lo = 0, hi = diffsplit.run_count - 1, r = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (diffsplit.runs[mid].b_line <= line) {
+            r = mid;  // The last run starting at or before line (filler runs share the next run's line)
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (r < 0)
+        return line;
+    const struct diffrun* run = &diffsplit.runs[r];
+    int lines = run->kind == DIFF_RUN_DELETED ? 0 : run->len;
+    if (line - run->b_line < lines)
+        return run->row + line - run->b_line;
+    return run->row + run->len + line - run->b_line - lines;
+}
+
+// Keep the cursor's row on screen
+void diff_split_scroll() {
+    if (!diffsplit.active)
+        return;
+    int row = diff_split_row_of_line(textbuf.cursor_abs_y);
+    if (row < diffsplit.rowoff)
+        diffsplit.rowoff = row;
+    if (row >= diffsplit.rowoff + screenrows)
+        diffsplit.rowoff = row - screenrows + 1;
+}
+
+// Find the start of a buffer line, walking back from the cursor when it is a screen or less above
+static enum RESULT diff_split_line_start(int line, struct bufchunk** chunk_out, int* rel_i_out) {
+    struct bufchunk* chunk;
+    int rel_i;
+    int start_abs_i;
+    int back = textbuf.cursor_abs_y - line;
+    if (back < 0 || back > screenrows || bufclient_find_pos(&textbuf, textbuf.cursor_abs_i, &chunk, &rel_i) != RESULT_OK)
+        return bufclient_find_line_start(&textbuf, line, chunk_out, rel_i_out, &start_abs_i);
+    while (chunk != NULL) {
+        while (rel_i > 0) {
+            if (chunk->data[rel_i - 1] == '\n' && back-- == 0) {
+                *chunk_out = chunk;
+                *rel_i_out = rel_i;
+                return RESULT_OK;
+            }
+            rel_i--;
+        }
+        if (chunk->prev == NULL)
+            break;
+        chunk = chunk->prev;
+        rel_i = chunk->size;
+    }
+    *chunk_out = textbuf.begin;
+    *rel_i_out = 0;
+    return RESULT_OK;
+}
+
+// Copy the line at (*chunk, *rel_i) to out (at most max bytes) and move past it, -1 at the end of the buffer
+static int diff_split_read_line(struct bufchunk** chunk, int* rel_i, char* out, int max) {
+    struct bufchunk* c = *chunk;
+    int i = *rel_i;
+    int len = 0;
+    while (c != NULL && i >= c->size) {
+        c = c->next;
+        i = 0;
+    }
+    if (c == NULL) {
+        *chunk = NULL;
+        return -1;
+    }
+    while (c != NULL) {
+        const char* s = c->data + i;
+        const char* nl = memchr(s, '\n', c->size - i);
+        int piece = nl != NULL ? (int)(nl - s) : c->size - i;
+        int copy = piece < max - len ? piece : max - len;
+        memcpy(out + len, s, copy);
+        len += copy;
+        if (nl != NULL) {
+            i += piece + 1;
+            break;
+        }
+        c = c->next;
+        i = 0;
+    }
+    *chunk = c;
+    *rel_i = i;
+    return len;
+}
+
+// Put a line into a pane width columns wide (scrolled by coloff), bytes hl_start..hl_end reversed
+static void diff_split_put(const char* s, int len, int width, int hl_start, int hl_end) {
+    int col = 0, x = 0, i, j;
+    for (i = 0; i < len && x < width; i++) {
+        unsigned char c = (unsigned char)s[i];
+        char cells[TAB_STOP_MAX + 2];
+        int w;
+        if (c == '\t') {
+            w = textbuf.tabstop - col % textbuf.tabstop;
+            memset(cells, ' ', w);
+        } else if (iscntrl(c)) {
+            w = 2;
+            cells[0] = '^';
+            cells[1] = (c & 0x1f) + '@';
+        } else {
+            w = 1;
+            cells[0] = c;
+        }
+        screen_set_attr(i >= hl_start && i < hl_end ? ATTR_REVERSE : ATTR_NORMAL);
+        for (j = 0; j < w; j++, col++) {
+            if (col >= textbuf.coloff && x < width) {
+                screen_put(cells + j, 1);
+                x++;
+            }
+        }
+    }
+    screen_set_attr(ATTR_NORMAL);
+    for (; x < width; x++)
+        screen_put(" ", 1);
+}
+
+// Put a row with no line in a pane: '-' filler against lines of the other side, else '~'
+static void diff_split_put_empty(int filler, int width) {
+    int x;
+    for (x = 0; x < width; x++)
+        screen_put(filler ? "-" : x == 0 ? "~" : " ", 1);
+}
+
+// Draw both panes (instead of editorDrawRows)
+void diff_split_draw() {
+    char line[DIFF_SPLIT_LINE_MAX];
+    struct bufchunk* chunk = NULL;
+    int rel_i = 0;
+    int next_line = -1;  // Buffer line at chunk/rel_i
+    int left = (screencols - 1) / 2;
+    int right = screencols - left - 1;
+    int y;
+    for (y = 0; y < screenrows; y++) {
+        int b_line, a_line;
+        int kind = diff_split_locate(diffsplit.rowoff + y, &b_line, &a_line);
+        int len = -1;
+        if (b_line >= 0) {
+            if (b_line != next_line && diff_split_line_start(b_line, &chunk, &rel_i) != RESULT_OK)
+                chunk = NULL;
+            len = chunk != NULL ? diff_split_read_line(&chunk, &rel_i, line, sizeof(line)) : -1;
+            next_line = b_line + 1;
+        }
+        const char* a_text = NULL;
+        int a_len = 0;
+        if (a_line >= 0 && a_line < diffsplit.line_count) {
+            a_text = diffsplit.map + diffsplit.line_starts[a_line];
+            a_len = diffsplit.line_starts[a_line + 1] - 1 - diffsplit.line_starts[a_line];
+        }
+
+        // Changed pair: highlight what lies between the common start and end
+        int hl_start = 0, b_hl_end = 0, a_hl_end = 0;
+        if (kind == DIFF_RUN_CHANGED && len >= 0 && a_text != NULL) {
+            int min_len = len < a_len ? len : a_len;
+            int tail = 0;
+            while (hl_start < min_len && line[hl_start] == a_text[hl_start])
+                hl_start++;
+            while (tail < min_len - hl_start && line[len - 1 - tail] == a_text[a_len - 1 - tail])
+                tail++;
+            b_hl_end = len - tail;
+            a_hl_end = a_len - tail;
+        }
+
+        screen_put(kind == DIFF_RUN_CHANGED ? "~ " : kind == DIFF_RUN_ADDED ? "+ " : kind == DIFF_RUN_DELETED ? "- " : "  ", DIFF_GUTTER_WIDTH);
+        if (len >= 0)
+            diff_split_put(line, len, left - DIFF_GUTTER_WIDTH, hl_start, b_hl_end);
+        else
+            diff_split_put_empty(kind == DIFF_RUN_DELETED, left - DIFF_GUTTER_WIDTH);
+        screen_put("|", 1);
+        if (a_text != NULL)
+            diff_split_put(a_text, a_len, right, hl_start, a_hl_end);
+        else
+            diff_split_put_empty(kind == DIFF_RUN_ADDED, right);
+        screen_next_row();
+    }
+}
+
+// Columns for the buffer's text: right of the gutter, left of the :diffsplit pane
+int diff_text_cols() {
+    if (diffsplit.active)
+        return (screencols - 1) / 2 - DIFF_GUTTER_WIDTH;
+    return screencols - diff_gutter_width();
+}
+
+// *** Multiple Cursors Implementation ***
+// Normal-mode Ctrl-N adds a cursor at the next whole-word match of the word under the
+// primary cursor (at the same offset into it), Ctrl-J or ":cursors N" a column of them
+// below the last one. While there are several, typing, Enter, Backspace, Del, 'x' and
+// left/right act at all of them; Esc in normal mode drops the extra ones. A keystroke is
+// one bufclient_apply_edits batch over every cursor, spliced in back to front, with one
+// coordinate update for the primary cursor; the others are offsets that are recomputed
+// from the batch arithmetically, and shifted by an observer for edits made elsewhere.
+
+// Index of the first extra cursor at or after abs_i
+int multicursor_first(int abs_i) {
+    int lo = 0, hi = multicursor.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (multicursor.pos[mid] < abs_i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// For drawing in ascending order: is there an extra cursor at abs_i? (*next is the index
+// to continue from, start with multicursor_first)
+int multicursor_at(int* next, int abs_i) {
+    while (*next < multicursor.count && multicursor.pos[*next] < abs_i)
+        (*next)++;
+    return *next < multicursor.count && multicursor.pos[*next] == abs_i;
+}
+
+// Draw an extra cursor that sits on a line end (abs_i) at column x of the text area
+void multicursor_draw_eol(int* next, int abs_i, int x, int text_cols) {
+    if (x >= 0 && x < text_cols && multicursor_at(next, abs_i)) {
+        screen_set_attr(ATTR_REVERSE);
+        screen_put(" ", 1);
+        screen_set_attr(ATTR_NORMAL);
+    }
+}
+
+// Drop duplicates and cursors on the primary one (after edits moved them together)
+static void multicursor_normalize() {
+    int k, n = 0;
+    for (k = 0; k < multicursor.count; k++) {
+        int pos = multicursor.pos[k];
+        if (pos == textbuf.cursor_abs_i || (n > 0 && multicursor.pos[n - 1] == pos))
+            continue;
+        multicursor.pos[n++] = pos;
+    }
+    multicursor.count = n;
+}
+
+// Move the extra cursors with an edit made by something else
+static void multicursor_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int i, k;
+    (void)buf; (void)ctx;
+    if (multicursor.applying)
+        return;
+    for (i = 0; i < count; i++) {
+        const struct bufdelta* d = &deltas[i];
+        for (k = multicursor_first(d->offset); k < multicursor.count; k++) {
+            if (multicursor.pos[k] >= d->offset + d->removed)
+                multicursor.pos[k] += d->inserted - d->removed;
+            else if (d->removed != d->inserted)
+                multicursor.pos[k] = d->offset;  // Inside the removed text (rewritten in place, it stays)
+        }
+    }
+    multicursor_normalize();
+}
+
+void multicursor_clear() {
+    if (multicursor.count == 0 && multicursor.observer.notify == NULL)
+        return;
+    bufclient_unobserve(&textbuf, &multicursor.observer);
+    multicursor.observer.notify = NULL;
+    multicursor.count = 0;
+}
+
+// Add a cursor at abs_i; 0 if there is one already or no room
+static int multicursor_add(int abs_i) {
+    int k = multicursor_first(abs_i);
+    if (abs_i == textbuf.cursor_abs_i || (k < multicursor.count && multicursor.pos[k] == abs_i))
+        return 0;
+    if (multicursor.count == MULTICURSOR_MAX) {
+        editorSetStatusMessage("cursors: no room for more");
+        return 0;
+    }
+    if (multicursor.observer.notify == NULL) {
+        multicursor.observer.notify = multicursor_on_edit;
+        if (bufclient_observe(&textbuf, &multicursor.observer) != RESULT_OK) {
+            multicursor.observer.notify = NULL;
+            editorSetStatusMessage("cursors: too many buffer observers");
+            return 0;
+        }
+    }
+    memmove(&multicursor.pos[k + 1], &multicursor.pos[k], (multicursor.count - k) * sizeof(multicursor.pos[0]));
+    multicursor.pos[k] = abs_i;
+    multicursor.count++;
+    return 1;
+}
+
+static void multicursor_report() {
+    char msg[STATUS_BUF_SIZE];
+    snprintf(msg, sizeof(msg), "cursors: %d (Esc drops the extra ones)", multicursor.count + 1);
+    editorSetStatusMessage(msg);
+}
+
+// The last cursor in the buffer (primary or not)
+static int multicursor_last() {
+    if (multicursor.count > 0 && multicursor.pos[multicursor.count - 1] > textbuf.cursor_abs_i)
+        return multicursor.pos[multicursor.count - 1];
+    return textbuf.cursor_abs_i;
+}
+
+// Add n cursors on the lines below the last one, at its byte column (or the line's end)
+void multicursor_column(int n) {
+    struct bufchunk* chunk;
+    int rel_i, added = 0;
+    int abs_i = multicursor_last();
+    int col = bufclient_line_col(&textbuf, abs_i);
+    if (server_mode) {
+        editorSetStatusMessage("cursors: not available in server mode");
+        return;
+    }
+    if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return;
+    // One forward walk: to the next newline, then up to col bytes into the line
+    while (added < n) {
+        int found = 0, x = 0;
+        while (chunk != NULL && !found) {
+            if (rel_i == chunk->size) {
+                chunk = chunk->next;
+                rel_i = 0;
+                continue;
+            }
+            char* p = memchr(chunk->data + rel_i, '\n', chunk->size - rel_i);
+            int n_skip = p != NULL ? (int)(p - chunk->data) + 1 - rel_i : chunk->size - rel_i;
+            abs_i += n_skip;
+            rel_i += n_skip;
+            found = p != NULL;
+        }
+        if (!found)
+            break;  // No line below
+        while (x < col && chunk != NULL) {
+            if (rel_i == chunk->size) {
+                chunk = chunk->next;
+                rel_i = 0;
+                continue;
+            }
+            if (chunk->data[rel_i] == '\n')
+                break;
+            rel_i++;
+            abs_i++;
+            x++;
+        }
+        if (!multicursor_add(abs_i) && multicursor.count == MULTICURSOR_MAX)
+            break;
+        added++;
+    }
+    multicursor_report();
+}
+
+// First whole-word match of w at or after from (and before to), or -1 (-2 - the offset
+// reached if Ctrl-C interrupted the search)
+static int multicursor_find_word(const char* w, int len, int from, int to) {
+    static char window[MULTICURSOR_WINDOW];
+    while (from < to) {
+        if (interrupted())
+            return -2 - from;
+        int base = from > 0 ? from - 1 : 0;  // One byte before for the word boundary
+        int n = bufclient_read(&textbuf, base, window, MULTICURSOR_WINDOW);
+        int at_end = base + n == textbuf.size;
+        int i;
+        for (i = from - base; i + len <= n && base + i < to; i++) {
+            if (window[i] != w[0] || memcmp(window + i, w, len) != 0)
+                continue;
+            if (i + len == n && !at_end)
+                break;  // The byte after it is in the next window
+            if ((base + i == 0 || !is_word_char(window[i - 1])) && (i + len == n || !is_word_char(window[i + len])))
+                return base + i;
+        }
+        if (at_end)
+            break;
+        from = base + i;
+    }
+    return -1;
+}
+
+// Add a cursor at the next match (after the last cursor, wrapping around) of the word
+// under the primary cursor
+static void multicursor_add_match() {
+    char w[WORDIDX_WORD_MAX];
+    int start = word_run_start(&textbuf, textbuf.cursor_abs_i);
+    int end = word_run_end(&textbuf, textbuf.cursor_abs_i);
+    int into = textbuf.cursor_abs_i - start;  // New cursors keep the primary's offset into the word
+    int len = end - start;
+    if (server_mode) {
+        editorSetStatusMessage("cursors: not available in server mode");
+        return;
+    }
+    if (len <= 0 || len > WORDIDX_WORD_MAX || bufclient_read(&textbuf, start, w, len) != len) {
+        editorSetStatusMessage("cursors: no word under the cursor");
+        return;
+    }
+    int from = multicursor_last() - into + len;
+    int pass, m = -1, searched = 0;
+    cancel_token_reset(&interrupt_token);
+    for (pass = 0; pass < 2 && m == -1; pass++) {
+        int limit = pass == 0 ? textbuf.size : from;
+        int at = pass == 0 ? from : 0, pass_start = at;
+        while ((m = multicursor_find_word(w, len, at, limit)) >= 0) {
+            if (multicursor_add(m + into)) {
+                multicursor_report();
+                return;
+            }
+            at = m + len;  // Has one already
+        }
+        searched += (m < -1 ? -2 - m : limit) - pass_start;
+    }
+    char msg[STATUS_BUF_SIZE];
+    if (m < -1)
+        snprintf(msg, sizeof(msg), "cursors: search interrupted after %d%% of the buffer",
+                 textbuf.size > 0 ? (int)((long long)searched * 100 / textbuf.size) : 100);
+    else
+        snprintf(msg, sizeof(msg), "cursors: no more matches of '%.*s'", len, w);
+    editorSetStatusMessage(msg);
+}
+
+// Merge the primary cursor into the others (multicursor.all, ascending); returns the count
+static int multicursor_gather() {
+    int k = multicursor_first(textbuf.cursor_abs_i);
+    memcpy(multicursor.all, multicursor.pos, k * sizeof(multicursor.all[0]));
+    multicursor.all[k] = textbuf.cursor_abs_i;
+    memcpy(&multicursor.all[k + 1], &multicursor.pos[k], (multicursor.count - k) * sizeof(multicursor.all[0]));
+    multicursor.primary = k;
+    return multicursor.count + 1;
+}
+
+// Replace up to `before` bytes before and `after` bytes after every cursor with text,
+// as one batch. Each cursor ends after its inserted text.
+static void multicursor_edit(int before, int after, const char* text, int len) {
+    int count = multicursor_gather();
+    int k, m = 0, shift = 0, prev_end = 0, primary_abs_i = 0;
+    for (k = 0; k < count; k++) {
+        int pos = multicursor.all[k];
+        int b = pos - before < prev_end ? pos - prev_end : before;  // Stop at the previous edit
+        int a = textbuf.size - pos < after ? textbuf.size - pos : after;
+        if (b < 0)
+            b = 0;
+        multicursor.all[k] = pos - b + shift + len;  // In the text after the batch
+        if (k == multicursor.primary)
+            primary_abs_i = multicursor.all[k];
+        if (b + a + len == 0)
+            continue;
+        multicursor.edits[m].offset = pos - b;
+        multicursor.edits[m].removed = b + a;
+        multicursor.edits[m].text = text;
+        multicursor.edits[m].inserted = len;
+        m++;
+        shift += len - b - a;
+        prev_end = pos + a;
+    }
+
+    multicursor.applying = 1;
+    enum RESULT result = bufclient_apply_edits(&textbuf, multicursor.edits, m, primary_abs_i);
+    multicursor.applying = 0;
+    if (result != RESULT_OK)
+        return;  // Nothing went in, the cursors stay where they are
+
+    // The others, in the text after the batch
+    memcpy(multicursor.pos, multicursor.all, multicursor.primary * sizeof(multicursor.pos[0]));
+    memcpy(&multicursor.pos[multicursor.primary], &multicursor.all[multicursor.primary + 1],
+           (count - 1 - multicursor.primary) * sizeof(multicursor.pos[0]));
+    multicursor_normalize();
+}
+
+// Move the extra cursors one byte left or right (the primary one moves on its own)
+static void multicursor_step(int dir) {
+    int k;
+    for (k = 0; k < multicursor.count; k++) {
+        int pos = multicursor.pos[k] + dir;
+        if (pos >= 0 && pos <= textbuf.size)
+            multicursor.pos[k] = pos;
+    }
+}
+
+// Leaving insert mode: step the extra cursors back like the primary one, unless they are
+// at the start of a line (one forward walk reading the byte before each)
+static void multicursor_step_back_in_line() {
+    struct bufchunk* chunk = textbuf.begin;
+    int base = 0, k;
+    for (k = 0; k < multicursor.count; k++) {
+        int before = multicursor.pos[k] - 1;
+        if (before < 0)
+            continue;
+        while (chunk != NULL && before >= base + chunk->size) {
+            base += chunk->size;
+            chunk = chunk->next;
+        }
+        if (chunk != NULL && chunk->data[before - base] != '\n')
+            multicursor.pos[k] = before;
+    }
+}
+
+// Handle a key for the extra cursors; 1 if it was consumed
+int multicursor_key(int c) {
+    if (mode == MODE_NORMAL && (c == CTRL_KEY('n') || c == CTRL_KEY('j'))) {
+        if (c == CTRL_KEY('n'))
+            multicursor_add_match();
+        else
+            multicursor_column(1);
+        return 1;
+    }
+    if (multicursor.count == 0)
+        return 0;
+
+    if (mode == MODE_NORMAL) {
+        switch (c) {
+            case '\x1b':
+                multicursor_clear();
+                editorSetStatusMessage("");
+                return 1;
+            case 'x':
+                multicursor_edit(0, 1, NULL, 0);
+                return 1;
+            case 'h': case ARROW_LEFT:
+                bufclient_move_cursor_relative(&textbuf, ARROW_LEFT);
+                multicursor_step(-1);
+                multicursor_normalize();
+                return 1;
+            case 'l': case ARROW_RIGHT:
+                bufclient_move_cursor_relative(&textbuf, ARROW_RIGHT);
+                multicursor_step(1);
+                multicursor_normalize();
+                return 1;
+            case 'a':
+                multicursor_step(1);  // The primary one moves with the key itself
+                return 0;
+        }
+        return 0;
+    }
+    if (mode != MODE_INSERT)
+        return 0;
+    switch (c) {
+        case '\x1b':
+            multicursor_step_back_in_line();
+            return 0;
+        case '\r':
+            multicursor_edit(0, 0, "\n", 1);
+            return 1;
+        case BACKSPACE:
+            multicursor_edit(1, 0, NULL, 0);
+            return 1;
+        case DEL_KEY:
+            multicursor_edit(0, 1, NULL, 0);
+            return 1;
+        case ARROW_LEFT:
+            bufclient_move_cursor_relative(&textbuf, ARROW_LEFT);
+            multicursor_step(-1);
+            multicursor_normalize();
+            return 1;
+        case ARROW_RIGHT:
+            bufclient_move_cursor_relative(&textbuf, ARROW_RIGHT);
+            multicursor_step(1);
+            multicursor_normalize();
+            return 1;
+    }
+    if ((c >= 32 && c <= 126) || c == '\t') {
+        char ch = (char)c;
+        multicursor_edit(0, 0, &ch, 1);
+        return 1;
+    }
+    return 0;
+}
+
+// *** Block Edit Implementation ***
+// Ctrl-V selects a block: the lines from the anchor to the cursor, and the visual columns
+// between them (widths as in bufclient_update_cursor_coords). 'd'/'x' delete it, 'I'
+// inserts before its left column and 'A' after its right one (padding short lines with
+// spaces), typing on the first line only; leaving insert mode repeats that text on the
+// other lines. Both are one bufclient_apply_edits batch built from one forward pass over
+// the lines of the block, so a column of 100k rows costs one walk and one splice each.
+
+// Lines and columns of the selection
+static void block_bounds(int* top, int* bottom, int* left, int* right) {
+    *top = block.anchor_y < textbuf.cursor_abs_y ? block.anchor_y : textbuf.cursor_abs_y;
+    *bottom = block.anchor_y < textbuf.cursor_abs_y ? textbuf.cursor_abs_y : block.anchor_y;
+    *left = block.anchor_x < textbuf.cursor_abs_x ? block.anchor_x : textbuf.cursor_abs_x;
+    *right = block.anchor_x < textbuf.cursor_abs_x ? textbuf.cursor_abs_x : block.anchor_x;
+}
+
+// Is the cell at visual column x of line y inside the selection? (for drawing)
+int block_covers(int y, int x) {
+    int top, bottom, left, right;
+    if (mode != MODE_BLOCK)
+        return 0;
+    block_bounds(&top, &bottom, &left, &right);
+    return y >= top && y <= bottom && x >= left && x <= right;
+}
+
+// Start of line (at or above the cursor's), walking back from the cursor
+static int block_line_start(int line) {
+    struct bufchunk* chunk;
+    int rel_i, abs_i = textbuf.cursor_abs_i;
+    int newlines = textbuf.cursor_abs_y - line + 1;  // To pass on the way back
+    if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    while (chunk != NULL) {
+        while (rel_i > 0) {
+            if (chunk->data[--rel_i] == '\n' && --newlines == 0)
+                return abs_i;
+            abs_i--;
+        }
+        chunk = chunk->prev;
+        if (chunk != NULL)
+            rel_i = chunk->size;
+    }
+    return 0;
+}
+
+// For count lines from the one starting at abs_i, in one forward pass: the bytes covering
+// visual columns left..right of each (block.starts..block.ends, equal on short lines) and
+// the columns where they start and end. Returns the lines found.
+static int block_scan(int abs_i, int count, int left, int right) {
+    struct bufchunk* chunk;
+    int rel_i, k;
+    if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return 0;
+    for (k = 0; k < count; k++) {
+        int x = 0;
+        while (chunk != NULL && rel_i == chunk->size && chunk->next != NULL) {
+            chunk = chunk->next;
+            rel_i = 0;
+        }
+        while (chunk != NULL && x < left) {
+            if (rel_i == chunk->size) {
+                chunk = chunk->next;
+                rel_i = 0;
+                continue;
+            }
+            if (chunk->data[rel_i] == '\n')
+                break;
+            x = bufclient_advance_x(&textbuf, x, &chunk->data[rel_i], 1);
+            rel_i++;
+            abs_i++;
+        }
+        block.starts[k] = abs_i;
+        block.start_cols[k] = x;
+        while (chunk != NULL && x <= right) {
+            if (rel_i == chunk->size) {
+                chunk = chunk->next;
+                rel_i = 0;
+                continue;
+            }
+            if (chunk->data[rel_i] == '\n')
+                break;
+            x = bufclient_advance_x(&textbuf, x, &chunk->data[rel_i], 1);
+            rel_i++;
+            abs_i++;
+        }
+        block.ends[k] = abs_i;
+        // On to the next line
+        while (chunk != NULL) {
+            if (rel_i < chunk->size) {
+                char* p = memchr(chunk->data + rel_i, '\n', chunk->size - rel_i);
+                if (p != NULL) {
+                    abs_i += (int)(p - chunk->data) + 1 - rel_i;
+                    rel_i = (int)(p - chunk->data) + 1;
+                    break;
+                }
+                abs_i += chunk->size - rel_i;
+            }
+            chunk = chunk->next;
+            rel_i = 0;
+        }
+        if (chunk == NULL)
+            return k + 1;  // That was the last line
+    }
+    return count;
+}
+
+// Spaces padding short lines up to the column of an 'A' insert
+static const char* block_spaces() {
+    static char spaces[BLOCK_TEXT_MAX];
+    if (spaces[0] != ' ')
+        memset(spaces, ' ', sizeof(spaces));
+    return spaces;
+}
+
+// Ctrl-V in normal mode
+void block_start() {
+    if (server_mode) {
+        editorSetStatusMessage("block: not available in server mode");
+        return;
+    }
+    multicursor_clear();
+    block.anchor_y = textbuf.cursor_abs_y;
+    block.anchor_x = textbuf.cursor_abs_x;
+    mode = MODE_BLOCK;
+    editorSetStatusMessage("-- BLOCK --");
+}
+
+// Delete the selection, one range per line
+static void block_delete() {
+    int top, bottom, left, right, k, m = 0;
+    block_bounds(&top, &bottom, &left, &right);
+    if (bottom - top + 1 > BLOCK_LINES_MAX) {
+        editorSetStatusMessage("block: too many lines");
+        return;
+    }
+    int count = block_scan(block_line_start(top), bottom - top + 1, left, right);
+    for (k = 0; k < count; k++) {
+        if (block.ends[k] == block.starts[k])
+            continue;
+        block.edits[m].offset = block.starts[k];
+        block.edits[m].removed = block.ends[k] - block.starts[k];
+        block.edits[m].text = NULL;
+        block.edits[m].inserted = 0;
+        m++;
+    }
+    if (count > 0)
+        bufclient_apply_edits(&textbuf, block.edits, m, block.starts[0]);
+    mode = MODE_NORMAL;
+    editorSetStatusMessage("");
+}
+
+// '~', 'U' or 'u': change the case of the selection, one range per line
+static void block_case(int kind) {
+    int top, bottom, left, right, k, m = 0;
+    block_bounds(&top, &bottom, &left, &right);
+    if (bottom - top + 1 > BLOCK_LINES_MAX) {
+        editorSetStatusMessage("block: too many lines");
+        return;
+    }
+    int count = block_scan(block_line_start(top), bottom - top + 1, left, right);
+    for (k = 0; k < count; k++) {
+        if (block.ends[k] == block.starts[k])
+            continue;
+        block.edits[m].offset = block.starts[k];
+        block.edits[m].removed = block.ends[k] - block.starts[k];
+        block.edits[m].text = NULL;
+        block.edits[m].inserted = block.edits[m].removed;
+        m++;
+    }
+    mode = MODE_NORMAL;
+    editorSetStatusMessage("");
+    if (count > 0) {
+        case_rewrite(block.edits, m, kind);
+        bufclient_move_cursor_to(&textbuf, block.starts[0]);
+    }
+}
+
+// 'I' (after = 0) or 'A' (after = 1): type on the first line of the selection
+static void block_insert(int after) {
+    int top, bottom, left, right;
+    block_bounds(&top, &bottom, &left, &right);
+    if (bottom - top + 1 > BLOCK_LINES_MAX) {
+        editorSetStatusMessage("block: too many lines");
+        return;
+    }
+    block.insert_col = after ? right + 1 : left;
+    block.insert_after = after;
+    block.insert_lines = bottom - top;  // Below the first
+    block_scan(block_line_start(top), 1, block.insert_col, block.insert_col - 1);
+    int pad = after ? block.insert_col - block.start_cols[0] : 0;
+    if (pad > BLOCK_TEXT_MAX)
+        pad = BLOCK_TEXT_MAX;
+    if (pad > 0) {
+        block.edits[0].offset = block.starts[0];
+        block.edits[0].removed = 0;
+        block.edits[0].text = block_spaces();
+        block.edits[0].inserted = pad;
+        bufclient_apply_edits(&textbuf, block.edits, 1, block.starts[0] + pad);
+    } else {
+        bufclient_move_cursor_to(&textbuf, block.starts[0]);
+    }
+    block.insert_abs_i = textbuf.cursor_abs_i;
+    block.insert_line = textbuf.cursor_abs_y;
+    block.inserting = 1;
+    mode = MODE_INSERT;
+    editorSetStatusMessage("-- INSERT --");
+}
+
+// Start of the line after the one at abs_i, or -1 on the last line
+static int block_next_line(int abs_i) {
+    struct bufchunk* chunk;
+    int rel_i;
+    if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return -1;
+    while (chunk != NULL) {
+        char* p = memchr(chunk->data + rel_i, '\n', chunk->size - rel_i);
+        if (p != NULL)
+            return abs_i + (int)(p - chunk->data) + 1 - rel_i;
+        abs_i += chunk->size - rel_i;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return -1;
+}
+
+// Leaving insert mode: repeat what was typed on the first line of a Ctrl-V I/A on the
+// others. 1 if it did (the cursor is then at the start of the text).
+int block_insert_done() {
+    static char text[BLOCK_TEXT_MAX];
+    int k, m = 0;
+    if (!block.inserting)
+        return 0;
+    block.inserting = 0;
+    int len = textbuf.cursor_abs_i - block.insert_abs_i;
+    if (block.insert_lines == 0 || textbuf.cursor_abs_y != block.insert_line || len <= 0 || len > BLOCK_TEXT_MAX ||
+        bufclient_read(&textbuf, block.insert_abs_i, text, len) != len)
+        return 0;  // Moved away, or nothing typed
+    int next = block_next_line(textbuf.cursor_abs_i);
+    if (next < 0)
+        return 0;
+
+    int count = block_scan(next, block.insert_lines, block.insert_col, block.insert_col);
+    for (k = 0; k < count; k++) {
+        int pad = block.insert_col - block.start_cols[k];
+        if (!block.insert_after && block.ends[k] == block.starts[k] && pad >= 0)
+            continue;  // 'I' leaves lines that end before the block alone
+        if (pad > BLOCK_TEXT_MAX)
+            pad = BLOCK_TEXT_MAX;
+        if (pad > 0) {
+            block.edits[m].offset = block.starts[k];
+            block.edits[m].removed = 0;
+            block.edits[m].text = block_spaces();
+            block.edits[m].inserted = pad;
+            m++;
+        }
+        block.edits[m].offset = block.starts[k];
+        block.edits[m].removed = 0;
+        block.edits[m].text = text;
+        block.edits[m].inserted = len;
+        m++;
+    }
+    bufclient_apply_edits(&textbuf, block.edits, m, block.insert_abs_i);
+    return 1;
+}
+
+// Keys of block mode; 0 for movement keys, which are handled as in normal mode
+int block_key(int c) {
+    switch (c) {
+        case 'h': case 'j': case 'k': case 'l':
+        case ARROW_LEFT: case ARROW_RIGHT: case ARROW_UP: case ARROW_DOWN:
+        case PAGE_UP: case PAGE_DOWN: case HOME_KEY: case END_KEY: case '0': case '$':
+            return 0;
+        case 'd': case 'x': case DEL_KEY:
+            block_delete();
+            break;
+        case 'I':
+            block_insert(0);
+            break;
+        case '~':
+            block_case(CASE_TOGGLE);
+            break;
+        case 'U':
+            block_case(CASE_UPPER);
+            break;
+        case 'u':
+            block_case(CASE_LOWER);
+            break;
+        case '>': case '<': {
+            int top, bottom, left, right;
+            block_bounds(&top, &bottom, &left, &right);
+            mode = MODE_NORMAL;
+            editorSetStatusMessage("");
+            indent_shift(top, bottom, c == '>' ? 1 : -1);
+            break;
+        }
+        case 'J': case 'g': {
+            int top, bottom, left, right;
+            block_bounds(&top, &bottom, &left, &right);
+            mode = MODE_NORMAL;
+            editorSetStatusMessage("");
+            if (c == 'J')
+                reflow_join(top, bottom > top ? bottom : top + 1);
+            else if (editorReadKey() == 'q')
+                reflow_fill(top, bottom);
+            break;
+        }
+        case 'A':
+            block_insert(1);
+            break;
+        case '\x1b': case CTRL_KEY('v'):
+            mode = MODE_NORMAL;
+            editorSetStatusMessage("");
+            break;
+    }
+    return 1;
+}
+
+// *** Indent Implementation ***
+// ">>"/"<<" (and '>'/'<' on a Ctrl-V block, or ":[range]>"/"<") shift lines by one tab
+// stop; ":[range]retab[!] [N]" spells indents for tab stop N (keeping their width) and
+// makes N the buffer's tab stop. Indents are written as tabs, then spaces. Either way
+// the lines are measured in one forward pass and rewritten as bufclient_apply_edits
+// batches of up to INDENT_BATCH lines; an indent string is a slice of indent.spelling.
+
+// Text of an indent of tabs tabs, followed by spaces (up to TAB_STOP_MAX)
+static const char* indent_spelling(int tabs) {
+    if (indent.spelling[0] != '\t') {
+        memset(indent.spelling, '\t', INDENT_TABS_MAX);
+        memset(indent.spelling + INDENT_TABS_MAX, ' ', TAB_STOP_MAX);
+    }
+    return indent.spelling + INDENT_TABS_MAX - tabs;
+}
+
+// Byte at (*chunk, *rel_i), stepping over chunk ends; -1 at the end of the buffer
+static int indent_peek(struct bufchunk** chunk, int* rel_i) {
+    while (*chunk != NULL && *rel_i == (*chunk)->size) {
+        *chunk = (*chunk)->next;
+        *rel_i = 0;
+    }
+    return *chunk != NULL ? (unsigned char)(*chunk)->data[*rel_i] : -1;
+}
+
+// Rewrite the indents of lines first..last. Widths are measured with tab stop from_ts;
+// the new width is the old one plus shift columns (at least 0; blank lines are left alone
+// when shifting), spelled for tab stop to_ts. Without all, only indents containing a tab
+// are rewritten. Returns the lines changed; *text_abs_i is where the text of line
+// text_line starts afterwards (-1 if it is not in the range).
+static int indent_rewrite(int first, int last, int shift, int from_ts, int to_ts, int all, int text_line, int* text_abs_i) {
+    struct bufchunk* chunk;
+    int rel_i, abs_i, line = first, changed = 0, done = 0;
+    *text_abs_i = -1;
+    if (first <= textbuf.cursor_abs_y) {
+        abs_i = block_line_start(first);  // Walk back from the cursor
+    } else if (bufclient_find_line_start(&textbuf, first, &chunk, &rel_i, &abs_i) != RESULT_OK) {
+        return 0;
+    }
+
+    while (line <= last && !done) {
+        int m = 0, delta = 0;  // Bytes the batch adds before the current position
+        int batch_abs_i = abs_i;
+        if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+            break;
+        while (line <= last && m < INDENT_BATCH && !done) {
+            int line_abs_i = abs_i, width = 0, tabs = 0, spaces = 0, mixed = 0, c;
+            while ((c = indent_peek(&chunk, &rel_i)) == ' ' || c == '\t') {
+                if (c == '\t') {
+                    width += from_ts - width % from_ts;
+                    mixed |= spaces > 0;  // A tab after a space is never how we spell it
+                    tabs++;
+                } else {
+                    width++;
+                    spaces++;
+                }
+                rel_i++;
+                abs_i++;
+            }
+            int blank = c == '\n' || c < 0;
+            int new_width = width + shift < 0 ? 0 : width + shift;
+            int new_tabs = new_width / to_ts, new_spaces = new_width % to_ts;
+            if (new_tabs > INDENT_TABS_MAX)
+                new_tabs = INDENT_TABS_MAX;
+            int rewrite = shift != 0 ? !blank : all || tabs > 0;
+            if (rewrite && (mixed || tabs != new_tabs || spaces != new_spaces)) {
+                indent.edits[m].offset = line_abs_i;
+                indent.edits[m].removed = tabs + spaces;
+                indent.edits[m].text = indent_spelling(new_tabs);
+                indent.edits[m].inserted = new_tabs + new_spaces;
+                m++;
+                delta += new_tabs + new_spaces - (tabs + spaces);
+            }
+            if (line == text_line)
+                *text_abs_i = abs_i + delta;
+
+            // On to the next line
+            while (chunk != NULL) {
+                char* p = memchr(chunk->data + rel_i, '\n', chunk->size - rel_i);
+                if (p != NULL) {
+                    abs_i += (int)(p - chunk->data) + 1 - rel_i;
+                    rel_i = (int)(p - chunk->data) + 1;
+                    break;
+                }
+                abs_i += chunk->size - rel_i;
+                chunk = chunk->next;
+                rel_i = 0;
+            }
+            done = chunk == NULL;  // That was the last line
+            line++;
+        }
+        if (bufclient_apply_edits(&textbuf, indent.edits, m, batch_abs_i) != RESULT_OK)
+            break;
+        changed += m;
+        abs_i += delta;
+    }
+    return changed;
+}
+
+// Shift lines first..last by dir tab stops; the cursor goes to the text of line first
+void indent_shift(int first, int last, int dir) {
+    int text_abs_i;
+    if (server_mode) {
+        editorSetStatusMessage("indent: not available in server mode");
+        return;
+    }
+    int changed = indent_rewrite(first, last, dir * textbuf.tabstop, textbuf.tabstop, textbuf.tabstop, 0, first, &text_abs_i);
+    if (text_abs_i >= 0)
+        bufclient_move_cursor_to(&textbuf, text_abs_i);
+    if (last > first) {
+        char msg[STATUS_BUF_SIZE];
+        snprintf(msg, sizeof(msg), "%d line%s %sed", changed, changed == 1 ? "" : "s", dir > 0 ? ">" : "<");
+        editorSetStatusMessage(msg);
+    }
+}
+
+// :retab[!] [N]: respell the indents of lines first..last for tab stop N (default: the
+// current one), which becomes the buffer's tab stop
+void indent_retab(int first, int last, int tabstop, int all) {
+    int text_abs_i, line = textbuf.cursor_abs_y;
+    if (server_mode) {
+        editorSetStatusMessage("retab: not available in server mode");
+        return;
+    }
+    if (tabstop == 0)
+        tabstop = textbuf.tabstop;
+    if (tabstop < 1 || tabstop > TAB_STOP_MAX) {
+        editorSetStatusMessage("retab: tab stop must be 1..32");
+        return;
+    }
+    int changed = indent_rewrite(first, last, 0, textbuf.tabstop, tabstop, all, line, &text_abs_i);
+    indent_set_tabstop(tabstop);
+    if (text_abs_i >= 0)
+        bufclient_move_cursor_to(&textbuf, text_abs_i);
+    char msg[STATUS_BUF_SIZE];
+    snprintf(msg, sizeof(msg), "retab: %d line%s changed, tab stop %d", changed, changed == 1 ? "" : "s", tabstop);
+    editorSetStatusMessage(msg);
+}
+
+// :set ts=N. Columns are counted anew: the cursor's (and in server mode, those of the
+// other views of the buffer); rows are drawn with the new widths from the next frame.
+void indent_set_tabstop(int tabstop) {
+    if (tabstop < 1 || tabstop > TAB_STOP_MAX) {
+        editorSetStatusMessage("ts: tab stop must be 1..32");
+        return;
+    }
+    if (tabstop == textbuf.tabstop)
+        return;
+    textbuf.tabstop = tabstop;
+    bufclient_update_cursor_coords(&textbuf);
+    textbuf.cursor_goal_x = textbuf.cursor_abs_x;
+    textbuf.coloff = 0;  // editorScroll brings the cursor back into view
+    server_views_invalidate();
+}
+
+// A line of a range: 1-based number, "." (the cursor's) or "$" (the last one)
+static int range_parse_line(const char** p) {
+    int n = 0;
+    if (**p == '.') {
+        (*p)++;
+        return textbuf.cursor_abs_y;
+    }
+    if (**p == '$') {
+        (*p)++;
+        return INT_MAX;
+    }
+    while (isdigit((unsigned char)**p)) {
+        n = n * 10 + (**p - '0');
+        (*p)++;
+    }
+    return n - 1;
+}
+
+// The range an ex command may start with: "%", a line, or "a,b". Returns 0 (leaving
+// *first and *last alone) if there is none.
+static int range_parse(const char** p, int* first, int* last) {
+    if (**p == '%') {
+        *first = 0;
+        *last = INT_MAX;
+        (*p)++;
+        return 1;
+    }
+    if (isdigit((unsigned char)**p) || **p == '.' || **p == '$') {
+        *first = *last = range_parse_line(p);
+        if (**p == ',') {
+            (*p)++;
+            *last = range_parse_line(p);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// ":[range]>", ":[range]<" (repeated for more stops) and ":[range]retab[!] [N]" (lines
+// are 1-based, "." is the cursor's and "$" the last one). Returns 0 if cmd is none of these.
+int indent_command(const char* cmd) {
+    int first = textbuf.cursor_abs_y, last = first, n = 0;
+    const char* p = cmd;
+    int ranged = range_parse(&p, &first, &last);
+    if (*p == '>' || *p == '<') {
+        char dir = *p;
+        while (*p == dir) {
+            n++;
+            p++;
+        }
+        if (*p != '\0')
+            return 0;
+        if (first > last || first < 0) {
+            editorSetStatusMessage("Invalid range");
+            return 1;
+        }
+        indent_shift(first, last, dir == '>' ? n : -n);
+        return 1;
+    }
+    if (strncmp(p, "retab", 5) == 0) {
+        int all = p[5] == '!';
+        p += 5 + all;
+        if (*p != '\0' && *p != ' ')
+            return 0;
+        if (!ranged) {  // No range: the whole buffer
+            first = 0;
+            last = INT_MAX;
+        }
+        if (first > last || first < 0) {
+            editorSetStatusMessage("Invalid range");
+            return 1;
+        }
+        indent_retab(first, last, atoi(p), all);
+        return 1;
+    }
+    return 0;
+}
+
+// *** Undo Implementation ***
+// An immediate observer of textbuf keeps every edit in undo.records, with the removed and
+// the inserted text in undo.text. The edits between two seals (every key outside insert
+// mode seals the unit before it) form one unit: u undoes it, Ctrl-R redoes it. Records
+// that each lie before the previous one, as bufclient_apply_edits emits a batch, do not
+// shift each other, so they are undone and redone as one batch again. Typing and a
+// removal followed by an insertion at the same place extend one record. A case change
+// keeps only its old text (~ not even that) and is undone and redone in place.
+// Editing after undoing starts a branch: the units form a tree (undo.tree, in the order
+// they were made), and :earlier/:later move through it by that order or by time. Every
+// UNDO_CHECKPOINT_EVERY records the text of the current state is kept as a checkpoint,
+// whose chunks are shared with the other checkpoints where they are the same, so a long
+// way through the tree starts from the nearest checkpoint instead of replaying it all.
+
+// End the current unit, keeping a checkpoint if it has been a while
+void undo_seal() {
+    if (undo.held)
+        return;
+    if (!undo.sealed && !undo.skipping &&
+        undo.recorded - (undo.checkpoint_count > 0 ? undo.checkpoints[undo.checkpoint_count - 1].at : 0) >= UNDO_CHECKPOINT_EVERY)
+        undo_checkpoint();
+    undo.sealed = 1;
+    undo.skipping = 0;
+}
+
+// The buffer matches the file now (undoing or redoing back here makes it clean again)
+void undo_mark_saved() {
+    undo.saved = undo.cur;
+}
+
+// Back to the static space for records, text and units (dropping the mapping of an undo file)
+static void undo_unmap() {
+    if (undo.map_records != NULL) {
+        munmap(undo.map_records, UNDO_RECORDS_MAX * sizeof(struct undorecord));
+        munmap(undo.map_text, UNDO_TEXT_SIZE);
+        munmap(undo.map_units, UNDO_UNITS_MAX * sizeof(struct undounit));
+        undo.map_records = NULL;
+        undo.map_text = NULL;
+        undo.map_units = NULL;
+    }
+    undo.records = undo_records;
+    undo.text = undo_text;
+    undo.tree = undo_units;
+}
+
+// Records from k on no longer match the undo file
+static void undo_changed_from(int k) {
+    if (undo.persisted > k)
+        undo.persisted = k;
+}
+
+// Unit Ctrl-R redoes from state s
+static int undo_redo_child(int s) {
+    return s >= 0 ? undo.tree[s].redo_child : undo.root_redo;
+}
+
+static void undo_set_redo_child(int s, int child) {
+    if (s >= 0)
+        undo.tree[s].redo_child = child;
+    else
+        undo.root_redo = child;
+}
+
+// Where the ways from states a and b up the tree meet
+static int undo_meet(int a, int b) {
+    while (a != b) {
+        if (b < 0 || (a >= 0 && undo.tree[a].depth >= undo.tree[b].depth))
+            a = undo.tree[a].parent;
+        else
+            b = undo.tree[b].parent;
+    }
+    return a;
+}
+
+// Records undone and redone on the way from state a to state b
+static long long undo_distance(int a, int b) {
+    int meet = undo_meet(a, b);
+    long long n = 0;
+    for (; a != meet; a = undo.tree[a].parent)
+        n += undo.tree[a].count;
+    for (; b != meet; b = undo.tree[b].parent)
+        n += undo.tree[b].count;
+    return n;
+}
+
+// Hash of one piece of text, 8 bytes at a time (the last few one by one)
+static uint64_t undo_hash_bytes(uint64_t h, const char* p, int n) {
+    uint64_t w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 32;
+    }
+    return diff_hash_step(h, p, n);
+}
+
+// The piece holding the size bytes of data, shared if a checkpoint already has them
+static int undo_piece(const char* data, int size) {
+    uint64_t hash = undo_hash_bytes(DIFF_HASH_SEED, data, size);
+    int* bucket = &undo.piece_hash[hash & (UNDO_PIECE_HASH - 1)];
+    struct undopiece* piece;
+    int i;
+    for (i = *bucket; i != 0; i = undo_pieces[i - 1].next) {
+        piece = &undo_pieces[i - 1];
+        if (piece->hash == hash && piece->size == size && memcmp(piece->data, data, size) == 0) {
+            piece->refs++;
+            return i - 1;
+        }
+    }
+    if (undo.piece_free != 0) {
+        i = undo.piece_free - 1;
+        undo.piece_free = undo_pieces[i].next;
+    } else {
+        i = undo.pieces_used++;
+    }
+    piece = &undo_pieces[i];
+    piece->hash = hash;
+    piece->size = size;
+    piece->refs = 1;
+    memcpy(piece->data, data, size);
+    piece->next = *bucket;
+    *bucket = i + 1;
+    undo.pieces_live++;
+    return i;
+}
+
+// Forget checkpoint c (its pieces go when no other checkpoint has them)
+static void undo_drop_checkpoint(int c) {
+    struct undocheckpoint* cp = &undo.checkpoints[c];
+    struct undocheckpoint tmp;
+    int k;
+    for (k = 0; k < cp->pieces; k++) {
+        int i = cp->refs[k];
+        struct undopiece* piece = &undo_pieces[i];
+        if (--piece->refs > 0)
+            continue;
+        int* link = &undo.piece_hash[piece->hash & (UNDO_PIECE_HASH - 1)];
+        while (*link != i + 1)
+            link = &undo_pieces[*link - 1].next;
+        *link = piece->next;
+        piece->next = undo.piece_free;
+        undo.piece_free = i + 1;
+        undo.pieces_live--;
+    }
+    // Keep the others in the order they were taken; the refs go along with theirs
+    tmp = *cp;
+    memmove(cp, cp + 1, (undo.checkpoint_count - c - 1) * sizeof(*cp));
+    undo.checkpoints[--undo.checkpoint_count] = tmp;
+}
+
+// The checkpoint that leaves the smallest gap when it goes (never the newest one)
+static int undo_thinnest_checkpoint() {
+    int c, best = 0;
+    long long best_gap = -1;
+    for (c = 0; c + 1 < undo.checkpoint_count; c++) {
+        long long gap = undo.checkpoints[c + 1].at - (c > 0 ? undo.checkpoints[c - 1].at : 0);
+        if (best_gap < 0 || gap < best_gap) {
+            best = c;
+            best_gap = gap;
+        }
+    }
+    return best;
+}
+
+// Keep the text of the current state. Its chunks become pieces, which the checkpoints
+// share: only those edited since the last checkpoint take new room.
+void undo_checkpoint() {
+    struct bufchunk* chunk;
+    struct undocheckpoint* cp;
+    int c, chunks = 0;
+    for (c = 0; c < undo.checkpoint_count; c++) {
+        if (undo.checkpoints[c].state == undo.cur) {
+            // Back at a state kept already: it becomes the newest checkpoint
+            struct undocheckpoint tmp = undo.checkpoints[c];
+            memmove(&undo.checkpoints[c], &undo.checkpoints[c + 1], (undo.checkpoint_count - c - 1) * sizeof(tmp));
+            tmp.at = undo.recorded;
+            undo.checkpoints[undo.checkpoint_count - 1] = tmp;
+            return;
+        }
+    }
+    for (chunk = textbuf.begin; chunk != NULL; chunk = chunk->next)
+        chunks++;
+    while (undo.checkpoint_count > 0 && (undo.checkpoint_count == UNDO_CHECKPOINTS_MAX || undo.pieces_live + chunks > UNDO_PIECES_MAX))
+        undo_drop_checkpoint(undo.checkpoint_count == 1 ? 0 : undo_thinnest_checkpoint());
+    cp = &undo.checkpoints[undo.checkpoint_count];
+    if (cp->refs == NULL)
+        cp->refs = undo_checkpoint_refs[undo.checkpoint_count];  // (never used yet)
+    undo.checkpoint_count++;
+    cp->state = undo.cur;
+    cp->at = undo.recorded;
+    cp->pieces = 0;
+    for (chunk = textbuf.begin; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size > 0)
+            cp->refs[cp->pieces++] = undo_piece(chunk->data, chunk->size);
+    }
+}
+
+// Next chunk from chunk on that has bytes
+static struct bufchunk* undo_skip_empty(struct bufchunk* chunk) {
+    while (chunk != NULL && chunk->size == 0)
+        chunk = chunk->next;
+    return chunk;
+}
+
+// Put the text of checkpoint c into the buffer. Its pieces are matched against the
+// chunks in order; where they differ, the nearest chunk and piece (within
+// UNDO_RESTORE_WINDOW of each) that are the same again end one edit, so only the runs
+// edited since the checkpoint are replaced. The removals go first, as their own batch,
+// so the pool never holds both the old and the new text of a run.
+static int undo_restore(int c) {
+    struct undocheckpoint* cp = &undo.checkpoints[c];
+    struct bufchunk* head = undo_skip_empty(textbuf.begin);
+    struct bufchunk* window[UNDO_RESTORE_WINDOW];
+    uint64_t hashes[UNDO_RESTORE_WINDOW];
+    int i = 0, abs_i = 0, len = 0, m = 0, k, shift;
+    while (head != NULL || i < cp->pieces) {
+        struct undopiece* piece = i < cp->pieces ? &undo_pieces[cp->refs[i]] : NULL;
+        if (head != NULL && piece != NULL && piece->size == head->size && memcmp(piece->data, head->data, head->size) == 0) {
+            abs_i += head->size;
+            head = undo_skip_empty(head->next);
+            i++;
+            continue;
+        }
+        int chunks = 0, pieces = cp->pieces - i < UNDO_RESTORE_WINDOW ? cp->pieces - i : UNDO_RESTORE_WINDOW;
+        struct bufchunk* chunk;
+        for (chunk = head; chunk != NULL && chunks < UNDO_RESTORE_WINDOW; chunk = undo_skip_empty(chunk->next)) {
+            window[chunks] = chunk;
+            hashes[chunks++] = undo_hash_bytes(DIFF_HASH_SEED, chunk->data, chunk->size);
+        }
+        int a = -1, b = -1, sum, x;
+        for (sum = 1; a < 0 && sum < chunks + pieces - 1; sum++) {
+            for (x = sum >= pieces ? sum - pieces + 1 : 0; x <= sum && x < chunks; x++) {
+                piece = &undo_pieces[cp->refs[i + sum - x]];
+                if (piece->hash == hashes[x] && piece->size == window[x]->size && memcmp(piece->data, window[x]->data, piece->size) == 0) {
+                    a = x;
+                    b = sum - x;
+                    break;
+                }
+            }
+        }
+        // Replace chunks head.. (a of them, or all that are left) with pieces i.. (b of them)
+        struct bufedit* e = &undo.edits[m++];
+        e->offset = abs_i;
+        e->removed = 0;
+        e->text = undo_restore_text + len;
+        for (x = 0; head != NULL && (a < 0 || x < a); x++) {
+            e->removed += head->size;
+            head = undo_skip_empty(head->next);
+        }
+        for (x = 0; i < cp->pieces && (b < 0 || x < b); x++, i++) {
+            memcpy(undo_restore_text + len, undo_pieces[cp->refs[i]].data, undo_pieces[cp->refs[i]].size);
+            len += undo_pieces[cp->refs[i]].size;
+        }
+        e->inserted = (int)(undo_restore_text + len - e->text);
+        abs_i += e->removed;
+    }
+    if (m == 0)
+        return 1;
+    for (k = 0; k < m; k++)
+        undo.edits[k].inserted = 0;
+    if (bufclient_apply_edits(&textbuf, undo.edits, m, undo.edits[0].offset) != RESULT_OK)
+        return 0;
+    for (k = 0, shift = 0; k < m; k++) {  // Each text runs up to the next one's
+        undo.edits[k].offset -= shift;
+        shift += undo.edits[k].removed;
+        undo.edits[k].removed = 0;
+        undo.edits[k].inserted = (int)((k + 1 < m ? undo.edits[k + 1].text : undo_restore_text + len) - undo.edits[k].text);
+    }
+    return bufclient_apply_edits(&textbuf, undo.edits, m, undo.edits[0].offset) == RESULT_OK;
+}
+
+// Forget the whole history: the buffer is the oldest state now
+static void undo_clear() {
+    undo.count = 0;
+    undo.text_len = 0;
+    undo.units = 0;
+    undo.cur = -1;
+    undo.root_redo = -1;
+    undo.root_depth = -1;
+    undo.root_time = time(NULL);
+    undo.saved = UNDO_UNIT_LOST;
+    undo.persisted = 0;
+    undo.persisted_units = 0;
+    while (undo.checkpoint_count > 0)
+        undo_drop_checkpoint(undo.checkpoint_count - 1);
+}
+
+// State s once units before kd are dropped and new_root is the oldest state
+static int undo_drop_state(int s, int kd, int new_root) {
+    if (s >= kd)
+        return undo.tree[s].parent == UNDO_UNIT_LOST ? UNDO_UNIT_LOST : s - kd;
+    return s == new_root ? -1 : UNDO_UNIT_LOST;
+}
+
+// Drop the units before kd with their records. The oldest state becomes the newest of
+// them that the current state was made from; branches that started from any other of
+// them can no longer be reached.
+static void undo_drop(int kd) {
+    int k = kd < undo.units ? undo.tree[kd].first : undo.count;
+    int text_at = k < undo.count ? undo.records[k].text_at : undo.text_len;
+    int new_root = undo.cur, u, c;
+    while (new_root >= kd)
+        new_root = undo.tree[new_root].parent;
+    for (u = kd; u < undo.units; u++) {
+        struct undounit* unit = &undo.tree[u];
+        unit->parent = unit->parent == UNDO_UNIT_LOST ? UNDO_UNIT_LOST : undo_drop_state(unit->parent, kd, new_root);
+        unit->redo_child = unit->redo_child >= kd ? unit->redo_child - kd : -1;
+        unit->first -= k;
+    }
+    if (new_root >= 0) {
+        undo.root_redo = undo.tree[new_root].redo_child;
+        undo.root_depth = undo.tree[new_root].depth;
+        undo.root_time = undo.tree[new_root].time;
+    }
+    undo.root_redo = undo.root_redo >= kd ? undo.root_redo - kd : -1;
+    undo.saved = undo.saved == UNDO_UNIT_LOST ? UNDO_UNIT_LOST : undo_drop_state(undo.saved, kd, new_root);
+    for (c = undo.checkpoint_count - 1; c >= 0; c--) {
+        struct undocheckpoint* cp = &undo.checkpoints[c];
+        cp->state = undo_drop_state(cp->state, kd, new_root);
+        if (cp->state == UNDO_UNIT_LOST)
+            undo_drop_checkpoint(c);
+    }
+    undo.cur = undo.cur >= kd ? undo.cur - kd : -1;
+
+    memmove(undo.text, undo.text + text_at, undo.text_len - text_at);
+    memmove(undo.records, undo.records + k, (undo.count - k) * sizeof(undo.records[0]));
+    memmove(undo.tree, undo.tree + kd, (undo.units - kd) * sizeof(undo.tree[0]));
+    undo.count -= k;
+    undo.text_len -= text_at;
+    undo.units -= kd;
+    undo.persisted = 0;  // Everything moved
+    undo.persisted_units = 0;
+    for (u = 0; u < undo.count; u++) {
+        undo.records[u].text_at -= text_at;
+        undo.records[u].unit -= kd;
+    }
+}
+
+// Drop the oldest units until a record with len bytes of text (and the unit it starts,
+// if sealed) fits. The unit being recorded stays whole; 0 if that is not enough.
+static int undo_make_room(int len) {
+    while (undo.count == UNDO_RECORDS_MAX || undo.text_len + len > UNDO_TEXT_SIZE || (undo.sealed && undo.units == UNDO_UNITS_MAX)) {
+        int older = undo.sealed ? undo.units : undo.cur;  // Units that may go
+        if (older == 0)
+            return 0;
+        int k = (older < undo.units ? undo.tree[older].first : undo.count) / 2;  // About half of their records
+        int kd = undo.records[k].unit + 1;
+        undo_drop(kd > 0 && kd <= older ? kd : older);
+    }
+    return 1;
+}
+
+// Record that removed bytes at offset are about to go, or that inserted bytes arrived
+// there (both are read from the buffer)
+static void undo_add(struct bufclient* buf, int offset, int removed, int inserted) {
+    struct undorecord* r;
+    int len = removed + inserted;
+    if (undo.applying || undo.skipping)
+        return;
+    r = !undo.sealed ? &undo.records[undo.count - 1] : NULL;  // Last one of the unit being recorded
+    if (undo.case_kind != 0 && r != NULL && removed == 0 && offset == r->offset && r->inserted == 0 && r->removed == inserted) {
+        // The new text of a case change: redo makes it again from the old one
+        undo_changed_from(undo.count - 1);
+        r->inserted = inserted;
+        r->kind = undo.case_kind;
+        if (r->kind == CASE_TOGGLE)
+            undo.text_len = r->text_at;  // Toggling again undoes it
+        return;
+    }
+    if (!undo_make_room(len)) {
+        // One unit bigger than the whole history: it cannot be undone, so none of it is kept
+        undo_clear();
+        undo.skipping = 1;
+        editorSetStatusMessage("undo: change too big to undo");
+        return;
+    }
+
+    if (undo.sealed) {
+        // A new unit on the current state (a new branch if that has others already)
+        struct undounit* unit = &undo.tree[undo.units];
+        unit->parent = undo.cur;
+        unit->depth = (undo.cur >= 0 ? undo.tree[undo.cur].depth : undo.root_depth) + 1;
+        unit->first = undo.count;
+        unit->count = 0;
+        unit->redo_child = -1;
+        unit->time = time(NULL);
+        undo_set_redo_child(undo.cur, undo.units);
+        undo.cur = undo.units++;
+        undo.sealed = 0;
+        r = NULL;
+    } else {
+        r = &undo.records[undo.count - 1];
+    }
+    if (r != NULL && removed == 0 && offset == r->offset + r->inserted) {
+        r->inserted += inserted;  // Its text ends where this one's goes
+        undo_changed_from(undo.count - 1);
+    } else {
+        r = &undo.records[undo.count++];
+        r->offset = offset;
+        r->removed = removed;
+        r->inserted = inserted;
+        r->text_at = undo.text_len;
+        r->unit = undo.cur;
+        r->kind = 0;
+        undo.tree[undo.cur].count++;
+        undo.recorded++;
+    }
+    bufclient_read(buf, offset, undo.text + undo.text_len, len);
+    undo.text_len += len;
+}
+
+static void undo_before_remove(struct bufclient* buf, int offset, int removed, void* ctx) {
+    (void)ctx;
+    undo_add(buf, offset, removed, 0);
+}
+
+static void undo_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int k;
+    (void)ctx;
+    for (k = 0; k < count; k++) {
+        if (deltas[k].inserted > 0)
+            undo_add(buf, deltas[k].offset, 0, deltas[k].inserted);  // Removals came through undo_before_remove
+    }
+}
+
+// Hash of the text of the chunks from begin on: 8 bytes at a time, whatever the chunk sizes
+static uint64_t undo_hash_chunks(const struct bufchunk* begin) {
+    const struct bufchunk* chunk;
+    uint64_t h = DIFF_HASH_SEED, w, size = 0;
+    unsigned char part[8];  // Bytes of a word split between chunks
+    int fill = 0;
+    for (chunk = begin; chunk != NULL; chunk = chunk->next) {
+        const char* p = chunk->data;
+        int n = chunk->size;
+        size += n;
+        while (fill > 0 && n > 0) {
+            part[fill++] = (unsigned char)*p++;
+            n--;
+            if (fill == 8) {
+                memcpy(&w, part, 8);
+                h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+                h ^= h >> 32;
+                fill = 0;
+            }
+        }
+        for (; n >= 8; p += 8, n -= 8) {
+            memcpy(&w, p, 8);
+            h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 32;
+        }
+        while (n > 0) {
+            part[fill++] = (unsigned char)*p++;
+            n--;
+        }
+    }
+    return diff_hash_step(h, (const char*)part, fill) ^ size;
+}
+
+// Hash of the text of textbuf (keys undo files)
+static uint64_t undo_hash_text() {
+    return undo_hash_chunks(textbuf.begin);
+}
+
+// The undo file of path: ".<name>.un~" in the same directory; 0 if that does not fit
+static int undo_file_path(const char* path, char* out, int size) {
+    const char* slash = strrchr(path, '/');
+    int dir_len = slash != NULL ? (int)(slash - path) + 1 : 0;
+    int n = snprintf(out, size, "%.*s.%s.un~", dir_len, path, path + dir_len);
+    return path[0] != '\0' && n > 0 && n < size;
+}
+
+static int undo_pwrite(int fd, const void* data, size_t len, off_t at) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, at);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+        at += n;
+    }
+    return 1;
+}
+
+// After a save: write the history to the undo file of the file. The records and units
+// added since the last write are appended when the file still holds the ones before them
+// and has room; otherwise a new file (with twice the room needed) replaces it.
+void undo_save_file() {
+    char path[PATH_MAX], tmp[PATH_MAX + 24];
+    struct undofileheader header;
+    int fd, from, ok;
+    if (undo.no_file || undo.observer.notify == NULL || undo.count == 0 || !undo_file_path(textbuf.filename, path, sizeof(path)))
+        return;
+    int append = undo.persisted > 0 && strcmp(path, undo.file) == 0 && undo.count <= undo.file_rec_cap && undo.text_len <= undo.file_text_cap &&
+                 undo.units <= undo.file_unit_cap;
+    if (!append) {
+        undo.file_rec_cap = UNDO_FILE_RECORDS_MIN;
+        while (undo.file_rec_cap < 2 * undo.count && undo.file_rec_cap < UNDO_RECORDS_MAX)
+            undo.file_rec_cap *= 2;
+        undo.file_text_cap = UNDO_FILE_TEXT_MIN;
+        while (undo.file_text_cap < 2 * undo.text_len && undo.file_text_cap < UNDO_TEXT_SIZE)
+            undo.file_text_cap *= 2;
+        undo.file_unit_cap = UNDO_FILE_UNITS_MIN;
+        while (undo.file_unit_cap < 2 * undo.units && undo.file_unit_cap < UNDO_UNITS_MAX)
+            undo.file_unit_cap *= 2;
+    }
+    off_t text_at = UNDO_FILE_PAGE + (off_t)undo.file_rec_cap * sizeof(struct undorecord);
+    off_t units_at = text_at + undo.file_text_cap;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UNDO_FILE_MAGIC, sizeof(header.magic));
+    header.hash = undo_hash_text();
+    header.size = textbuf.size;
+    header.record_size = sizeof(struct undorecord);
+    header.unit_size = sizeof(struct undounit);
+    header.rec_cap = undo.file_rec_cap;
+    header.text_cap = undo.file_text_cap;
+    header.unit_cap = undo.file_unit_cap;
+    header.count = undo.count;
+    header.text_len = undo.text_len;
+    header.units = undo.units;
+    header.cur = undo.cur;
+    header.root_depth = undo.root_depth;
+    header.root_time = undo.root_time;
+
+    // A new file is written aside and renamed over the old one (which may be mapped). Links
+    // are not followed: one planted in a shared directory cannot redirect the write.
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (!append)
+        unlink(tmp);  // Left by a crash
+    fd = append ? open(path, O_WRONLY | O_NOFOLLOW) : open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        undo.file[0] = '\0';
+        return;
+    }
+    from = append ? undo.persisted : 0;
+    int text_from = from < undo.count ? undo.records[from].text_at : undo.text_len;
+    int unit_from = append && undo.persisted_units > 0 ? undo.persisted_units - 1 : 0;  // (the last one may have grown)
+    ok = (append || ftruncate(fd, units_at + (off_t)undo.file_unit_cap * sizeof(struct undounit)) == 0) &&
+         undo_pwrite(fd, undo.records + from, (size_t)(undo.count - from) * sizeof(struct undorecord), UNDO_FILE_PAGE + (off_t)from * sizeof(struct undorecord)) &&
+         undo_pwrite(fd, undo.text + text_from, undo.text_len - text_from, text_at + text_from) &&
+         undo_pwrite(fd, undo.tree + unit_from, (size_t)(undo.units - unit_from) * sizeof(struct undounit), units_at + (off_t)unit_from * sizeof(struct undounit)) &&
+         undo_pwrite(fd, &header, sizeof(header), 0);  // Last: a cut short write leaves the old history
+    if (close(fd) != 0)
+        ok = 0;
+    if (ok && !append && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok) {
+        char msg[STATUS_BUF_SIZE];
+        if (!append)
+            unlink(tmp);
+        undo.file[0] = '\0';
+        undo.persisted = 0;
+        undo.persisted_units = 0;
+        snprintf(msg, sizeof(msg), "undo file: %s", strerror(errno));
+        editorSetStatusMessage(msg);
+        return;
+    }
+    snprintf(undo.file, sizeof(undo.file), "%s", path);
+    undo.persisted = undo.count;
+    undo.persisted_units = undo.units;
+}
+
+// Whether the records of unit u of a loaded history are sound: its own, of a known kind,
+// with their text within the text_len bytes kept. With offsets set, each must also lie in
+// the text it was made on, *size bytes before the unit. Adds the change in size to *size.
+static int undo_check_unit(const struct undorecord* records, const struct undounit* unit, int u, int text_len, int offsets, int* size) {
+    int k;
+    for (k = unit->first; k < unit->first + unit->count; k++) {
+        const struct undorecord* r = &records[k];
+        long long kept = r->kind == 0 ? (long long)r->removed + r->inserted : r->kind == CASE_TOGGLE ? 0 : r->removed;
+        if (r->unit != u || r->kind < 0 || r->kind > CASE_TOGGLE || r->removed < 0 || r->inserted < 0 ||
+            (r->kind != 0 && r->removed != r->inserted) || r->text_at < 0 || r->text_at + kept > text_len ||
+            r->offset < 0 || (offsets && (long long)r->offset + r->removed > *size))
+            return 0;
+        *size += r->inserted - r->removed;
+        if (*size < -BUFCHUNK_COUNT * BUFCHUNK_SIZE || *size > BUFCHUNK_COUNT * BUFCHUNK_SIZE)
+            return 0;  // No text the buffer can hold
+    }
+    return 1;
+}
+
+// After a file was loaded: take up the history of its undo file if that leads to this
+// very text. The file is mapped privately under undo.records, undo.text and undo.tree,
+// so its pages are read only when undo reaches them (the units are checked, and get their
+// redo_child back: the newest child; their depths and times are checked, and every record
+// against the text it was made on). The file must be the user's own. Returns the records
+// that can be undone.
+int undo_load_file() {
+    char path[PATH_MAX];
+    struct undofileheader header;
+    struct stat st;
+    int fd, u;
+    if (undo.no_file || undo.observer.notify == NULL || !undo_file_path(textbuf.filename, path, sizeof(path)))
+        return 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, UNDO_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(struct undorecord) || header.unit_size != sizeof(struct undounit) || header.size != textbuf.size ||
+        header.rec_cap < UNDO_FILE_RECORDS_MIN || header.rec_cap > UNDO_RECORDS_MAX || header.rec_cap % UNDO_FILE_RECORDS_MIN != 0 ||
+        header.text_cap < UNDO_FILE_TEXT_MIN || header.text_cap > UNDO_TEXT_SIZE || header.text_cap % UNDO_FILE_PAGE != 0 ||
+        header.unit_cap < UNDO_FILE_UNITS_MIN || header.unit_cap > UNDO_UNITS_MAX || header.unit_cap % UNDO_FILE_UNITS_MIN != 0 ||
+        header.count <= 0 || header.count > header.rec_cap || header.text_len < 0 || header.text_len > header.text_cap ||
+        header.units <= 0 || header.units > header.unit_cap || header.cur < -1 || header.cur >= header.units ||
+        header.root_depth < -1 || header.root_depth > INT_MAX - UNDO_UNITS_MAX || header.root_time < 0 || header.root_time > UNDO_FILE_TIME_MAX ||
+        fstat(fd, &st) != 0 || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+        st.st_size < UNDO_FILE_PAGE + (off_t)header.rec_cap * sizeof(struct undorecord) + header.text_cap + (off_t)header.unit_cap * sizeof(struct undounit) ||
+        header.hash != undo_hash_text()) {
+        close(fd);
+        return 0;
+    }
+    off_t text_at = UNDO_FILE_PAGE + (off_t)header.rec_cap * sizeof(struct undorecord);
+    off_t units_at = text_at + header.text_cap;
+
+    // Reserve the whole space, then put the file over its start (copied on write)
+    void* records = mmap(NULL, UNDO_RECORDS_MAX * sizeof(struct undorecord), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void* text = mmap(NULL, UNDO_TEXT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void* units = mmap(NULL, UNDO_UNITS_MAX * sizeof(struct undounit), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (records == MAP_FAILED || text == MAP_FAILED || units == MAP_FAILED ||
+        mmap(records, (size_t)header.rec_cap * sizeof(struct undorecord), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, UNDO_FILE_PAGE) == MAP_FAILED ||
+        mmap(text, header.text_cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, text_at) == MAP_FAILED ||
+        mmap(units, (size_t)header.unit_cap * sizeof(struct undounit), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, units_at) == MAP_FAILED) {
+        if (records != MAP_FAILED)
+            munmap(records, UNDO_RECORDS_MAX * sizeof(struct undorecord));
+        if (text != MAP_FAILED)
+            munmap(text, UNDO_TEXT_SIZE);
+        if (units != MAP_FAILED)
+            munmap(units, UNDO_UNITS_MAX * sizeof(struct undounit));
+        close(fd);
+        return 0;
+    }
+    close(fd);  // The mappings keep the file
+
+    struct undounit* tree = units;
+    int root_redo = -1, next_first = 0, size;
+    for (u = 0; u < header.units; u++) {
+        struct undounit* unit = &tree[u];
+        if (unit->parent < UNDO_UNIT_LOST || unit->parent >= u || (unit->parent >= 0 && tree[unit->parent].parent == UNDO_UNIT_LOST) ||
+            unit->first != next_first || unit->count <= 0 || unit->count > header.count - unit->first ||
+            (unit->parent != UNDO_UNIT_LOST && unit->depth != (unit->parent >= 0 ? tree[unit->parent].depth : header.root_depth) + 1) ||
+            unit->time < 0 || unit->time > UNDO_FILE_TIME_MAX)
+            break;
+        undo_sizes[u] = unit->parent >= 0 ? undo_sizes[unit->parent] : 0;  // From the oldest state for now
+        if (!undo_check_unit(records, unit, u, header.text_len, 0, &undo_sizes[u]))
+            break;
+        next_first += unit->count;
+        unit->redo_child = -1;
+        if (unit->parent >= 0)
+            tree[unit->parent].redo_child = u;
+        else if (unit->parent == -1)
+            root_redo = u;
+    }
+    // Now that the size of the oldest state is known, the offsets (units cut off from the
+    // history are never applied)
+    int root_size = (int)header.size - (u == header.units && header.cur >= 0 ? undo_sizes[header.cur] : 0);
+    if (u == header.units && next_first == header.count && root_size >= 0) {
+        for (u = 0; u < header.units; u++) {
+            size = root_size + (tree[u].parent >= 0 ? undo_sizes[tree[u].parent] : 0);
+            if (tree[u].parent != UNDO_UNIT_LOST && !undo_check_unit(records, &tree[u], u, header.text_len, 1, &size))
+                break;
+        }
+    }
+    if (u < header.units || next_first != header.count || root_size < 0 || (header.cur >= 0 && tree[header.cur].parent == UNDO_UNIT_LOST)) {
+        munmap(records, UNDO_RECORDS_MAX * sizeof(struct undorecord));
+        munmap(text, UNDO_TEXT_SIZE);
+        munmap(units, UNDO_UNITS_MAX * sizeof(struct undounit));
+        return 0;
+    }
+
+    undo_unmap();
+    undo_clear();
+    undo.map_records = records;
+    undo.map_text = text;
+    undo.map_units = units;
+    undo.records = records;
+    undo.text = text;
+    undo.tree = tree;
+    undo.count = header.count;
+    undo.text_len = header.text_len;
+    undo.units = header.units;
+    undo.cur = header.cur;
+    undo.saved = header.cur;
+    undo.root_redo = root_redo;
+    undo.root_depth = header.root_depth;
+    undo.root_time = header.root_time;
+    undo.sealed = 1;
+    undo.persisted = header.count;
+    undo.persisted_units = header.units;
+    undo.file_rec_cap = header.rec_cap;
+    undo.file_text_cap = header.text_cap;
+    undo.file_unit_cap = header.unit_cap;
+    snprintf(undo.file, sizeof(undo.file), "%s", path);
+    return (int)undo_distance(undo.cur, -1);
+}
+
+// Start recording the edits of textbuf, with an empty history (a file was loaded)
+void undo_track() {
+    if (server_mode || undo.observer.notify != NULL)
+        return;
+    undo_unmap();
+    undo_clear();
+    undo.saved = textbuf.dirty ? UNDO_UNIT_LOST : -1;
+    undo.sealed = 1;
+    undo.skipping = 0;
+    undo.file[0] = '\0';
+    undo.observer.notify = undo_on_edit;
+    undo.observer.before_remove = undo_before_remove;
+    if (bufclient_observe(&textbuf, &undo.observer) != RESULT_OK)
+        undo.observer.notify = NULL;
+}
+
+// Stop recording (before a file is loaded)
+void undo_untrack() {
+    if (undo.observer.notify == NULL)
+        return;
+    bufclient_unobserve(&textbuf, &undo.observer);
+    undo.observer.notify = NULL;
+}
+
+// After a batch of u/Ctrl-R failed part way, the history no longer matches the buffer
+static void undo_lost() {
+    undo.applying = 0;
+    undo_clear();
+    editorSetStatusMessage("undo: out of memory, history cleared");
+}
+
+static void undo_report(int records, const char* what) {
+    char msg[STATUS_BUF_SIZE];
+    textbuf.dirty = undo.cur != undo.saved;
+    snprintf(msg, sizeof(msg), "%d change%s %s", records, records == 1 ? "" : "s", what);
+    editorSetStatusMessage(msg);
+}
+
+// The edits until undo_note_case(0) are case changes of kind (enum caseKind)
+void undo_note_case(int kind) {
+    undo.case_kind = kind;
+}
+
+// Undo (or redo) records start..end-1, case changes of one kind at ascending places, in
+// place: the old text is copied back (or the case changed again; ~ undoes itself)
+static void undo_apply_case(int start, int end, int undoing) {
+    int j, m = 0, kind = undo.records[start].kind;
+    for (j = start; j < end; j++) {
+        struct undorecord* r = &undo.records[j];
+        undo.edits[m].offset = r->offset;
+        undo.edits[m].removed = r->removed;
+        undo.edits[m].text = undo.text + r->text_at;
+        undo.edits[m].inserted = r->removed;
+        m++;
+    }
+    bufclient_rewrite(&textbuf, undo.edits, m, undoing && kind != CASE_TOGGLE ? 0 : kind);
+    bufclient_move_cursor_to(&textbuf, undo.edits[0].offset);
+}
+
+// Take the edits of unit u back out of the buffer (with undo.applying set); 0 if the
+// buffer ran out of memory part way
+static int undo_unit_undo(int u) {
+    int first = undo.tree[u].first, k;
+    for (k = first + undo.tree[u].count; k > first;) {
+        int m = 0, shift = 0;  // shift: what the records put in the batch add before the next one
+        if (undo.records[k - 1].kind != 0) {
+            int start = k - 1;
+            while (start > first && k - start < UNDO_BATCH && undo.records[start - 1].kind == undo.records[k - 1].kind &&
+                   undo.records[start - 1].offset + undo.records[start - 1].removed <= undo.records[start].offset)
+                start--;
+            undo_apply_case(start, k, 1);
+            k = start;
+            continue;
+        }
+        // Records k-1, k-2, ... while each lies after the one before it in the batch
+        do {
+            struct undorecord* r = &undo.records[--k];
+            undo.edits[m].offset = r->offset + shift;
+            undo.edits[m].removed = r->inserted;
+            undo.edits[m].text = undo.text + r->text_at;
+            undo.edits[m].inserted = r->removed;
+            shift += r->inserted - r->removed;
+            m++;
+        } while (k > first && m < UNDO_BATCH && undo.records[k - 1].kind == 0 && undo.records[k].offset + undo.records[k].removed <= undo.records[k - 1].offset);
+        if (bufclient_apply_edits(&textbuf, undo.edits, m, undo.edits[0].offset) != RESULT_OK)
+            return 0;
+    }
+    return 1;
+}
+
+// Put the edits of unit u (made on the state the buffer is in) back in
+static int undo_unit_redo(int u) {
+    int last = undo.tree[u].first + undo.tree[u].count, k, j;
+    for (k = undo.tree[u].first; k < last;) {
+        int end = k + 1, m = 0;
+        if (undo.records[k].kind != 0) {
+            while (end < last && end - k < UNDO_BATCH && undo.records[end].kind == undo.records[k].kind &&
+                   undo.records[end - 1].offset + undo.records[end - 1].removed <= undo.records[end].offset)
+                end++;
+            undo_apply_case(k, end, 0);
+            k = end;
+            continue;
+        }
+        while (end < last && end - k < UNDO_BATCH && undo.records[end].kind == 0 && undo.records[end].offset + undo.records[end].removed <= undo.records[end - 1].offset)
+            end++;
+        for (j = end - 1; j >= k; j--) {  // Ascending: the last record is the lowest
+            struct undorecord* r = &undo.records[j];
+            undo.edits[m].offset = r->offset;
+            undo.edits[m].removed = r->removed;
+            undo.edits[m].text = undo.text + r->text_at + r->removed;
+            undo.edits[m].inserted = r->inserted;
+            m++;
+        }
+        if (bufclient_apply_edits(&textbuf, undo.edits, m, undo.edits[0].offset) != RESULT_OK)
+            return 0;
+        k = end;
+    }
+    return 1;
+}
+
+// u: take the unit of the current state back out, to the state it was made on. The
+// cursor goes to the first place it changed.
+void undo_undo() {
+    int u = undo.cur;
+    if (server_mode) {
+        editorSetStatusMessage("undo: not available in server mode");
+        return;
+    }
+    if (u < 0) {
+        editorSetStatusMessage("Already at oldest change");
+        return;
+    }
+    undo.applying = 1;
+    if (!undo_unit_undo(u)) {
+        undo_lost();
+        return;
+    }
+    undo.applying = 0;
+    undo.cur = undo.tree[u].parent;
+    undo_set_redo_child(undo.cur, u);
+    undo_report(undo.tree[u].count, "undone");
+}
+
+// Ctrl-R: put the unit undone last (or the newest one made here) back in
+void undo_redo() {
+    int u = undo_redo_child(undo.cur);
+    if (server_mode) {
+        editorSetStatusMessage("redo: not available in server mode");
+        return;
+    }
+    if (u < 0) {
+        editorSetStatusMessage("Already at newest change");
+        return;
+    }
+    undo.applying = 1;
+    if (!undo_unit_redo(u)) {
+        undo_lost();
+        return;
+    }
+    undo.applying = 0;
+    undo.cur = u;
+    undo_report(undo.tree[u].count, "redone");
+}
+
+// Bring the buffer to state target, along the tree from the current state or from the
+// checkpoint nearest to it (when that saves more than a quarter of the replays between
+// two checkpoints; putting a checkpoint back costs about as much). Returns the records
+// replayed; -1 if the buffer ran out of memory.
+static long long undo_goto(int target) {
+    int from = undo.cur, meet, n = 0, c, u;
+    long long cost, replayed;
+    int best = -1;
+    if (target < -1 || target >= undo.units || (target >= 0 && undo.tree[target].parent == UNDO_UNIT_LOST))
+        return 0;  // No state of the history
+    cost = undo_distance(from, target);
+    for (c = 0; c < undo.checkpoint_count; c++) {
+        long long k = undo_distance(undo.checkpoints[c].state, target) + UNDO_CHECKPOINT_EVERY / 4;
+        if (k < cost) {
+            cost = k;
+            best = c;
+        }
+    }
+    undo.applying = 1;
+    if (best >= 0) {
+        if (!undo_restore(best))
+            return -1;
+        from = undo.checkpoints[best].state;
+        undo.cur = from;
+    }
+    replayed = undo_distance(from, target);
+    meet = undo_meet(from, target);
+    for (u = from; u != meet; u = undo.tree[u].parent) {
+        if (!undo_unit_undo(u))
+            return -1;
+        undo_set_redo_child(undo.tree[u].parent, u);
+    }
+    for (u = target; u != meet && n < UNDO_UNITS_MAX; u = undo.tree[u].parent)
+        undo_path[n++] = u;
+    while (n > 0) {
+        u = undo_path[--n];
+        if (!undo_unit_redo(u))
+            return -1;
+        undo_set_redo_child(undo.tree[u].parent, u);
+    }
+    undo.applying = 0;
+    undo.cur = target;
+    return replayed;
+}
+
+// :earlier [count] / :later [count]: go back or forward count units in the order they
+// were made (whichever branch they are on), or count seconds, minutes, hours or days
+// (count followed by s, m, h or d) from when the current state was made
+void undo_travel(const char* arg, int forward) {
+    char msg[STATUS_BUF_SIZE];
+    char* end;
+    long n = 1;
+    int seconds = 0, target;
+    while (isspace((unsigned char)*arg))
+        arg++;
+    if (*arg != '\0') {
+        n = strtol(arg, &end, 10);
+        seconds = *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 0;
+        if (end == arg || n <= 0 || (seconds == 0 && *end != '\0') || (seconds != 0 && end[1] != '\0')) {
+            editorSetStatusMessage(forward ? "later: expected a count, or a time like 10s, 5m, 2h, 1d" : "earlier: expected a count, or a time like 10s, 5m, 2h, 1d");
+            return;
+        }
+        if (n > INT_MAX)
+            n = INT_MAX;  // Past every unit and every time kept
+    }
+    if (server_mode || undo.observer.notify == NULL) {
+        editorSetStatusMessage("undo: not available in server mode");
+        return;
+    }
+
+    if (seconds == 0) {
+        target = forward ? (n < undo.units - undo.cur ? undo.cur + (int)n : undo.units - 1) : (n <= undo.cur ? undo.cur - (int)n : -1);
+    } else {
+        long long when = (undo.cur >= 0 ? undo.tree[undo.cur].time : undo.root_time) + (forward ? 1 : -1) * (long long)n * seconds;
+        for (target = undo.units - 1; target >= 0 && undo.tree[target].time > when; target--)
+            ;
+        if (forward && target < undo.cur)
+            target = undo.cur;
+    }
+    while (target >= 0 && undo.tree[target].parent == UNDO_UNIT_LOST && (!forward || target > undo.cur))
+        target--;  // Cut off: the one made before it
+    if (target == undo.cur) {
+        editorSetStatusMessage(forward ? "Already at newest change" : "Already at oldest change");
+        return;
+    }
+
+    long long replayed = undo_goto(target);
+    if (replayed < 0) {
+        undo_lost();
+        return;
+    }
+    textbuf.dirty = undo.cur != undo.saved;
+    if (target >= 0) {
+        time_t made = (time_t)undo.tree[target].time;
+        struct tm* tm = localtime(&made);
+        char when[16] = "?";
+        if (tm != NULL)
+            strftime(when, sizeof(when), "%H:%M:%S", tm);
+        snprintf(msg, sizeof(msg), "Change %d of %d, made %s (%lld replayed)", target + 1, undo.units, when, replayed);
+    } else {
+        snprintf(msg, sizeof(msg), "Before change 1 of %d (%lld replayed)", undo.units, replayed);
+    }
+    editorSetStatusMessage(msg);
+}
+
+// *** Autosave Implementation ***
+// With :set autosave=N (seconds) or :set autosaveedits=M, a buffer with unsaved edits is
+// saved N seconds after the last key or once M edits were made. The main loop only copies
+// the chunks (no hashing, no I/O); a pool task hashes the copy, skips the write if that is
+// the text saved last, and writes it as editorSave would (save transforms included). The
+// result comes back through the task's done callback. If nothing was edited meanwhile, the buffer is
+// clean and the undo history is saved with it.
+
+static long long autosave_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Count the edits of textbuf (immediate observer)
+static void autosave_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    (void)buf;
+    (void)deltas;
+    (void)ctx;
+    autosave.edits += count;
+    autosave.serial++;
+}
+
+// Start counting the edits of textbuf
+void autosave_bind() {
+    if (server_mode || autosave.observer.notify != NULL)
+        return;
+    autosave.observer.notify = autosave_on_edit;
+    autosave.last_key_ms = autosave_now_ms();
+    if (bufclient_observe(&textbuf, &autosave.observer) != RESULT_OK)
+        autosave.observer.notify = NULL;
+}
+
+// :set autosave=N, autosaveedits=M, noautosave. Returns 0 if opt is none of them.
+int autosave_set_option(const char* opt) {
+    if (strncmp(opt, "autosave=", 9) == 0) {
+        autosave.idle_seconds = atoi(opt + 9) > 0 ? atoi(opt + 9) : 0;
+    } else if (strncmp(opt, "autosaveedits=", 14) == 0) {
+        autosave.edit_limit = atoi(opt + 14) > 0 ? atoi(opt + 14) : 0;
+    } else if (strcmp(opt, "noautosave") == 0) {
+        autosave.idle_seconds = 0;
+        autosave.edit_limit = 0;
+    } else {
+        return 0;
+    }
+    if (autosave.observer.notify == NULL && (autosave.idle_seconds > 0 || autosave.edit_limit > 0))
+        editorSetStatusMessage("autosave: not available in server mode");
+    return 1;
+}
+
+// There are edits an autosave could write now
+static int autosave_wanted() {
+    return autosave.observer.notify != NULL && !autosave.running && autosave.edits > 0 && textbuf.dirty && textbuf.filename[0] != '\0';
+}
+
+// Hash the copy and write it to job_filename (pool task)
+static void autosave_task(void* arg, int worker) {
+    char path[PATH_MAX], tmp[PATH_MAX + 24];
+    struct stat st;
+    (void)arg;
+    (void)worker;
+    autosave.job_hash = undo_hash_chunks(autosave.job_begin);
+    autosave.job_same = autosave.have_hash && autosave.job_hash == autosave.saved_hash;
+    autosave.job_failed = 0;
+    autosave.job_changed = 0;
+    autosave.job_written = 0;
+    if (autosave.job_same)
+        return;
+
+    // Written aside in the same directory, then renamed over the file: a crash or a full
+    // disk part way leaves the file as it was. A link keeps pointing at the file.
+    if (realpath(autosave.job_filename, path) == NULL)
+        snprintf(path, sizeof(path), "%s", autosave.job_filename);  // Not there yet
+    int existed = stat(path, &st) == 0;
+    const char* slash = strrchr(path, '/');
+    int dir_len = slash != NULL ? (int)(slash - path) + 1 : 0;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.%d.tmp", dir_len, path, path + dir_len, (int)getpid());
+    unlink(tmp);  // Left by a crash
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fp == NULL) {
+        autosave.job_failed = 1;
+        autosave.job_errno = errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+    if (existed && (fchmod(fd, st.st_mode & 07777) != 0 || (fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM))) {
+        autosave.job_failed = 1;  // The file keeps its mode (and its owner where that is allowed)
+    } else if (autosave.job_flags != 0) {
+        autosave.job_failed = save_stream(fp, autosave.job_begin, autosave.job_flags, &autosave.job_written) != RESULT_OK;
+        autosave.job_changed = savestream.changed;
+    } else {
+        struct bufchunk* chunk;
+        for (chunk = autosave.job_begin; chunk != NULL && !autosave.job_failed; chunk = chunk->next) {
+            if (fwrite(chunk->data, 1, chunk->size, fp) != (size_t)chunk->size)
+                autosave.job_failed = 1;
+            autosave.job_written += chunk->size;
+        }
+    }
+    if (!autosave.job_failed && (fflush(fp) != 0 || fsync(fd) != 0))
+        autosave.job_failed = 1;
+    if (fclose(fp) != 0)
+        autosave.job_failed = 1;
+    if (!autosave.job_failed && rename(tmp, path) != 0)
+        autosave.job_failed = 1;
+    autosave.job_errno = errno;
+    if (autosave.job_failed)
+        unlink(tmp);
+}
+
+// Take the result of a finished autosave (done callback of the task)
+static void autosave_finished(void* arg) {
+    char msg[STATUS_BUF_SIZE];
+    (void)arg;
+    autosave.running = 0;
+    if (autosave.job_failed) {
+        snprintf(msg, sizeof(msg), "autosave: \"%.60s\": %s", autosave.job_filename, strerror(autosave.job_errno));
+        editorSetStatusMessage(msg);
+        return;
+    }
+    autosave.saved_hash = autosave.job_hash;
+    autosave.have_hash = 1;
+    if (autosave.serial != autosave.job_serial || strcmp(autosave.job_filename, textbuf.filename) != 0)
+        return;  // Edited (or another file loaded) meanwhile: still dirty
+    textbuf.dirty = 0;
+    undo_mark_saved();
+    if (autosave.job_same)
+        return;
+    if (autosave.job_flags == 0 || !autosave.job_changed)
+        undo_save_file();
+    snprintf(msg, sizeof(msg), "\"%.80s\" %lld bytes autosaved", autosave.job_filename, autosave.job_written);
+    editorSetStatusMessage(msg);
+}
+
+// Copy the chunks of textbuf (those with text) and start writing the copy
+static void autosave_start() {
+    struct bufchunk* chunk;
+    int n = 0;
+    for (chunk = textbuf.begin; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size == 0)
+            continue;
+        struct bufchunk* copy = &autosave_chunks[n];
+        memcpy(copy->data, chunk->data, chunk->size);
+        copy->size = chunk->size;
+        copy->prev = n > 0 ? &autosave_chunks[n - 1] : NULL;
+        copy->next = NULL;
+        if (n > 0)
+            autosave_chunks[n - 1].next = copy;
+        n++;
+    }
+    autosave.job_begin = n > 0 ? autosave_chunks : NULL;
+    autosave.job_serial = autosave.serial;
+    autosave.job_flags = textbuf.save_flags;
+    snprintf(autosave.job_filename, sizeof(autosave.job_filename), "%s", textbuf.filename);
+    autosave.edits = 0;  // Counted again from the copy on
+    if (taskpool_submit(autosave_task, autosave_finished, NULL, TASK_BACKGROUND, NULL, &autosave.tasks) != RESULT_OK) {
+        editorSetStatusMessage("autosave: failed to start writer task");
+        return;
+    }
+    autosave.running = 1;
+}
+
+// Milliseconds until the idle autosave is due (-1: none is waiting)
+int autosave_timeout() {
+    if (autosave.idle_seconds == 0 || !autosave_wanted())
+        return -1;
+    long long left = autosave.last_key_ms + autosave.idle_seconds * 1000LL - autosave_now_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+// The main loop waited without a key: start the idle autosave if it is due
+void autosave_tick() {
+    if (autosave_timeout() == 0)
+        autosave_start();
+}
+
+// A key was handled: the idle time starts again, and enough edits save right away
+void autosave_after_key() {
+    autosave.last_key_ms = autosave_now_ms();
+    if (autosave.edit_limit > 0 && autosave.edits >= autosave.edit_limit && autosave_wanted())
+        autosave_start();
+}
+
+// Let a running autosave finish (before the file is written or replaced otherwise)
+void autosave_wait() {
+    if (!autosave.running)
+        return;
+    taskpool_wait_group(&autosave.tasks);
+    taskpool_deliver();  // Calls autosave_finished
+}
+
+// textbuf matches its file now (:w, or the file was just loaded)
+void autosave_note_saved() {
+    autosave.edits = 0;
+    autosave.have_hash = 0;
+    if (autosave.idle_seconds > 0 || autosave.edit_limit > 0) {
+        autosave.saved_hash = undo_hash_text();
+        autosave.have_hash = 1;
+    }
+}
+
+// *** Session Implementation ***
+// Every file opened gets an entry in the session; leaving it (:e, :bn, a tag or grep jump,
+// :mksession, exit) records the cursor offset and line and the view. :mksession writes the
+// entries to a small text file, rewritten at exit from then on; "-S [file]", or starting
+// without a file where SESSION_FILE_DEFAULT exists, reads it back and opens only the file
+// that was on screen. :bn and :bp open the others when they are gone to. A file unchanged
+// on disk (same size and mtime) gets its cursor back by byte offset, a changed one by line.
+
+// Entry of filename (-1: none)
+static int session_find(const char* filename) {
+    int i;
+    for (i = 0; i < session.count; i++) {
+        if (strcmp(session.files[i].filename, filename) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Entry of filename, added if it has none (the oldest other entry makes room if needed)
+static int session_entry(const char* filename) {
+    int i = session_find(filename);
+    if (i >= 0)
+        return i;
+    if (session.count == SESSION_FILES_MAX) {
+        int drop = session.current == 0 ? 1 : 0;
+        memmove(&session.files[drop], &session.files[drop + 1], (session.count - drop - 1) * sizeof(session.files[0]));
+        session.count--;
+        if (session.current > drop)
+            session.current--;
+    }
+    i = session.count++;
+    memset(&session.files[i], 0, sizeof(session.files[i]));
+    snprintf(session.files[i].filename, sizeof(session.files[i].filename), "%s", filename);
+    session.files[i].size = -1;
+    return i;
+}
+
+// Record where the cursor and the view are in the file in textbuf
+void session_leave() {
+    struct stat st;
+    if (textbuf.filename[0] == '\0')
+        return;
+    int i = session_entry(textbuf.filename);
+    struct sessionfile* f = &session.files[i];
+    session.current = i;
+    f->offset = textbuf.cursor_abs_i;
+    f->line = textbuf.cursor_abs_y;
+    f->rowoff = textbuf.rowoff;
+    f->coloff = textbuf.coloff;
+    f->size = -1;
+    f->mtime = 0;
+    if (!textbuf.dirty && stat(textbuf.filename, &st) == 0) {
+        f->size = st.st_size;
+        f->mtime = st.st_mtime;
+    }
+}
+
+// Put the cursor and the view where f says
+static void session_position(const struct sessionfile* f) {
+    struct stat st;
+    struct bufchunk* chunk;
+    int rel_i, abs_i;
+    if (f->size >= 0 && stat(f->filename, &st) == 0 && st.st_size == f->size && st.st_mtime == f->mtime && f->offset <= textbuf.size) {
+        bufclient_move_cursor_to(&textbuf, f->offset);
+    } else if (bufclient_find_line_start(&textbuf, f->line, &chunk, &rel_i, &abs_i) == RESULT_OK) {
+        bufclient_move_cursor_to(&textbuf, abs_i);
+    } else {
+        bufclient_move_cursor_to(&textbuf, textbuf.size);
+    }
+    textbuf.rowoff = f->rowoff;
+    textbuf.coloff = f->coloff;
+    textbuf.rowoff_chunk = NULL;  // Found again by editorScroll
+}
+
+// editorOpen loaded the file in textbuf: it is the current entry (back where it was left
+// if a session opened it)
+void session_enter() {
+    int i = session_entry(textbuf.filename);
+    session.current = i;
+    if (session.restoring)
+        session_position(&session.files[i]);
+}
+
+// Open the file of entry i where it was left
+static enum RESULT session_open(int i) {
+    char filename[sizeof(session.files[0].filename)];
+    if (textbuf.dirty) {
+        editorSetStatusMessage("Unsaved changes! Save or use :e! to discard.");
+        return RESULT_ERR;
+    }
+    snprintf(filename, sizeof(filename), "%s", session.files[i].filename);  // Entries may move
+    session.restoring = 1;
+    enum RESULT res = editorOpen(filename);
+    session.restoring = 0;
+    return res;
+}
+
+// :mksession [file], and exit once a session was made or restored
+enum RESULT session_write(const char* path) {
+    char msg[STATUS_BUF_SIZE];
+    char real[PATH_MAX], tmp[PATH_MAX + 24];
+    struct stat st;
+    int i, ok;
+    session_leave();
+
+    // Written aside in the same directory, then renamed over the file (as autosave does):
+    // a crash part way leaves the old session
+    if (realpath(path, real) == NULL)
+        snprintf(real, sizeof(real), "%s", path);  // Not there yet
+    int existed = stat(real, &st) == 0;
+    const char* slash = strrchr(real, '/');
+    int dir_len = slash != NULL ? (int)(slash - real) + 1 : 0;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.%d.tmp", dir_len, real, real + dir_len, (int)getpid());
+    unlink(tmp);  // Left by a crash
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0666);
+    FILE* fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (fp == NULL) {
+        snprintf(msg, sizeof(msg), "mksession: \"%.60s\": %s", path, strerror(errno));
+        editorSetStatusMessage(msg);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return RESULT_ERR;
+    }
+    ok = !existed || fchmod(fd, st.st_mode & 07777) == 0;
+    fprintf(fp, "%s\ncurrent %d\n", SESSION_MAGIC, session.current);
+    for (i = 0; i < session.count; i++) {
+        const struct sessionfile* f = &session.files[i];
+        fprintf(fp, "%d %d %d %d %lld %lld %s\n", f->offset, f->line, f->rowoff, f->coloff, f->size, f->mtime, f->filename);
+    }
+    if (fflush(fp) != 0 || fsync(fd) != 0)
+        ok = 0;
+    if (fclose(fp) != 0)
+        ok = 0;
+    if (ok && rename(tmp, real) != 0)
+        ok = 0;
+    if (!ok) {
+        snprintf(msg, sizeof(msg), "mksession: \"%.60s\": %s", path, strerror(errno));
+        editorSetStatusMessage(msg);
+        unlink(tmp);
+        return RESULT_ERR;
+    }
+    if (path != session.path)
+        snprintf(session.path, sizeof(session.path), "%s", path);
+    snprintf(msg, sizeof(msg), "Session \"%.60s\" written (%d file%s)", path, session.count, session.count == 1 ? "" : "s");
+    editorSetStatusMessage(msg);
+    return RESULT_OK;
+}
+
+// Read a session file and open the file that was on screen
+enum RESULT session_restore(const char* path) {
+    char msg[STATUS_BUF_SIZE];
+    char line[512];
+    int current = -1;
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        snprintf(msg, sizeof(msg), "Session \"%.60s\": %s", path, strerror(errno));
+        editorSetStatusMessage(msg);
+        return RESULT_ERR;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, SESSION_MAGIC, strlen(SESSION_MAGIC)) != 0 ||
+        fgets(line, sizeof(line), fp) == NULL || sscanf(line, "current %d", &current) != 1) {
+        fclose(fp);
+        snprintf(msg, sizeof(msg), "Session \"%.60s\": not a session file", path);
+        editorSetStatusMessage(msg);
+        return RESULT_ERR;
+    }
+    session.count = 0;
+    session.current = -1;
+    while (session.count < SESSION_FILES_MAX && fgets(line, sizeof(line), fp) != NULL) {
+        struct sessionfile* f = &session.files[session.count];
+        int name_at = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%d %d %d %d %lld %lld %n", &f->offset, &f->line, &f->rowoff, &f->coloff, &f->size, &f->mtime, &name_at) < 6 ||
+            name_at == 0 || line[name_at] == '\0') {
+            continue;  // Damaged line: the file is left out
+        }
+        snprintf(f->filename, sizeof(f->filename), "%s", line + name_at);
+        session.count++;
+    }
+    fclose(fp);
+    snprintf(session.path, sizeof(session.path), "%s", path);
+    if (current < 0 || current >= session.count)
+        current = session.count - 1;
+    if (current < 0 || session_open(current) != RESULT_OK)
+        return current < 0 ? RESULT_OK : RESULT_ERR;
+    snprintf(msg, sizeof(msg), "Session \"%.40s\": \"%.40s\" (%d of %d files)", path, textbuf.filename, session.current + 1, session.count);
+    editorSetStatusMessage(msg);
+    return RESULT_OK;
+}
+
+// :bn and :bp: open the next or the previous file of the session
+void session_next(int dir) {
+    if (session.count == 0 || (session.count == 1 && session.current == 0)) {
+        editorSetStatusMessage("No other file in the session");
+        return;
+    }
+    int i = session.current < 0 ? 0 : (session.current + dir + session.count) % session.count;
+    session_open(i);
+}
+
+// *** Join And Reflow Implementation ***
+// J joins lines, and gq fills paragraphs (runs of non-blank lines) to the text width.
+// Both scan the lines once, front to back, and queue the edits they need in
+// reflow.edits, where each edit replaces the blanks between two words. A full queue is
+// applied as one bufclient_apply_edits batch and the scan goes on after it. A whole J or
+// gq is one undo unit.
+
+// Start a scan at the beginning of line first; 0 if there is no such line
+static int reflow_begin(int first) {
+    struct bufchunk* chunk;
+    int rel_i, abs_i;
+    if (first <= textbuf.cursor_abs_y) {
+        abs_i = block_line_start(first);  // Walk back from the cursor
+    } else if (bufclient_find_line_start(&textbuf, first, &chunk, &rel_i, &abs_i) != RESULT_OK) {
+        return 0;
+    }
+    reflow.count = 0;
+    reflow.delta = 0;
+    reflow.edited = 0;
+    reflow.failed = 0;
+    reflow.indent[0] = '\n';
+    reflow.abs_i = abs_i;
+    return bufclient_find_pos(&textbuf, abs_i, &reflow.chunk, &reflow.rel_i) == RESULT_OK;
+}
+
+// Byte at the scan position, -1 at the end of the buffer
+static int reflow_peek() {
+    return indent_peek(&reflow.chunk, &reflow.rel_i);
+}
+
+// Step over the byte reflow_peek returned
+static void reflow_skip() {
+    reflow.rel_i++;
+    reflow.abs_i++;
+}
+
+// Move to the newline ending the line (or the end of the buffer); returns the last byte
+// passed, or c if there was none
+static int reflow_to_eol(int c) {
+    while (reflow.chunk != NULL) {
+        char* start = reflow.chunk->data + reflow.rel_i;
+        char* p = memchr(start, '\n', reflow.chunk->size - reflow.rel_i);
+        int n = (int)((p != NULL ? p : reflow.chunk->data + reflow.chunk->size) - start);
+        if (n > 0)
+            c = (unsigned char)start[n - 1];
+        reflow.rel_i += n;
+        reflow.abs_i += n;
+        if (p != NULL)
+            break;
+        reflow.chunk = reflow.chunk->next;
+        reflow.rel_i = 0;
+    }
+    return c;
+}
+
+// Apply the queued edits; the scan goes on from the same text
+static void reflow_flush() {
+    if (reflow.count == 0 || reflow.failed)
+        return;
+    if (bufclient_apply_edits(&textbuf, reflow.edits, reflow.count, reflow.last_at) != RESULT_OK) {
+        reflow.failed = 1;
+        return;
+    }
+    reflow.edited += reflow.count;
+    reflow.count = 0;
+    reflow.abs_i += reflow.delta;
+    reflow.delta = 0;
+    if (bufclient_find_pos(&textbuf, reflow.abs_i, &reflow.chunk, &reflow.rel_i) != RESULT_OK)
+        reflow.failed = 1;
+}
+
+// Queue replacing removed bytes at offset (before the scan position) with text
+static void reflow_edit(int offset, int removed, const char* text, int inserted) {
+    struct bufedit* e = &reflow.edits[reflow.count++];
+    e->offset = offset;
+    e->removed = removed;
+    e->text = text;
+    e->inserted = inserted;
+    reflow.last_at = offset + reflow.delta;
+    reflow.delta += inserted - removed;
+    if (reflow.count == REFLOW_BATCH)
+        reflow_flush();
+}
+
+// Join lines first..last (at least two) into one. As with Vim's J, each newline and the
+// indent after it become one space, or nothing after a blank or an empty line and before
+// a ')' or an empty line. The cursor goes to the last join.
+void reflow_join(int first, int last) {
+    int line, c = '\n';  // c: last byte of the joined line so far ('\n' while it is empty)
+    if (server_mode) {
+        editorSetStatusMessage("join: not available in server mode");
+        return;
+    }
+    if (!reflow_begin(first))
+        return;
+    for (line = first; line < last && !reflow.failed; line++) {
+        c = reflow_to_eol(c);
+        int newline_at = reflow.abs_i, next;
+        if (reflow_peek() != '\n')
+            break;  // That was the last line
+        reflow_skip();
+        if (reflow_peek() < 0)
+            break;  // The newline ends the buffer (there is no line after it)
+        while ((next = reflow_peek()) == ' ' || next == '\t')
+            reflow_skip();
+        int space = c != ' ' && c != '\t' && c != '\n' && next != ')' && next != '\n' && next >= 0;
+        reflow_edit(newline_at, reflow.abs_i - newline_at, " ", space);
+    }
+    reflow_flush();
+    if (reflow.edited > 1) {
+        char msg[STATUS_BUF_SIZE];
+        snprintf(msg, sizeof(msg), "%d lines joined", reflow.edited + 1);
+        editorSetStatusMessage(msg);
+    }
+}
+
+// Fill the paragraphs of lines first..last to the text width, breaking lines only between
+// words (a longer word gets a line of its own). Each gap between two words of a
+// paragraph becomes a space, or a newline and the indent of the paragraph's first line;
+// blanks at the end of a paragraph go. Gaps spelled that way already are left alone, so
+// text that is filled already costs no edits. The cursor goes to the line after the range.
+void reflow_fill(int first, int last) {
+    int line, c = 0, lines = 0;
+    int in_par = 0;      // In a paragraph (a gap before the next word is pending)
+    int col = 0;         // Visual width of the output line so far
+    int indent_col = 0;  // Width of the paragraph's indent
+    int gap_at = 0;      // Start of the blanks after the last word
+    int gap_trail = 0;   // How many there are before the end of their line
+    int gap_space = 0;   // The gap is one space
+    int gap_newline = 0; // The gap is a newline and the indent
+    if (server_mode) {
+        editorSetStatusMessage("gq: not available in server mode");
+        return;
+    }
+    if (!reflow_begin(first))
+        return;
+    for (line = first; line <= last && !reflow.failed; line++) {
+        int lead_col = 0, n = 0, same = 1;
+        lines++;
+        // Leading blanks: the indent of a paragraph's first line, compared with it later on
+        while ((c = reflow_peek()) == ' ' || c == '\t') {
+            lead_col += c == '\t' ? textbuf.tabstop - lead_col % textbuf.tabstop : 1;
+            if (!in_par && n < REFLOW_INDENT_MAX)
+                reflow.indent[1 + n] = (char)c;
+            else if (in_par)
+                same &= n < reflow.indent_len && reflow.indent[1 + n] == c;
+            n++;
+            reflow_skip();
+        }
+        if (c == '\n' || c < 0) {  // A blank line ends the paragraph
+            if (in_par && gap_trail > 0)
+                reflow_edit(gap_at, gap_trail, "", 0);
+            if (in_par)
+                reflow_flush();  // Its edits insert reflow.indent, which the next paragraph rewrites
+            in_par = 0;
+            if (c < 0)
+                break;
+            reflow_skip();
+            continue;
+        }
+        if (!in_par) {
+            reflow.indent_len = n < REFLOW_INDENT_MAX ? n : REFLOW_INDENT_MAX;
+            indent_col = lead_col;
+            col = -1;  // No word yet
+        }
+        gap_space = 0;
+        gap_newline = gap_trail == 0 && same && n == reflow.indent_len;
+        in_par = 1;
+
+        for (;;) {
+            int word_at = reflow.abs_i, w = 0;
+            while ((c = reflow_peek()) >= 0 && c != ' ' && c != '\t' && c != '\n') {
+                w += (c & 0xC0) != 0x80;  // UTF-8 continuation bytes take no column
+                reflow_skip();
+            }
+            if (col < 0) {
+                col = indent_col + w;
+            } else if (col + 1 + w <= textbuf.textwidth) {
+                if (!gap_space)
+                    reflow_edit(gap_at, word_at - gap_at, " ", 1);
+                col += 1 + w;
+            } else {
+                if (!gap_newline)
+                    reflow_edit(gap_at, word_at - gap_at, reflow.indent, 1 + reflow.indent_len);
+                col = indent_col + w;
+            }
+
+            // The blanks after the word
+            int blank = 0;
+            gap_at = reflow.abs_i;
+            while ((c = reflow_peek()) == ' ' || c == '\t') {
+                blank = c;
+                reflow_skip();
+            }
+            gap_trail = reflow.abs_i - gap_at;
+            if (c == '\n' || c < 0)
+                break;
+            gap_space = gap_trail == 1 && blank == ' ';
+            gap_newline = 0;
+        }
+        if (c < 0)
+            break;
+        reflow_skip();  // The newline, part of the gap if the paragraph goes on
+    }
+    if (in_par && gap_trail > 0)
+        reflow_edit(gap_at, gap_trail, "", 0);
+    reflow_flush();
+    if (!reflow.failed)
+        bufclient_move_cursor_to(&textbuf, reflow.abs_i);
+    if (lines > 1) {
+        char msg[STATUS_BUF_SIZE];
+        snprintf(msg, sizeof(msg), "%d lines formatted", lines);
+        editorSetStatusMessage(msg);
+    }
+}
+
+// Lines of the paragraph around the cursor's line; 0 if that line is blank
+static int reflow_paragraph(int* first, int* last) {
+    struct bufchunk* chunk;
+    int rel_i, line = textbuf.cursor_abs_y, c, blank = 1;
+    int start = block_line_start(line);
+
+    // Down to the last non-blank line
+    if (!reflow_begin(line))
+        return 0;
+    for (;; line++) {
+        while ((c = reflow_peek()) == ' ' || c == '\t')
+            reflow_skip();
+        if (c == '\n' || c < 0)
+            break;
+        *last = line;
+        reflow_to_eol(0);
+        if (reflow_peek() != '\n')
+            break;
+        reflow_skip();
+    }
+    if (line == textbuf.cursor_abs_y)
+        return 0;
+
+    // Up, a byte at a time, through the lines above while they are not blank
+    *first = textbuf.cursor_abs_y;
+    if (start == 0 || bufclient_find_pos(&textbuf, start - 1, &chunk, &rel_i) != RESULT_OK)
+        return 1;  // (rel_i: the newline ending the line above)
+    for (;;) {
+        while (chunk != NULL && rel_i == 0) {
+            chunk = chunk->prev;
+            if (chunk != NULL)
+                rel_i = chunk->size;
+        }
+        c = chunk != NULL ? (unsigned char)chunk->data[--rel_i] : '\n';  // Start of the buffer
+        if (c == '\n') {
+            if (blank)
+                break;
+            (*first)--;
+            if (chunk == NULL)
+                break;
+            blank = 1;
+        } else if (c != ' ' && c != '\t') {
+            blank = 0;
+        }
+    }
+    return 1;
+}
+
+// After "gq": "q" fills the cursor's line, "ap" or "ip" its paragraph
+void reflow_motion() {
+    int c = editorReadKey(), first = textbuf.cursor_abs_y, last = first;
+    if (c == 'a' || c == 'i') {
+        if (editorReadKey() != 'p' || !reflow_paragraph(&first, &last))
+            return;
+    } else if (c != 'q') {
+        return;
+    }
+    reflow_fill(first, last);
+}
+
+// :set tw=N
+void reflow_set_textwidth(int width) {
+    if (width < 1) {
+        editorSetStatusMessage("tw: text width must be at least 1");
+        return;
+    }
+    textbuf.textwidth = width;
+}
+
+// ":[range]j[oin]" (without a range, or with a single line, that line and the next) and
+// ":[range]gq" (the cursor's line without a range). Returns 0 if cmd is neither.
+int reflow_command(const char* cmd) {
+    int first = textbuf.cursor_abs_y, last = first;
+    const char* p = cmd;
+    range_parse(&p, &first, &last);
+    if (strcmp(p, "j") == 0 || strcmp(p, "join") == 0) {
+        if (first > last || first < 0) {
+            editorSetStatusMessage("Invalid range");
+            return 1;
+        }
+        reflow_join(first, last > first ? last : first + 1);
+        return 1;
+    }
+    if (strcmp(p, "gq") == 0) {
+        if (first > last || first < 0) {
+            editorSetStatusMessage("Invalid range");
+            return 1;
+        }
+        reflow_fill(first, last);
+        return 1;
+    }
+    return 0;
+}
+
+// *** Case Conversion Implementation ***
+// "~" toggles the case of the character under the cursor, "g~", "gU" and "gu" toggle,
+// upper and lower the case over a motion ("g~~", "gUU", "guu" the line; "w", "iw", "$",
+// "0", "j", "k", "ap", "ip"), and "~", "U", "u" over a Ctrl-V block. Case changes keep
+// the length of the text, so bufclient_rewrite makes them in place in the chunks, and
+// undo keeps only what it needs to change them back.
+
+// Change the case of the bytes of each edit (offset and removed, ascending) as one undo unit
+void case_rewrite(struct bufedit* edits, int count, int kind) {
+    if (server_mode) {
+        editorSetStatusMessage("case: not available in server mode");
+        return;
+    }
+    undo_note_case(kind);
+    bufclient_rewrite(&textbuf, edits, count, kind);
+    undo_note_case(0);
+}
+
+// Change the case of the bytes start..end-1; the cursor goes to start
+static void case_range(int start, int end, int kind) {
+    struct bufedit e;
+    if (end <= start)
+        return;
+    e.offset = start;
+    e.removed = end - start;
+    e.text = NULL;
+    e.inserted = e.removed;
+    case_rewrite(&e, 1, kind);
+    bufclient_move_cursor_to(&textbuf, start);
+}
+
+// End (before its newline) of the line lines-1 lines below the one starting at abs_i
+static int case_lines_end(int abs_i, int lines) {
+    struct bufchunk* chunk;
+    int rel_i;
+    if (bufclient_find_pos(&textbuf, abs_i, &chunk, &rel_i) != RESULT_OK)
+        return abs_i;
+    while (chunk != NULL) {
+        char* p = memchr(chunk->data + rel_i, '\n', chunk->size - rel_i);
+        if (p != NULL) {
+            int at = abs_i + (int)(p - chunk->data) - rel_i;
+            if (--lines == 0)
+                return at;
+            abs_i = at + 1;
+            rel_i = (int)(p - chunk->data) + 1;
+            continue;
+        }
+        abs_i += chunk->size - rel_i;
+        chunk = chunk->next;
+        rel_i = 0;
+    }
+    return textbuf.size;
+}
+
+// ~: toggle the case of the character under the cursor and step past it
+void case_toggle_char() {
+    int start = textbuf.cursor_abs_i;
+    unsigned char c;
+    if (bufclient_read(&textbuf, start, (char*)&c, 1) != 1 || c == '\n')
+        return;
+    int end = start + 1 + (c >= 0xC0) + (c >= 0xE0) + (c >= 0xF0);  // UTF-8 sequence length
+    if (end > textbuf.size)
+        end = textbuf.size;
+    case_range(start, end, CASE_TOGGLE);
+    if (!server_mode)
+        bufclient_move_cursor_to(&textbuf, end);
+}
+
+// After "g~", "gU" or "gu": read the motion and change the case over it
+void case_motion(int kind) {
+    int c = editorReadKey(), cursor = textbuf.cursor_abs_i, y = textbuf.cursor_abs_y;
+    int first, last, start, end;
+    switch (c) {
+        case 'w': case 'e':
+            end = word_run_end(&textbuf, cursor);
+            case_range(cursor, end > cursor ? end : cursor + 1, kind);
+            return;
+        case '$':
+            case_range(cursor, case_lines_end(cursor, 1), kind);
+            return;
+        case '0':
+            case_range(block_line_start(y), cursor, kind);
+            return;
+        case 'a': case 'i':
+            c = editorReadKey();
+            if (c == 'w') {
+                case_range(word_run_start(&textbuf, cursor), word_run_end(&textbuf, cursor), kind);
+                return;
+            }
+            if (c != 'p' || !reflow_paragraph(&first, &last))
+                return;
+            break;
+        case 'j':
+            first = y;
+            last = y + 1;
+            break;
+        case 'k':
+            if (y == 0)
+                return;
+            first = y - 1;
+            last = y;
+            break;
+        default:
+            if (c != (kind == CASE_UPPER ? 'U' : kind == CASE_LOWER ? 'u' : '~'))
+                return;
+            first = last = y;  // Doubled: the line
+            break;
+    }
+    start = block_line_start(first);
+    case_range(start, case_lines_end(start, last - first + 1), kind);
+}
+
+// *** Substitute Implementation ***
+// ":[range]s/old/new/[g]" replaces the fixed string old (any punctuation may stand for
+// the '/', a backslash takes the next character as it is) by new, the first time on each
+// line of the range or, with g, every time. The range defaults to the cursor's line.
+// The scan is a scheduler job, SUBST_STEP bytes a step, so keys are still read while it
+// goes through a large file: matches are only recorded (an observer keeps them right when
+// the text is edited meanwhile) and applied at the end, a batch of SUBST_BATCH a step, as
+// one undo unit held open across the steps. A unit takes at most unit_max matches, what
+// the undo history can hold, so a larger :s is applied as several units, each undone on
+// its own. Only moving around and typing a command line go on meanwhile: any other key
+// first waits for the :s to be done. Ctrl-C stops it between steps, dropping the matches
+// not applied yet and keeping the batches applied: the text is substituted up to a point.
+
+// Where the scan is, found again after the text changed
+static int subst_seek() {
+    if (subst.chunk == NULL && bufclient_find_pos(&textbuf, subst.pos, &subst.chunk, &subst.rel_i) != RESULT_OK)
+        return 0;
+    return 1;
+}
+
+// Copy up to len bytes from the scan position into window; returns how many
+static int subst_fill(int len) {
+    struct bufchunk* chunk;
+    int rel_i, n = 0;
+    if (!subst_seek())
+        return 0;
+    for (chunk = subst.chunk, rel_i = subst.rel_i; chunk != NULL && n < len; chunk = chunk->next, rel_i = 0) {
+        int k = chunk->size - rel_i < len - n ? chunk->size - rel_i : len - n;
+        memcpy(subst.window + n, chunk->data + rel_i, k);
+        n += k;
+    }
+    return n;
+}
+
+// Move the scan position n bytes on
+static void subst_advance(int n) {
+    subst.pos += n;
+    while (subst.chunk != NULL && n > 0) {
+        int k = subst.chunk->size - subst.rel_i;
+        if (n < k) {
+            subst.rel_i += n;
+            return;
+        }
+        n -= k;
+        subst.chunk = subst.chunk->next;
+        subst.rel_i = 0;
+    }
+}
+
+// Keep the recorded matches and the scan position right when the text changes under the
+// scan: matches after an edit move with it, matches it touches are dropped, and the scan
+// goes back to an edit made in the part it has passed.
+static void subst_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int k, i, kept;
+    (void)buf;
+    (void)ctx;
+    if (subst.applying)
+        return;
+    if (subst.applied > 0) {
+        // Between two batches: what is left moves past the batches applied, so that the
+        // text before is the text now
+        int shift = subst.applied * (subst.rep_len - subst.pat_len);
+        subst.edit_count -= subst.applied;
+        memmove(subst.edits, subst.edits + subst.applied, subst.edit_count * sizeof(subst.edits[0]));
+        for (i = 0; i < subst.edit_count; i++)
+            subst.edits[i].offset += shift;
+        subst.pos += shift;
+        subst.end += shift;
+        subst.count += subst.applied;
+        subst.applied = 0;
+    }
+    for (k = 0; k < count; k++) {
+        const struct bufdelta* d = &deltas[k];
+        int old_end = d->offset + d->removed, shift = d->inserted - d->removed;
+        for (i = 0, kept = 0; i < subst.edit_count; i++) {
+            struct bufedit* e = &subst.edits[i];
+            if (e->offset >= old_end)
+                e->offset += shift;
+            else if (e->offset + e->removed > d->offset)
+                continue;
+            subst.edits[kept++] = *e;
+        }
+        subst.edit_count = kept;
+        if (subst.pos >= old_end)
+            subst.pos += shift;
+        else if (subst.pos > d->offset)
+            subst.pos = d->offset;
+        if (subst.end >= old_end)
+            subst.end += shift;
+        else if (subst.end > d->offset)
+            subst.end = d->offset;
+        if (subst.start > d->offset)
+            subst.start = subst.start >= old_end ? subst.start + shift : d->offset;
+    }
+    subst.chunk = NULL;
+}
+
+// Start applying the recorded matches (all before the scan position) as one undo unit
+static void subst_flush_begin() {
+    undo_seal();
+    undo.held = 1;
+    subst.flushing = 1;
+    subst.applied = 0;
+}
+
+// The matches are applied (or some of them, if interrupted or out of memory): the scan
+// goes on past them
+static void subst_flush_end() {
+    int d = subst.rep_len - subst.pat_len;
+    subst.units += !undo.sealed;  // A batch was applied (and recorded)
+    undo.held = 0;
+    undo_seal();
+    if (subst.applied < subst.edit_count)
+        subst.pos = subst.edits[subst.applied].offset + subst.applied * d;  // Substituted up to here
+    else
+        subst.pos += subst.applied * d;
+    subst.end += subst.applied * d;
+    subst.chunk = NULL;
+    subst.count += subst.applied;
+    subst.edit_count = 0;
+    subst.applied = 0;
+    subst.flushing = 0;
+}
+
+// Apply the next batch of matches; the cursor goes to its last one. 0 once all are.
+static int subst_flush_step() {
+    int d = subst.rep_len - subst.pat_len, shift = subst.applied * d, i;
+    int n = subst.edit_count - subst.applied < SUBST_BATCH ? subst.edit_count - subst.applied : SUBST_BATCH;
+    struct bufedit* batch = &subst.edits[subst.applied];
+    enum RESULT result;
+    for (i = 0; i < n; i++)
+        batch[i].offset += shift;  // Past the batches applied before
+    subst.applying = 1;
+    result = bufclient_apply_edits(&textbuf, batch, n, batch[n - 1].offset + (n - 1) * d);
+    subst.applying = 0;
+    if (result != RESULT_OK) {
+        for (i = 0; i < n; i++)
+            batch[i].offset -= shift;
+        subst.failed = 1;
+        return 0;
+    }
+    subst.applied += n;
+    return subst.applied < subst.edit_count;
+}
+
+// Ctrl-C: stop a running :s at its next step or batch; 0 if none ran
+int subst_interrupt() {
+    if (!subst.active)
+        return 0;
+    cancel_token_cancel(&subst.cancel);
+    return 1;
+}
+
+// How much of the range is substituted (scanned, and applied up to there), in percent
+static int subst_progress() {
+    return subst.end > subst.start ? (int)((long long)(subst.pos - subst.start) * 100 / (subst.end - subst.start)) : 100;
+}
+
+// Give up a running :s (matches not applied yet are forgotten)
+void subst_stop() {
+    if (!subst.active)
+        return;
+    if (subst.flushing)
+        subst_flush_end();
+    sched_remove(subst_step, NULL);
+    bufclient_unobserve(&textbuf, &subst.observer);
+    subst.active = 0;
+    subst.edit_count = 0;
+}
+
+// Done (or stopped): report
+static void subst_finish() {
+    char msg[STATUS_BUF_SIZE];
+    if (subst.flushing)
+        subst_flush_end();
+    bufclient_unobserve(&textbuf, &subst.observer);
+    subst.active = 0;
+    if (cancel_token_cancelled(&subst.cancel))
+        snprintf(msg, sizeof(msg), "s: interrupted at %d%% of the range, %d substitution%s made%s", subst_progress(),
+                 subst.count, subst.count == 1 ? "" : "s",
+                 subst.units > 1 ? " (in several undo units)" : subst.count > 0 ? " (u undoes them)" : "");
+    else if (subst.failed)
+        snprintf(msg, sizeof(msg), "s: out of buffer memory after %d substitutions", subst.count);
+    else if (subst.count == 0)
+        snprintf(msg, sizeof(msg), "Pattern not found: %.60s", subst.pat);
+    else if (subst.units > 1)
+        snprintf(msg, sizeof(msg), "%d substitutions, too many for one undo: %d undo units", subst.count, subst.units);
+    else
+        snprintf(msg, sizeof(msg), "%d substitution%s", subst.count, subst.count == 1 ? "" : "s");
+    editorSetStatusMessage(msg);
+}
+
+// Scan the next SUBST_STEP bytes; the matches are applied from the next step once there
+// are unit_max of them or the range is scanned. 0 once done.
+static int subst_scan() {
+    int want = subst.end - subst.pos, n, lim, i = 0;
+    int span = SUBST_STEP + subst.pat_len - 1;  // A match may start in the step and end past it
+    if (want > span)
+        want = span;
+    n = want > 0 ? subst_fill(want) : 0;
+    lim = n - subst.pat_len + 1 < SUBST_STEP ? n - subst.pat_len + 1 : SUBST_STEP;
+    while (i < lim) {
+        char* hit;
+        if (subst.skip_line) {
+            hit = memchr(subst.window + i, '\n', n - i);
+            if (hit == NULL) {
+                i = n;
+                break;
+            }
+            i = (int)(hit - subst.window) + 1;
+            subst.skip_line = 0;
+            continue;
+        }
+        hit = memchr(subst.window + i, subst.pat[0], lim - i);
+        if (hit == NULL) {
+            i = lim;
+            break;
+        }
+        i = (int)(hit - subst.window);
+        if (memcmp(hit, subst.pat, subst.pat_len) != 0) {
+            i++;
+            continue;
+        }
+        struct bufedit* e = &subst.edits[subst.edit_count++];
+        e->offset = subst.pos + i;
+        e->removed = subst.pat_len;
+        e->text = subst.rep;
+        e->inserted = subst.rep_len;
+        i += subst.pat_len;
+        subst.skip_line = !subst.global;
+        if (subst.edit_count == subst.unit_max) {
+            subst_advance(i);
+            subst_flush_begin();
+            return 1;
+        }
+    }
+    if (n < want || want < span) {  // Reached the end of the range
+        if (subst.edit_count == 0) {
+            subst_finish();
+            return 0;
+        }
+        subst.scanned = 1;
+        subst_flush_begin();
+        return 1;
+    }
+    subst_advance(i);
+    int percent = subst_progress();
+    if (percent != subst.percent) {
+        char msg[STATUS_BUF_SIZE];
+        subst.percent = percent;
+        snprintf(msg, sizeof(msg), "Substituting... %d%% (%d so far)", percent, subst.count + subst.edit_count);
+        editorSetStatusMessage(msg);
+    }
+    return 1;
+}
+
+// Scan the next SUBST_STEP bytes or apply the next batch (scheduler job); 0 once done
+static int subst_step(void* ctx) {
+    (void)ctx;
+    if (cancel_token_cancelled(&subst.cancel)) {
+        if (!subst.flushing)
+            subst.edit_count = 0;  // Not applied: the text stays as the last batch left it
+        subst_finish();
+        return 0;
+    }
+    if (subst.flushing) {
+        if (subst_flush_step())
+            return 1;
+        if (subst.failed || subst.scanned) {
+            subst_finish();
+            return 0;
+        }
+        subst_flush_end();
+        return 1;
+    }
+    return subst_scan();
+}
+
+// Run a :s to its end (Ctrl-C still stops it)
+static void subst_wait() {
+    while (subst.active) {
+        interrupt_poll();
+        if (!subst_step(NULL))
+            sched_remove(subst_step, NULL);
+    }
+}
+
+// Before key c is handled: while a :s runs, only moving around and typing a command line
+// go on; a key that could edit, undo, save or quit first waits for the :s to be done
+void subst_before_key(int c) {
+    if (!subst.active)
+        return;
+    if (mode == MODE_COMMAND && c != '\r')
+        return;
+    if (mode == MODE_NORMAL) {
+        switch (c) {
+            case 'h': case 'j': case 'k': case 'l': case ':':
+            case ARROW_LEFT: case ARROW_RIGHT: case ARROW_UP: case ARROW_DOWN:
+            case PAGE_UP: case PAGE_DOWN: case HOME_KEY: case END_KEY:
+                return;
+        }
+    }
+    editorSetStatusMessage("Substituting...");
+    editorRefreshScreen();
+    subst_wait();
+}
+
+// Copy one delimited part of ":s" into out, stepping over the delimiter; -1 if it is too long
+static int subst_parse_part(const char** p, char delim, char* out) {
+    int n = 0;
+    while (**p != '\0' && **p != delim) {
+        if (**p == '\\' && (*p)[1] != '\0')
+            (*p)++;
+        if (n == CMD_BUF_SIZE - 1)
+            return -1;
+        out[n++] = *(*p)++;
+    }
+    out[n] = '\0';
+    if (**p == delim)
+        (*p)++;
+    return n;
+}
+
+// ":[range]s/old/new/[g]". Returns 0 if cmd is not a substitute command.
+int subst_command(const char* cmd) {
+    int first = textbuf.cursor_abs_y, last = first, start, end;
+    char pat[CMD_BUF_SIZE], rep[CMD_BUF_SIZE];
+    struct bufchunk* chunk;
+    int rel_i, pat_len, rep_len, global = 0;
+    const char* p = cmd;
+    char delim;
+    range_parse(&p, &first, &last);
+    if (p[0] != 's' || !ispunct((unsigned char)p[1]) || p[1] == '\\' || p[1] == '"')
+        return 0;
+    delim = p[1];
+    p += 2;
+    pat_len = subst_parse_part(&p, delim, pat);
+    rep_len = subst_parse_part(&p, delim, rep);
+    if (*p == 'g') {
+        global = 1;
+        p++;
+    }
+    if (server_mode) {
+        editorSetStatusMessage("s: not available in server mode");
+        return 1;
+    }
+    if (subst.active) {
+        editorSetStatusMessage("s: a substitution is still running");
+        return 1;
+    }
+    if (pat_len < 0 || rep_len < 0 || *p != '\0') {
+        editorSetStatusMessage("Usage: :[range]s/old/new/[g]");
+        return 1;
+    }
+    if (pat_len == 0) {
+        editorSetStatusMessage("s: empty pattern");
+        return 1;
+    }
+    if (first > last || first < 0) {
+        editorSetStatusMessage("Invalid range");
+        return 1;
+    }
+    if (first <= textbuf.cursor_abs_y) {
+        start = block_line_start(first);  // Walk back from the cursor
+    } else if (bufclient_find_line_start(&textbuf, first, &chunk, &rel_i, &start) != RESULT_OK) {
+        editorSetStatusMessage("Invalid range");
+        return 1;
+    }
+    if (last == INT_MAX || bufclient_find_line_start(&textbuf, last + 1, &chunk, &rel_i, &end) != RESULT_OK)
+        end = textbuf.size;
+
+    memcpy(subst.pat, pat, pat_len + 1);
+    memcpy(subst.rep, rep, rep_len + 1);
+    subst.pat_len = pat_len;
+    subst.rep_len = rep_len;
+    subst.global = global;
+    subst.start = subst.pos = start;
+    subst.end = end;
+    subst.chunk = NULL;
+    subst.skip_line = 0;
+    subst.count = 0;
+    subst.edit_count = 0;
+    // Each match is one undo record of pat_len + rep_len bytes: a unit takes as many as fit
+    subst.unit_max = SUBST_EDITS_MAX < UNDO_RECORDS_MAX ? SUBST_EDITS_MAX : UNDO_RECORDS_MAX;
+    if (subst.unit_max > UNDO_TEXT_SIZE / (pat_len + rep_len))
+        subst.unit_max = UNDO_TEXT_SIZE / (pat_len + rep_len);
+    subst.units = 0;
+    subst.flushing = 0;
+    subst.applied = 0;
+    subst.scanned = 0;
+    subst.failed = 0;
+    subst.percent = -1;
+    subst.applying = 0;
+    cancel_token_reset(&subst.cancel);
+    subst.observer.notify = subst_on_edit;
+    subst.observer.before_remove = NULL;
+    subst.observer.ctx = NULL;
+    subst.observer.batched = 0;
+    if (bufclient_observe(&textbuf, &subst.observer) != RESULT_OK) {
+        editorSetStatusMessage("s: too many buffer observers");
+        return 1;
+    }
+    if (sched_add(subst_step, NULL) != RESULT_OK) {
+        bufclient_unobserve(&textbuf, &subst.observer);
+        editorSetStatusMessage("s: too many long operations running");
+        return 1;
+    }
+    subst.active = 1;
+    return 1;
+}
+
+// *** Client/Server Implementation ***
+// "--server" keeps buffers resident in a daemon listening on a Unix socket. "-c [file]"
+// is a thin client: it puts its own terminal in raw mode, sends a hello line
+// ("LKJ1 <rows> <cols> <absolute path>\n") and then just copies bytes both ways, while
+// the server runs the editor with the socket as its terminal. Re-opening a file that is
+// still resident (and unchanged on disk) skips loading it entirely.
+
+// Path of the server socket: $XDG_RUNTIME_DIR/lkjsxceditor.sock, or without it
+// /tmp/lkjsxceditor-<uid>/lkjsxceditor.sock. /tmp is shared, so the socket lives in a
+// 0700 directory that must be ours (anyone could have created that name first).
+// Returns NULL or why there is no usable path.
+const char* server_socket_path(char* out, size_t size) {
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    char own_dir[PATH_MAX];
+    struct stat st;
+    int len;
+    if (dir == NULL || dir[0] == '\0') {
+        snprintf(own_dir, sizeof(own_dir), "/tmp/%s-%d", SERVER_SOCKET_NAME, (int)getuid());
+        if (mkdir(own_dir, 0700) == -1 && errno != EEXIST)
+            return "cannot create the socket directory";
+        if (lstat(own_dir, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0077) != 0)
+            return "socket directory is not a private directory of this user";
+        dir = own_dir;
+    }
+    len = snprintf(out, size, "%s/%s.sock", dir, SERVER_SOCKET_NAME);
+    if (len < 0 || (size_t)len >= size || (size_t)len >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        return "socket path too long";
+    }
+    return NULL;
+}
+
+// Connect to the server socket, -1 if no server is listening
+static int server_connect(const char* path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);  // Length checked by server_socket_path
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Start a detached server process running this executable with --server
+static void server_spawn() {
+    pid_t pid = fork();
+    if (pid != 0)
+        return;  // Parent (or fork failure): the caller retries connecting
+    setsid();
+    if (fork() != 0)
+        _exit(0);  // Double fork so the server is not our child
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull != -1) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO)
+            close(devnull);
+    }
+    execl("/proc/self/exe", "lkjsxceditor", "--server", (char*)NULL);
+    _exit(127);
+}
+
+// Make filename absolute (relative to the client's working directory)
+static enum RESULT client_abs_path(const char* filename, char* out, size_t size) {
+    if (filename == NULL || filename[0] == '\0') {
+        out[0] = '\0';  // Scratch buffer
+        return RESULT_OK;
+    }
+    char resolved[PATH_MAX];
+    if (realpath(filename, resolved) != NULL) {
+        if (strlen(resolved) >= size)
+            return RESULT_ERR;
+        strcpy(out, resolved);
+        return RESULT_OK;
+    }
+    // New file: keep the name, anchored at the working directory
+    if (filename[0] == '/') {
+        if (strlen(filename) >= size)
+            return RESULT_ERR;
+        strcpy(out, filename);
+        return RESULT_OK;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return RESULT_ERR;
+    int len = snprintf(out, size, "%s/%s", cwd, filename);
+    return (len < 0 || (size_t)len >= size) ? RESULT_ERR : RESULT_OK;
+}
+
+// Write all of buf to fd, -1 on error
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Client side of -c: attach the local terminal to the server's editor session
+int clientMain(const char* filename) {
+    char sock_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    char abs_path[PATH_MAX];
+    char hello[SERVER_HELLO_SIZE];
+    int rows = 0, cols = 0;
+    int fd, tries;
+    const char* err;
+
+    if ((err = server_socket_path(sock_path, sizeof(sock_path))) != NULL) {
+        fprintf(stderr, "Error: No server socket: %s.\n", err);
+        return 1;
+    }
+    if (client_abs_path(filename, abs_path, sizeof(abs_path)) != RESULT_OK) {
+        fprintf(stderr, "Error: Cannot resolve path '%s'.\n", filename);
+        return 1;
+    }
+
+    fd = server_connect(sock_path);
+    if (fd == -1) {
+        // No server yet: start one and wait for it to listen
+        server_spawn();
+        for (tries = 0; tries < 200 && fd == -1; tries++) {
+            usleep(10000);
+            fd = server_connect(sock_path);
+        }
+        if (fd == -1) {
+            fprintf(stderr, "Error: Could not connect to server at %s.\n", sock_path);
+            return 1;
+        }
+    }
+
+    if (enableRawMode() == RESULT_ERR || getWindowSize(&rows, &cols) == RESULT_ERR) {
+        disableRawMode();
+        close(fd);
+        return 1;
+    }
+    int len = snprintf(hello, sizeof(hello), "LKJ1 %d %d %s\n", rows, cols, abs_path);
+    if (len < 0 || (size_t)len >= sizeof(hello) || write_all(fd, hello, len) == -1) {
+        disableRawMode();
+        close(fd);
+        return 1;
+    }
+
+    // Proxy bytes until the server ends the session
+    struct pollfd pfds[2];
+    char buf[PROXY_BUF_SIZE];
+    pfds[0].fd = STDIN_FILENO;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = fd;
+    pfds[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0 || write_all(STDOUT_FILENO, buf, n) == -1)
+                break;
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0 || write_all(fd, buf, n) == -1)
+                break;
+        }
+    }
+    close(fd);
+    write(STDOUT_FILENO, "\x1b[?25h\r\n", 8);  // Cursor visible, leave the prompt below the editor
+    disableRawMode();
+    return 0;
+}
+
+// Read what arrived of the hello line of pc without blocking: 1 once it is complete (rows,
+// cols and path filled in), 0 while more is to come, -1 if it is malformed or the client
+// went away. Byte by byte, so keys sent right after it stay in the socket.
+static int server_read_hello(struct pendingclient* pc, int* rows, int* cols, char* path, size_t path_size) {
+    char c;
+    int n;
+    for (;;) {
+        ssize_t got = recv(pc->fd, &c, 1, MSG_DONTWAIT);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (got != 1)
+            return -1;
+        if (c == '\n')
+            break;
+        if (pc->len >= (int)sizeof(pc->hello) - 1)
+            return -1;
+        pc->hello[pc->len++] = c;
+    }
+    pc->hello[pc->len] = '\0';
+    if (sscanf(pc->hello, "LKJ1 %d %d %n", rows, cols, &n) != 2 || *rows < 3 || *cols < 1)
+        return -1;
+    if (strlen(pc->hello + n) >= path_size)
+        return -1;
+    strcpy(path, pc->hello + n);
+    return 1;
+}
+
+// Observer of resident buffers: carry each edit over to every other session on the
+// same buffer, so each of them only re-renders (and sends) the cells that changed.
+static void server_notify(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int i, d;
+    (void)buf;
+    (void)ctx;
+    if (server_active == NULL)
+        return;
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        struct termsession* s = &server_sessions[i];
+        if (!s->used || s->slot != server_active->slot)
+            continue;
+        s->needs_refresh = 1;  // Status bar (line count, [+]) changes for every viewer
+        if (s != server_active)
+            for (d = 0; d < count; d++)
+                bufview_apply_change(&s->view, &deltas[d]);
+    }
+}
+
+// The other sessions on the active buffer count their columns anew (after :set ts)
+void server_views_invalidate() {
+    int i;
+    if (server_active == NULL)
+        return;
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        struct termsession* s = &server_sessions[i];
+        if (!s->used || s->slot != server_active->slot || s == server_active)
+            continue;
+        s->view.cursor_chunk = NULL;  // bufview_load recomputes the coordinates
+        s->needs_refresh = 1;
+    }
+}
+
+// Slot of the resident buffer for path, loading it into a free slot if it is not resident
+// (or reloading it if it is clean, unattached and changed on disk). -1 if no slot is free.
+// Must be called with no session active: textbuf is used as scratch for loading.
+static int server_attach_buffer(const char* path) {
+    struct stat st;
+    int have_stat = (path[0] != '\0' && stat(path, &st) == 0);
+    int i, slot = -1;
+
+    for (i = 0; i < SERVER_MAX_BUFS; i++) {
+        if (server_bufs[i].used && strcmp(server_bufs[i].buf.filename, path) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) {
+        struct residentbuf* rb = &server_bufs[slot];
+        int stale = !rb->buf.dirty && rb->sessions == 0 && have_stat && (st.st_mtime != rb->mtime || st.st_size != rb->fsize);
+        if (!stale) {
+            rb->last_used = time(NULL);
+            if (rb->sessions > 0) {
+                editorSetStatusMessage("Shared buffer (other clients attached)");
+            } else {
+                editorSetStatusMessage(rb->buf.dirty ? "Resident buffer (unsaved changes)" : "Resident buffer");
+            }
+            return slot;
+        }
+        bufclient_free(&rb->buf);  // Changed on disk: reload below
+        rb->used = 0;
+    } else {
+        // Pick a free slot, or evict the least recently used clean, unattached buffer
+        for (i = 0; i < SERVER_MAX_BUFS; i++) {
+            if (!server_bufs[i].used) {
+                slot = i;
+                break;
+            }
+            if (!server_bufs[i].buf.dirty && server_bufs[i].sessions == 0 &&
+                (slot == -1 || server_bufs[i].last_used < server_bufs[slot].last_used)) {
+                slot = i;
+            }
+        }
+        if (slot == -1)
+            return -1;
+        if (server_bufs[slot].used) {
+            bufclient_free(&server_bufs[slot].buf);
+            server_bufs[slot].used = 0;
+        }
+    }
+
+    if (bufclient_init(&textbuf) != RESULT_OK)
+        return -1;
+    if (path[0] != '\0') {
+        editorOpen(path);
+    } else {
+        editorSetStatusMessage("lkjsxceditor | Version " LKJSXCEDITOR_VERSION " | Press : for command");
+    }
+    bufclient_observe(&textbuf, &server_observer);
+    server_bufs[slot].buf = textbuf;
+    server_bufs[slot].used = 1;
+    server_bufs[slot].sessions = 0;
+    server_bufs[slot].last_used = time(NULL);
+    return slot;
+}
+
+// The last session on a resident buffer left: remember the file version it matches,
+// or drop it if that session quit with :q!
+static void server_detach_buffer(int slot, int discard) {
+    struct residentbuf* rb = &server_bufs[slot];
+    struct stat st;
+    if (discard) {
+        bufclient_free(&rb->buf);  // :q! discards the changes, next open reloads the file
+        rb->used = 0;
+        return;
+    }
+    rb->mtime = 0;
+    rb->fsize = -1;
+    if (!rb->buf.dirty && rb->buf.filename[0] != '\0' && stat(rb->buf.filename, &st) == 0) {
+        rb->mtime = st.st_mtime;  // Clean buffer matches this version of the file
+        rb->fsize = st.st_size;
+    }
+}
+
+// Make session s current: its terminal, editor state and view of its buffer move into the globals
+static void session_activate(struct termsession* s) {
+    term_in_fd = s->fd;
+    screen_pipe = &s->pipe;
+    screenrows = s->rows;
+    screencols = s->cols;
+    mode = s->mode;
+    memcpy(cmdbuf, s->cmdbuf, sizeof(cmdbuf));
+    cmdbuf_len = s->cmdbuf_len;
+    memcpy(statusbuf, s->statusbuf, sizeof(statusbuf));
+    statusbuf_time = s->statusbuf_time;
+    terminate_editor = 0;
+    server_discard_buffer = 0;
+    textbuf = server_bufs[s->slot].buf;
+    bufview_load(&textbuf, &s->view);
+    server_active = s;
+}
+
+// Store the globals back into the current session (and its shared buffer)
+static void session_deactivate(struct termsession* s) {
+    s->mode = mode;
+    memcpy(s->cmdbuf, cmdbuf, sizeof(cmdbuf));
+    s->cmdbuf_len = cmdbuf_len;
+    memcpy(s->statusbuf, statusbuf, sizeof(statusbuf));
+    s->statusbuf_time = statusbuf_time;
+    bufview_save(&s->view, &textbuf);
+    server_bufs[s->slot].buf = textbuf;
+    server_active = NULL;
+}
+
+// Start a session for the client on fd, which said hello; closes fd if it cannot be served
+static void server_open_session(int fd, int rows, int cols, const char* path) {
+    int slot, i;
+    struct termsession* s = NULL;
+
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        if (!server_sessions[i].used) {
+            s = &server_sessions[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        const char* msg = "lkjsxceditor server: too many clients\r\n";
+        write_all(fd, msg, strlen(msg));
+        close(fd);
+        return;
+    }
+
+    statusbuf[0] = '\0';
+    statusbuf_time = 0;
+    slot = server_attach_buffer(path);
+    if (slot < 0) {
+        const char* msg = "lkjsxceditor server: all resident buffers have unsaved changes\r\n";
+        write_all(fd, msg, strlen(msg));
+        close(fd);
+        return;
+    }
+
+    s->fd = fd;
+    s->slot = slot;
+    s->cols = cols > SCREEN_MAX_COLS ? SCREEN_MAX_COLS : cols;
+    s->rows = rows - 2;
+    if (s->rows > SCREEN_MAX_ROWS - 2) s->rows = SCREEN_MAX_ROWS - 2;
+    s->mode = MODE_NORMAL;
+    s->cmdbuf[0] = '\0';
+    s->cmdbuf_len = 0;
+    memcpy(s->statusbuf, statusbuf, sizeof(s->statusbuf));  // Message from attaching/loading
+    s->statusbuf_time = statusbuf_time;
+    s->in_len = 0;
+    s->in_retry = 0;
+    bufview_save(&s->view, &server_bufs[slot].buf);  // Start where the buffer was last left
+    s->view.rowoff_chunk = NULL;  // Screen size may differ from the last viewer's
+    if (render_thread_start(&s->pipe, fd) != RESULT_OK) {
+        const char* msg = "lkjsxceditor server: cannot start a render thread\r\n";
+        write_all(fd, msg, strlen(msg));
+        close(fd);
+        if (server_bufs[slot].sessions == 0)
+            server_detach_buffer(slot, 0);
+        return;
+    }
+    s->used = 1;
+    s->needs_refresh = 1;
+    server_bufs[slot].sessions++;
+}
+
+// Only clients of this user may attach. The socket's directory and mode say so too, but
+// the kernel's word on the peer does not depend on the file system.
+static int server_peer_ok(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// A client connected: wait for its hello without blocking the sessions already served.
+// Returns -1 if accepting failed for good.
+static int server_accept(int lfd) {
+    struct pendingclient* pc = NULL;
+    int fd = accept(lfd, NULL, NULL), i;
+    if (fd == -1)
+        return (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) ? 0 : -1;
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        if (!server_pending[i].used) {
+            pc = &server_pending[i];
+            break;
+        }
+    }
+    if (!server_peer_ok(fd) || pc == NULL) {
+        const char* msg = "lkjsxceditor server: too many clients\r\n";
+        if (pc == NULL)
+            write_all(fd, msg, strlen(msg));
+        close(fd);
+        return 0;
+    }
+    pc->used = 1;
+    pc->fd = fd;
+    pc->since_ms = sched_now_us() / 1000;
+    pc->len = 0;
+    return 0;
+}
+
+// Bytes of a pending client's hello arrived (or it hung up)
+static void server_pending_input(struct pendingclient* pc) {
+    char path[PATH_MAX];
+    int rows, cols;
+    int done = server_read_hello(pc, &rows, &cols, path, sizeof(path));
+    if (done == 0)
+        return;
+    pc->used = 0;
+    if (done < 0) {
+        close(pc->fd);
+        return;
+    }
+    server_open_session(pc->fd, rows, cols, path);
+}
+
+// Drop pending clients that did not say hello in time. Returns the poll timeout until
+// the next one is due, -1 if none is pending.
+static int server_pending_expire() {
+    long long now = sched_now_us() / 1000;
+    int i, timeout = -1;
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        struct pendingclient* pc = &server_pending[i];
+        if (!pc->used)
+            continue;
+        long long left = pc->since_ms + SERVER_HELLO_TIMEOUT_MS - now;
+        if (left <= 0) {
+            close(pc->fd);
+            pc->used = 0;
+        } else if (timeout == -1 || left < timeout) {
+            timeout = (int)left;
+        }
+    }
+    return timeout;
+}
+
+// End session s (its client quit or went away)
+static void server_close_session(struct termsession* s) {
+    struct residentbuf* rb = &server_bufs[s->slot];
+    shutdown(s->fd, SHUT_RDWR);  // Unblocks the render thread if it is stuck writing
+    render_thread_stop(&s->pipe);
+    close(s->fd);
+    s->used = 0;
+    rb->sessions--;  // The resident view stays this session's, so a re-attach resumes there
+    if (rb->sessions == 0) {
+        server_detach_buffer(s->slot, server_discard_buffer);
+    }
+}
+
+// 1 if the escape sequence timeout passed since the last input of s arrived
+static int server_input_stale(struct termsession* s) {
+    return sched_now_us() / 1000 - s->in_ms >= ESC_SEQ_TIMEOUT_MS;
+}
+
+// Server mode editorReadKey: the next key from the input of the active session. Nothing
+// blocks: a command that needs more keys than have arrived gets KEY_NULL here, and
+// server_session_keys runs it again from its first key once they are there.
+enum editorKey server_read_key() {
+    struct termsession* s = server_active;
+    int key, used = key_decode(s->in + server_in_pos, s->in_len - server_in_pos, &key);
+    if (used == 0 && server_in_pos < s->in_len && server_input_stale(s)) {
+        used = s->in_len - server_in_pos;  // A lone ESC, or a sequence cut short
+        key = '\x1b';
+    }
+    if (used == 0) {
+        server_in_short = 1;
+        return KEY_NULL;
+    }
+    server_in_pos += used;
+    return key;
+}
+
+// Handle the complete commands in the input of session s; the rest stays for later
+static void server_session_keys(struct termsession* s) {
+    int key;
+    while (s->used && s->in_len > 0) {
+        if (key_decode(s->in, s->in_len, &key) == 0 && !server_input_stale(s))
+            break;  // Rest of an escape sequence still to come
+        session_activate(s);
+        server_in_pos = 0;
+        server_in_short = 0;
+        editorProcessKeypress();
+        if (server_in_short) {
+            session_deactivate(s);  // Unfinished command: no key is used up
+            break;
+        }
+        memmove(s->in, s->in + server_in_pos, s->in_len - server_in_pos);
+        s->in_len -= server_in_pos;
+        bufclient_flush_deltas(&textbuf);  // End of this session's tick
+        s->needs_refresh = 1;
+        session_deactivate(s);
+        if (terminate_editor)
+            server_close_session(s);
+    }
+}
+
+// Input from session s arrived (or its client went away)
+static void server_session_input(struct termsession* s) {
+    ssize_t n = recv(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len, MSG_DONTWAIT);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        server_discard_buffer = 0;  // Client gone: end its session, keeping the buffer
+        server_close_session(s);
+        return;
+    }
+    s->in_len += n;
+    s->in_ms = sched_now_us() / 1000;
+    server_session_keys(s);
+    s->in_retry = s->used && s->in_len > 0;
+}
+
+// Poll timeout until the next session's input must be looked at again (a lone ESC is a
+// key once the escape sequence timeout passed), -1 if none. Looks at the due ones now.
+static int server_input_retry() {
+    long long now = sched_now_us() / 1000;
+    int i, timeout = -1;
+    for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+        struct termsession* s = &server_sessions[i];
+        if (!s->used || !s->in_retry)
+            continue;
+        long long left = s->in_ms + ESC_SEQ_TIMEOUT_MS - now;
+        if (left <= 0) {
+            s->in_retry = 0;
+            server_session_keys(s);
+        } else if (timeout == -1 || left < timeout) {
+            timeout = (int)left;
+        }
+    }
+    return timeout;
+}
+
+// Resident server: serve all attached clients from one event loop, keeping buffers
+// loaded between sessions
+int serverMain() {
+    char sock_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    struct sockaddr_un addr;
+    const char* err;
+    int lfd, fd, i;
+
+    if ((err = server_socket_path(sock_path, sizeof(sock_path))) != NULL) {
+        fprintf(stderr, "Error: No server socket: %s.\n", err);
+        return 1;
+    }
+    fd = server_connect(sock_path);
+    if (fd != -1) {
+        close(fd);
+        fprintf(stderr, "Error: A server is already running at %s.\n", sock_path);
+        return 1;
+    }
+    unlink(sock_path);  // Stale socket from a server that died
+
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd == -1) {
+        perror("socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, sock_path, strlen(sock_path) + 1);
+    mode_t old_umask = umask(0077);  // Only this user may attach
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(lfd, 8) == -1) {
+        umask(old_umask);
+        perror("bind/listen");
+        close(lfd);
+        return 1;
+    }
+    umask(old_umask);
+
+    signal(SIGPIPE, SIG_IGN);  // A vanished client must not kill the server
+    server_mode = 1;
+    bufchunk_pool_init();
+
+    for (;;) {
+        struct pollfd pfds[1 + 2 * SERVER_MAX_SESSIONS];
+        struct termsession* owners[1 + 2 * SERVER_MAX_SESSIONS];
+        struct pendingclient* pending[1 + 2 * SERVER_MAX_SESSIONS];
+        int nfds = 1, retry = server_input_retry(), timeout = server_pending_expire();
+        if (retry >= 0 && (timeout < 0 || retry < timeout))
+            timeout = retry;
+
+        // Redraw sessions whose view changed (their own keys or another client's edits)
+        for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+            struct termsession* s = &server_sessions[i];
+            if (s->used && s->needs_refresh) {
+                session_activate(s);
+                editorRefreshScreen();
+                session_deactivate(s);
+                s->needs_refresh = 0;
+            }
+        }
+
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        owners[0] = NULL;
+        pending[0] = NULL;
+        for (i = 0; i < SERVER_MAX_SESSIONS; i++) {
+            if (server_sessions[i].used) {
+                pfds[nfds].fd = server_sessions[i].fd;
+                pfds[nfds].events = POLLIN;
+                owners[nfds] = &server_sessions[i];
+                pending[nfds] = NULL;
+                nfds++;
+            }
+            if (server_pending[i].used) {
+                pfds[nfds].fd = server_pending[i].fd;
+                pfds[nfds].events = POLLIN;
+                owners[nfds] = NULL;
+                pending[nfds] = &server_pending[i];
+                nfds++;
+            }
+        }
+        if (poll(pfds, nfds, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (i = 1; i < nfds; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (owners[i] != NULL)
+                server_session_input(owners[i]);
+            else
+                server_pending_input(pending[i]);
+        }
+        if ((pfds[0].revents & POLLIN) && server_accept(lfd) == -1) {
+            perror("accept");
+            break;
+        }
+    }
+    close(lfd);
+    unlink(sock_path);
+    return 1;
+}
+
+// *** Language Server Client Implementation ***
+// ":lsp <command>" (or $LKJSXCEDITOR_LSP at startup) runs a language server over stdio.
+// The open document is synced with incremental didChange edits built from buffer
+// deltas, batched once per event loop tick. All server I/O is non-blocking and is
+// served from the main loop while it waits for keys (editorWaitInput), so typing never
+// waits for a reply; replies are dropped if the buffer changed since the request.
+// Columns are bytes if the server takes the UTF-8 position encoding the client offers,
+// otherwise UTF-16 code units (the protocol's default) counted over the line's text.
+
+// Skip JSON whitespace
+static const char* json_ws(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+// Skip one JSON value starting at p (after whitespace), NULL if malformed
+static const char* json_skip(const char* p, const char* end) {
+    int depth = 0;
+    p = json_ws(p, end);
+    if (p >= end)
+        return NULL;
+    do {
+        if (p >= end)
+            return NULL;
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++)
+                if (*p == '\\')
+                    p++;
+            if (p >= end)
+                return NULL;
+            p++;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+            p++;
+        } else if (*p == '}' || *p == ']') {
+            depth--;
+            p++;
+        } else if (depth > 0 && (*p == ',' || *p == ':' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            p++;
+        } else {
+            // Number or literal
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\r' && *p != '\n' && *p != '\t')
+                p++;
+        }
+    } while (depth > 0);
+    return p;
+}
+
+// Value of member key of the object at p, NULL if p is not an object or has no such key
+static const char* json_get(const char* p, const char* end, const char* key) {
+    size_t key_len = strlen(key);
+    if (p == NULL)
+        return NULL;
+    p = json_ws(p, end);
+    if (p >= end || *p != '{')
+        return NULL;
+    p = json_ws(p + 1, end);
+    while (p < end && *p == '"') {
+        const char* name = p + 1;
+        const char* name_end = json_skip(p, end);
+        if (name_end == NULL)
+            return NULL;
+        p = json_ws(name_end, end);
+        if (p >= end || *p != ':')
+            return NULL;
+        p = json_ws(p + 1, end);
+        if ((size_t)(name_end - 1 - name) == key_len && memcmp(name, key, key_len) == 0)
+            return p;
+        p = json_skip(p, end);
+        if (p == NULL)
+            return NULL;
+        p = json_ws(p, end);
+        if (p < end && *p == ',')
+            p = json_ws(p + 1, end);
+    }
+    return NULL;
+}
+
+// Element index of the array at p, NULL if p is not an array or is too short
+static const char* json_at(const char* p, const char* end, int index) {
+    if (p == NULL)
+        return NULL;
+    p = json_ws(p, end);
+    if (p >= end || *p != '[')
+        return NULL;
+    p = json_ws(p + 1, end);
+    while (p < end && *p != ']') {
+        if (index-- == 0)
+            return p;
+        p = json_skip(p, end);
+        if (p == NULL)
+            return NULL;
+        p = json_ws(p, end);
+        if (p < end && *p == ',')
+            p = json_ws(p + 1, end);
+    }
+    return NULL;
+}
+
+// Read the integer at p, never past end (the read buffer is not NUL-terminated)
+static enum RESULT json_int(const char* p, const char* end, int* out) {
+    long long value = 0;
+    int negative = 0;
+    if (p == NULL)
+        return RESULT_ERR;
+    p = json_ws(p, end);
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p >= end || !isdigit((unsigned char)*p))
+        return RESULT_ERR;
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+        if (value <= INT_MAX)
+            value = value * 10 + (*p - '0');  // Past INT_MAX it is clamped below
+    }
+    if (value > INT_MAX)
+        value = INT_MAX;
+    *out = negative ? (int)-value : (int)value;
+    return RESULT_OK;
+}
+
+// Decode the string at p into out (NUL-terminated, truncated to size)
+static enum RESULT json_str(const char* p, const char* end, char* out, int size) {
+    int n = 0;
+    if (p == NULL)
+        return RESULT_ERR;
+    p = json_ws(p, end);
+    if (p >= end || *p != '"')
+        return RESULT_ERR;
+    for (p++; p < end && *p != '"'; p++) {
+        char c = *p;
+        if (c == '\\' && p + 1 < end) {
+            c = *++p;
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    // Only ASCII is decoded, anything else shows as '?'
+                    unsigned int code = 0;
+                    if (p + 4 < end && sscanf(p + 1, "%4x", &code) == 1)
+                        p += 4;
+                    c = code < 0x80 ? (char)code : '?';
+                } break;
+                default: break;  // '"', '\\', '/'
+            }
+        }
+        if (n < size - 1)
+            out[n++] = c;
+    }
+    out[n] = '\0';
+    return RESULT_OK;
+}
+
+// Append s as JSON string contents (without quotes); returns bytes written, -1 if out is too small
+static int json_escape(char* out, int size, const char* s, int len) {
+    int n = 0, i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        char esc[8];
+        int esc_len = 0;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\'; esc[1] = c; esc_len = 2;
+        } else if (c == '\n') {
+            esc[0] = '\\'; esc[1] = 'n'; esc_len = 2;
+        } else if (c == '\t') {
+            esc[0] = '\\'; esc[1] = 't'; esc_len = 2;
+        } else if (c == '\r') {
+            esc[0] = '\\'; esc[1] = 'r'; esc_len = 2;
+        } else if (c < 0x20) {
+            esc_len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        } else {
+            esc[0] = c; esc_len = 1;
+        }
+        if (n + esc_len > size)
+            return -1;
+        memcpy(out + n, esc, esc_len);
+        n += esc_len;
+    }
+    return n;
+}
+
+// "file://" URI of an absolute path (percent-encoding anything unusual)
+static void lsp_path_to_uri(const char* path, char* out, int size) {
+    int n = snprintf(out, size, "file://");
+    for (; *path && n < size - 4; path++) {
+        unsigned char c = (unsigned char)*path;
+        if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '~') {
+            out[n++] = c;
+        } else {
+            n += snprintf(out + n, size - n, "%%%02X", c);
+        }
+    }
+    out[n] = '\0';
+}
+
+// Path of a "file://" URI, RESULT_ERR for other schemes
+static enum RESULT lsp_uri_to_path(const char* uri, char* out, int size) {
+    int n = 0;
+    unsigned int c;
+    if (strncmp(uri, "file://", 7) != 0)
+        return RESULT_ERR;
+    for (uri += 7; *uri && n < size - 1; uri++) {
+        if (*uri == '%' && sscanf(uri + 1, "%2x", &c) == 1) {
+            out[n++] = (char)c;
+            uri += 2;
+        } else {
+            out[n++] = *uri;
+        }
+    }
+    out[n] = '\0';
+    return RESULT_OK;
+}
+
+// languageId for the open file, from its extension
+static const char* lsp_language_id(const char* filename) {
+    static const char* const map[][2] = {
+        {"c", "c"}, {"h", "c"}, {"cc", "cpp"}, {"cpp", "cpp"}, {"cxx", "cpp"}, {"hh", "cpp"},
+        {"hpp", "cpp"}, {"py", "python"}, {"rs", "rust"}, {"go", "go"}, {"js", "javascript"},
+        {"ts", "typescript"}, {"java", "java"}, {"lua", "lua"}, {"sh", "shellscript"},
+    };
+    const char* dot = strrchr(filename, '.');
+    size_t i;
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        for (i = 0; i < sizeof(map) / sizeof(map[0]); i++)
+            if (strcmp(dot + 1, map[i][0]) == 0)
+                return map[i][1];
+    }
+    return "plaintext";
+}
+
+// Write as much of the outgoing queue as the server takes without blocking
+static void lsp_write_some() {
+    while (lsp.out_len > 0) {
+        ssize_t n = write(lsp.in_fd, lsp.out, lsp.out_len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                lsp.out_len = 0;  // Server is gone; the read side notices and stops
+            return;
+        }
+        memmove(lsp.out, lsp.out + n, lsp.out_len - n);
+        lsp.out_len -= n;
+    }
+}
+
+// Queue bytes for the server. Only blocks (bounded by LSP_WRITE_TIMEOUT_MS) if the
+// queue is full, i.e. the server stopped reading.
+static enum RESULT lsp_queue(const char* data, int len) {
+    while (len > 0) {
+        int room = LSP_MSG_MAX - lsp.out_len;
+        if (room == 0) {
+            struct pollfd pfd;
+            lsp_write_some();
+            if (lsp.out_len < LSP_MSG_MAX)
+                continue;
+            pfd.fd = lsp.in_fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, LSP_WRITE_TIMEOUT_MS) <= 0)
+                return RESULT_ERR;
+            continue;
+        }
+        int n = len < room ? len : room;
+        memcpy(lsp.out + lsp.out_len, data, n);
+        lsp.out_len += n;
+        data += n;
+        len -= n;
+    }
+    return RESULT_OK;
+}
+
+// Queue one message (body is a complete JSON-RPC object)
+static enum RESULT lsp_send(const char* body, int len) {
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "Content-Length: %d\r\n\r\n", len);
+    if (lsp_queue(header, header_len) != RESULT_OK || lsp_queue(body, len) != RESULT_OK) {
+        lsp_stop();
+        editorSetStatusMessage("LSP: server stopped reading, disconnected");
+        return RESULT_ERR;
+    }
+    lsp_write_some();
+    return RESULT_OK;
+}
+
+// Send a request (params is a JSON value) and remember what its reply is for
+static enum RESULT lsp_request(enum lspRequest kind, const char* method, const char* params) {
+    int i;
+    for (i = 0; i < LSP_PENDING_MAX; i++) {
+        if (lsp.pending[i].kind == LSP_REQ_NONE)
+            break;
+    }
+    if (i == LSP_PENDING_MAX) {
+        editorSetStatusMessage("LSP: too many requests in flight");
+        return RESULT_ERR;
+    }
+    int id = ++lsp.next_id;
+    int len = snprintf(lsp.body, sizeof(lsp.body), "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"%s\",\"params\":%s}", id, method, params);
+    if (len < 0 || len >= (int)sizeof(lsp.body))
+        return RESULT_ERR;
+    lsp.pending[i].id = id;
+    lsp.pending[i].kind = kind;
+    lsp.pending[i].abs_i = textbuf.cursor_abs_i;
+    lsp.pending[i].version = lsp.version;
+    return lsp_send(lsp.body, len);
+}
+
+static enum RESULT lsp_notify_server(const char* method, const char* params) {
+    int len = snprintf(lsp.body, sizeof(lsp.body), "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":%s}", method, params);
+    if (len < 0 || len >= (int)sizeof(lsp.body))
+        return RESULT_ERR;
+    return lsp_send(lsp.body, len);
+}
+
+// Send this tick's content changes as one didChange
+// Columns bytes advance an LSP position by: UTF-16 code units (two for a 4-byte sequence)
+// unless the server counts bytes
+static int lsp_units(const char* bytes, int len) {
+    int i, units = 0;
+    if (!lsp.utf16)
+        return len;
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)bytes[i];
+        if ((c & 0xC0) != 0x80)
+            units += c >= 0xF0 ? 2 : 1;
+    }
+    return units;
+}
+
+// LSP column of the len bytes of buf starting at abs_i (a line start)
+static int lsp_units_at(struct bufclient* buf, int abs_i, int len) {
+    char piece[256];
+    int units = 0;
+    if (!lsp.utf16)
+        return len;
+    while (len > 0) {
+        int n = bufclient_read(buf, abs_i, piece, len < (int)sizeof(piece) ? len : (int)sizeof(piece));
+        if (n == 0)
+            break;
+        units += lsp_units(piece, n);
+        abs_i += n;
+        len -= n;
+    }
+    return units;
+}
+
+// LSP column of abs_i in its line
+static int lsp_col(struct bufclient* buf, int abs_i) {
+    int col = bufclient_line_col(buf, abs_i);
+    return lsp_units_at(buf, abs_i - col, col);
+}
+
+void lsp_flush_changes() {
+    if (lsp.changes_len == 0)
+        return;
+    if (!lsp.doc_open) {
+        lsp.changes_len = 0;
+        return;
+    }
+    lsp.version++;
+    int len = snprintf(lsp.body, sizeof(lsp.body),
+                       "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":"
+                       "{\"uri\":\"%s\",\"version\":%d},\"contentChanges\":[%.*s]}}",
+                       lsp.uri, lsp.version, lsp.changes_len, lsp.changes);
+    lsp.changes_len = 0;
+    if (len < 0 || len >= (int)sizeof(lsp.body))
+        return;  // Cannot happen: changes are capped to leave room for the envelope
+    lsp_send(lsp.body, len);
+}
+
+// Add one contentChanges entry replacing [start, end) with text (len bytes)
+static void lsp_add_change(int line, int col, int end_line, int end_col, const char* text, int len) {
+    char head[160];
+    int head_len = snprintf(head, sizeof(head), "%s{\"range\":{\"start\":{\"line\":%d,\"character\":%d},\"end\":{\"line\":%d,\"character\":%d}},\"text\":\"",
+                            lsp.changes_len > 0 ? "," : "", line, col, end_line, end_col);
+    int room, text_len;
+    // Worst case escaping is 6 bytes per byte; flush first if this might not fit
+    if (lsp.changes_len + head_len + len * 6 + 2 > LSP_CHANGES_MAX) {
+        lsp_flush_changes();
+        head_len = snprintf(head, sizeof(head), "{\"range\":{\"start\":{\"line\":%d,\"character\":%d},\"end\":{\"line\":%d,\"character\":%d}},\"text\":\"",
+                            line, col, end_line, end_col);
+    }
+    memcpy(lsp.changes + lsp.changes_len, head, head_len);
+    room = LSP_CHANGES_MAX - lsp.changes_len - head_len - 2;
+    text_len = json_escape(lsp.changes + lsp.changes_len + head_len, room, text, len);
+    if (text_len < 0)
+        return;  // Cannot happen: pieces are at most LSP_CHANGE_PIECE bytes
+    lsp.changes_len += head_len + text_len;
+    lsp.changes[lsp.changes_len++] = '"';
+    lsp.changes[lsp.changes_len++] = '}';
+}
+
+// Text is about to be removed: where it ends is known in UTF-16 only while it is there
+static void lsp_before_remove(struct bufclient* buf, int offset, int removed, void* ctx) {
+    char piece[256];
+    int line_start = -1, at = offset, left = removed;
+    (void)ctx;
+    if (!lsp.doc_open || !lsp.incremental || !lsp.utf16)
+        return;
+    while (left > 0) {
+        int n = bufclient_read(buf, at, piece, left < (int)sizeof(piece) ? left : (int)sizeof(piece));
+        const char* nl;
+        if (n == 0)
+            break;
+        for (nl = piece + n; nl > piece && nl[-1] != '\n'; nl--) {}
+        if (nl > piece)
+            line_start = at + (int)(nl - piece);  // After the last newline so far
+        at += n;
+        left -= n;
+    }
+    if (line_start < 0)
+        line_start = offset - bufclient_line_col(buf, offset);
+    lsp.removed_at = offset;
+    lsp.removed_end = lsp_units_at(buf, line_start, offset + removed - line_start);
+}
+
+// Buffer observer: turn each delta into content changes while its text is still at hand
+static void lsp_on_edit(struct bufclient* buf, const struct bufdelta* deltas, int count, void* ctx) {
+    int d;
+    (void)ctx;
+    if (!lsp.doc_open || !lsp.incremental)
+        return;
+    for (d = 0; d < count; d++) {
+        const struct bufdelta* delta = &deltas[d];
+        int line = delta->line, col = delta->col, end_col = delta->end_col;
+        int done = 0;
+        if (lsp.utf16) {
+            col = lsp_units_at(buf, delta->offset - delta->col, delta->col);  // Text before offset is unchanged
+            end_col = lsp.removed_at == delta->offset ? lsp.removed_end : col;
+        }
+        if (delta->removed > 0)
+            lsp_add_change(line, col, delta->end_line, end_col, "", 0);
+        // Inserted text goes in pieces, each inserted where the previous one ended
+        while (done < delta->inserted) {
+            char piece[LSP_CHANGE_PIECE];
+            int n = delta->inserted - done, i;
+            if (n > LSP_CHANGE_PIECE)
+                n = LSP_CHANGE_PIECE;
+            n = bufclient_read(buf, delta->offset + done, piece, n);
+            if (n == 0)
+                break;
+            lsp_add_change(line, col, line, col, piece, n);
+            for (i = 0; i < n; i++) {
+                if (piece[i] == '\n') {
+                    line++;
+                    col = 0;
+                } else {
+                    col += lsp_units(piece + i, 1);
+                }
+            }
+            done += n;
+        }
+    }
+}
+
+// Stream the whole buffer as a didOpen (once per opened file; edits go through didChange)
+void lsp_open_document() {
+    char path[PATH_MAX];
+    char text[LSP_CHANGE_PIECE];
+    char escaped[LSP_CHANGE_PIECE * 6];
+    char head[PATH_MAX * 3 + 256];
+    const char* tail = "\"}}}";
+    struct bufchunk* chunk;
+    long long text_len = 0;
+    int i;
+
+    if (!lsp.initialized || lsp.doc_open || textbuf.filename[0] == '\0')
+        return;
+    if (client_abs_path(textbuf.filename, path, sizeof(path)) != RESULT_OK)
+        return;
+    lsp_path_to_uri(path, lsp.uri, sizeof(lsp.uri));
+    lsp.version = 1;
+    lsp.changes_len = 0;
+    lsp.diag_count = 0;
+
+    // Length of the escaped text, for the header
+    for (chunk = textbuf.begin; chunk != NULL; chunk = chunk->next) {
+        for (i = 0; i < chunk->size; i++) {
+            unsigned char c = (unsigned char)chunk->data[i];
+            if (c == '"' || c == '\\' || c == '\n' || c == '\t' || c == '\r')
+                text_len += 2;
+            else if (c < 0x20)
+                text_len += 6;
+            else
+                text_len++;
+        }
+    }
+    int head_len = snprintf(head, sizeof(head),
+                            "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":"
+                            "{\"uri\":\"%s\",\"languageId\":\"%s\",\"version\":%d,\"text\":\"",
+                            lsp.uri, lsp_language_id(textbuf.filename), lsp.version);
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "Content-Length: %lld\r\n\r\n", head_len + text_len + (long long)strlen(tail));
+    enum RESULT res = lsp_queue(header, header_len);
+    if (res == RESULT_OK)
+        res = lsp_queue(head, head_len);
+    int offset = 0;
+    while (res == RESULT_OK && offset < textbuf.size) {
+        int n = bufclient_read(&textbuf, offset, text, sizeof(text));
+        int escaped_len = json_escape(escaped, sizeof(escaped), text, n);
+        res = lsp_queue(escaped, escaped_len);
+        offset += n;
+    }
+    if (res == RESULT_OK)
+        res = lsp_queue(tail, strlen(tail));
+    if (res != RESULT_OK) {
+        lsp_stop();
+        editorSetStatusMessage("LSP: server stopped reading, disconnected");
+        return;
+    }
+    lsp_write_some();
+    lsp.doc_open = 1;
+}
+
+// Tell the server the current document is gone (before the buffer is reloaded or renamed)
+void lsp_close_document() {
+    char params[PATH_MAX * 3 + 64];
+    if (!lsp.doc_open)
+        return;
+    lsp.doc_open = 0;
+    lsp.changes_len = 0;
+    lsp.diag_count = 0;
+    snprintf(params, sizeof(params), "{\"textDocument\":{\"uri\":\"%s\"}}", lsp.uri);
+    lsp_notify_server("textDocument/didClose", params);
+}
+
+// Absolute index of an LSP position in textbuf (clamped to the line and buffer)
+static int lsp_position_to_abs(int line, int col) {
+    struct bufchunk* chunk;
+    int rel_i, line_abs_i, next_abs_i, abs_i;
+    if (line < 0 || bufclient_find_line_start(&textbuf, line, &chunk, &rel_i, &line_abs_i) != RESULT_OK)
+        return textbuf.size;
+    if (bufclient_find_line_start(&textbuf, line + 1, &chunk, &rel_i, &next_abs_i) == RESULT_OK)
+        next_abs_i--;  // Stop before the newline
+    else
+        next_abs_i = textbuf.size;
+    if (col < 0)
+        col = 0;
+    if (!lsp.utf16)
+        return line_abs_i + col < next_abs_i ? line_abs_i + col : next_abs_i;
+    // Count UTF-16 code units up to col, then step past the rest of that character
+    abs_i = line_abs_i;
+    while (abs_i < next_abs_i) {
+        char piece[256];
+        int n = next_abs_i - abs_i, i;
+        n = bufclient_read(&textbuf, abs_i, piece, n < (int)sizeof(piece) ? n : (int)sizeof(piece));
+        if (n == 0)
+            break;
+        for (i = 0; i < n; i++) {
+            if (col <= 0 && ((unsigned char)piece[i] & 0xC0) != 0x80)
+                return abs_i + i;
+            col -= lsp_units(piece + i, 1);
+        }
+        abs_i += n;
+    }
+    return next_abs_i;
+}
+
+// "textDocument" and "position" params for a request at the cursor
+static void lsp_cursor_params(char* out, int size) {
+    snprintf(out, size, "{\"textDocument\":{\"uri\":\"%s\"},\"position\":{\"line\":%d,\"character\":%d}}",
+             lsp.uri, textbuf.cursor_abs_y, lsp_col(&textbuf, textbuf.cursor_abs_i));
+}
+
+void lsp_request_completion() {
+    char params[PATH_MAX * 3 + 128];
+    if (!lsp.doc_open) {
+        editorSetStatusMessage(lsp.pid ? "LSP: starting..." : "LSP: not running (use :lsp <command>)");
+        return;
+    }
+    lsp_flush_changes();  // The server must see the text the cursor is in
+    lsp_cursor_params(params, sizeof(params));
+    lsp_request(LSP_REQ_COMPLETION, "textDocument/completion", params);
+}
+
+void lsp_request_definition() {
+    char params[PATH_MAX * 3 + 128];
+    if (!lsp.doc_open) {
+        editorSetStatusMessage(lsp.pid ? "LSP: starting..." : "LSP: not running (use :lsp <command>)");
+        return;
+    }
+    lsp_flush_changes();
+    lsp_cursor_params(params, sizeof(params));
+    lsp_request(LSP_REQ_DEFINITION, "textDocument/definition", params);
+}
+
+// Move to the next diagnostic after the cursor line (wrapping) and show its message
+void lsp_next_diagnostic() {
+    int i, best = -1;
+    char msg[STATUS_BUF_SIZE];
+    if (lsp.diag_count == 0) {
+        editorSetStatusMessage("LSP: no diagnostics");
+        return;
+    }
+    for (i = 0; i < lsp.diag_count; i++) {
+        if (lsp.diags[i].line > textbuf.cursor_abs_y && (best < 0 || lsp.diags[i].line < lsp.diags[best].line))
+            best = i;
+    }
+    if (best < 0) {  // Wrap to the first one
+        for (i = 0; i < lsp.diag_count; i++)
+            if (best < 0 || lsp.diags[i].line < lsp.diags[best].line)
+                best = i;
+    }
+    bufclient_move_cursor_to(&textbuf, lsp_position_to_abs(lsp.diags[best].line, lsp.diags[best].col));
+    snprintf(msg, sizeof(msg), "%c %d:%d %s", "?EWIH"[lsp.diags[best].severity], lsp.diags[best].line + 1,
+             lsp.diags[best].col + 1, lsp.diags[best].message);
+    editorSetStatusMessage(msg);
+}
+
+static void lsp_on_initialize(const char* result, const char* end) {
+    const char* caps = json_get(result, end, "capabilities");
+    const char* sync = json_get(caps, end, "textDocumentSync");
+    char encoding[16];
+    int change = 0;
+    // The server picks from the encodings offered; one that does not answer uses UTF-16
+    if (json_str(json_get(caps, end, "positionEncoding"), end, encoding, sizeof(encoding)) != RESULT_OK)
+        strcpy(encoding, "utf-16");
+    if (strcmp(encoding, "utf-8") != 0 && strcmp(encoding, "utf-16") != 0) {
+        char msg[STATUS_BUF_SIZE];
+        snprintf(msg, sizeof(msg), "LSP: unsupported position encoding %s, disconnected", encoding);
+        lsp_stop();
+        editorSetStatusMessage(msg);
+        return;
+    }
+    lsp.utf16 = strcmp(encoding, "utf-16") == 0;
+    // textDocumentSync is either a TextDocumentSyncKind or TextDocumentSyncOptions
+    if (json_int(sync, end, &change) != RESULT_OK)
+        json_int(json_get(sync, end, "change"), end, &change);
+    lsp.incremental = (change == 2);
+    lsp.initialized = 1;
+    lsp_notify_server("initialized", "{}");
+    lsp_open_document();
+    editorSetStatusMessage(lsp.incremental ? "LSP: ready" : "LSP: ready (server has no incremental sync, edits are not sent)");
+}
+
+static void lsp_on_diagnostics(const char* params, const char* end) {
+    char uri[sizeof(lsp.uri)];
+    char msg[STATUS_BUF_SIZE];
+    const char* item;
+    int i, errors = 0, warnings = 0;
+    if (json_str(json_get(params, end, "uri"), end, uri, sizeof(uri)) != RESULT_OK || strcmp(uri, lsp.uri) != 0)
+        return;
+    const char* list = json_get(params, end, "diagnostics");
+    lsp.diag_count = 0;
+    for (i = 0; (item = json_at(list, end, i)) != NULL; i++) {
+        struct lspdiag* diag;
+        const char* start = json_get(json_get(item, end, "range"), end, "start");
+        if (lsp.diag_count == LSP_DIAG_MAX)
+            break;
+        diag = &lsp.diags[lsp.diag_count];
+        if (json_int(json_get(start, end, "line"), end, &diag->line) != RESULT_OK ||
+            json_int(json_get(start, end, "character"), end, &diag->col) != RESULT_OK)
+            continue;
+        if (json_int(json_get(item, end, "severity"), end, &diag->severity) != RESULT_OK ||
+            diag->severity < 1 || diag->severity > 4)
+            diag->severity = 1;
+        if (json_str(json_get(item, end, "message"), end, diag->message, sizeof(diag->message)) != RESULT_OK)
+            diag->message[0] = '\0';
+        if (diag->severity == 1)
+            errors++;
+        else if (diag->severity == 2)
+            warnings++;
+        lsp.diag_count++;
+    }
+    if (errors == lsp.diag_errors && warnings == lsp.diag_warnings)
+        return;  // Servers republish after every change; only news goes to the status line
+    lsp.diag_errors = errors;
+    lsp.diag_warnings = warnings;
+    snprintf(msg, sizeof(msg), "LSP: %d error%s, %d warning%s (:diag to step through)",
+             errors, errors == 1 ? "" : "s", warnings, warnings == 1 ? "" : "s");
+    editorSetStatusMessage(errors + warnings > 0 ? msg : "LSP: no errors or warnings");
+}
+
+// Apply the first completion item at the cursor and list the others
+static void lsp_on_completion(const char* result, const char* end) {
+    char text[LSP_COMPLETION_MAX];
+    char msg[STATUS_BUF_SIZE];
+    const char* items = json_get(result, end, "items");  // CompletionList or CompletionItem[]
+    const char* first;
+    const char* edit;
+    int i, n, start_abs_i;
+    if (items == NULL)
+        items = result;
+    first = json_at(items, end, 0);
+    if (first == NULL) {
+        editorSetStatusMessage("LSP: no completions");
+        return;
+    }
+    edit = json_get(first, end, "textEdit");
+    if (json_str(json_get(edit, end, "newText"), end, text, sizeof(text)) == RESULT_OK) {
+        const char* range = json_get(edit, end, "range");
+        if (range == NULL)
+            range = json_get(edit, end, "insert");  // InsertReplaceEdit
+        const char* start = json_get(range, end, "start");
+        int line = 0, col = 0;
+        if (json_int(json_get(start, end, "line"), end, &line) != RESULT_OK ||
+            json_int(json_get(start, end, "character"), end, &col) != RESULT_OK)
+            return;
+        start_abs_i = lsp_position_to_abs(line, col);
+    } else {
+        // Replace the identifier before the cursor
+        if (json_str(json_get(first, end, "insertText"), end, text, sizeof(text)) != RESULT_OK &&
+            json_str(json_get(first, end, "label"), end, text, sizeof(text)) != RESULT_OK)
+            return;
+        start_abs_i = textbuf.cursor_abs_i;
+        while (start_abs_i > 0) {
+            char c;
+            if (bufclient_read(&textbuf, start_abs_i - 1, &c, 1) != 1 || !(isalnum((unsigned char)c) || c == '_'))
+                break;
+            start_abs_i--;
+        }
+    }
+    if (start_abs_i > textbuf.cursor_abs_i)
+        start_abs_i = textbuf.cursor_abs_i;
+    if (start_abs_i < textbuf.cursor_abs_i)
+        bufclient_delete_range(&textbuf, start_abs_i, textbuf.cursor_abs_i - start_abs_i);
+    bufclient_insert_bytes(&textbuf, text, strlen(text));
+
+    // Show the other candidates
+    n = snprintf(msg, sizeof(msg), "LSP:");
+    for (i = 0; n < (int)sizeof(msg) - 1; i++) {
+        char label[64];
+        const char* item = json_at(items, end, i);
+        if (item == NULL)
+            break;
+        if (json_str(json_get(item, end, "label"), end, label, sizeof(label)) == RESULT_OK)
+            n += snprintf(msg + n, sizeof(msg) - n, " %s", label);
+    }
+    editorSetStatusMessage(msg);
+}
+
+// Jump to the first location of a definition reply (Location, Location[] or LocationLink[])
+static void lsp_on_definition(const char* result, const char* end) {
+    char uri[sizeof(lsp.uri)];
+    char path[PATH_MAX];
+    const char* loc = json_at(result, end, 0);
+    const char* range;
+    int line = 0, col = 0;
+    if (loc == NULL)
+        loc = result;
+    if (json_str(json_get(loc, end, "uri"), end, uri, sizeof(uri)) == RESULT_OK) {
+        range = json_get(loc, end, "range");
+    } else if (json_str(json_get(loc, end, "targetUri"), end, uri, sizeof(uri)) == RESULT_OK) {
+        range = json_get(loc, end, "targetSelectionRange");
+    } else {
+        editorSetStatusMessage("LSP: no definition found");
+        return;
+    }
+    const char* start = json_get(range, end, "start");
+    json_int(json_get(start, end, "line"), end, &line);
+    json_int(json_get(start, end, "character"), end, &col);
+    if (strcmp(uri, lsp.uri) != 0) {
+        if (lsp_uri_to_path(uri, path, sizeof(path)) != RESULT_OK) {
+            editorSetStatusMessage("LSP: definition is not in a file");
+            return;
+        }
+        if (textbuf.dirty) {
+            editorSetStatusMessage("LSP: definition is in another file; save first");
+            return;
+        }
+        if (editorOpen(path) != RESULT_OK)
+            return;
+    }
+    bufclient_move_cursor_to(&textbuf, lsp_position_to_abs(line, col));
+}
+
+// Handle one message from the server
+static void lsp_dispatch(const char* msg, const char* end) {
+    const char* id = json_get(msg, end, "id");
+    const char* method = json_get(msg, end, "method");
+    char name[64];
+    int i, id_num;
+
+    if (method != NULL && id != NULL) {
+        // Server-to-client request: none are supported, but they must be answered
+        const char* id_end = json_skip(id, end);
+        if (id_end == NULL)
+            return;  // Malformed id
+        int len = snprintf(lsp.body, sizeof(lsp.body), "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":null}", (int)(id_end - id), id);
+        if (len > 0 && len < (int)sizeof(lsp.body))
+            lsp_send(lsp.body, len);
+        return;
+    }
+    if (method != NULL) {
+        if (json_str(method, end, name, sizeof(name)) == RESULT_OK && strcmp(name, "textDocument/publishDiagnostics") == 0)
+            lsp_on_diagnostics(json_get(msg, end, "params"), end);
+        return;
+    }
+    if (json_int(id, end, &id_num) != RESULT_OK)
+        return;
+    for (i = 0; i < LSP_PENDING_MAX; i++) {
+        struct lsprequest* req = &lsp.pending[i];
+        if (req->kind == LSP_REQ_NONE || req->id != id_num)
+            continue;
+        enum lspRequest kind = req->kind;
+        // Replies about text that has changed since are of no use
+        int stale = req->version != lsp.version || lsp.changes_len > 0 || req->abs_i != textbuf.cursor_abs_i;
+        req->kind = LSP_REQ_NONE;
+        const char* result = json_get(msg, end, "result");
+        if (result == NULL) {
+            char err[STATUS_BUF_SIZE - 8];
+            if (json_str(json_get(json_get(msg, end, "error"), end, "message"), end, err, sizeof(err)) == RESULT_OK) {
+                char status[STATUS_BUF_SIZE];
+                snprintf(status, sizeof(status), "LSP: %s", err);
+                editorSetStatusMessage(status);
+            }
+            return;
+        }
+        if (kind == LSP_REQ_INITIALIZE)
+            lsp_on_initialize(result, end);
+        else if (kind == LSP_REQ_COMPLETION && !stale)
+            lsp_on_completion(result, end);
+        else if (kind == LSP_REQ_DEFINITION && !stale)
+            lsp_on_definition(result, end);
+        return;
+    }
+}
+
+// Read what the server sent and dispatch complete messages; 0 if the server went away
+static int lsp_read() {
+    for (;;) {
+        if (lsp.in_len == LSP_MSG_MAX)
+            lsp.in_len = 0;  // No header in a full buffer: garbage, drop it
+        ssize_t n = read(lsp.out_fd, lsp.in + lsp.in_len, LSP_MSG_MAX - lsp.in_len);
+        if (n == 0)
+            return 0;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN;
+        }
+        lsp.in_len += n;
+
+        for (;;) {
+            if (lsp.in_skip > 0) {
+                int drop = lsp.in_skip < lsp.in_len ? lsp.in_skip : lsp.in_len;
+                memmove(lsp.in, lsp.in + drop, lsp.in_len - drop);
+                lsp.in_len -= drop;
+                lsp.in_skip -= drop;
+                if (lsp.in_skip > 0)
+                    break;
+            }
+            // Header: "Content-Length: N\r\n" (and maybe others) then a blank line
+            char* header_end = NULL;
+            int i, body_len = -1;
+            for (i = 0; i + 3 < lsp.in_len; i++) {
+                if (memcmp(lsp.in + i, "\r\n\r\n", 4) == 0) {
+                    header_end = lsp.in + i + 4;
+                    break;
+                }
+            }
+            if (header_end == NULL)
+                break;
+            for (i = 0; lsp.in + i < header_end; i++) {
+                if ((i == 0 || lsp.in[i - 1] == '\n') && strncasecmp(lsp.in + i, "Content-Length:", 15) == 0)
+                    body_len = atoi(lsp.in + i + 15);
+            }
+            int header_len = header_end - lsp.in;
+            if (body_len < 0) {
+                lsp.in_skip = header_len;  // Malformed header, drop it
+                continue;
+            }
+            if (header_len + body_len > LSP_MSG_MAX) {
+                lsp.in_skip = header_len + body_len;
+                continue;
+            }
+            if (lsp.in_len < header_len + body_len)
+                break;
+            lsp_dispatch(header_end, header_end + body_len);
+            if (lsp.pid == 0)
+                return 1;  // Stopped while dispatching
+            lsp.in_skip = header_len + body_len;
+        }
+    }
+}
+
+// Start the language server and send initialize; the document is opened when it replies
+void lsp_start(const char* command) {
+    int to_server[2], from_server[2];
+    char root[PATH_MAX], root_uri[PATH_MAX * 3 + 16];
+    char params[PATH_MAX * 3 + 512];
+
+    if (server_mode) {
+        editorSetStatusMessage("LSP: not available in server mode");
+        return;
+    }
+    lsp_stop();
+    if (pipe(to_server) == -1) {
+        editorSetStatusMessage("LSP: could not start server");
+        return;
+    }
+    if (pipe(from_server) == -1) {
+        close(to_server[0]);
+        close(to_server[1]);
+        editorSetStatusMessage("LSP: could not start server");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(to_server[0]);
+        close(to_server[1]);
+        close(from_server[0]);
+        close(from_server[1]);
+        editorSetStatusMessage("LSP: could not start server");
+        return;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(to_server[0], STDIN_FILENO);
+        dup2(from_server[1], STDOUT_FILENO);
+        if (null_fd != -1)
+            dup2(null_fd, STDERR_FILENO);  // Keep server chatter off the terminal
+        close(to_server[1]);
+        close(from_server[0]);
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+    close(to_server[0]);
+    close(from_server[1]);
+    signal(SIGPIPE, SIG_IGN);  // A dying server must not take the editor with it
+
+    memset(&lsp, 0, offsetof(struct lspclient, out));  // Everything but the big buffers
+    lsp.pid = pid;
+    lsp.in_fd = to_server[1];
+    lsp.out_fd = from_server[0];
+    fcntl(lsp.in_fd, F_SETFL, fcntl(lsp.in_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(lsp.out_fd, F_SETFL, fcntl(lsp.out_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(lsp.in_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(lsp.out_fd, F_SETFD, FD_CLOEXEC);
+    lsp.observer.notify = lsp_on_edit;
+    lsp.observer.before_remove = lsp_before_remove;
+    lsp.removed_at = -1;
+    bufclient_observe(&textbuf, &lsp.observer);
+
+    if (getcwd(root, sizeof(root)) == NULL)
+        strcpy(root, "/");
+    lsp_path_to_uri(root, root_uri, sizeof(root_uri));
+    snprintf(params, sizeof(params),
+             "{\"processId\":%d,\"rootUri\":\"%s\",\"capabilities\":{"
+             "\"general\":{\"positionEncodings\":[\"utf-8\"]},"
+             "\"textDocument\":{\"synchronization\":{\"dynamicRegistration\":false},"
+             "\"completion\":{\"completionItem\":{\"snippetSupport\":false}},"
+             "\"definition\":{\"linkSupport\":true},\"publishDiagnostics\":{}}}}",
+             (int)getpid(), root_uri);
+    if (lsp_request(LSP_REQ_INITIALIZE, "initialize", params) == RESULT_OK)
+        editorSetStatusMessage("LSP: starting...");
+}
+
+// Shut the server down (politely, then firmly)
+void lsp_stop() {
+    int i;
+    if (lsp.pid == 0)
+        return;
+    pid_t pid = lsp.pid;
+    lsp.pid = 0;  // A failing send below calls back into here; make that a no-op
+    if (lsp.initialized) {
+        lsp_close_document();
+        lsp_request(LSP_REQ_SHUTDOWN, "shutdown", "null");
+        lsp_notify_server("exit", "null");
+    }
+    bufclient_unobserve(&textbuf, &lsp.observer);
+    lsp.doc_open = 0;
+    lsp.initialized = 0;
+    lsp_write_some();
+    close(lsp.in_fd);
+    close(lsp.out_fd);
+    for (i = 0; i < 10 && waitpid(pid, NULL, WNOHANG) == 0; i++) {
+        struct timespec ts = {0, 10 * 1000 * 1000};
+        nanosleep(&ts, NULL);
+    }
+    if (i == 10) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Fill pfd (room for 2) with the server's fds for the main loop's poll; returns how many
+int lsp_poll_fds(struct pollfd* pfd) {
+    if (lsp.pid == 0)
+        return 0;
+    pfd[0].fd = lsp.out_fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    if (lsp.out_len == 0)
+        return 1;
+    pfd[1].fd = lsp.in_fd;
+    pfd[1].events = POLLOUT;
+    pfd[1].revents = 0;
+    return 2;
+}
+
+// Serve the server after poll() reported on the fds from lsp_poll_fds
+void lsp_handle_poll(const struct pollfd* pfd, int count) {
+    if (count == 0 || lsp.pid == 0)
+        return;
+    if (count == 2 && pfd[1].revents)
+        lsp_write_some();
+    if (pfd[0].revents && !lsp_read()) {
+        lsp.initialized = 0;  // Nothing left to say goodbye to
+        lsp_stop();
+        editorSetStatusMessage("LSP: server exited");
+    }
+}
+
+// *** Main Function ***
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        return serverMain();
+    }
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        return clientMain(argc >= 3 ? argv[2] : NULL);
+    }
+
+    // Initialization (terminal, screen size, buffers, raw mode, exit handler)
+    initEditor();
+
+    // Open file specified on command line, if any
+    if (argc >= 2 && strcmp(argv[1], "-S") == 0) {
+        session_restore(argc >= 3 ? argv[2] : SESSION_FILE_DEFAULT);
+    } else if (argc < 2 && access(SESSION_FILE_DEFAULT, R_OK) == 0) {
+        session_restore(SESSION_FILE_DEFAULT);  // The session of this directory
+    } else if (argc >= 2) {
+        editorOpen(argv[1]);
+        // editorOpen sets status messages for success/failure/new file
+    } else {
+        // No file specified, show welcome message
+        editorSetStatusMessage("lkjsxceditor | Version " LKJSXCEDITOR_VERSION " | Press : for command");
+    }
+
+    wordidx_bind();  // Index the buffer's words for completion while idle
+    undo_track();    // (No-op if editorOpen already did)
+    autosave_bind();  // Count edits for :set autosave
+
+    // Language server from the environment, e.g. LKJSXCEDITOR_LSP=clangd
+    const char* lsp_command = getenv("LKJSXCEDITOR_LSP");
+    if (lsp_command != NULL && lsp_command[0] != '\0') {
+        lsp_start(lsp_command);
+    }
+
+    // Main event loop
+    while (!terminate_editor && !atomic_load(&main_pipe.output_failed)) {
+        bufclient_flush_deltas(&textbuf);  // Deliver this tick's batched edits
+        lsp_flush_changes();      // One didChange for this tick's edits
+        editorRefreshScreen();    // Update display based on current state
+        if (!editorWaitInput())   // Serve the language server and idle work until a key arrives
+            continue;
+        editorProcessKeypress();  // Wait for and process one keypress
+        autosave_after_key();
+    }
+
+    autosave_wait();
+    if (session.path[0] != '\0')
+        session_write(session.path);  // Keep the session current
+    lsp_stop();
+    grep_stop();
+    finder_stop();
+    diff_off();
+    taskpool_stop();
 
-    // Cleanup is handled by atexit(disableRawMode)
     // Optional: explicit free?
     // bufclient_free(&textbuf); // Free buffer chunks back to pool
 
-    // Clear screen finally for a clean exit (disableRawMode might already do this)
-    // write(STDOUT_FILENO, "\x1b[2J", 4); // Already in die() and maybe atexit handler
-    // write(STDOUT_FILENO, "\x1b[H", 3);
-
+    // Stop the render thread and restore the terminal (the loop also ends if writing failed)
+    if (atomic_load(&main_pipe.output_failed))
+        editorExit(1, "Fatal: write to screen failed");
+    editorExit(0, NULL);
     return 0;  // Successful exit
 }